@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/MappedOsmDatasource.hh>
+#include <glosm/PageAllocator.hh>
+#include <glosm/LoadListener.hh>
+#include <glosm/GeometryGenerator.hh>
+#include <glosm/Timer.hh>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+void usage(const char* progname) {
+	fprintf(stderr, "Usage: %s [-f] [-j threads] [-t tmpdir] <infile.osm[.gz|.bz2]|infile.osm.pbf|infile.glosm> outfile.glosmmap\n", progname);
+	exit(1);
+}
+
+int real_main(int argc, char** argv) {
+	const char* progname = argv[0];
+
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	bool filter = false;
+
+	int c;
+	while ((c = getopt(argc, argv, "fj:t:")) != -1) {
+		switch (c) {
+		case 'f': filter = true; break;
+		case 'j': nthreads = (int)strtol(optarg, NULL, 10); break;
+		case 't': FilePageAllocator::SetDirectory(optarg); break;
+		default:
+			usage(progname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage(progname);
+
+	Timer t;
+	std::auto_ptr<PreloadedXmlDatasource> osm_datasource;
+	PrintingLoadListener load_listener;
+
+	std::string infile = argv[0];
+	if (infile.length() > 6 && infile.rfind(".glosm") == infile.length() - 6) {
+		fprintf(stderr, "Loading OSM data snapshot...\n");
+		osm_datasource.reset(new PreloadedXmlDatasource);
+		osm_datasource->LoadSnapshot(argv[0]);
+		osm_datasource->InlineNodes();
+	} else {
+		if (infile.length() > 4 && infile.rfind(".pbf") == infile.length() - 4) {
+			fprintf(stderr, "Loading OSM PBF data...\n");
+			osm_datasource.reset(new PreloadedPbfDatasource);
+		} else {
+			fprintf(stderr, "Loading OSM data...\n");
+			osm_datasource.reset(new PreloadedXmlDatasource);
+		}
+		if (filter) {
+			/* keep only ways which may produce geometry */
+			PreloadedXmlDatasource::LoadFilter loadfilter;
+			GeometryGenerator::GetKnownKeys(loadfilter.keys);
+			loadfilter.prune_nodes = true;
+
+			osm_datasource->SetLoadFilter(loadfilter);
+		}
+		osm_datasource->SetLoadListener(&load_listener);
+		osm_datasource->LoadParallel(argv[0], nthreads);
+		osm_datasource->InlineNodes();
+		fprintf(stderr, "Parsed %lu bytes at %.1f MB/s\n", (unsigned long)osm_datasource->GetLoadedBytes(), osm_datasource->GetLoadRate() / 1048576.0f);
+	}
+	fprintf(stderr, "Loaded in %.3f seconds\n", t.Count());
+
+	fprintf(stderr, "Writing %lu ways...\n", (unsigned long)osm_datasource->GetWayStore().GetSize());
+	MappedOsmDatasource::Write(argv[1], osm_datasource->GetWayStore(), osm_datasource->GetBBox());
+	fprintf(stderr, "Written in %.3f seconds\n", t.Count());
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	try {
+		return real_main(argc, argv);
+	} catch (std::exception &e) {
+		fprintf(stderr, "Exception: %s\n", e.what());
+	} catch (...) {
+		fprintf(stderr, "Unknown exception\n");
+	}
+
+	return 1;
+}
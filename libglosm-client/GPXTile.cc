@@ -28,20 +28,60 @@
 #include <glosm/Projection.hh>
 #include <glosm/VertexBuffer.hh>
 
+/* tracks are simplified to about this fraction of tile width */
+static const int TRACK_RESOLUTION = 1024;
+
 GPXTile::GPXTile(const Projection& projection, const GPXDatasource& datasource, const HeightmapDatasource& heightmap, const Vector2i& ref, const BBoxi& bbox) : Tile(ref), size_(0) {
 	std::vector<Vector3i> points;
-	datasource.GetPoints(points, bbox);
+	std::vector<size_t> lengths;
+	datasource.GetTracks(points, lengths, bbox, (int)(((osmlong_t)bbox.right - (osmlong_t)bbox.left) / TRACK_RESOLUTION));
 
 	if (!points.empty()) {
 		points_.reset(new VertexBuffer<Vector3f>(GL_ARRAY_BUFFER));
+		tracks_.reset(new VertexBuffer<Vector3f>(GL_ARRAY_BUFFER));
+
+		/* polylines may extend beyond tile; points are only
+		 * taken from inside so neighbor tiles don't duplicate
+		 * them, and lines with at least one end inside */
+		std::vector<Vector3i> inside;
+		std::vector<Vector2i> ground;
+		std::vector<Vector3i>::const_iterator point = points.begin();
+		for (std::vector<size_t>::const_iterator length = lengths.begin(); length != lengths.end(); ++length) {
+			for (size_t n = 0; n < *length; ++n, ++point) {
+				bool contained = bbox.Contains(*point);
+
+				if (contained) {
+					inside.push_back(*point);
+					ground.push_back(Vector2i(point->x, point->y));
+				}
+
+				if (n > 0 && (contained || bbox.Contains(*(point - 1)))) {
+					tracks_->Data().push_back(projection.Project(*(point - 1), ref));
+					tracks_->Data().push_back(projection.Project(*point, ref));
+				}
+			}
+		}
 
-		points_->Data().reserve(2 * points.size());
-		for (std::vector<Vector3i>::const_iterator i = points.begin(); i != points.end(); ++i) {
-			points_->Data().push_back(projection.Project(*i, ref));
-			points_->Data().push_back(projection.Project(Vector3i(i->x, i->y, heightmap.GetHeight(*i)), ref));
+		/* ground heights are queried all at once */
+		std::vector<osmint_t> heights(ground.size());
+		if (!ground.empty())
+			heightmap.GetHeights(&ground.front(), &heights.front(), ground.size());
+
+		points_->Data().reserve(2 * inside.size());
+		for (size_t i = 0; i < inside.size(); ++i) {
+			points_->Data().push_back(projection.Project(inside[i], ref));
+			points_->Data().push_back(projection.Project(Vector3i(inside[i].x, inside[i].y, heights[i]), ref));
 		}
 
-		size_ = points_->GetFootprint();
+		if (points_->GetSize() == 0)
+			points_.reset(NULL);
+		else
+			size_ += points_->GetFootprint();
+
+		if (tracks_->GetSize() == 0)
+			tracks_.reset(NULL);
+		else
+			size_ += tracks_->GetFootprint();
 	}
 }
 
@@ -67,6 +107,21 @@ void GPXTile::Render() {
 
 		glDisableClientState(GL_VERTEX_ARRAY);
 	}
+
+	if (tracks_.get()) {
+		glDepthFunc(GL_LEQUAL);
+
+		glColor4f(1.0f, 0.0f, 1.0f, 0.8f);
+
+		tracks_->Bind();
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+
+		glVertexPointer(3, GL_FLOAT, sizeof(Vector3f), BUFFER_OFFSET(0));
+		glDrawArrays(GL_LINES, 0, tracks_->GetSize());
+
+		glDisableClientState(GL_VERTEX_ARRAY);
+	}
 }
 
 size_t GPXTile::GetSize() const {
@@ -52,10 +52,18 @@ TileManager::TileManager(const Projection projection): projection_(projection),
 		throw SystemError(errn) << "pthread_cond_init failed";
 	}
 
+	if ((errn = pthread_cond_init(&loaded_cond_, 0)) != 0) {
+		pthread_mutex_destroy(&tiles_mutex_);
+		pthread_mutex_destroy(&queue_mutex_);
+		pthread_cond_destroy(&queue_cond_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
 	if ((errn = pthread_create(&loading_thread_, NULL, LoadingThreadFuncWrapper, (void*)this)) != 0) {
 		pthread_mutex_destroy(&tiles_mutex_);
 		pthread_mutex_destroy(&queue_mutex_);
 		pthread_cond_destroy(&queue_cond_);
+		pthread_cond_destroy(&loaded_cond_);
 		throw SystemError(errn) << "pthread_create failed";
 	}
 
@@ -77,6 +85,7 @@ TileManager::~TileManager() {
 	pthread_join(loading_thread_, NULL);
 
 	pthread_cond_destroy(&queue_cond_);
+	pthread_cond_destroy(&loaded_cond_);
 	pthread_mutex_destroy(&queue_mutex_);
 	pthread_mutex_destroy(&tiles_mutex_);
 
@@ -244,6 +253,22 @@ void TileManager::RecDestroyTiles(QuadNode* node) {
 	}
 }
 
+void TileManager::RecInvalidateTiles(QuadNode* node, const BBoxi& bbox) {
+	if (!node || !node->bbox.Intersects(bbox))
+		return;
+
+	if (node->tile) {
+		tile_count_--;
+		total_size_ -= node->tile->GetSize();
+		delete node->tile;
+		node->tile = NULL;
+	}
+
+	/* quadtree nodes are kept so tiles are loaded again */
+	for (int i = 0; i < 4; ++i)
+		RecInvalidateTiles(node->childs[i], bbox);
+}
+
 void TileManager::RecGarbageCollectTiles(QuadNode* node, GCQueue& gcqueue) {
 	/* simplest garbage collection that drops all inactive
 	 * tiles. This should become much more clever */
@@ -405,7 +430,6 @@ void TileManager::LoadingThreadFunc() {
 
 		pthread_mutex_lock(&tiles_mutex_);
 		RecPlaceTile(&root_, tile, task.id.level, task.id.x, task.id.y);
-
 		pthread_mutex_unlock(&tiles_mutex_);
 
 		/* The following happens:
@@ -422,6 +446,7 @@ void TileManager::LoadingThreadFunc() {
 
 		pthread_mutex_lock(&queue_mutex_);
 		loading_ = TileId(-1, -1, -1);
+		pthread_cond_signal(&loaded_cond_);
 	}
 	pthread_mutex_unlock(&queue_mutex_);
 }
@@ -531,6 +556,20 @@ void TileManager::Clear() {
 	pthread_mutex_unlock(&tiles_mutex_);
 }
 
+void TileManager::StopLoading() {
+	pthread_mutex_lock(&queue_mutex_);
+	queue_.clear();
+	while (loading_ != TileId(-1, -1, -1))
+		pthread_cond_wait(&loaded_cond_, &queue_mutex_);
+	pthread_mutex_unlock(&queue_mutex_);
+}
+
+void TileManager::InvalidateArea(const BBoxi& bbox) {
+	pthread_mutex_lock(&tiles_mutex_);
+	RecInvalidateTiles(&root_, bbox);
+	pthread_mutex_unlock(&tiles_mutex_);
+}
+
 void TileManager::SetLevel(int level) {
 	level_ = level;
 }
@@ -38,12 +38,21 @@ class HeightmapDatasource;
 /**
  * A tile of GPX points
  *
+ * Track points are drawn with sticks down to the ground, and
+ * tracks themselves as lines. Coarse tiles use simplified tracks,
+ * so amount of geometry depends on tile resolution rather than
+ * on number of loaded points.
+ *
  * This tile type is used by GPXLayer
  */
 class GPXTile : public Tile, private NonCopyable {
 protected:
+	/* pairs of track point and its projection to the ground */
 	std::auto_ptr<VertexBuffer<Vector3f> > points_;
 
+	/* pairs of ends of track lines */
+	std::auto_ptr<VertexBuffer<Vector3f> > tracks_;
+
 	size_t size_;
 
 public:
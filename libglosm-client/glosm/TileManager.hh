@@ -147,6 +147,7 @@ protected:
 
 	mutable pthread_mutex_t queue_mutex_;
 	pthread_cond_t queue_cond_;
+	pthread_cond_t loaded_cond_;
 	/* protected by queue_mutex_ */
 	TilesQueue queue_;
 	TileId loading_;
@@ -202,6 +203,11 @@ protected:
 	 */
 	void RecDestroyTiles(QuadNode* node);
 
+	/**
+	 * Recursive function for destroying tiles which intersect bbox
+	 */
+	void RecInvalidateTiles(QuadNode* node, const BBoxi& bbox);
+
 	/**
 	 * Recursive function for garbage collecting unneeded tiles
 	 */
@@ -252,6 +258,29 @@ public:
 	 */
 	void Clear();
 
+	/**
+	 * Drops queued tile requests and waits until tile which
+	 * is being loaded in background is ready
+	 *
+	 * Datasource must not be modified while tiles are being
+	 * loaded from it, so this should be called before data is
+	 * updated. Loading resumes on next LoadArea() or
+	 * LoadLocality().
+	 */
+	void StopLoading();
+
+	/**
+	 * Destroys tiles which intersect given area
+	 *
+	 * Used after the underlying data has changed; tiles are
+	 * loaded again on next LoadArea() or LoadLocality().
+	 *
+	 * @see StopLoading()
+	 *
+	 * @param bbox changed area
+	 */
+	void InvalidateArea(const BBoxi& bbox);
+
 	/**
 	 * Sets designated tile level
 	 *
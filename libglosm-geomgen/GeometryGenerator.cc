@@ -28,24 +28,153 @@
 #include <glosm/geomath.h>
 
 #include <list>
+#include <algorithm>
 #include <cstdlib>
 #include <cstdio>
 
 typedef std::list<Vector2i> VertexList;
 typedef std::vector<Vector2i> VertexVector;
 
-static void CreateLines(Geometry& geom, const VertexVector& vertices, int z, const OsmDatasource::Way& /*unused*/) {
+/* ids of tag keys and values the generator looks for; these are
+ * resolved once so that tag lookups are integer comparisons */
+struct KnownTags {
+	/* keys */
+	tagid_t roof_angle;
+	tagid_t roof_orientation;
+	tagid_t roof_shape;
+	tagid_t building_part_height;
+	tagid_t height;
+	tagid_t building_levels;
+	tagid_t building;
+	tagid_t min_height;
+	tagid_t building_min_level;
+	tagid_t building_skipped_levels;
+	tagid_t building_ground_level;
+	tagid_t lanes;
+	tagid_t oneway;
+	tagid_t width;
+	tagid_t building_part;
+	tagid_t man_made;
+	tagid_t barrier;
+	tagid_t highway;
+	tagid_t area;
+	tagid_t railway;
+	tagid_t boundary;
+	tagid_t waterway;
+	tagid_t natural;
+	tagid_t landuse;
+	tagid_t power;
+
+	/* values */
+	tagid_t v_across;
+	tagid_t v_pyramidal;
+	tagid_t v_conical;
+	tagid_t v_gabled;
+	tagid_t v_hipped;
+	tagid_t v_crosspitched;
+	tagid_t v_skillion;
+	tagid_t v_garages;
+	tagid_t v_garage;
+	tagid_t v_no;
+	tagid_t v_motorway;
+	tagid_t v_motorway_link;
+	tagid_t v_service;
+	tagid_t v_track;
+	tagid_t v_residential;
+	tagid_t v_path;
+	tagid_t v_footway;
+	tagid_t v_steps;
+	tagid_t v_pedestrian;
+	tagid_t v_tower;
+	tagid_t v_chimney;
+	tagid_t v_trunk;
+	tagid_t v_trunk_link;
+	tagid_t v_primary;
+	tagid_t v_primary_link;
+	tagid_t v_secondary;
+	tagid_t v_secondary_link;
+	tagid_t v_tertiary;
+	tagid_t v_rail;
+	tagid_t v_administrative;
+	tagid_t v_line;
+
+	KnownTags() :
+		roof_angle(TagDictionary::Intern("roof:angle")),
+		roof_orientation(TagDictionary::Intern("roof:orientation")),
+		roof_shape(TagDictionary::Intern("roof:shape")),
+		building_part_height(TagDictionary::Intern("building:part:height")),
+		height(TagDictionary::Intern("height")),
+		building_levels(TagDictionary::Intern("building:levels")),
+		building(TagDictionary::Intern("building")),
+		min_height(TagDictionary::Intern("min_height")),
+		building_min_level(TagDictionary::Intern("building:min_level")),
+		building_skipped_levels(TagDictionary::Intern("building:skipped_levels")),
+		building_ground_level(TagDictionary::Intern("building:ground_level")),
+		lanes(TagDictionary::Intern("lanes")),
+		oneway(TagDictionary::Intern("oneway")),
+		width(TagDictionary::Intern("width")),
+		building_part(TagDictionary::Intern("building:part")),
+		man_made(TagDictionary::Intern("man_made")),
+		barrier(TagDictionary::Intern("barrier")),
+		highway(TagDictionary::Intern("highway")),
+		area(TagDictionary::Intern("area")),
+		railway(TagDictionary::Intern("railway")),
+		boundary(TagDictionary::Intern("boundary")),
+		waterway(TagDictionary::Intern("waterway")),
+		natural(TagDictionary::Intern("natural")),
+		landuse(TagDictionary::Intern("landuse")),
+		power(TagDictionary::Intern("power")),
+		v_across(TagDictionary::Intern("across")),
+		v_pyramidal(TagDictionary::Intern("pyramidal")),
+		v_conical(TagDictionary::Intern("conical")),
+		v_gabled(TagDictionary::Intern("gabled")),
+		v_hipped(TagDictionary::Intern("hipped")),
+		v_crosspitched(TagDictionary::Intern("crosspitched")),
+		v_skillion(TagDictionary::Intern("skillion")),
+		v_garages(TagDictionary::Intern("garages")),
+		v_garage(TagDictionary::Intern("garage")),
+		v_no(TagDictionary::Intern("no")),
+		v_motorway(TagDictionary::Intern("motorway")),
+		v_motorway_link(TagDictionary::Intern("motorway_link")),
+		v_service(TagDictionary::Intern("service")),
+		v_track(TagDictionary::Intern("track")),
+		v_residential(TagDictionary::Intern("residential")),
+		v_path(TagDictionary::Intern("path")),
+		v_footway(TagDictionary::Intern("footway")),
+		v_steps(TagDictionary::Intern("steps")),
+		v_pedestrian(TagDictionary::Intern("pedestrian")),
+		v_tower(TagDictionary::Intern("tower")),
+		v_chimney(TagDictionary::Intern("chimney")),
+		v_trunk(TagDictionary::Intern("trunk")),
+		v_trunk_link(TagDictionary::Intern("trunk_link")),
+		v_primary(TagDictionary::Intern("primary")),
+		v_primary_link(TagDictionary::Intern("primary_link")),
+		v_secondary(TagDictionary::Intern("secondary")),
+		v_secondary_link(TagDictionary::Intern("secondary_link")),
+		v_tertiary(TagDictionary::Intern("tertiary")),
+		v_rail(TagDictionary::Intern("rail")),
+		v_administrative(TagDictionary::Intern("administrative")),
+		v_line(TagDictionary::Intern("line")) {
+	}
+};
+
+static const KnownTags& GetKnownTags() {
+	static const KnownTags tags;
+	return tags;
+}
+
+static void CreateLines(Geometry& geom, const VertexVector& vertices, int z, const OsmDatasource::WayView& /*unused*/) {
 	geom.StartLine();
 	for (unsigned int i = 0; i < vertices.size(); ++i)
 		geom.AppendLine(Vector3i(vertices[i], z));
 }
 
-static void CreateVerticalLines(Geometry& geom, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::Way& way) {
+static void CreateVerticalLines(Geometry& geom, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::WayView& way) {
 	for (unsigned int i = way.Closed ? 1 : 0; i < vertices.size(); ++i)
 		geom.AddLine(Vector3i(vertices[i], minz), Vector3i(vertices[i], maxz));
 }
 
-static void CreateSmartVerticalLines(Geometry& geom, const VertexVector& vertices, int minz, int maxz, float minslope, const OsmDatasource::Way& way) {
+static void CreateSmartVerticalLines(Geometry& geom, const VertexVector& vertices, int minz, int maxz, float minslope, const OsmDatasource::WayView& way) {
 	double cosminslope = cos(minslope/180.0*M_PI);
 
 	if (vertices.size() < 2)
@@ -72,19 +201,19 @@ static void CreateSmartVerticalLines(Geometry& geom, const VertexVector& vertice
 	}
 }
 
-static void CreateWalls(Geometry& geom, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::Way& /*unused*/) {
+static void CreateWalls(Geometry& geom, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::WayView& /*unused*/) {
 	for (unsigned int i = 1; i < vertices.size(); ++i)
 		geom.AddQuad(Vector3i(vertices[i-1], minz), Vector3i(vertices[i-1], maxz), Vector3i(vertices[i], maxz), Vector3i(vertices[i], minz));
 }
 
-static void CreateWall(Geometry& geom, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::Way& /*unused*/) {
+static void CreateWall(Geometry& geom, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::WayView& /*unused*/) {
 	for (unsigned int i = 1; i < vertices.size(); ++i) {
 		geom.AddQuad(Vector3i(vertices[i-1], minz), Vector3i(vertices[i-1], maxz), Vector3i(vertices[i], maxz), Vector3i(vertices[i], minz));
 		geom.AddQuad(Vector3i(vertices[i-1], maxz), Vector3i(vertices[i-1], minz), Vector3i(vertices[i], minz), Vector3i(vertices[i], maxz));
 	}
 }
 
-static void CreateArea(Geometry& geom, const VertexVector& vertices, bool revorder, int z, const OsmDatasource::Way& way) {
+static void CreateArea(Geometry& geom, const VertexVector& vertices, bool revorder, int z, const OsmDatasource::WayView& way) {
 	if (vertices.size() < 3 || !way.Closed)
 		return;
 
@@ -148,15 +277,16 @@ static void CreateArea(Geometry& geom, const VertexVector& vertices, bool revord
 	}
 }
 
-static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, const OsmDatasource::Way& way) {
+static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, const OsmDatasource::WayView& way) {
+	const KnownTags& tags = GetKnownTags();
 	float slope = 30.0;
 	bool along = true;
 
 	OsmDatasource::TagsMap::const_iterator shape, tag;
 
-	if ((tag = way.Tags.find("roof:angle")) != way.Tags.end())
-		slope = strtof(tag->second.c_str(), NULL);
-	if ((tag = way.Tags.find("roof:orientation")) != way.Tags.end() && tag->second == "across")
+	if ((tag = way.Tags.find(tags.roof_angle)) != way.Tags.end())
+		slope = strtof(TagDictionary::GetString(tag->second), NULL);
+	if ((tag = way.Tags.find(tags.roof_orientation)) != way.Tags.end() && tag->second == tags.v_across)
 		along = false;
 
 	std::vector<Vector3i> vert;
@@ -165,8 +295,8 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 		vert.push_back(Vector3i(*i, z));
 
 	if (vert.size() > 3 && way.Closed &&
-				(shape = way.Tags.find("roof:shape")) != way.Tags.end() &&
-				(shape->second == "pyramidal" || shape->second == "conical")
+				(shape = way.Tags.find(tags.roof_shape)) != way.Tags.end() &&
+				(shape->second == tags.v_pyramidal || shape->second == tags.v_conical)
 			) {
 		/* calculate center */
 		Vector3l center;
@@ -190,11 +320,11 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 	}
 
 	/* only 4-vert buildings are supported for other types, yet */
-	if (vert.size() == 5 && way.Closed && (shape = way.Tags.find("roof:shape")) != way.Tags.end()) {
+	if (vert.size() == 5 && way.Closed && (shape = way.Tags.find(tags.roof_shape)) != way.Tags.end()) {
 		float length1 = ToLocalMetric(vert[0], vert[1]).Length();
 		float length2 = ToLocalMetric(vert[1], vert[2]).Length();
 
-		if (shape->second == "pyramidal") {
+		if (shape->second == tags.v_pyramidal) {
 			Vector3i center = ((Vector3l)vert[0] + (Vector3l)vert[1] + (Vector3l)vert[2] + (Vector3l)vert[3]) / 4;
 			center.z += (tan(slope/180.0*M_PI) * std::min(length1, length2) * 0.5) * GEOM_UNITSINMETER;
 
@@ -203,7 +333,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(vert[i], center);
 			}
 			return;
-		} else if (shape->second == "gabled") {
+		} else if (shape->second == tags.v_gabled) {
 			if (!!(length1 < length2) ^ !along) {
 				osmint_t height = (tan(slope/180.0*M_PI) * length1 * 0.5) * GEOM_UNITSINMETER;
 
@@ -240,7 +370,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(center1, center2);
 			}
 			return;
-		} else if (shape->second == "hipped") {
+		} else if (shape->second == tags.v_hipped) {
 			if (length1 < length2) {
 				osmint_t height = (tan(slope/180.0*M_PI) * length1 * 0.5) * GEOM_UNITSINMETER;
 
@@ -287,7 +417,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(center1, center2);
 			}
 			return;
-		} else if (shape->second == "crosspitched") {
+		} else if (shape->second == tags.v_crosspitched) {
 			int height = (tan(slope/180.0*M_PI) * std::min(length1, length2) * 0.5) * GEOM_UNITSINMETER;
 
 			Vector3i center = ((Vector3l)vert[0] + (Vector3l)vert[1] + (Vector3l)vert[2] + (Vector3l)vert[3]) / 4;
@@ -307,7 +437,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(vert[i], center);
 			}
 			return;
-		} else if (shape->second == "skillion") {
+		} else if (shape->second == tags.v_skillion) {
 			if (!!(length1 < length2) ^ !along) {
 				Vector3i extension1 = vert[1];
 				extension1.z += (tan(slope/180.0*M_PI) * std::min(length1, length2) * 0.5) * GEOM_UNITSINMETER;
@@ -350,24 +480,29 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 	return CreateArea(geom, vertices, false, z, way);
 }
 
-static void CreateBuilding(Geometry& geom, HeightmapDatasource& hmds, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::Way& way) {
+static void CreateBuilding(Geometry& geom, HeightmapDatasource& hmds, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::WayView& way) {
+	std::vector<osmint_t> heights(vertices.size());
+	if (!vertices.empty())
+		hmds.GetHeights(&vertices.front(), &heights.front(), vertices.size());
+
 	int minele = std::numeric_limits<int>::max();
 	int maxele = 0;
-	for (VertexVector::const_iterator i = vertices.begin(); i != vertices.end(); ++i) {
-		int h = hmds.GetHeight(*i);
-		if (h < minele)
-			minele = h;
-		if (h > maxele)
-			maxele = h;
+	for (std::vector<osmint_t>::const_iterator h = heights.begin(); h != heights.end(); ++h) {
+		if (*h < minele)
+			minele = *h;
+		if (*h > maxele)
+			maxele = *h;
 	}
 
-	/* roof */
-	CreateRoof(geom, vertices, maxele + maxz, way);
+	/* roof; inner rings bound courtyards, which have none */
+	if (!way.Inner)
+		CreateRoof(geom, vertices, maxele + maxz, way);
 	CreateLines(geom, vertices, maxele + maxz, way);
 
 	if (minz > 0) { /* floating */
 		/* ceiling */
-		CreateArea(geom, vertices, true, maxele + minz, way);
+		if (!way.Inner)
+			CreateArea(geom, vertices, true, maxele + minz, way);
 		CreateLines(geom, vertices, maxele + minz, way);
 
 		/* walls */
@@ -382,7 +517,7 @@ static void CreateBuilding(Geometry& geom, HeightmapDatasource& hmds, const Vert
 	}
 }
 
-static void CreateRoad(Geometry& geom, const VertexVector& vertices, float width, const OsmDatasource::Way& /*unused*/) {
+static void CreateRoad(Geometry& geom, const VertexVector& vertices, float width, const OsmDatasource::WayView& /*unused*/) {
 	if (vertices.size() < 2)
 		return;
 
@@ -575,7 +710,7 @@ static void CreateWire(Geometry& geom, const Vector3i& one, const Vector3i& two)
 	}
 }
 
-static void CreatePowerLine(Geometry& geom, const VertexVector& vertices, const OsmDatasource::Way& /*unused*/) {
+static void CreatePowerLine(Geometry& geom, const VertexVector& vertices, const OsmDatasource::WayView& /*unused*/) {
 	if (vertices.size() < 2)
 		return;
 
@@ -606,24 +741,25 @@ static void CreatePowerLine(Geometry& geom, const VertexVector& vertices, const
 	}
 }
 
-static float GetMaxHeight(const OsmDatasource::Way& way) {
+static float GetMaxHeight(const OsmDatasource::WayView& way) {
+	const KnownTags& tags = GetKnownTags();
 	OsmDatasource::TagsMap::const_iterator building, tag;
 
-	if ((tag = way.Tags.find("building:part:height")) != way.Tags.end()) {
+	if ((tag = way.Tags.find(tags.building_part_height)) != way.Tags.end()) {
 		/* building:part:height is topmost precedence (hack for Ostankino tower) */
-		return strtof(tag->second.c_str(), NULL);
-	} else if ((tag = way.Tags.find("height")) != way.Tags.end()) {
+		return strtof(TagDictionary::GetString(tag->second), NULL);
+	} else if ((tag = way.Tags.find(tags.height)) != way.Tags.end()) {
 		/* explicit height - topmost precedence in all other cases */
-		return strtof(tag->second.c_str(), NULL);
-	} else if ((tag = way.Tags.find("building:levels")) != way.Tags.end()) {
+		return strtof(TagDictionary::GetString(tag->second), NULL);
+	} else if ((tag = way.Tags.find(tags.building_levels)) != way.Tags.end()) {
 		/* count level heights as 3 meters */
-		int levels = strtol(tag->second.c_str(), NULL, 10);
+		int levels = strtol(TagDictionary::GetString(tag->second), NULL, 10);
 		float h = 3.0 * levels;
 
 		/* also add 1 meter for basement for short buildings
 		 * (except for garages which doesn't have one) - should work
 		 * well in rural areas */
-		if (levels == 1 && (building = way.Tags.find("building")) != way.Tags.end() && building->second != "garages" && building->second != "garage")
+		if (levels == 1 && (building = way.Tags.find(tags.building)) != way.Tags.end() && building->second != tags.v_garages && building->second != tags.v_garage)
 			h += 1.0;
 
 		return h;
@@ -632,19 +768,20 @@ static float GetMaxHeight(const OsmDatasource::Way& way) {
 	return 0.0;
 }
 
-static float GetMinHeight(const OsmDatasource::Way& way) {
-	OsmDatasource::TagsMap::const_iterator building, tag, tag1;
+static float GetMinHeight(const OsmDatasource::WayView& way) {
+	const KnownTags& tags = GetKnownTags();
+	OsmDatasource::TagsMap::const_iterator tag, tag1;
 
-	if ((tag = way.Tags.find("min_height")) != way.Tags.end()) {
+	if ((tag = way.Tags.find(tags.min_height)) != way.Tags.end()) {
 		/* explicit height - topmost precedence in all other cases */
-		return strtof(tag->second.c_str(), NULL);
-	} else if ((tag = way.Tags.find("building:min_level")) != way.Tags.end() || (tag = way.Tags.find("building:skipped_levels")) != way.Tags.end()) {
+		return strtof(TagDictionary::GetString(tag->second), NULL);
+	} else if ((tag = way.Tags.find(tags.building_min_level)) != way.Tags.end() || (tag = way.Tags.find(tags.building_skipped_levels)) != way.Tags.end()) {
 		/* count level heights as 3 meters */
-		float h = 3.0 * strtol(tag->second.c_str(), NULL, 10);
+		float h = 3.0 * strtol(TagDictionary::GetString(tag->second), NULL, 10);
 
 		/* in building:min_level scheme, levels are counted from zero, which may be fixed by building:ground_level... */
-		if (tag->first == "building:min_level" && (tag1 = way.Tags.find("building:ground_level")) != way.Tags.end())
-			h -= 3.0 * strtol(tag1->second.c_str(), NULL, 10);
+		if (tag->first == tags.building_min_level && (tag1 = way.Tags.find(tags.building_ground_level)) != way.Tags.end())
+			h -= 3.0 * strtol(TagDictionary::GetString(tag1->second), NULL, 10);
 		/* ...while in my proposal (building:skipped_levels) everythng just works */
 
 		return h;
@@ -653,49 +790,52 @@ static float GetMinHeight(const OsmDatasource::Way& way) {
 	return 0.0;
 }
 
-static int GetHighwayLanes(const std::string& highway, const OsmDatasource::Way& way) {
+static int GetHighwayLanes(tagid_t highway, const OsmDatasource::WayView& way) {
+	const KnownTags& tags = GetKnownTags();
 	OsmDatasource::TagsMap::const_iterator tag;
 
 	/* explicitely tagged lanes have top */
-	if ((tag = way.Tags.find("lanes")) != way.Tags.end())
-		return strtol(tag->second.c_str(), NULL, 10);
+	if ((tag = way.Tags.find(tags.lanes)) != way.Tags.end())
+		return strtol(TagDictionary::GetString(tag->second), NULL, 10);
 
 	bool oneway = false;
-	if ((tag = way.Tags.find("oneway")) != way.Tags.end() && tag->second != "no")
+	if ((tag = way.Tags.find(tags.oneway)) != way.Tags.end() && tag->second != tags.v_no)
 		oneway = true;
 
 	/* motorway assumes one-way */
-	if (highway == "motorway" || highway == "motorway_link")
+	if (highway == tags.v_motorway || highway == tags.v_motorway_link)
 		oneway = true;
 
-	if (highway == "service" || highway == "track") {
+	if (highway == tags.v_service || highway == tags.v_track) {
 		return 1;
-	} else if (highway == "residential") {
+	} else if (highway == tags.v_residential) {
 		return 2;
 	} else {
 		return oneway ? 2 : 4;
 	}
 }
 
-static float GetHighwayWidth(const std::string& highway, const OsmDatasource::Way& way) {
+static float GetHighwayWidth(tagid_t highway, const OsmDatasource::WayView& way) {
+	const KnownTags& tags = GetKnownTags();
 	OsmDatasource::TagsMap::const_iterator tag;
 
 	/* explicitely tagged lanes have top */
-	if ((tag = way.Tags.find("width")) != way.Tags.end())
-		return strtof(tag->second.c_str(), NULL);
+	if ((tag = way.Tags.find(tags.width)) != way.Tags.end())
+		return strtof(TagDictionary::GetString(tag->second), NULL);
 
-	if (highway == "path") {
+	if (highway == tags.v_path) {
 		return 0.5f;
-	} else if (highway == "footway" || highway == "steps") {
+	} else if (highway == tags.v_footway || highway == tags.v_steps) {
 		return 2.0f;
-	} else if (highway == "pedestrian") {
+	} else if (highway == tags.v_pedestrian) {
 		return 3.0f;
 	} else {
 		return GetHighwayLanes(highway, way) * 3.5f; /* likely 4 is closer to truth */
 	}
 }
 
-static void WayDispatcher(Geometry& geom, const OsmDatasource& datasource, HeightmapDatasource& hmds, int flags, const OsmDatasource::Way& way) {
+static void WayDispatcher(Geometry& geom, const OsmDatasource& datasource, HeightmapDatasource& hmds, int flags, const OsmDatasource::WayView& way) {
+	const KnownTags& tags = GetKnownTags();
 	osmint_t minz = GetMinHeight(way) * GEOM_UNITSINMETER;
 	osmint_t maxz = GetMaxHeight(way) * GEOM_UNITSINMETER;
 
@@ -709,29 +849,45 @@ static void WayDispatcher(Geometry& geom, const OsmDatasource& datasource, Heigh
 	OsmDatasource::TagsMap::const_iterator t;
 
 	VertexVector vertices;
-	vertices.reserve(way.Nodes.size());
 
-	if (way.Clockwise)
-		for (OsmDatasource::Way::NodesList::const_iterator n = way.Nodes.begin(); n != way.Nodes.end(); ++n)
-			vertices.push_back(datasource.GetNode(*n).Pos);
-	else
-		for (OsmDatasource::Way::NodesList::const_reverse_iterator n = way.Nodes.rbegin(); n != way.Nodes.rend(); ++n)
-			vertices.push_back(datasource.GetNode(*n).Pos);
+	if (!way.Coords.empty()) {
+		if (way.Clockwise)
+			vertices.assign(way.Coords.begin(), way.Coords.end());
+		else
+			vertices.assign(way.Coords.rbegin(), way.Coords.rend());
+	} else {
+		vertices.resize(way.Nodes.size());
+
+		if (!datasource.TryGetNodes(way.Nodes.data(), way.Nodes.size(), vertices.data())) {
+			fprintf(stderr, "warning: some nodes of way were not found, skipping it\n");
+			return;
+		}
+
+		if (!way.Clockwise)
+			std::reverse(vertices.begin(), vertices.end());
+	}
+
+	/* inner rings of multipolygons bound holes, so their walls
+	 * face inwards; areas can't have holes, so these are only
+	 * drawn as outlines */
+	if (way.Inner)
+		std::reverse(vertices.begin(), vertices.end());
 
 	/* dispatch */
-	if ((way.Tags.find("building") != way.Tags.end() || way.Tags.find("building:part") != way.Tags.end()) && minz != maxz) {
+	if ((way.Tags.find(tags.building) != way.Tags.end() || way.Tags.find(tags.building_part) != way.Tags.end()) && minz != maxz) {
 		if (flags & GeometryDatasource::DETAIL)
 			CreateBuilding(geom, hmds, vertices, minz, maxz, way);
-	} else if ((t = way.Tags.find("man_made")) != way.Tags.end() && (t->second == "tower" || t->second == "chimney") && minz != maxz) {
+	} else if ((t = way.Tags.find(tags.man_made)) != way.Tags.end() && (t->second == tags.v_tower || t->second == tags.v_chimney) && minz != maxz) {
 		if (flags & GeometryDatasource::DETAIL) {
 			CreateWalls(geom, vertices, minz, maxz, way);
-			CreateArea(geom, vertices, false, maxz, way);
+			if (!way.Inner)
+				CreateArea(geom, vertices, false, maxz, way);
 
 			CreateLines(geom, vertices, minz, way);
 			CreateLines(geom, vertices, maxz, way);
 			CreateSmartVerticalLines(geom, vertices, minz, maxz, 5.0, way);
 		}
-	} else if (way.Tags.find("barrier") != way.Tags.end()) {
+	} else if (way.Tags.find(tags.barrier) != way.Tags.end()) {
 		if (flags & GeometryDatasource::DETAIL) {
 			if (maxz == minz)
 				maxz += 2 * GEOM_UNITSINMETER;
@@ -741,44 +897,45 @@ static void WayDispatcher(Geometry& geom, const OsmDatasource& datasource, Heigh
 			CreateLines(geom, vertices, maxz, way);
 			CreateVerticalLines(geom, vertices, minz, maxz, way);
 		}
-	} else if ((t = way.Tags.find("highway")) != way.Tags.end()) {
+	} else if ((t = way.Tags.find(tags.highway)) != way.Tags.end()) {
 		if (flags & GeometryDatasource::DETAIL) {
 			OsmDatasource::TagsMap::const_iterator t1;
 
-			if ((t1 = way.Tags.find("area")) != way.Tags.end() && t1->second != "no") {
+			if ((t1 = way.Tags.find(tags.area)) != way.Tags.end() && t1->second != tags.v_no) {
 				/* area */
-				CreateArea(geom, vertices, false, 0, way);
+				if (!way.Inner)
+					CreateArea(geom, vertices, false, 0, way);
 			} else {
 				CreateRoad(geom, vertices, GetHighwayWidth(t->second, way), way);
 			}
 		} else if ((flags & GeometryDatasource::GROUND) && (
-				t->second == "motorway" || t->second == "motorway_link" ||
-				t->second == "trunk" || t->second == "trunk_link" ||
-				t->second == "primary" || t->second == "primary_link" ||
-				t->second == "secondary" || t->second == "secondary_link" ||
-				t->second == "tertiary")) {
+				t->second == tags.v_motorway || t->second == tags.v_motorway_link ||
+				t->second == tags.v_trunk || t->second == tags.v_trunk_link ||
+				t->second == tags.v_primary || t->second == tags.v_primary_link ||
+				t->second == tags.v_secondary || t->second == tags.v_secondary_link ||
+				t->second == tags.v_tertiary)) {
 			CreateLines(geom, vertices, minz, way);
 		}
-	} else if ((t = way.Tags.find("railway")) != way.Tags.end() && (t->second == "rail")) {
+	} else if ((t = way.Tags.find(tags.railway)) != way.Tags.end() && (t->second == tags.v_rail)) {
 		if (flags & GeometryDatasource::DETAIL) {
 			CreateLines(geom, vertices, minz, way);
 		} else if (flags & GeometryDatasource::GROUND) {
-			if (t->second == "rail")
+			if (t->second == tags.v_rail)
 				CreateLines(geom, vertices, minz, way);
 		}
-	} else if ((t = way.Tags.find("boundary")) != way.Tags.end() && (t->second == "administrative")) {
+	} else if ((t = way.Tags.find(tags.boundary)) != way.Tags.end() && (t->second == tags.v_administrative)) {
 		if (flags & GeometryDatasource::GROUND)
 			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("waterway")) != way.Tags.end()) {
+	} else if ((t = way.Tags.find(tags.waterway)) != way.Tags.end()) {
 		if (flags & GeometryDatasource::GROUND)
 			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("natural")) != way.Tags.end()) {
+	} else if ((t = way.Tags.find(tags.natural)) != way.Tags.end()) {
 		if (flags & GeometryDatasource::GROUND)
 			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("landuse")) != way.Tags.end()) {
+	} else if ((t = way.Tags.find(tags.landuse)) != way.Tags.end()) {
 		if (flags & GeometryDatasource::GROUND)
 			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("power")) != way.Tags.end() && (t->second == "line")) {
+	} else if ((t = way.Tags.find(tags.power)) != way.Tags.end() && (t->second == tags.v_line)) {
 		if (flags & GeometryDatasource::DETAIL)
 			CreatePowerLine(geom, vertices, way);
 	} else {
@@ -791,7 +948,7 @@ GeometryGenerator::GeometryGenerator(const OsmDatasource& datasource, HeightmapD
 }
 
 void GeometryGenerator::GetGeometry(Geometry& geom, const BBoxi& bbox, int flags) const {
-	std::vector<OsmDatasource::Way> ways;
+	std::vector<OsmDatasource::WayView> ways;
 
 	/* safe bbox is a bit wider than requested one to be sure
 	 * all ways are included, even those which have width */
@@ -804,7 +961,7 @@ void GeometryGenerator::GetGeometry(Geometry& geom, const BBoxi& bbox, int flags
 
 	Geometry temp;
 
-	for (std::vector<OsmDatasource::Way>::const_iterator w = ways.begin(); w != ways.end(); ++w)
+	for (std::vector<OsmDatasource::WayView>::const_iterator w = ways.begin(); w != ways.end(); ++w)
 		WayDispatcher(temp, datasource_, heightmap_ds_, flags, *w);
 
 	geom.AppendCropped(temp, bbox);
@@ -817,3 +974,20 @@ Vector2i GeometryGenerator::GetCenter() const {
 BBoxi GeometryGenerator::GetBBox() const {
 	return datasource_.GetBBox();
 }
+
+void GeometryGenerator::GetKnownKeys(std::vector<tagid_t>& keys) {
+	const KnownTags& tags = GetKnownTags();
+
+	/* keys checked by WayDispatcher */
+	keys.push_back(tags.building);
+	keys.push_back(tags.building_part);
+	keys.push_back(tags.man_made);
+	keys.push_back(tags.barrier);
+	keys.push_back(tags.highway);
+	keys.push_back(tags.railway);
+	keys.push_back(tags.boundary);
+	keys.push_back(tags.waterway);
+	keys.push_back(tags.natural);
+	keys.push_back(tags.landuse);
+	keys.push_back(tags.power);
+}
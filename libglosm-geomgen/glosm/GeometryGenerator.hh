@@ -24,6 +24,9 @@
 #include <glosm/GeometryDatasource.hh>
 #include <glosm/Math.hh>
 #include <glosm/BBox.hh>
+#include <glosm/TagDictionary.hh>
+
+#include <vector>
 
 class OsmDatasource;
 class HeightmapDatasource;
@@ -40,6 +43,16 @@ public:
 
 	virtual Vector2i GetCenter() const;
 	virtual BBoxi GetBBox() const;
+
+	/**
+	 * Returns keys of tags which select way geometry type
+	 *
+	 * Ways which have none of these are only drawn as thin
+	 * lines in detail mode, so datasources may drop them on load.
+	 *
+	 * @param keys vector to append keys to
+	 */
+	static void GetKnownKeys(std::vector<tagid_t>& keys);
 };
 
 #endif
@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/Decompressor.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Timer.hh>
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+/* size of single decompressed buffer */
+static const size_t OUTPUT_BUFFER_SIZE = 1048576;
+
+/* number of decompressed buffers which may be queued */
+static const size_t QUEUE_LENGTH = 4;
+
+static const size_t INPUT_BUFFER_SIZE = 262144;
+
+namespace {
+	class GzipCodec : private NonCopyable {
+	protected:
+		z_stream stream_;
+
+	public:
+		GzipCodec() {
+			memset(&stream_, 0, sizeof(stream_));
+			/* 32 enables gzip header detection */
+			if (inflateInit2(&stream_, 15 + 32) != Z_OK)
+				throw Exception() << "cannot initialize zlib";
+		}
+
+		~GzipCodec() {
+			inflateEnd(&stream_);
+		}
+
+		/* returns true at the end of compressed stream */
+		bool Step(const char*& in, size_t& inlen, char*& out, size_t& outlen) {
+			stream_.next_in = (Bytef*)in;
+			stream_.avail_in = inlen;
+			stream_.next_out = (Bytef*)out;
+			stream_.avail_out = outlen;
+
+			int ret = inflate(&stream_, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+				throw Exception() << "gzip decompression error: " << (stream_.msg ? stream_.msg : "unknown error");
+
+			in = (const char*)stream_.next_in;
+			inlen = stream_.avail_in;
+			out = (char*)stream_.next_out;
+			outlen = stream_.avail_out;
+
+			return ret == Z_STREAM_END;
+		}
+
+		void Reset() {
+			inflateReset(&stream_);
+		}
+
+		/* skips zero padding after the last stream, which
+		 * gzip(1) ignores as well */
+		void SkipPadding(const char*& in, size_t& inlen) {
+			while (inlen > 0 && *in == '\0') {
+				++in;
+				--inlen;
+			}
+		}
+	};
+
+	class Bzip2Codec : private NonCopyable {
+	protected:
+		bz_stream stream_;
+
+	public:
+		Bzip2Codec() {
+			memset(&stream_, 0, sizeof(stream_));
+			if (BZ2_bzDecompressInit(&stream_, 0, 0) != BZ_OK)
+				throw Exception() << "cannot initialize bzip2";
+		}
+
+		~Bzip2Codec() {
+			BZ2_bzDecompressEnd(&stream_);
+		}
+
+		bool Step(const char*& in, size_t& inlen, char*& out, size_t& outlen) {
+			stream_.next_in = const_cast<char*>(in);
+			stream_.avail_in = inlen;
+			stream_.next_out = out;
+			stream_.avail_out = outlen;
+
+			int ret = BZ2_bzDecompress(&stream_);
+			if (ret != BZ_OK && ret != BZ_STREAM_END)
+				throw Exception() << "bzip2 decompression error " << ret;
+
+			in = stream_.next_in;
+			inlen = stream_.avail_in;
+			out = stream_.next_out;
+			outlen = stream_.avail_out;
+
+			return ret == BZ_STREAM_END;
+		}
+
+		void Reset() {
+			/* bzip2 has no reset, so the stream is recreated */
+			BZ2_bzDecompressEnd(&stream_);
+			memset(&stream_, 0, sizeof(stream_));
+			if (BZ2_bzDecompressInit(&stream_, 0, 0) != BZ_OK)
+				throw Exception() << "cannot initialize bzip2";
+		}
+
+		void SkipPadding(const char*& /*unused*/, size_t& /*unused*/) {
+		}
+	};
+}
+
+Decompressor::Format Decompressor::DetectFormat(const char* data, size_t size) {
+	const unsigned char* magic = reinterpret_cast<const unsigned char*>(data);
+	if (size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return GZIP;
+	if (size >= 3 && magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h')
+		return BZIP2;
+	return NONE;
+}
+
+Decompressor::Decompressor(Format format, const char* prefix, size_t prefixsize, int fd)
+	: format_(format), prefix_(prefix), prefix_size_(prefixsize), fd_(fd),
+	  buffers_(QUEUE_LENGTH), produced_(0), consumed_(0), holding_(false), finished_(false), stop_(false),
+	  input_bytes_(0), output_bytes_(0), busy_time_(0.0f) {
+	if (format != GZIP && format != BZIP2)
+		throw Exception() << "unsupported compression format";
+
+	for (std::vector<Buffer>::iterator buffer = buffers_.begin(); buffer != buffers_.end(); ++buffer) {
+		buffer->data.resize(OUTPUT_BUFFER_SIZE);
+		buffer->size = 0;
+	}
+
+	int errn;
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_cond_init(&cond_, 0)) != 0) {
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	if ((errn = pthread_create(&thread_, NULL, ThreadFuncWrapper, this)) != 0) {
+		pthread_cond_destroy(&cond_);
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_create failed";
+	}
+}
+
+Decompressor::~Decompressor() {
+	pthread_mutex_lock(&mutex_);
+	stop_ = true;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+
+	pthread_join(thread_, NULL);
+
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+void* Decompressor::ThreadFuncWrapper(void* arg) {
+	static_cast<Decompressor*>(arg)->ThreadFunc();
+	return NULL;
+}
+
+void Decompressor::ThreadFunc() {
+	std::string error;
+	try {
+		if (format_ == GZIP) {
+			GzipCodec codec;
+			Run(codec);
+		} else {
+			Bzip2Codec codec;
+			Run(codec);
+		}
+	} catch (std::exception& e) {
+		error = e.what();
+		if (error.empty())
+			error = "decompression failed";
+	}
+
+	pthread_mutex_lock(&mutex_);
+	finished_ = true;
+	error_ = error;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+}
+
+template <class C>
+void Decompressor::Run(C& codec) {
+	Timer timer;
+
+	Buffer* buffer = AcquireBuffer();
+	timer.Count();
+	if (buffer == NULL)
+		return;
+
+	char* out = &buffer->data.front();
+	size_t outlen = buffer->data.size();
+
+	const char* in = NULL;
+	size_t inlen = 0;
+
+	/* true if we're between compressed streams */
+	bool ended = true;
+
+	/* true if output buffer was filled, so decoder may have
+	 * more output even without new input */
+	bool full = false;
+
+	for (;;) {
+		if (inlen == 0 && (ended || !full) && !ReadInput(in, inlen))
+			break;
+
+		if (ended) {
+			codec.SkipPadding(in, inlen);
+			if (inlen == 0)
+				continue;
+
+			/* concatenated streams */
+			codec.Reset();
+			ended = false;
+		}
+
+		ended = codec.Step(in, inlen, out, outlen);
+
+		if ((full = (outlen == 0))) {
+			PushBuffer(buffer->data.size(), timer.Count());
+
+			buffer = AcquireBuffer();
+			timer.Count();
+			if (buffer == NULL)
+				return;
+
+			out = &buffer->data.front();
+			outlen = buffer->data.size();
+		}
+	}
+
+	if (!ended)
+		throw Exception() << "unexpected end of compressed data";
+
+	PushBuffer(buffer->data.size() - outlen, timer.Count());
+}
+
+bool Decompressor::ReadInput(const char*& data, size_t& size) {
+	/* prefix is passed without copying */
+	if (prefix_size_ > 0) {
+		data = prefix_;
+		size = prefix_size_;
+		prefix_size_ = 0;
+
+		pthread_mutex_lock(&mutex_);
+		input_bytes_ += size;
+		pthread_mutex_unlock(&mutex_);
+
+		return true;
+	}
+
+	if (fd_ == -1)
+		return false;
+
+	if (input_.empty())
+		input_.resize(INPUT_BUFFER_SIZE);
+
+	ssize_t len;
+	while ((len = read(fd_, &input_.front(), input_.size())) < 0)
+		if (errno != EINTR)
+			throw SystemError() << "input read error";
+
+	pthread_mutex_lock(&mutex_);
+	input_bytes_ += len;
+	pthread_mutex_unlock(&mutex_);
+
+	data = &input_.front();
+	size = len;
+	return len > 0;
+}
+
+Decompressor::Buffer* Decompressor::AcquireBuffer() {
+	pthread_mutex_lock(&mutex_);
+	while (!stop_ && produced_ - consumed_ >= buffers_.size())
+		pthread_cond_wait(&cond_, &mutex_);
+	bool stop = stop_;
+	pthread_mutex_unlock(&mutex_);
+
+	return stop ? NULL : &buffers_[produced_ % buffers_.size()];
+}
+
+void Decompressor::PushBuffer(size_t size, float busytime) {
+	pthread_mutex_lock(&mutex_);
+	buffers_[produced_ % buffers_.size()].size = size;
+	++produced_;
+	output_bytes_ += size;
+	busy_time_ += busytime;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+}
+
+bool Decompressor::GetData(const char*& data, size_t& size) {
+	pthread_mutex_lock(&mutex_);
+
+	/* previously returned buffer may now be reused */
+	if (holding_) {
+		++consumed_;
+		holding_ = false;
+		pthread_cond_broadcast(&cond_);
+	}
+
+	while (produced_ == consumed_ && !finished_)
+		pthread_cond_wait(&cond_, &mutex_);
+
+	if (produced_ == consumed_) {
+		std::string error = error_;
+		pthread_mutex_unlock(&mutex_);
+		if (!error.empty())
+			throw Exception() << error;
+		return false;
+	}
+
+	Buffer& buffer = buffers_[consumed_ % buffers_.size()];
+	holding_ = true;
+	pthread_mutex_unlock(&mutex_);
+
+	data = &buffer.data.front();
+	size = buffer.size;
+	return true;
+}
+
+size_t Decompressor::GetInputBytes() const {
+	pthread_mutex_lock(&mutex_);
+	size_t bytes = input_bytes_;
+	pthread_mutex_unlock(&mutex_);
+	return bytes;
+}
+
+size_t Decompressor::GetOutputBytes() const {
+	pthread_mutex_lock(&mutex_);
+	size_t bytes = output_bytes_;
+	pthread_mutex_unlock(&mutex_);
+	return bytes;
+}
+
+float Decompressor::GetBusyTime() const {
+	pthread_mutex_lock(&mutex_);
+	float time = busy_time_;
+	pthread_mutex_unlock(&mutex_);
+	return time;
+}
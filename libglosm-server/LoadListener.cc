@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/LoadListener.hh>
+
+const char* LoadListener::GetPhaseName(Phase phase) {
+	switch (phase) {
+	case PARSE: return "parse";
+	case FINALIZE: return "finalize";
+	case MULTIPOLYGONS: return "multipolygons";
+	case INDEX: return "index";
+	default: return "unknown";
+	}
+}
+
+PrintingLoadListener::PrintingLoadListener(FILE* stream) : stream_(stream) {
+}
+
+void PrintingLoadListener::LoadProgress(Phase phase, const Progress& progress) {
+	float time = progress.time > 0.0f ? progress.time : 1.0f;
+
+	fprintf(stream_, "  %s: %.1f MB", GetPhaseName(phase), progress.bytes / 1048576.0f);
+	if (progress.total_bytes > 0)
+		fprintf(stream_, " of %.1f MB (%d%%)", progress.total_bytes / 1048576.0f, (int)((double)progress.bytes * 100.0 / progress.total_bytes));
+	fprintf(stream_, " at %.1f MB/s, %lu nodes (%.0f/s), %lu ways (%.0f/s), %lu relations (%.0f/s)\n",
+			progress.bytes / 1048576.0f / time,
+			(unsigned long)progress.nodes, progress.nodes / time,
+			(unsigned long)progress.ways, progress.ways / time,
+			(unsigned long)progress.relations, progress.relations / time);
+}
+
+void PrintingLoadListener::LoadPhaseFinished(Phase phase, const Progress& progress) {
+	if (phase == PARSE) {
+		float time = progress.time > 0.0f ? progress.time : 1.0f;
+		fprintf(stream_, "  %s: %.3f sec, %.1f MB at %.1f MB/s, %lu nodes, %lu ways, %lu relations\n", GetPhaseName(phase), progress.time,
+				progress.bytes / 1048576.0f, progress.bytes / 1048576.0f / time,
+				(unsigned long)progress.nodes, (unsigned long)progress.ways, (unsigned long)progress.relations);
+	} else {
+		fprintf(stream_, "  %s: %.3f sec, %lu nodes, %lu ways, %lu relations\n", GetPhaseName(phase), progress.time,
+				(unsigned long)progress.nodes, (unsigned long)progress.ways, (unsigned long)progress.relations);
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/MappedFile.hh>
+#include <glosm/Exception.hh>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char* filename) : fd_(-1), data_(NULL), size_(0) {
+	if ((fd_ = open(filename, O_RDONLY)) == -1)
+		throw SystemError() << "cannot open " << filename;
+
+	struct stat st;
+	if (fstat(fd_, &st) == -1) {
+		SystemError e;
+		close(fd_);
+		throw e << "cannot stat " << filename;
+	}
+
+	size_ = st.st_size;
+
+	if (size_ == 0)
+		return;
+
+	void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if (data == MAP_FAILED) {
+		SystemError e;
+		close(fd_);
+		throw e << "cannot mmap " << filename;
+	}
+
+	data_ = static_cast<const char*>(data);
+}
+
+MappedFile::~MappedFile() {
+	if (data_)
+		munmap(const_cast<char*>(data_), size_);
+	close(fd_);
+}
+
+void MappedFile::Advise(int advice) const {
+	/* this is only a hint, so failure is not an error */
+	if (data_)
+		madvise(const_cast<char*>(data_), size_, advice);
+}
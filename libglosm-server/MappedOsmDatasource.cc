@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/MappedOsmDatasource.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/WayStore.hh>
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+	/*
+	 * Mapped file format; all values are in host byte order, which
+	 * is verified on open with byte order mark. Each section starts
+	 * at 8 byte boundary.
+	 *
+	 * header:    magic[8] version:u32 bom:u32 bbox:i32[4]
+	 *            nstrings:u64 nways:u64 ncoords:u64 ntags:u64
+	 *            fanout:u64 nlevels:u64 nindex:u64
+	 * strings:   (string\0)[nstrings]; ids 1..nstrings
+	 * ids:       id[nways]
+	 * byid:      u64[nways]; way indexes sorted by id
+	 * bboxes:    i32[4][nways]
+	 * coordoffs: u64[nways + 1]
+	 * coords:    (x:i32 y:i32)[ncoords]
+	 * tagoffs:   u64[nways + 1]
+	 * tags:      (key:u32 value:u32)[ntags]
+	 * levels:    u64[nlevels + 1]; offsets of index levels
+	 * index:     i32[4][nindex]; bboxes of index nodes
+	 * flags:     u8[nways]
+	 *
+	 * Node i of index level 0 covers ways [i * fanout; (i + 1) *
+	 * fanout), node i of higher level covers nodes of the level
+	 * below in the same way.
+	 */
+	const char MAPPED_MAGIC[8] = { 'G', 'L', 'O', 'S', 'M', 'M', 'A', 'P' };
+	const uint32_t MAPPED_VERSION = 1;
+	const uint32_t MAPPED_BOM = 0x01020304;
+	const size_t MAPPED_FANOUT = 16;
+
+	enum MappedWayFlags {
+		MAPPED_CLOSED = 0x01,
+		MAPPED_CLOCKWISE = 0x02,
+		MAPPED_INNER = 0x04,
+	};
+
+	struct MappedHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t bom;
+		osmint_t bbox[4];
+		uint64_t nstrings;
+		uint64_t nways;
+		uint64_t ncoords;
+		uint64_t ntags;
+		uint64_t fanout;
+		uint64_t nlevels;
+		uint64_t nindex;
+	};
+
+	class MappedWriter {
+	protected:
+		FILE* file_;
+		std::vector<char> buffer_;
+		uint64_t written_;
+
+	public:
+		MappedWriter(const char* filename) : written_(0) {
+			if ((file_ = fopen(filename, "wb")) == NULL)
+				throw SystemError() << "cannot open " << filename << " for writing";
+			buffer_.reserve(1048576);
+		}
+
+		~MappedWriter() {
+			if (file_)
+				fclose(file_);
+		}
+
+		void Flush() {
+			if (!buffer_.empty() && fwrite(&buffer_.front(), buffer_.size(), 1, file_) != 1)
+				throw SystemError() << "mapped file write error";
+			buffer_.clear();
+		}
+
+		void Close() {
+			Flush();
+			FILE* file = file_;
+			file_ = NULL;
+			if (fclose(file) != 0)
+				throw SystemError() << "mapped file write error";
+		}
+
+		void WriteData(const void* data, size_t size) {
+			if (buffer_.size() + size > buffer_.capacity())
+				Flush();
+			buffer_.insert(buffer_.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+			written_ += size;
+		}
+
+		template <class T>
+		void Write(const T& value) {
+			WriteData(&value, sizeof(T));
+		}
+
+		/* pads data to start of next section */
+		void Align() {
+			static const char zeroes[8] = {};
+			if (written_ % 8)
+				WriteData(zeroes, 8 - written_ % 8);
+		}
+	};
+
+	class MappedReader {
+	protected:
+		const char* begin_;
+		const char* cur_;
+		const char* end_;
+
+	public:
+		MappedReader(const char* data, size_t size) : begin_(data), cur_(data), end_(data + size) {
+		}
+
+		template <class T>
+		const T* ReadArray(uint64_t count) {
+			if (count > (uint64_t)(end_ - cur_) / sizeof(T))
+				throw DataException() << "mapped file is truncated";
+			const T* data = reinterpret_cast<const T*>(cur_);
+			cur_ += count * sizeof(T);
+			Align();
+			return data;
+		}
+
+		const char* ReadString() {
+			const char* nul = static_cast<const char*>(memchr(cur_, '\0', end_ - cur_));
+			if (nul == NULL)
+				throw DataException() << "mapped file is truncated";
+			const char* str = cur_;
+			cur_ = nul + 1;
+			return str;
+		}
+
+		void Align() {
+			size_t pos = cur_ - begin_;
+			if (pos % 8)
+				cur_ += std::min((size_t)(end_ - cur_), 8 - pos % 8);
+		}
+	};
+
+	struct WayIdLess {
+		const osmid_t* ids;
+
+		WayIdLess(const osmid_t* i) : ids(i) {}
+		bool operator()(uint64_t index, osmid_t id) const { return ids[index] < id; }
+	};
+}
+
+struct MappedOsmDatasource::WayViewAppender {
+	const MappedOsmDatasource& source;
+	std::vector<WayView>& out;
+
+	WayViewAppender(const MappedOsmDatasource& s, std::vector<WayView>& o) : source(s), out(o) {}
+	void operator()(size_t index) { out.push_back(source.GetView(index)); }
+};
+
+MappedOsmDatasource::MappedOsmDatasource(const char* filename) : file_(filename) {
+	MappedReader reader(file_.GetData(), file_.GetSize());
+
+	const MappedHeader& header = *reader.ReadArray<MappedHeader>(1);
+	if (memcmp(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) != 0)
+		throw DataException() << filename << " is not a mapped OSM file";
+	if (header.bom != MAPPED_BOM)
+		throw DataException() << "mapped file byte order doesn't match host byte order";
+	if (header.version != MAPPED_VERSION)
+		throw DataException() << "unsupported mapped file version " << header.version;
+	if (header.fanout != MAPPED_FANOUT)
+		throw DataException() << "unsupported mapped file index fanout " << header.fanout;
+
+	if (header.nstrings > file_.GetSize())
+		throw DataException() << "mapped file is truncated";
+
+	bbox_ = BBoxi(header.bbox[0], header.bbox[1], header.bbox[2], header.bbox[3]);
+	nways_ = header.nways;
+	nlevels_ = header.nlevels;
+
+	/* strings are the only thing which is read on open */
+	std::vector<tagid_t> strings(header.nstrings + 1, TagDictionary::NONE);
+	bool same_ids = true;
+	for (uint64_t i = 1; i <= header.nstrings; ++i) {
+		strings[i] = TagDictionary::Intern(reader.ReadString());
+		same_ids = same_ids && strings[i] == i;
+	}
+	reader.Align();
+
+	ids_ = reader.ReadArray<osmid_t>(nways_);
+	byid_ = reader.ReadArray<uint64_t>(nways_);
+	bboxes_ = reader.ReadArray<BBoxi>(nways_);
+	coord_offsets_ = reader.ReadArray<uint64_t>(nways_ + 1);
+	coords_ = reader.ReadArray<Vector2i>(header.ncoords);
+	tag_offsets_ = reader.ReadArray<uint64_t>(nways_ + 1);
+	tags_ = reader.ReadArray<Tag>(header.ntags);
+	levels_ = reader.ReadArray<uint64_t>(nlevels_ + 1);
+	index_ = reader.ReadArray<BBoxi>(header.nindex);
+	flags_ = reader.ReadArray<uint8_t>(nways_);
+
+	if (nlevels_ > 16 || coord_offsets_[nways_] != header.ncoords || tag_offsets_[nways_] != header.ntags || levels_[nlevels_] != header.nindex || nlevels_ == 0)
+		throw DataException() << "mapped file is inconsistent";
+
+	/* everything queries index into is checked, so corrupt file
+	 * can't make them read outside of the mapping */
+	if (coord_offsets_[0] != 0 || tag_offsets_[0] != 0)
+		throw DataException() << "mapped file is inconsistent";
+	for (size_t i = 0; i < nways_; ++i)
+		if (coord_offsets_[i] > coord_offsets_[i + 1] || tag_offsets_[i] > tag_offsets_[i + 1])
+			throw DataException() << "mapped file has bad way offsets";
+
+	for (size_t i = 0; i < nways_; ++i)
+		if (byid_[i] >= nways_ || (i > 0 && ids_[byid_[i - 1]] > ids_[byid_[i]]))
+			throw DataException() << "mapped file has bad way id table";
+
+	/* each index level must cover the one below */
+	if (levels_[0] != 0)
+		throw DataException() << "mapped file has bad index";
+	for (size_t level = 0, below = nways_; level < nlevels_; ++level) {
+		size_t count = levels_[level + 1] - levels_[level];
+		if (levels_[level] > levels_[level + 1] || count != (below + MAPPED_FANOUT - 1) / MAPPED_FANOUT)
+			throw DataException() << "mapped file has bad index";
+		below = count;
+	}
+	if (levels_[nlevels_] - levels_[nlevels_ - 1] > 1)
+		throw DataException() << "mapped file has bad index";
+
+	/* tag ids in file are those of the process which wrote it,
+	 * so they can be used in place only if dictionary of this
+	 * process has assigned the same ids, which is the case if
+	 * nothing else was interned before */
+	for (size_t i = 0; i < header.ntags; ++i)
+		if (tags_[i].first >= strings.size() || tags_[i].second >= strings.size())
+			throw DataException() << "bad tag id in mapped file";
+
+	if (!same_ids) {
+		remapped_tags_.resize(header.ntags);
+		for (size_t i = 0; i < header.ntags; ++i)
+			remapped_tags_[i] = std::make_pair(strings[tags_[i].first], strings[tags_[i].second]);
+		for (size_t i = 0; i < nways_; ++i)
+			std::sort(remapped_tags_.begin() + tag_offsets_[i], remapped_tags_.begin() + tag_offsets_[i + 1]);
+		tags_ = remapped_tags_.empty() ? NULL : &remapped_tags_.front();
+	}
+
+	/* readahead would only pull in data of unrelated areas */
+	file_.Advise(MADV_RANDOM);
+}
+
+MappedOsmDatasource::~MappedOsmDatasource() {
+}
+
+void MappedOsmDatasource::Write(const char* filename, const WayStore& ways, const BBoxi& bbox) {
+	size_t nways = ways.GetSize();
+
+	uint64_t ncoords = 0, ntags = 0;
+	for (size_t i = 0; i < nways; ++i) {
+		WayView way = ways.GetView(i);
+		if (way.Coords.size() != way.Nodes.size())
+			throw Exception() << "way " << ways.GetId(i) << " has no inlined coordinates";
+		ncoords += way.Coords.size();
+		ntags += way.Tags.size();
+	}
+
+	/* index is built just like PackedRTree does, except that
+	 * ways are taken in order they are stored */
+	std::vector<BBoxi> index;
+	std::vector<uint64_t> levels;
+	levels.push_back(0);
+	for (size_t i = 0; i < nways; i += MAPPED_FANOUT) {
+		BBoxi node(BBoxi::Empty());
+		for (size_t j = i; j < nways && j < i + MAPPED_FANOUT; ++j)
+			node.Include(ways.GetBBox(j));
+		index.push_back(node);
+	}
+	while (index.size() - levels.back() > 1) {
+		size_t begin = levels.back();
+		size_t end = index.size();
+		levels.push_back(end);
+		for (size_t i = begin; i < end; i += MAPPED_FANOUT) {
+			BBoxi node(BBoxi::Empty());
+			for (size_t j = i; j < end && j < i + MAPPED_FANOUT; ++j)
+				node.Include(index[j]);
+			index.push_back(node);
+		}
+	}
+	levels.push_back(index.size());
+
+	std::vector<std::pair<osmid_t, uint64_t> > byid;
+	byid.reserve(nways);
+	for (size_t i = 0; i < nways; ++i)
+		byid.push_back(std::make_pair(ways.GetId(i), (uint64_t)i));
+	std::sort(byid.begin(), byid.end());
+
+	MappedWriter writer(filename);
+
+	MappedHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+	header.version = MAPPED_VERSION;
+	header.bom = MAPPED_BOM;
+	header.bbox[0] = bbox.left;
+	header.bbox[1] = bbox.bottom;
+	header.bbox[2] = bbox.right;
+	header.bbox[3] = bbox.top;
+	header.nstrings = TagDictionary::GetSize();
+	header.nways = nways;
+	header.ncoords = ncoords;
+	header.ntags = ntags;
+	header.fanout = MAPPED_FANOUT;
+	header.nlevels = levels.size() - 1;
+	header.nindex = index.size();
+	writer.Write(header);
+	writer.Align();
+
+	for (tagid_t i = 1; i <= header.nstrings; ++i) {
+		const char* str = TagDictionary::GetString(i);
+		writer.WriteData(str, strlen(str) + 1);
+	}
+	writer.Align();
+
+	for (size_t i = 0; i < nways; ++i)
+		writer.Write(ways.GetId(i));
+	writer.Align();
+
+	for (size_t i = 0; i < nways; ++i)
+		writer.Write(byid[i].second);
+	writer.Align();
+
+	for (size_t i = 0; i < nways; ++i)
+		writer.Write(ways.GetBBox(i));
+	writer.Align();
+
+	uint64_t offset = 0;
+	writer.Write(offset);
+	for (size_t i = 0; i < nways; ++i)
+		writer.Write(offset += ways.GetView(i).Coords.size());
+	writer.Align();
+
+	for (size_t i = 0; i < nways; ++i) {
+		WayView way = ways.GetView(i);
+		if (!way.Coords.empty())
+			writer.WriteData(way.Coords.data(), way.Coords.size() * sizeof(Vector2i));
+	}
+	writer.Align();
+
+	offset = 0;
+	writer.Write(offset);
+	for (size_t i = 0; i < nways; ++i)
+		writer.Write(offset += ways.GetView(i).Tags.size());
+	writer.Align();
+
+	for (size_t i = 0; i < nways; ++i) {
+		WayView way = ways.GetView(i);
+		for (TagsView::const_iterator tag = way.Tags.begin(); tag != way.Tags.end(); ++tag) {
+			writer.Write((uint32_t)tag->first);
+			writer.Write((uint32_t)tag->second);
+		}
+	}
+	writer.Align();
+
+	for (std::vector<uint64_t>::const_iterator level = levels.begin(); level != levels.end(); ++level)
+		writer.Write(*level);
+	writer.Align();
+
+	for (std::vector<BBoxi>::const_iterator node = index.begin(); node != index.end(); ++node)
+		writer.Write(*node);
+	writer.Align();
+
+	for (size_t i = 0; i < nways; ++i) {
+		WayView way = ways.GetView(i);
+		uint8_t flags = 0;
+		if (way.Closed)
+			flags |= MAPPED_CLOSED;
+		if (way.Clockwise)
+			flags |= MAPPED_CLOCKWISE;
+		if (way.Inner)
+			flags |= MAPPED_INNER;
+		writer.Write(flags);
+	}
+	writer.Align();
+
+	writer.Close();
+}
+
+template <class V>
+void MappedOsmDatasource::Query(const BBoxi& bbox, V& visitor) const {
+	if (nways_ == 0 || !bbox.Intersects(bbox_))
+		return;
+
+	/* same traversal as in PackedRTree::Query(); 64 bit counts
+	 * can't produce more than 16 levels with this fanout */
+	struct { size_t level; size_t index; } stack[MAPPED_FANOUT * 16];
+	int top = 0;
+
+	stack[top].level = nlevels_ - 1;
+	stack[top].index = 0;
+	++top;
+
+	while (top > 0) {
+		--top;
+		size_t level = stack[top].level;
+		size_t index = stack[top].index;
+
+		if (level == 0) {
+			size_t end = std::min(nways_, (index + 1) * MAPPED_FANOUT);
+			for (size_t i = index * MAPPED_FANOUT; i < end; ++i)
+				if (bboxes_[i].Intersects(bbox))
+					visitor(i);
+		} else {
+			size_t below = levels_[level - 1];
+			size_t belowcount = levels_[level] - below;
+			size_t end = std::min(belowcount, (index + 1) * MAPPED_FANOUT);
+
+			/* push in reverse so that children are visited in order */
+			for (size_t i = end; i > index * MAPPED_FANOUT; --i) {
+				if (index_[below + i - 1].Intersects(bbox)) {
+					assert(top < (int)(MAPPED_FANOUT * 16));
+					stack[top].level = level - 1;
+					stack[top].index = i - 1;
+					++top;
+				}
+			}
+		}
+	}
+}
+
+OsmDatasource::WayView MappedOsmDatasource::GetView(size_t index) const {
+	/* Nodes are left empty as node ids are not stored */
+	WayView view;
+
+	uint8_t flags = flags_[index];
+	view.Closed = flags & MAPPED_CLOSED;
+	view.Clockwise = flags & MAPPED_CLOCKWISE;
+	view.Inner = flags & MAPPED_INNER;
+	view.BBox = bboxes_[index];
+	view.Coords = ArrayView<Vector2i>(coords_ + coord_offsets_[index], coords_ + coord_offsets_[index + 1]);
+	view.Tags = TagsView(tags_ + tag_offsets_[index], tags_ + tag_offsets_[index + 1]);
+
+	return view;
+}
+
+OsmDatasource::Node MappedOsmDatasource::GetNode(osmid_t /*unused*/) const {
+	throw DataException() << "nodes are not stored in mapped file";
+}
+
+const OsmDatasource::Way& MappedOsmDatasource::GetWay(osmid_t /*unused*/) const {
+	throw Exception() << "way objects are not kept by mapped datasource, use TryGetWay()";
+}
+
+const OsmDatasource::Relation& MappedOsmDatasource::GetRelation(osmid_t /*unused*/) const {
+	throw DataException() << "relations are not stored in mapped file";
+}
+
+bool MappedOsmDatasource::TryGetNode(osmid_t /*unused*/, Node& /*unused*/) const {
+	return false;
+}
+
+bool MappedOsmDatasource::TryGetWay(osmid_t id, WayView& out) const {
+	const uint64_t* i = std::lower_bound(byid_, byid_ + nways_, id, WayIdLess(ids_));
+	if (i == byid_ + nways_ || ids_[*i] != id)
+		return false;
+
+	out = GetView(*i);
+	return true;
+}
+
+void MappedOsmDatasource::GetWays(std::vector<const Way*>& /*unused*/, const BBoxi& /*unused*/) const {
+	throw Exception() << "way objects are not kept by mapped datasource, use way views";
+}
+
+void MappedOsmDatasource::GetWays(std::vector<WayView>& out, const BBoxi& bbox) const {
+	WayViewAppender appender(*this, out);
+	Query(bbox, appender);
+}
+
+Vector2i MappedOsmDatasource::GetCenter() const {
+	return bbox_.GetCenter();
+}
+
+BBoxi MappedOsmDatasource::GetBBox() const {
+	return bbox_;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/PageAllocator.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+#include <map>
+#include <vector>
+#include <cstdlib>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const size_t HugePageAllocator::HUGE_PAGE_SIZE;
+const size_t HugePageAllocator::MIN_MAPPED_SIZE;
+const size_t HugePageAllocator::ARENA_SIZE;
+const size_t FilePageAllocator::MIN_MAPPED_SIZE;
+
+std::string FilePageAllocator::directory_;
+
+namespace {
+	/*
+	 * Source of mapped blocks for both policies
+	 *
+	 * Blocks are carved from large arenas, so there are only a few
+	 * mappings instead of one per block, which would quickly hit
+	 * vm.max_map_count. File backed arenas are extents of a single
+	 * file per directory, grown by ARENA_SIZE.
+	 *
+	 * Freed blocks give their memory and disk space back but keep
+	 * address space, which is reused for blocks of the same size;
+	 * that's the common case as id_map pages have fixed size.
+	 * Blocks larger than half of arena get arenas of their own,
+	 * which are unmapped when freed.
+	 */
+	class ArenaPool {
+	protected:
+		struct Arena {
+			size_t size;
+			size_t used;
+			bool file;
+			bool dedicated;
+			/* file arena of previous directory, its blocks are
+			 * not reused */
+			bool retired;
+		};
+
+		typedef std::map<char*, Arena> ArenaMap;
+		typedef std::multimap<size_t, char*> FreeMap;
+
+		pthread_mutex_t mutex_;
+
+		ArenaMap arenas_;
+
+		/* indexed by Arena::file */
+		FreeMap free_[2];
+		char* current_[2];
+
+		int fd_;
+		std::string fd_directory_;
+		off_t fd_size_;
+
+		size_t page_size_;
+
+	protected:
+		size_t Round(size_t size) const {
+			size_t unit = size >= HugePageAllocator::HUGE_PAGE_SIZE ? HugePageAllocator::HUGE_PAGE_SIZE : page_size_;
+			return (size + unit - 1) / unit * unit;
+		}
+
+		void OpenFile(const std::string& directory) {
+			std::string path = directory + "/glosm-pages-XXXXXX";
+			std::vector<char> buffer(path.begin(), path.end());
+			buffer.push_back('\0');
+
+			int fd = mkstemp(&buffer.front());
+			if (fd == -1)
+				throw SystemError() << "cannot create page file in " << directory;
+
+			/* file is only accessed through the mapping */
+			unlink(&buffer.front());
+
+			/* existing mappings stay valid after close */
+			if (fd_ != -1)
+				close(fd_);
+
+			fd_ = fd;
+			fd_directory_ = directory;
+			fd_size_ = 0;
+
+			for (ArenaMap::iterator arena = arenas_.begin(); arena != arenas_.end(); ++arena)
+				if (arena->second.file)
+					arena->second.retired = true;
+			free_[true].clear();
+			current_[true] = NULL;
+		}
+
+		char* MapAnonymous(size_t size) {
+			/* map extra huge page and trim both ends to get aligned block */
+			size_t mapsize = size + HugePageAllocator::HUGE_PAGE_SIZE;
+			char* map = static_cast<char*>(mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+			if (map == MAP_FAILED)
+				throw std::bad_alloc();
+
+			char* ptr = reinterpret_cast<char*>(((uintptr_t)map + HugePageAllocator::HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HugePageAllocator::HUGE_PAGE_SIZE - 1));
+			if (ptr > map)
+				munmap(map, ptr - map);
+			if (ptr + size < map + mapsize)
+				munmap(ptr + size, map + mapsize - ptr - size);
+
+#if defined(MADV_HUGEPAGE)
+			/* this is only a hint, so failure is not an error */
+			madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+			return ptr;
+		}
+
+		char* MapFile(size_t size) {
+			if (ftruncate(fd_, fd_size_ + size) == -1)
+				throw SystemError() << "cannot extend page file in " << fd_directory_;
+
+			void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, fd_size_);
+			if (ptr == MAP_FAILED)
+				throw SystemError() << "cannot mmap page file in " << fd_directory_;
+
+			fd_size_ += size;
+
+			return static_cast<char*>(ptr);
+		}
+
+		char* NewArena(size_t size, bool file, bool dedicated) {
+			char* ptr = file ? MapFile(size) : MapAnonymous(size);
+
+			Arena arena;
+			arena.size = size;
+			arena.used = dedicated ? size : 0;
+			arena.file = file;
+			arena.dedicated = dedicated;
+			arena.retired = false;
+			arenas_.insert(std::make_pair(ptr, arena));
+
+			return ptr;
+		}
+
+		/* drops block contents, memory and backing storage are
+		 * released while address space is kept */
+		static void Release(char* ptr, size_t size, bool file) {
+			/* these are only hints, so failures are not errors */
+			if (file) {
+#if defined(MADV_REMOVE)
+				madvise(ptr, size, MADV_REMOVE);
+#endif
+			} else {
+				madvise(ptr, size, MADV_DONTNEED);
+			}
+		}
+
+	public:
+		ArenaPool() : fd_(-1), fd_size_(0), page_size_(sysconf(_SC_PAGESIZE)) {
+			current_[false] = current_[true] = NULL;
+
+			int errn;
+			if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+				throw SystemError(errn) << "pthread_mutex_init failed";
+		}
+
+		/* directory is NULL for anonymous memory */
+		void* Allocate(size_t size, const std::string* directory) {
+			Guard guard(mutex_);
+
+			bool file = directory != NULL;
+			if (file && (fd_ == -1 || *directory != fd_directory_))
+				OpenFile(*directory);
+
+			size = Round(size);
+
+			FreeMap::iterator reused = free_[file].find(size);
+			if (reused != free_[file].end()) {
+				char* ptr = reused->second;
+				free_[file].erase(reused);
+				return ptr;
+			}
+
+			if (size > HugePageAllocator::ARENA_SIZE / 2)
+				return NewArena(size, file, true);
+
+			if (current_[file] != NULL) {
+				Arena& arena = arenas_[current_[file]];
+				/* large blocks are aligned to huge page */
+				size_t offset = arena.used;
+				if (size >= HugePageAllocator::HUGE_PAGE_SIZE)
+					offset = (arena.used + HugePageAllocator::HUGE_PAGE_SIZE - 1) / HugePageAllocator::HUGE_PAGE_SIZE * HugePageAllocator::HUGE_PAGE_SIZE;
+				if (offset + size <= arena.size) {
+					arena.used = offset + size;
+					return current_[file] + offset;
+				}
+			}
+
+			/* tail of previous arena is left unused */
+			current_[file] = NewArena(HugePageAllocator::ARENA_SIZE, file, false);
+			arenas_[current_[file]].used = size;
+			return current_[file];
+		}
+
+		void Free(void* block, size_t size) {
+			Guard guard(mutex_);
+
+			char* ptr = static_cast<char*>(block);
+			size = Round(size);
+
+			ArenaMap::iterator arena = arenas_.upper_bound(ptr);
+			if (arena == arenas_.begin())
+				return;
+			--arena;
+
+			Release(ptr, size, arena->second.file);
+
+			if (arena->second.dedicated) {
+				munmap(arena->first, arena->second.size);
+				arenas_.erase(arena);
+			} else if (!arena->second.retired) {
+				free_[arena->second.file].insert(std::make_pair(size, ptr));
+			}
+		}
+	};
+
+	ArenaPool& Pool() {
+		/* never destroyed, as maps may be freed from other
+		 * static destructors */
+		static ArenaPool* pool = new ArenaPool;
+		return *pool;
+	}
+}
+
+void* HugePageAllocator::Allocate(size_t size) {
+	if (size < MIN_MAPPED_SIZE)
+		return HeapPageAllocator::Allocate(size);
+
+	return Pool().Allocate(size, NULL);
+}
+
+void HugePageAllocator::Free(void* ptr, size_t size) {
+	if (size < MIN_MAPPED_SIZE)
+		HeapPageAllocator::Free(ptr, size);
+	else
+		Pool().Free(ptr, size);
+}
+
+void* FilePageAllocator::Allocate(size_t size) {
+	if (size < MIN_MAPPED_SIZE || directory_.empty())
+		return HugePageAllocator::Allocate(size);
+
+	return Pool().Allocate(size, &directory_);
+}
+
+void FilePageAllocator::Free(void* ptr, size_t size) {
+	/* pool knows whether block is file backed */
+	HugePageAllocator::Free(ptr, size);
+}
+
+void FilePageAllocator::SetDirectory(const std::string& directory) {
+	directory_ = directory;
+}
@@ -20,8 +20,112 @@
 
 #include <glosm/PreloadedGPXDatasource.hh>
 #include <glosm/ParsingHelpers.hh>
+#include <glosm/Guard.hh>
+#include <glosm/Timer.hh>
+
+#include <algorithm>
+#include <cstring>
+
+#include <dirent.h>
+#include <pthread.h>
+
+namespace {
+	/* number of points in a chunk, including point shared with
+	 * the next chunk */
+	const size_t CHUNK_SIZE = 32;
+
+	/* tolerance of first simplified level, about a meter */
+	const int MIN_TOLERANCE = 100;
+
+	/* ratio of tolerances of adjacent levels */
+	const int TOLERANCE_STEP = 4;
+
+	/* maximal number of simplified levels */
+	const int MAX_LEVELS = 12;
+
+	/* squared distance from point to line segment */
+	double SegmentDistance2(const Vector3i& p, const Vector3i& a, const Vector3i& b) {
+		double dx = (double)b.x - a.x;
+		double dy = (double)b.y - a.y;
+		double px = (double)p.x - a.x;
+		double py = (double)p.y - a.y;
+
+		double len2 = dx * dx + dy * dy;
+		if (len2 > 0.0) {
+			double t = std::max(0.0, std::min(1.0, (px * dx + py * dy) / len2));
+			px -= t * dx;
+			py -= t * dy;
+		}
+
+		return px * px + py * py;
+	}
+
+	/* appends polyline simplified with Douglas-Peucker algorithm;
+	 * keep is scratch space */
+	void Simplify(const Vector3i* points, size_t count, int tolerance, std::vector<char>& keep, std::vector<Vector3i>& out) {
+		if (count <= 2) {
+			out.insert(out.end(), points, points + count);
+			return;
+		}
+
+		keep.assign(count, 0);
+		keep[0] = keep[count - 1] = 1;
+
+		/* stack of ranges to process, so long tracks don't
+		 * exhaust call stack */
+		std::vector<std::pair<size_t, size_t> > ranges;
+		ranges.push_back(std::make_pair(0, count - 1));
+
+		double tolerance2 = (double)tolerance * tolerance;
+		while (!ranges.empty()) {
+			size_t first = ranges.back().first;
+			size_t last = ranges.back().second;
+			ranges.pop_back();
+
+			double maxdist2 = 0.0;
+			size_t farthest = first;
+			for (size_t i = first + 1; i < last; ++i) {
+				double dist2 = SegmentDistance2(points[i], points[first], points[last]);
+				if (dist2 > maxdist2) {
+					maxdist2 = dist2;
+					farthest = i;
+				}
+			}
+
+			if (maxdist2 > tolerance2) {
+				keep[farthest] = 1;
+				ranges.push_back(std::make_pair(first, farthest));
+				ranges.push_back(std::make_pair(farthest, last));
+			}
+		}
+
+		for (size_t i = 0; i < count; ++i)
+			if (keep[i])
+				out.push_back(points[i]);
+	}
+}
+
+struct PreloadedGPXDatasource::LoadTask {
+	const std::vector<std::string>* filenames;
+	size_t* next;
+	pthread_mutex_t* mutex;
+
+	/* files are parsed into this one */
+	PreloadedGPXDatasource* parser;
+
+	/* per-file: task which parsed it, range of its segments
+	 * in task's parser and error message */
+	std::vector<LoadTask*>* owners;
+	std::vector<std::pair<size_t, size_t> >* segments;
+	std::vector<std::string>* errors;
+
+	size_t loaded_bytes;
+};
 
 PreloadedGPXDatasource::PreloadedGPXDatasource() : XMLParser(XMLParser::HANDLE_ELEMENTS | XMLParser::HANDLE_CHARDATA) {
+	/* levels are never moved, as they may be large */
+	levels_.reserve(MAX_LEVELS + 1);
+	levels_.push_back(Level());
 }
 
 PreloadedGPXDatasource::~PreloadedGPXDatasource() {
@@ -30,6 +134,7 @@ PreloadedGPXDatasource::~PreloadedGPXDatasource() {
 void PreloadedGPXDatasource::StartElement(const char* name, const char** atts) {
 	if (tag_level_ == 4 && current_tag_ == TRKPT && StrEq<-1>(name, "ele")) {
 		current_tag_ = ELE;
+		ele_.clear();
 	} else if (tag_level_ == 3 && current_tag_ == TRKSEG && StrEq<-1>(name, "trkpt")) {
 		current_tag_ = TRKPT;
 
@@ -44,7 +149,7 @@ void PreloadedGPXDatasource::StartElement(const char* name, const char** atts) {
 				++att;
 		}
 
-		points_.push_back(Vector3i(lon, lat, 0));
+		levels_.front().points.push_back(Vector3i(lon, lat, 0));
 	} else if (tag_level_ == 2 && current_tag_ == TRK && StrEq<-1>(name, "trkseg")) {
 		current_tag_ = TRKSEG;
 	} else if (tag_level_ == 1 && current_tag_ == GPX && StrEq<-1>(name, "trk")) {
@@ -59,35 +164,313 @@ void PreloadedGPXDatasource::StartElement(const char* name, const char** atts) {
 }
 
 void PreloadedGPXDatasource::EndElement(const char* /*name*/) {
-	if (tag_level_ == 5 && current_tag_ == ELE)
+	Level& tracks = levels_.front();
+
+	if (tag_level_ == 5 && current_tag_ == ELE) {
+		tracks.points.back().z = ParseEle(ele_.c_str());
 		current_tag_ = TRKPT;
-	else if (tag_level_ == 4 && current_tag_ == TRKPT)
+	} else if (tag_level_ == 4 && current_tag_ == TRKPT) {
 		current_tag_ = TRKSEG;
-	else if (tag_level_ == 3 && current_tag_ == TRKSEG)
+	} else if (tag_level_ == 3 && current_tag_ == TRKSEG) {
+		if (tracks.points.size() > tracks.segments.back())
+			tracks.segments.push_back(tracks.points.size());
 		current_tag_ = TRK;
-	else if (tag_level_ == 2 && current_tag_ == TRK)
+	} else if (tag_level_ == 2 && current_tag_ == TRK) {
 		current_tag_ = GPX;
-	else if (tag_level_ == 1 && current_tag_ == GPX)
+	} else if (tag_level_ == 1 && current_tag_ == GPX) {
 		current_tag_ = NONE;
+	}
 
 	--tag_level_;
 }
 
 void PreloadedGPXDatasource::CharacterData(const char* data, int len) {
-	std::string buf(data, len);
+	/* text may come in pieces */
 	if (tag_level_ == 5 && current_tag_ == ELE)
-		points_.back().z = ParseEle(buf.c_str());
+		ele_.append(data, len);
 }
 
-void PreloadedGPXDatasource::Load(const char* filename) {
+void PreloadedGPXDatasource::GetLoadCounts(LoadListener::Progress& progress) const {
+	/* track points are counted as nodes, segments as ways */
+	progress.nodes = levels_.front().points.size();
+	progress.ways = levels_.front().segments.size() - 1;
+}
+
+void PreloadedGPXDatasource::IndexLevel(Level& level) {
+	level.chunks.clear();
+	for (size_t s = 0; s + 1 < level.segments.size(); ++s) {
+		size_t end = level.segments[s + 1];
+		for (size_t first = level.segments[s]; ; ) {
+			size_t last = std::min(first + CHUNK_SIZE, end);
+			level.chunks.push_back(Chunk(first, last));
+			if (last == end)
+				break;
+			first = last - 1;
+		}
+	}
+
+	level.index.Clear();
+	level.index.Reserve(level.chunks.size());
+	for (size_t i = 0; i < level.chunks.size(); ++i) {
+		BBoxi bbox(BBoxi::Empty());
+		for (size_t p = level.chunks[i].begin; p < level.chunks[i].end; ++p)
+			bbox.Include(level.points[p]);
+		level.index.Insert(bbox, i);
+	}
+	level.index.Build();
+}
+
+void PreloadedGPXDatasource::BuildIndex() {
+	levels_.resize(1);
+	IndexLevel(levels_.front());
+
+	std::vector<char> keep;
+	int tolerance = MIN_TOLERANCE;
+	for (int step = 0; step < MAX_LEVELS; ++step, tolerance *= TOLERANCE_STEP) {
+		const Level& previous = levels_.back();
+
+		/* nothing to simplify when all segments are reduced to
+		 * their endpoints */
+		if (previous.points.size() <= 2 * (previous.segments.size() - 1))
+			break;
+
+		Level level;
+		level.tolerance = tolerance;
+		for (size_t s = 0; s + 1 < previous.segments.size(); ++s) {
+			Simplify(&previous.points[previous.segments[s]], previous.segments[s + 1] - previous.segments[s], tolerance, keep, level.points);
+			level.segments.push_back(level.points.size());
+		}
+
+		/* levels which save little are not worth memory; next
+		 * step will try larger tolerance on the same data */
+		if (level.points.size() * 4 > previous.points.size() * 3)
+			continue;
+
+		levels_.push_back(Level());
+		levels_.back().tolerance = level.tolerance;
+		levels_.back().points.swap(level.points);
+		levels_.back().segments.swap(level.segments);
+		IndexLevel(levels_.back());
+	}
+}
+
+void PreloadedGPXDatasource::QueryChunks(const Level& level, const BBoxi& bbox, std::vector<size_t>& out) {
+	level.index.Query(bbox, out);
+	std::sort(out.begin(), out.end());
+}
+
+void PreloadedGPXDatasource::ParseFile(const char* filename) {
 	current_tag_ = NONE;
 	tag_level_ = 0;
 
-	XMLParser::Load(filename);
+	Level& tracks = levels_.front();
+	size_t npoints = tracks.points.size();
+	size_t nsegments = tracks.segments.size();
+
+	try {
+		XMLParser::Load(filename);
+	} catch (...) {
+		tracks.points.resize(npoints);
+		tracks.segments.resize(nsegments);
+		throw;
+	}
+}
+
+void PreloadedGPXDatasource::Load(const char* filename) {
+	/* index stays valid if parsing fails, as data is restored */
+	ParseFile(filename);
+
+	Timer timer;
+	BuildIndex();
+	FinishPhase(LoadListener::INDEX, timer.Count());
+}
+
+void* PreloadedGPXDatasource::LoadThread(void* arg) {
+	LoadTask* task = static_cast<LoadTask*>(arg);
+	const std::vector<size_t>& segments = task->parser->levels_.front().segments;
+
+	for (;;) {
+		size_t file;
+		{
+			Guard guard(*task->mutex);
+			if (*task->next == task->filenames->size())
+				return NULL;
+			file = (*task->next)++;
+		}
+
+		const std::string& filename = (*task->filenames)[file];
+		size_t first = segments.size() - 1;
+		try {
+			task->parser->ParseFile(filename.c_str());
+			task->loaded_bytes += task->parser->GetLoadedBytes();
+		} catch (std::exception& e) {
+			(*task->errors)[file] = filename + ": " + e.what();
+			continue;
+		} catch (...) {
+			(*task->errors)[file] = filename + ": unknown error";
+			continue;
+		}
+
+		(*task->owners)[file] = task;
+		(*task->segments)[file] = std::make_pair(first, segments.size() - 1);
+	}
+}
+
+size_t PreloadedGPXDatasource::LoadFiles(const std::vector<std::string>& filenames, int nthreads, std::vector<std::string>& errors) {
+	ResetLoadStats();
+
+	Timer timer;
+
+	/* files are small and many, so they are taken by threads
+	 * one by one, each thread parsing into its own datasource */
+	size_t next = 0;
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, NULL);
+
+	std::vector<LoadTask*> owners(filenames.size(), (LoadTask*)NULL);
+	std::vector<std::pair<size_t, size_t> > segments(filenames.size());
+	std::vector<std::string> fileerrors(filenames.size());
+
+	std::vector<LoadTask> tasks(std::max(1, std::min(nthreads, (int)filenames.size())));
+
+	size_t loaded = 0;
+	try {
+		for (std::vector<LoadTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+			task->filenames = &filenames;
+			task->next = &next;
+			task->mutex = &mutex;
+			task->parser = new PreloadedGPXDatasource;
+			task->parser->tokenizer_ = tokenizer_;
+			task->owners = &owners;
+			task->segments = &segments;
+			task->errors = &fileerrors;
+		}
+
+		/* first task is run by calling thread, also tasks for
+		 * which thread could not be created */
+		std::vector<pthread_t> threads(tasks.size());
+		std::vector<bool> started(tasks.size());
+		for (size_t i = 1; i < tasks.size(); ++i)
+			started[i] = pthread_create(&threads[i], NULL, LoadThread, &tasks[i]) == 0;
+
+		for (size_t i = 0; i < tasks.size(); ++i)
+			if (!started[i])
+				LoadThread(&tasks[i]);
+
+		for (size_t i = 1; i < tasks.size(); ++i)
+			if (started[i])
+				pthread_join(threads[i], NULL);
+
+		/* merge tracks in order of files */
+		Level& tracks = levels_.front();
+		for (size_t file = 0; file < filenames.size(); ++file) {
+			if (owners[file] == NULL) {
+				errors.push_back(fileerrors[file]);
+				continue;
+			}
+
+			const Level& parsed = owners[file]->parser->levels_.front();
+			for (size_t s = segments[file].first; s < segments[file].second; ++s) {
+				tracks.points.insert(tracks.points.end(), parsed.points.begin() + parsed.segments[s], parsed.points.begin() + parsed.segments[s + 1]);
+				tracks.segments.push_back(tracks.points.size());
+			}
+
+			++loaded;
+		}
+	} catch (...) {
+		for (std::vector<LoadTask>::iterator task = tasks.begin(); task != tasks.end(); ++task)
+			delete task->parser;
+		pthread_mutex_destroy(&mutex);
+		throw;
+	}
+
+	for (std::vector<LoadTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+		loaded_bytes_ += task->loaded_bytes;
+		delete task->parser;
+	}
+	pthread_mutex_destroy(&mutex);
+
+	parse_time_ = timer.Count();
+	FinishPhase(LoadListener::PARSE, parse_time_);
+
+	BuildIndex();
+	FinishPhase(LoadListener::INDEX, timer.Count());
+
+	load_time_ = phase_times_[LoadListener::PARSE] + phase_times_[LoadListener::INDEX];
+
+	return loaded;
+}
+
+void PreloadedGPXDatasource::FindFiles(const char* path, std::vector<std::string>& filenames) {
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+		throw SystemError() << "cannot open directory " << path;
+
+	std::vector<std::string> found;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		size_t len = strlen(entry->d_name);
+		if (len > 4 && strcmp(entry->d_name + len - 4, ".gpx") == 0)
+			found.push_back(std::string(path) + "/" + entry->d_name);
+	}
+
+	closedir(dir);
+
+	std::sort(found.begin(), found.end());
+	filenames.insert(filenames.end(), found.begin(), found.end());
+}
+
+size_t PreloadedGPXDatasource::GetPointsCount() const {
+	return levels_.front().points.size();
+}
+
+size_t PreloadedGPXDatasource::GetSegmentsCount() const {
+	return levels_.front().segments.size() - 1;
+}
+
+size_t PreloadedGPXDatasource::GetSimplifiedLevelsCount() const {
+	return levels_.size() - 1;
 }
 
 void PreloadedGPXDatasource::GetPoints(std::vector<Vector3i>& out, const BBoxi& bbox) const {
-	for (PointsVector::const_iterator i = points_.begin(); i != points_.end(); ++i)
-		if (bbox.Contains(*i))
-			out.push_back(*i);
+	const Level& tracks = levels_.front();
+
+	std::vector<size_t> chunks;
+	QueryChunks(tracks, bbox, chunks);
+
+	for (std::vector<size_t>::const_iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		/* point shared with the next chunk belongs to that chunk */
+		size_t end = tracks.chunks[*i].end;
+		if (*i + 1 < tracks.chunks.size() && tracks.chunks[*i + 1].begin == end - 1)
+			--end;
+
+		for (size_t p = tracks.chunks[*i].begin; p < end; ++p)
+			if (bbox.Contains(tracks.points[p]))
+				out.push_back(tracks.points[p]);
+	}
+}
+
+void PreloadedGPXDatasource::GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int tolerance) const {
+	/* coarsest level which fits tolerance */
+	LevelsVector::const_iterator level = levels_.begin();
+	while (level + 1 != levels_.end() && (level + 1)->tolerance <= tolerance)
+		++level;
+
+	std::vector<size_t> chunks;
+	QueryChunks(*level, bbox, chunks);
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		const Chunk& chunk = level->chunks[chunks[i]];
+		const Vector3i* first = &level->points[chunk.begin];
+		const Vector3i* last = first + (chunk.end - chunk.begin);
+
+		/* continuation of previous chunk extends its polyline */
+		if (i > 0 && chunks[i - 1] + 1 == chunks[i] && level->chunks[chunks[i - 1]].end - 1 == chunk.begin) {
+			points.insert(points.end(), first + 1, last);
+			lengths.back() += last - first - 1;
+		} else {
+			points.insert(points.end(), first, last);
+			lengths.push_back(last - first);
+		}
+	}
 }
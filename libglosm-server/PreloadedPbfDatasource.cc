@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * PBF format reference: http://wiki.openstreetmap.org/wiki/PBF_Format
+ *
+ * Protobuf wire format is decoded by hand, as only a handful of
+ * messages is needed.
+ */
+
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/MappedFile.hh>
+#include <glosm/Timer.hh>
+
+#include <zlib.h>
+#include <pthread.h>
+
+#include <cstring>
+#include <string>
+
+namespace {
+	/* limits imposed by the format */
+	const size_t MAX_BLOB_HEADER_SIZE = 64 * 1024;
+	const size_t MAX_BLOB_SIZE = 32 * 1024 * 1024;
+
+	/* number of decoded blocks which may wait to be merged, per thread */
+	const size_t BLOCKS_PER_THREAD = 4;
+
+	/**
+	 * Reader for protobuf messages
+	 */
+	class PbfReader {
+	protected:
+		const unsigned char* cur_;
+		const unsigned char* end_;
+		uint32_t key_;
+
+	public:
+		PbfReader(const char* data, size_t size) : cur_(reinterpret_cast<const unsigned char*>(data)), end_(cur_ + size), key_(0) {
+		}
+
+		bool AtEnd() const {
+			return cur_ >= end_;
+		}
+
+		/* advances to next field, returns false at the end of message */
+		bool Next() {
+			if (AtEnd())
+				return false;
+			key_ = (uint32_t)Varint();
+			return true;
+		}
+
+		int Field() const {
+			return key_ >> 3;
+		}
+
+		int WireType() const {
+			return key_ & 7;
+		}
+
+		uint64_t Varint() {
+			uint64_t value = 0;
+			for (int shift = 0; shift < 64; shift += 7) {
+				if (cur_ >= end_)
+					break;
+				unsigned char byte = *cur_++;
+				value |= (uint64_t)(byte & 0x7f) << shift;
+				if ((byte & 0x80) == 0)
+					return value;
+			}
+			throw ParsingException() << "bad varint in PBF data";
+		}
+
+		int64_t SVarint() {
+			uint64_t value = Varint();
+			return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+		}
+
+		/* length-delimited field: bytes, string, submessage or packed array */
+		PbfReader Message() {
+			const char* data;
+			size_t size;
+			Bytes(data, size);
+			return PbfReader(data, size);
+		}
+
+		void Bytes(const char*& data, size_t& size) {
+			if (WireType() != 2)
+				throw ParsingException() << "unexpected wire type in PBF data";
+			uint64_t len = Varint();
+			if (len > (uint64_t)(end_ - cur_))
+				throw ParsingException() << "PBF message is truncated";
+			data = reinterpret_cast<const char*>(cur_);
+			size = len;
+			cur_ += len;
+		}
+
+		std::string String() {
+			const char* data;
+			size_t size;
+			Bytes(data, size);
+			return std::string(data, size);
+		}
+
+		void Skip() {
+			switch (WireType()) {
+			case 0: Varint(); break;
+			case 1: Advance(8); break;
+			case 2: { const char* data; size_t size; Bytes(data, size); } break;
+			case 5: Advance(4); break;
+			default: throw ParsingException() << "unsupported wire type in PBF data";
+			}
+		}
+
+	protected:
+		void Advance(size_t size) {
+			if (size > (size_t)(end_ - cur_))
+				throw ParsingException() << "PBF message is truncated";
+			cur_ += size;
+		}
+	};
+
+	struct PbfBlob {
+		const char* data;
+		size_t size;
+		bool header;
+
+		PbfBlob(const char* d, size_t s, bool h) : data(d), size(s), header(h) {}
+	};
+
+	/**
+	 * Contents of a single decoded blob
+	 */
+	struct PbfBlock {
+		typedef std::vector<std::pair<osmid_t, OsmDatasource::Node> > NodesVector;
+		typedef std::vector<std::pair<osmid_t, OsmDatasource::Way> > WaysVector;
+		typedef std::vector<std::pair<osmid_t, OsmDatasource::Relation> > RelationsVector;
+
+		NodesVector nodes;
+		WaysVector ways;
+		RelationsVector relations;
+
+		BBoxi bbox;
+
+		bool ready;
+		std::string error;
+
+		PbfBlock() : bbox(BBoxi::Empty()), ready(false) {}
+
+		void Clear() {
+			NodesVector().swap(nodes);
+			WaysVector().swap(ways);
+			RelationsVector().swap(relations);
+		}
+	};
+
+	/**
+	 * String table of primitive block with ids interned on demand
+	 */
+	class PbfStringTable {
+	protected:
+		std::vector<std::pair<const char*, size_t> > strings_;
+		std::vector<tagid_t> ids_;
+
+	public:
+		void Add(const char* data, size_t size) {
+			strings_.push_back(std::make_pair(data, size));
+			ids_.push_back(TagDictionary::NONE);
+		}
+
+		tagid_t Get(uint64_t index) {
+			if (index >= strings_.size())
+				throw ParsingException() << "bad string index in PBF data";
+			if (ids_[index] == TagDictionary::NONE)
+				ids_[index] = TagDictionary::Intern(std::string(strings_[index].first, strings_[index].second).c_str());
+			return ids_[index];
+		}
+	};
+
+	/* reads packed keys and values into tags map */
+	void DecodeTags(PbfStringTable& strings, const char* keys, size_t nkeys, const char* vals, size_t nvals, OsmDatasource::TagsMap& tags) {
+		PbfReader k(keys, nkeys), v(vals, nvals);
+		while (!k.AtEnd() && !v.AtEnd()) {
+			tagid_t key = strings.Get(k.Varint());
+			tags.insert(key, strings.Get(v.Varint()));
+		}
+		if (!k.AtEnd() || !v.AtEnd())
+			throw ParsingException() << "keys and values count mismatch in PBF data";
+	}
+
+	/* converts coordinate in granularity units into glosm fixed point */
+	inline osmint_t DecodeCoord(int64_t value, int64_t offset, int64_t granularity) {
+		/* nanodegrees to 1e-7 degrees */
+		return (osmint_t)((offset + granularity * value) / 100);
+	}
+
+	void DecodeHeaderBlock(PbfReader message, PbfBlock& block) {
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: { /* bbox */
+					PbfReader bbox = message.Message();
+					int64_t left = 0, right = 0, top = 0, bottom = 0;
+					while (bbox.Next()) {
+						switch (bbox.Field()) {
+						case 1: left = bbox.SVarint(); break;
+						case 2: right = bbox.SVarint(); break;
+						case 3: top = bbox.SVarint(); break;
+						case 4: bottom = bbox.SVarint(); break;
+						default: bbox.Skip();
+						}
+					}
+					block.bbox = BBoxi(DecodeCoord(left, 0, 1), DecodeCoord(bottom, 0, 1), DecodeCoord(right, 0, 1), DecodeCoord(top, 0, 1));
+				} break;
+			case 4: { /* required_features */
+					std::string feature = message.String();
+					if (feature != "OsmSchema-V0.6" && feature != "DenseNodes")
+						throw ParsingException() << "unsupported PBF feature " << feature;
+				} break;
+			default:
+				message.Skip();
+			}
+		}
+	}
+
+	void DecodeNode(PbfReader message, PbfBlock& block, int64_t lat_offset, int64_t lon_offset, int64_t granularity) {
+		osmid_t id = 0;
+		int64_t lat = 0, lon = 0;
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: id = message.SVarint(); break;
+			case 8: lat = message.SVarint(); break;
+			case 9: lon = message.SVarint(); break;
+			default: message.Skip();
+			}
+		}
+
+		block.nodes.push_back(std::make_pair(id, OsmDatasource::Node(DecodeCoord(lon, lon_offset, granularity), DecodeCoord(lat, lat_offset, granularity))));
+	}
+
+	void DecodeDenseNodes(PbfReader message, PbfBlock& block, int64_t lat_offset, int64_t lon_offset, int64_t granularity) {
+		PbfReader ids(NULL, 0), lats(NULL, 0), lons(NULL, 0);
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: ids = message.Message(); break;
+			case 8: lats = message.Message(); break;
+			case 9: lons = message.Message(); break;
+			default: message.Skip();
+			}
+		}
+
+		int64_t id = 0, lat = 0, lon = 0;
+		while (!ids.AtEnd() && !lats.AtEnd() && !lons.AtEnd()) {
+			id += ids.SVarint();
+			lat += lats.SVarint();
+			lon += lons.SVarint();
+			block.nodes.push_back(std::make_pair(id, OsmDatasource::Node(DecodeCoord(lon, lon_offset, granularity), DecodeCoord(lat, lat_offset, granularity))));
+		}
+
+		if (!ids.AtEnd() || !lats.AtEnd() || !lons.AtEnd())
+			throw ParsingException() << "dense nodes arrays size mismatch in PBF data";
+	}
+
+	void DecodeWay(PbfReader message, PbfBlock& block, PbfStringTable& strings) {
+		block.ways.push_back(std::make_pair(0, OsmDatasource::Way()));
+		OsmDatasource::Way& way = block.ways.back().second;
+
+		const char* keys = NULL, *vals = NULL;
+		size_t nkeys = 0, nvals = 0;
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: block.ways.back().first = (int64_t)message.Varint(); break;
+			case 2: message.Bytes(keys, nkeys); break;
+			case 3: message.Bytes(vals, nvals); break;
+			case 8: {
+					PbfReader refs = message.Message();
+					int64_t ref = 0;
+					while (!refs.AtEnd())
+						way.Nodes.push_back(ref += refs.SVarint());
+				} break;
+			default:
+				message.Skip();
+			}
+		}
+
+		DecodeTags(strings, keys, nkeys, vals, nvals, way.Tags);
+	}
+
+	void DecodeRelation(PbfReader message, PbfBlock& block, PbfStringTable& strings) {
+		block.relations.push_back(std::make_pair(0, OsmDatasource::Relation()));
+		OsmDatasource::Relation& relation = block.relations.back().second;
+
+		const char* keys = NULL, *vals = NULL;
+		size_t nkeys = 0, nvals = 0;
+		PbfReader roles(NULL, 0), memids(NULL, 0), types(NULL, 0);
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: block.relations.back().first = (int64_t)message.Varint(); break;
+			case 2: message.Bytes(keys, nkeys); break;
+			case 3: message.Bytes(vals, nvals); break;
+			case 8: roles = message.Message(); break;
+			case 9: memids = message.Message(); break;
+			case 10: types = message.Message(); break;
+			default: message.Skip();
+			}
+		}
+
+		int64_t ref = 0;
+		while (!roles.AtEnd() && !memids.AtEnd() && !types.AtEnd()) {
+			tagid_t role = strings.Get(roles.Varint());
+			ref += memids.SVarint();
+
+			OsmDatasource::Relation::Member::Type_t type;
+			switch (types.Varint()) {
+			case 0: type = OsmDatasource::Relation::Member::NODE; break;
+			case 1: type = OsmDatasource::Relation::Member::WAY; break;
+			case 2: type = OsmDatasource::Relation::Member::RELATION; break;
+			default: throw ParsingException() << "bad relation member type in PBF data";
+			}
+
+			relation.Members.push_back(OsmDatasource::Relation::Member(type, ref, role));
+		}
+
+		if (!roles.AtEnd() || !memids.AtEnd() || !types.AtEnd())
+			throw ParsingException() << "relation member arrays size mismatch in PBF data";
+
+		DecodeTags(strings, keys, nkeys, vals, nvals, relation.Tags);
+	}
+
+	void DecodePrimitiveBlock(PbfReader message, PbfBlock& block) {
+		PbfStringTable strings;
+		std::vector<PbfReader> groups;
+		int64_t granularity = 100, lat_offset = 0, lon_offset = 0;
+
+		/* groups may only be decoded when all parameters are known */
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: {
+					PbfReader table = message.Message();
+					while (table.Next()) {
+						if (table.Field() == 1) {
+							const char* data;
+							size_t size;
+							table.Bytes(data, size);
+							strings.Add(data, size);
+						} else {
+							table.Skip();
+						}
+					}
+				} break;
+			case 2: groups.push_back(message.Message()); break;
+			case 17: granularity = (int64_t)message.Varint(); break;
+			case 19: lat_offset = (int64_t)message.Varint(); break;
+			case 20: lon_offset = (int64_t)message.Varint(); break;
+			default: message.Skip();
+			}
+		}
+
+		for (std::vector<PbfReader>::iterator group = groups.begin(); group != groups.end(); ++group) {
+			while (group->Next()) {
+				switch (group->Field()) {
+				case 1: DecodeNode(group->Message(), block, lat_offset, lon_offset, granularity); break;
+				case 2: DecodeDenseNodes(group->Message(), block, lat_offset, lon_offset, granularity); break;
+				case 3: DecodeWay(group->Message(), block, strings); break;
+				case 4: DecodeRelation(group->Message(), block, strings); break;
+				default: group->Skip();
+				}
+			}
+		}
+	}
+
+	void DecodeBlob(const PbfBlob& blob, PbfBlock& block) {
+		PbfReader message(blob.data, blob.size);
+
+		const char* raw = NULL, *zdata = NULL;
+		size_t rawsize = 0, zsize = 0;
+		uint64_t inflatedsize = 0;
+		while (message.Next()) {
+			switch (message.Field()) {
+			case 1: message.Bytes(raw, rawsize); break;
+			case 2: inflatedsize = message.Varint(); break;
+			case 3: message.Bytes(zdata, zsize); break;
+			case 4: case 5: case 6: case 7:
+				throw ParsingException() << "unsupported PBF blob compression";
+			default: message.Skip();
+			}
+		}
+
+		std::vector<char> buffer;
+		if (zdata) {
+			if (inflatedsize > MAX_BLOB_SIZE)
+				throw ParsingException() << "PBF blob is too large";
+
+			buffer.resize(inflatedsize);
+			uLongf destsize = inflatedsize;
+			if (inflatedsize == 0 || uncompress(reinterpret_cast<Bytef*>(&buffer.front()), &destsize, reinterpret_cast<const Bytef*>(zdata), zsize) != Z_OK || destsize != inflatedsize)
+				throw ParsingException() << "cannot inflate PBF blob";
+
+			raw = &buffer.front();
+			rawsize = inflatedsize;
+		}
+
+		if (raw == NULL)
+			throw ParsingException() << "PBF blob has no data";
+
+		if (blob.header)
+			DecodeHeaderBlock(PbfReader(raw, rawsize), block);
+		else
+			DecodePrimitiveBlock(PbfReader(raw, rawsize), block);
+	}
+
+	/**
+	 * Pool of threads which decodes blobs, keeping a limited number
+	 * of blocks ahead of the consumer
+	 */
+	class PbfDecoder {
+	protected:
+		const std::vector<PbfBlob>& blobs_;
+		std::vector<PbfBlock> blocks_;
+
+		size_t next_;
+		size_t released_;
+		size_t window_;
+		bool stop_;
+
+		std::vector<pthread_t> threads_;
+
+		pthread_mutex_t mutex_;
+		pthread_cond_t cond_;
+
+	protected:
+		static void* ThreadFuncWrapper(void* arg) {
+			static_cast<PbfDecoder*>(arg)->ThreadFunc();
+			return NULL;
+		}
+
+		void ThreadFunc() {
+			pthread_mutex_lock(&mutex_);
+			for (;;) {
+				while (!stop_ && next_ < blobs_.size() && next_ >= released_ + window_)
+					pthread_cond_wait(&cond_, &mutex_);
+
+				if (stop_ || next_ >= blobs_.size())
+					break;
+
+				size_t current = next_++;
+
+				pthread_mutex_unlock(&mutex_);
+
+				PbfBlock& block = blocks_[current];
+				try {
+					DecodeBlob(blobs_[current], block);
+				} catch (std::exception& e) {
+					block.Clear();
+					block.error = e.what();
+				}
+
+				pthread_mutex_lock(&mutex_);
+				block.ready = true;
+				pthread_cond_broadcast(&cond_);
+			}
+			pthread_mutex_unlock(&mutex_);
+		}
+
+		void Stop() {
+			pthread_mutex_lock(&mutex_);
+			stop_ = true;
+			pthread_cond_broadcast(&cond_);
+			pthread_mutex_unlock(&mutex_);
+
+			for (std::vector<pthread_t>::iterator thread = threads_.begin(); thread != threads_.end(); ++thread)
+				pthread_join(*thread, NULL);
+			threads_.clear();
+		}
+
+	public:
+		PbfDecoder(const std::vector<PbfBlob>& blobs, int nthreads) : blobs_(blobs), blocks_(blobs.size()), next_(0), released_(0), window_(nthreads * BLOCKS_PER_THREAD), stop_(false) {
+			int errn;
+			if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+				throw SystemError(errn) << "pthread_mutex_init failed";
+
+			if ((errn = pthread_cond_init(&cond_, 0)) != 0) {
+				pthread_mutex_destroy(&mutex_);
+				throw SystemError(errn) << "pthread_cond_init failed";
+			}
+
+			for (int i = 0; i < nthreads; ++i) {
+				pthread_t thread;
+				if ((errn = pthread_create(&thread, NULL, ThreadFuncWrapper, this)) != 0) {
+					Stop();
+					pthread_cond_destroy(&cond_);
+					pthread_mutex_destroy(&mutex_);
+					throw SystemError(errn) << "pthread_create failed";
+				}
+				threads_.push_back(thread);
+			}
+		}
+
+		~PbfDecoder() {
+			Stop();
+			pthread_cond_destroy(&cond_);
+			pthread_mutex_destroy(&mutex_);
+		}
+
+		/* waits for block to be decoded */
+		PbfBlock& Get(size_t index) {
+			pthread_mutex_lock(&mutex_);
+			while (!blocks_[index].ready)
+				pthread_cond_wait(&cond_, &mutex_);
+			pthread_mutex_unlock(&mutex_);
+
+			if (!blocks_[index].error.empty())
+				throw ParsingException() << blocks_[index].error;
+
+			return blocks_[index];
+		}
+
+		/* frees block and lets decoding threads proceed */
+		void Release(size_t index) {
+			blocks_[index].Clear();
+
+			pthread_mutex_lock(&mutex_);
+			released_ = index + 1;
+			pthread_cond_broadcast(&cond_);
+			pthread_mutex_unlock(&mutex_);
+		}
+	};
+
+	/* splits file into blobs */
+	void ScanBlobs(const char* data, size_t size, std::vector<PbfBlob>& blobs) {
+		size_t pos = 0;
+		while (pos < size) {
+			if (size - pos < 4)
+				throw ParsingException() << "PBF file is truncated";
+
+			const unsigned char* len = reinterpret_cast<const unsigned char*>(data + pos);
+			size_t headersize = ((size_t)len[0] << 24) | ((size_t)len[1] << 16) | ((size_t)len[2] << 8) | (size_t)len[3];
+			pos += 4;
+
+			if (headersize > MAX_BLOB_HEADER_SIZE)
+				throw ParsingException() << "PBF blob header is too large";
+			if (headersize > size - pos)
+				throw ParsingException() << "PBF file is truncated";
+
+			std::string type;
+			uint64_t blobsize = 0;
+			PbfReader header(data + pos, headersize);
+			while (header.Next()) {
+				switch (header.Field()) {
+				case 1: type = header.String(); break;
+				case 3: blobsize = header.Varint(); break;
+				default: header.Skip();
+				}
+			}
+			pos += headersize;
+
+			if (blobsize > MAX_BLOB_SIZE)
+				throw ParsingException() << "PBF blob is too large";
+			if (blobsize > size - pos)
+				throw ParsingException() << "PBF file is truncated";
+
+			/* unknown blob types should be skipped */
+			if (type == "OSMHeader" || type == "OSMData")
+				blobs.push_back(PbfBlob(data + pos, blobsize, type == "OSMHeader"));
+
+			pos += blobsize;
+		}
+	}
+}
+
+PreloadedPbfDatasource::PreloadedPbfDatasource() {
+}
+
+PreloadedPbfDatasource::~PreloadedPbfDatasource() {
+}
+
+void PreloadedPbfDatasource::Load(const char* filename) {
+	LoadParallel(filename, 1);
+}
+
+void PreloadedPbfDatasource::LoadParallel(const char* filename, int nthreads) {
+	Timer timer;
+
+	MappedFile file(filename);
+
+	std::vector<PbfBlob> blobs;
+	ScanBlobs(file.GetData(), file.GetSize(), blobs);
+
+	ResetLoadStats();
+	total_bytes_ = file.GetSize();
+	bbox_ = BBoxi::Empty();
+
+	PbfDecoder decoder(blobs, nthreads < 1 ? 1 : nthreads);
+
+	/* merge blocks in order of file, like XML parser does */
+	for (size_t i = 0; i < blobs.size(); ++i) {
+		PbfBlock& block = decoder.Get(i);
+
+		bbox_.Include(block.bbox);
+
+		for (PbfBlock::NodesVector::const_iterator node = block.nodes.begin(); node != block.nodes.end(); ++node)
+			nodes_.insert(*node);
+
+		/* id_map allows duplicate keys; like in XML load, first
+		 * of duplicate ways and relations is kept */
+		for (PbfBlock::WaysVector::iterator way = block.ways.begin(); way != block.ways.end(); ++way) {
+			if (ways_.find(way->first) != ways_.end())
+				continue;
+
+			Way& target = ways_.insert(std::make_pair(way->first, Way())).first->second;
+			target.Nodes.swap(way->second.Nodes);
+			target.Tags.swap(way->second.Tags);
+		}
+
+		for (PbfBlock::RelationsVector::iterator relation = block.relations.begin(); relation != block.relations.end(); ++relation) {
+			if (relations_.find(relation->first) != relations_.end())
+				continue;
+
+			Relation& target = relations_.insert(std::make_pair(relation->first, Relation())).first->second;
+			target.Members.swap(relation->second.Members);
+			target.Tags.swap(relation->second.Tags);
+		}
+
+		decoder.Release(i);
+
+		loaded_bytes_ = blobs[i].data + blobs[i].size - file.GetData();
+		ReportParseProgress();
+	}
+
+	loaded_bytes_ = file.GetSize();
+	parse_time_ = timer.Count();
+	FinishPhase(LoadListener::PARSE, parse_time_);
+
+	FinalizeLoad(nthreads);
+
+	load_time_ = parse_time_ + timer.Count();
+}
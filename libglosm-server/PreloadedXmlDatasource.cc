@@ -23,18 +23,13 @@
  *
  * Possible generic improvements:
  * - use hash maps instead of tree maps
- * - store tag names separately and operate with tag id
- *   - use (hash)map for forward lookup (tag -> id)
- *   - use vector for reverse lookup (id -> tag)
  * - use fastosm library
  * - use custom allocators for most data
  *
  * Space iprovements with complexity/speed cost
  * - prefix encoding for node coords and refs
  * - store nodes without tags in a separate or additional map
- * - store node coords directly in ways
- * Last two should save tons of memory and improve speed severely
- * by killing an indirection
+ * Should save tons of memory
  *
  * Improvements for non-generic use:
  * (tons)
@@ -44,23 +39,460 @@
  */
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <glosm/PreloadedXmlDatasource.hh>
 #include <glosm/ParsingHelpers.hh>
 #include <glosm/WayMerger.hh>
+#include <glosm/MappedFile.hh>
+#include <glosm/Timer.hh>
+#include <glosm/Guard.hh>
+
+namespace {
+	typedef std::pair<osmid_t, const OsmDatasource::Way*> WayItem;
+
+	/* orders indexes of way store by way ids */
+	struct StoredIdLess {
+		const WayStore& store;
+
+		StoredIdLess(const WayStore& s) : store(s) {}
+		bool operator()(size_t a, size_t b) const { return store.GetId(a) < store.GetId(b); }
+	};
+
+	struct StoredIdSearch {
+		const WayStore& store;
+
+		StoredIdSearch(const WayStore& s) : store(s) {}
+		bool operator()(size_t index, osmid_t id) const { return store.GetId(index) < id; }
+	};
+
+	struct WayViewAppender {
+		const WayStore& store;
+		std::vector<OsmDatasource::WayView>& out;
+
+		WayViewAppender(const WayStore& s, std::vector<OsmDatasource::WayView>& o) : store(s), out(o) {}
+		void operator()(size_t index) { out.push_back(store.GetView(index)); }
+	};
+
+	/*
+	 * Snapshot format; all values are in host byte order, which
+	 * is verified on load with byte order mark.
+	 *
+	 * header:    magic[8] version:u32 bom:u32
+	 *            bbox:i32[4] next_synthetic_id:id
+	 * strings:   count:u32 (string\0)[count]; ids 1..count
+	 * nodes:     count:u64 (id x:i32 y:i32)[count]
+	 * ways:      count:u64 (id flags:u8 bbox:i32[4] nnodes:u32
+	 *            nodes:id[nnodes] [coords:i32[2*nnodes]] tags)[count]
+	 * relations: count:u64 (id nmembers:u32 (type:u8 ref:id
+	 *            role:u32)[nmembers] tags)[count]
+	 * synthetic: count:u64 (relation:id nways:u32 ways:id[nways])[count]
+	 * tags:      count:u32 (key:u32 value:u32)[count]
+	 */
+	const char SNAPSHOT_MAGIC[8] = { 'G', 'L', 'O', 'S', 'M', 'S', 'N', 'P' };
+	const uint32_t SNAPSHOT_VERSION = 2;
+	const uint32_t SNAPSHOT_BOM = 0x01020304;
+
+	enum SnapshotWayFlags {
+		SNAPSHOT_CLOSED = 0x01,
+		SNAPSHOT_CLOCKWISE = 0x02,
+		SNAPSHOT_COORDS = 0x04,
+		SNAPSHOT_INNER = 0x08,
+	};
+
+	/* checks whether pos points to start tag of top-level OSM object */
+	bool IsObjectStart(const char* pos, const char* end) {
+		static const char* names[] = { "<node", "<way", "<relation" };
+		for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i) {
+			size_t len = strlen(names[i]);
+			if ((size_t)(end - pos) > len && memcmp(pos, names[i], len) == 0 && strchr(" \t\r\n/>", pos[len]) != NULL)
+				return true;
+		}
+		return false;
+	}
+
+	/* finds first start tag of top-level OSM object at or after pos */
+	const char* FindObjectStart(const char* pos, const char* end) {
+		while (pos < end && (pos = static_cast<const char*>(memchr(pos, '<', end - pos))) != NULL) {
+			if (IsObjectStart(pos, end))
+				return pos;
+			++pos;
+		}
+		return end;
+	}
+
+	/* finds contents of <osm> root element; returns false if
+	 * document structure is not what we expect */
+	bool FindRootContents(const char* begin, const char* end, const char*& first, const char*& last) {
+		const char* pos = begin;
+
+		/* skip XML declaration, comments and whatever else until root */
+		while ((pos = static_cast<const char*>(memchr(pos, '<', end - pos))) != NULL && end - pos > 1 && (pos[1] == '?' || pos[1] == '!'))
+			++pos;
+
+		if (pos == NULL || end - pos < 5 || memcmp(pos, "<osm", 4) != 0 || strchr(" \t\r\n>", pos[4]) == NULL)
+			return false;
+
+		/* end of root start tag; note that '>' is allowed in attributes */
+		char quote = 0;
+		for (pos += 4; pos < end && (quote || *pos != '>'); ++pos)
+			if (*pos == '"' || *pos == '\'')
+				quote = (quote == 0) ? *pos : (quote == *pos ? 0 : quote);
+
+		if (pos == end || pos[-1] == '/')
+			return false;
+
+		first = pos + 1;
+
+		if (end - first < 5)
+			return false;
+
+		/* root end tag, there should only be whitespace after it */
+		for (last = end - 5; last >= first; --last)
+			if (memcmp(last, "</osm", 5) == 0)
+				return true;
+
+		return false;
+	}
+
+	/* checks whether sorted vector contains an id */
+	bool Contains(const std::vector<osmid_t>& ids, osmid_t id) {
+		return std::binary_search(ids.begin(), ids.end(), id);
+	}
+
+	void SortUnique(std::vector<osmid_t>& ids) {
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	}
+
+	bool IsFull(const BBoxi& bbox) {
+		return bbox.left == std::numeric_limits<osmint_t>::min() && bbox.bottom == std::numeric_limits<osmint_t>::min() &&
+			bbox.right == std::numeric_limits<osmint_t>::max() && bbox.top == std::numeric_limits<osmint_t>::max();
+	}
+
+	/* runs func for each task, using a thread per task */
+	template <class T>
+	void RunTasks(std::vector<T>& tasks, void* (*func)(void*)) {
+		std::vector<pthread_t> threads(tasks.size());
+		std::vector<bool> started(tasks.size());
+
+		/* first task is run by calling thread, also tasks for
+		 * which thread could not be created */
+		for (size_t i = 1; i < tasks.size(); ++i)
+			started[i] = pthread_create(&threads[i], NULL, func, &tasks[i]) == 0;
+
+		for (size_t i = 0; i < tasks.size(); ++i)
+			if (!started[i])
+				func(&tasks[i]);
+
+		for (size_t i = 1; i < tasks.size(); ++i)
+			if (started[i])
+				pthread_join(threads[i], NULL);
+	}
+
+	/* splits vector into ranges for tasks */
+	template <class T, class V>
+	void SplitTasks(std::vector<T>& tasks, std::vector<V>& items) {
+		V* data = items.empty() ? NULL : &items.front();
+		for (size_t i = 0; i < tasks.size(); ++i) {
+			tasks[i].begin = data + items.size() * i / tasks.size();
+			tasks[i].end = data + items.size() * (i + 1) / tasks.size();
+		}
+	}
+
+	/* id_map hash size which fits given number of elements;
+	 * stops at the largest power of two */
+	size_t HashSize(uint64_t count) {
+		size_t size = 1;
+		while (size < count && size <= std::numeric_limits<size_t>::max() / 2)
+			size *= 2;
+		return size;
+	}
+
+	class SnapshotWriter {
+	protected:
+		FILE* file_;
+		std::vector<char> buffer_;
+
+	public:
+		SnapshotWriter(const char* filename) {
+			if ((file_ = fopen(filename, "wb")) == NULL)
+				throw SystemError() << "cannot open " << filename << " for writing";
+			buffer_.reserve(1048576);
+		}
+
+		~SnapshotWriter() {
+			if (file_)
+				fclose(file_);
+		}
+
+		void Flush() {
+			if (!buffer_.empty() && fwrite(&buffer_.front(), buffer_.size(), 1, file_) != 1)
+				throw SystemError() << "snapshot write error";
+			buffer_.clear();
+		}
+
+		void WriteData(const void* data, size_t size) {
+			if (buffer_.size() + size > buffer_.capacity())
+				Flush();
+			buffer_.insert(buffer_.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+		}
+
+		template <class T>
+		void Write(const T& value) {
+			WriteData(&value, sizeof(T));
+		}
+
+		void WriteString(const char* str) {
+			WriteData(str, strlen(str) + 1);
+		}
+
+		void WriteBBox(const BBoxi& bbox) {
+			Write(bbox.left);
+			Write(bbox.bottom);
+			Write(bbox.right);
+			Write(bbox.top);
+		}
+
+		template <class T>
+		void WriteTags(const T& tags) {
+			Write((uint32_t)tags.size());
+			for (typename T::const_iterator tag = tags.begin(); tag != tags.end(); ++tag) {
+				Write((uint32_t)tag->first);
+				Write((uint32_t)tag->second);
+			}
+		}
+
+		void Close() {
+			Flush();
+			FILE* file = file_;
+			file_ = NULL;
+			if (fclose(file) != 0)
+				throw SystemError() << "snapshot write error";
+		}
+	};
+
+	class SnapshotReader {
+	protected:
+		const char* cur_;
+		const char* end_;
+
+		/* snapshot string id -> dictionary id */
+		std::vector<tagid_t> strings_;
+
+	public:
+		SnapshotReader(const char* data, size_t size) : cur_(data), end_(data + size) {
+		}
+
+		const char* ReadData(size_t size) {
+			if ((size_t)(end_ - cur_) < size)
+				throw DataException() << "snapshot is truncated";
+			const char* data = cur_;
+			cur_ += size;
+			return data;
+		}
+
+		template <class T>
+		T Read() {
+			T value;
+			memcpy(&value, ReadData(sizeof(T)), sizeof(T));
+			return value;
+		}
+
+		/* reads number of records of at least given size, which
+		 * must fit into the rest of data, so bogus counts don't
+		 * make us reserve huge amounts of memory */
+		template <class T>
+		T ReadCount(size_t minsize) {
+			T count = Read<T>();
+			if ((uint64_t)count > (uint64_t)(end_ - cur_) / minsize)
+				throw DataException() << "snapshot is truncated";
+			return count;
+		}
+
+		const char* ReadString() {
+			const char* nul = static_cast<const char*>(memchr(cur_, '\0', end_ - cur_));
+			if (nul == NULL)
+				throw DataException() << "snapshot is truncated";
+			const char* str = cur_;
+			cur_ = nul + 1;
+			return str;
+		}
+
+		BBoxi ReadBBox() {
+			osmint_t left = Read<osmint_t>();
+			osmint_t bottom = Read<osmint_t>();
+			osmint_t right = Read<osmint_t>();
+			osmint_t top = Read<osmint_t>();
+			return BBoxi(left, bottom, right, top);
+		}
+
+		void ReadStrings() {
+			uint32_t count = ReadCount<uint32_t>(1);
+			strings_.resize(count + 1);
+			strings_[0] = TagDictionary::NONE;
+			for (uint32_t i = 1; i <= count; ++i)
+				strings_[i] = TagDictionary::Intern(ReadString());
+		}
+
+		tagid_t ReadStringId() {
+			uint32_t id = Read<uint32_t>();
+			if (id >= strings_.size())
+				throw DataException() << "bad string id in snapshot";
+			return strings_[id];
+		}
+
+		void ReadTags(OsmDatasource::TagsMap& tags) {
+			for (uint32_t count = Read<uint32_t>(); count > 0; --count) {
+				tagid_t key = ReadStringId();
+				tagid_t value = ReadStringId();
+				tags.insert(key, value);
+			}
+		}
+	};
+}
 
 osmid_t PreloadedXmlDatasource::next_synthetic_id_ = std::numeric_limits<osmid_t>::max();
 
-PreloadedXmlDatasource::PreloadedXmlDatasource() : XMLParser(XMLParser::HANDLE_ELEMENTS), bbox_(BBoxi::Empty()) {
+/* synthetic ids are shared by all datasources, and these may
+ * be loaded concurrently */
+static pthread_mutex_t synthetic_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct PreloadedXmlDatasource::ParseTask {
+	PreloadedXmlDatasource* datasource;
+	const char* data;
+	size_t size;
+
+	pthread_t thread;
+	std::string error;
+
+	ParseTask() : datasource(NULL), data(NULL), size(0) {}
+};
+
+struct PreloadedXmlDatasource::ChangeSet {
+	enum Action {
+		CREATE,
+		MODIFY,
+		DELETE,
+	};
+
+	Action action;
+
+	/* ids of objects met in change file */
+	std::vector<osmid_t> nodes;
+	std::vector<osmid_t> ways;
+	std::vector<osmid_t> relations;
+
+	std::vector<BBoxi>& dirty;
+
+	ChangeSet(std::vector<BBoxi>& d) : action(MODIFY), dirty(d) {}
+
+	void AddDirty(const BBoxi& bbox) {
+		if (!bbox.IsEmpty())
+			dirty.push_back(bbox);
+	}
+};
+
+struct PreloadedXmlDatasource::NodeMover {
+	NodesMap& target;
+
+	NodeMover(NodesMap& t) : target(t) {}
+	void operator()(const NodesMap::value_type& node) {
+		target.insert(node);
+	}
+};
+
+struct PreloadedXmlDatasource::WayMover {
+	PreloadedXmlDatasource& target;
+
+	WayMover(PreloadedXmlDatasource& t) : target(t) {}
+	void operator()(WaysMap::value_type& way) {
+		/* like in serial load, first of duplicate ways is kept */
+		if (target.ways_.find(way.first) != target.ways_.end())
+			return;
+		Way& target_way = target.ways_.insert(std::make_pair(way.first, Way())).first->second;
+		target_way.Nodes.swap(way.second.Nodes);
+		target_way.Tags.swap(way.second.Tags);
+	}
+};
+
+struct PreloadedXmlDatasource::RelationMover {
+	PreloadedXmlDatasource& target;
+
+	RelationMover(PreloadedXmlDatasource& t) : target(t) {}
+	void operator()(RelationsMap::value_type& relation) {
+		if (target.relations_.find(relation.first) != target.relations_.end())
+			return;
+		Relation& target_relation = target.relations_.insert(std::make_pair(relation.first, Relation())).first->second;
+		target_relation.Members.swap(relation.second.Members);
+		target_relation.Tags.swap(relation.second.Tags);
+	}
+};
+
+struct PreloadedXmlDatasource::WayTask {
+	const PreloadedXmlDatasource* datasource;
+	WaysMap::value_type** begin;
+	WaysMap::value_type** end;
+
+	/* ways to drop, along with missing node ids */
+	std::vector<std::pair<WaysMap::value_type*, osmid_t> > dropped;
+};
+
+struct PreloadedXmlDatasource::RelationTask {
+	const PreloadedXmlDatasource* datasource;
+	RelationsMap::value_type** begin;
+	RelationsMap::value_type** end;
+
+	/* results for each relation of the range */
+	std::vector<RingsList> rings;
+	std::vector<std::vector<osmid_t> > missing;
+};
+
+PreloadedXmlDatasource::PreloadedXmlDatasource() : XMLParser(XMLParser::HANDLE_ELEMENTS), bbox_(BBoxi::Empty()), object_level_(1), change_(NULL), filter_bbox_(BBoxi::Full()) {
+	pthread_mutex_init(&restore_mutex_, NULL);
 }
 
 PreloadedXmlDatasource::~PreloadedXmlDatasource() {
+	pthread_mutex_destroy(&restore_mutex_);
 }
 
-static void ParseTag(OsmDatasource::TagsMap& map, const char** atts) {
-	std::string key;
-	std::string value;
+void PreloadedXmlDatasource::SetLoadFilter(const LoadFilter& filter) {
+	filter_ = filter;
+	std::sort(filter_.keys.begin(), filter_.keys.end());
+
+	/* extend bbox by margin, avoiding overflow */
+	osmlong_t left = (osmlong_t)filter.bbox.left - filter.margin;
+	osmlong_t bottom = (osmlong_t)filter.bbox.bottom - filter.margin;
+	osmlong_t right = (osmlong_t)filter.bbox.right + filter.margin;
+	osmlong_t top = (osmlong_t)filter.bbox.top + filter.margin;
+
+	osmlong_t min = std::numeric_limits<osmint_t>::min();
+	osmlong_t max = std::numeric_limits<osmint_t>::max();
+
+	filter_bbox_ = BBoxi(
+			(osmint_t)std::max(left, min),
+			(osmint_t)std::max(bottom, min),
+			(osmint_t)std::min(right, max),
+			(osmint_t)std::min(top, max)
+		);
+}
+
+bool PreloadedXmlDatasource::HasFilterKey(const TagsMap& tags) const {
+	for (TagsMap::const_iterator tag = tags.begin(); tag != tags.end(); ++tag)
+		if (std::binary_search(filter_.keys.begin(), filter_.keys.end(), tag->first))
+			return true;
+	return false;
+}
+
+static void ParseTag(TagDictionary::Cache& cache, OsmDatasource::TagsMap& map, const char** atts) {
+	const char* key = "";
+	const char* value = "";
 	for (const char** att = atts; *att; ++att) {
 		if (StrEq<1>(*att, "k"))
 			key = *(++att);
@@ -70,11 +502,11 @@ static void ParseTag(OsmDatasource::TagsMap& map, const char** atts) {
 			++att;
 	}
 
-	map.insert(std::make_pair(key, value));
+	map.insert(cache.Intern(key), cache.Intern(value));
 }
 
 void PreloadedXmlDatasource::StartElement(const char* name, const char** atts) {
-	if (tag_level_ == 1 && current_tag_ == OSM) {
+	if (tag_level_ == object_level_ && current_tag_ == OSM) {
 		osmid_t id = 0;
 		osmint_t lat = 0;
 		osmint_t lon = 0;
@@ -91,38 +523,58 @@ void PreloadedXmlDatasource::StartElement(const char* name, const char** atts) {
 
 		if (StrEq<1>(name, "node")) {
 			current_tag_ = NODE;
-			std::pair<NodesMap::iterator, bool> p = nodes_.insert(std::make_pair(id, Node(lon, lat)));
-			last_node_ = p.first;
+			/* nodes outside of filter area are kept until it's
+			 * known whether ways use them, see FilterArea() */
+			if (change_ == NULL || BeginChange(NODE, id)) {
+				std::pair<NodesMap::iterator, bool> p = nodes_.insert(std::make_pair(id, Node(lon, lat)));
+				last_node_ = p.first;
+			} else {
+				last_node_ = nodes_.end();
+			}
 			//last_node_tags_ = node_tags_.end();
 		} else if (StrEq<1>(name, "way")) {
 			current_tag_ = WAY;
-			std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(id, Way()));
-			last_way_ = p.first;
+			if (change_ == NULL || BeginChange(WAY, id)) {
+				/* id_map allows duplicate keys; first of
+				 * duplicate ways is kept, others are skipped */
+				if (ways_.find(id) != ways_.end())
+					last_way_ = ways_.end();
+				else
+					last_way_ = ways_.insert(std::make_pair(id, Way())).first;
+			} else {
+				last_way_ = ways_.end();
+			}
 		} else if (StrEq<1>(name, "relation")) {
 			current_tag_ = RELATION;
-			std::pair<RelationsMap::iterator, bool> p = relations_.insert(std::make_pair(id, Relation()));
-			last_relation_ = p.first;
+			if (change_ == NULL || BeginChange(RELATION, id)) {
+				if (relations_.find(id) != relations_.end())
+					last_relation_ = relations_.end();
+				else
+					last_relation_ = relations_.insert(std::make_pair(id, Relation())).first;
+			} else {
+				last_relation_ = relations_.end();
+			}
 		} else if (StrEq<-1>(name, "bounds")) {
 			bbox_.Include(ParseBounds(atts));
 		} else if (StrEq<-1>(name, "bound")) {
 			bbox_.Include(ParseBound(atts));
 		}
-	} else if (tag_level_ == 2 && current_tag_ == NODE) {
+	} else if (tag_level_ == object_level_ + 1 && current_tag_ == NODE) {
 		if (last_node_ != nodes_.end()) {
 			if (StrEq<0>(name, "tag")) {
 //				if (last_node_tags_ == node_tags_.end()) {
 //					std::pair<NodeTagsMap::iterator, bool> p = node_tags_.insert(std::make_pair(last_node_->first, TagsMap()));
 //					last_node_tags_ = p.first;
 //				}
-//				ParseTag(last_node_tags_->second, atts);
+//				ParseTag(tag_cache_, last_node_tags_->second, atts);
 			} else {
 				throw ParsingException() << "unexpected tag in node";
 			}
 		}
-	} else if (tag_level_ == 2 && current_tag_ == WAY) {
+	} else if (tag_level_ == object_level_ + 1 && current_tag_ == WAY) {
 		if (last_way_ != ways_.end()) {
 			if (StrEq<1>(name, "tag")) {
-				ParseTag(last_way_->second.Tags, atts);
+				ParseTag(tag_cache_, last_way_->second.Tags, atts);
 			} else if (StrEq<1>(name, "nd")) {
 				osmid_t id;
 
@@ -136,10 +588,10 @@ void PreloadedXmlDatasource::StartElement(const char* name, const char** atts) {
 				throw ParsingException() << "unexpected tag in way";
 			}
 		}
-	} else if (tag_level_ == 2 && current_tag_ == RELATION) {
+	} else if (tag_level_ == object_level_ + 1 && current_tag_ == RELATION) {
 		if (last_relation_ != relations_.end()) {
 			if (StrEq<1>(name, "tag")) {
-				ParseTag(last_relation_->second.Tags, atts);
+				ParseTag(tag_cache_, last_relation_->second.Tags, atts);
 			} else if (StrEq<1>(name, "member")) {
 				osmid_t ref = 0;
 				const char* role = 0;
@@ -168,133 +620,318 @@ void PreloadedXmlDatasource::StartElement(const char* name, const char** atts) {
 				if (ref == 0 || role == NULL || type == Relation::Member::UNKNOWN)
 					throw ParsingException() << "bad relation member";
 
-				last_relation_->second.Members.push_back(Relation::Member(type, ref, role));
+				last_relation_->second.Members.push_back(Relation::Member(type, ref, tag_cache_.Intern(role)));
 			} else {
 				throw ParsingException() << "unexpected tag in relation";
 			}
 		}
-	} else if (tag_level_ == 0 && current_tag_ == NONE && StrEq<-1>(name, "osm")) {
+	} else if (tag_level_ == 1 && current_tag_ == OSMCHANGE) {
+		if (StrEq<-1>(name, "create"))
+			change_->action = ChangeSet::CREATE;
+		else if (StrEq<-1>(name, "modify"))
+			change_->action = ChangeSet::MODIFY;
+		else if (StrEq<-1>(name, "delete"))
+			change_->action = ChangeSet::DELETE;
+		else
+			throw ParsingException() << "unexpected change action " << name;
+		current_tag_ = OSM;
+	} else if (tag_level_ == 0 && current_tag_ == NONE && change_ == NULL && StrEq<-1>(name, "osm")) {
 		current_tag_ = OSM;
+	} else if (tag_level_ == 0 && current_tag_ == NONE && change_ != NULL && StrEq<-1>(name, "osmChange")) {
+		current_tag_ = OSMCHANGE;
 	} else if (tag_level_ == 0) {
-		throw ParsingException() << "unexpected root element (" << name << " instead of osm)";
+		throw ParsingException() << "unexpected root element (" << name << " instead of " << (change_ ? "osmChange" : "osm") << ")";
 	}
 
 	++tag_level_;
 }
 
 void PreloadedXmlDatasource::EndElement(const char* /*name*/) {
-	if (tag_level_ == 2) {
+	if (tag_level_ == object_level_ + 1) {
 		switch (current_tag_) {
 		case NODE:
 			last_node_ = nodes_.end();
 			current_tag_ = OSM;
 			break;
 		case WAY:
-			FinalizeWay();
 			last_way_ = ways_.end();
 			current_tag_ = OSM;
 			break;
 		case RELATION:
-			FinalizeRelation();
 			last_relation_ = relations_.end();
 			current_tag_ = OSM;
 			break;
 		default:
 			break;
 		}
-	} else if (tag_level_ == 1 && current_tag_ == OSM) {
+	} else if (tag_level_ == object_level_ && current_tag_ == OSM) {
+		current_tag_ = change_ ? OSMCHANGE : NONE;
+	} else if (tag_level_ == 1 && current_tag_ == OSMCHANGE) {
 		current_tag_ = NONE;
 	}
 
 	--tag_level_;
 }
 
-void PreloadedXmlDatasource::FinalizeWay() {
-	if (last_way_ == ways_.end())
-		return;
+bool PreloadedXmlDatasource::ProcessWay(Way& way, osmid_t& missing) const {
+	missing = 0;
 
-	if (last_way_->second.Nodes.size() < 2) {
-		std::cerr << "WARNING: way " << last_way_->first << " has < 2 nodes, dropping" << std::endl;
-		ways_.erase_last();
-		last_way_ = ways_.end();
-		return;
-	}
+	if (way.Nodes.size() < 2)
+		return false;
 
 	/* check if a way is closed */
-	if (last_way_->second.Nodes.front() == last_way_->second.Nodes.back()) {
-		last_way_->second.Closed = true;
+	if (way.Nodes.front() == way.Nodes.back()) {
+		way.Closed = true;
 
 		/* check if a way is clockwise */
 		NodesMap::const_iterator prev, cur;
 		osmlong_t area = 0;
-		for (Way::NodesList::const_iterator i = last_way_->second.Nodes.begin(); i != last_way_->second.Nodes.end(); ++i) {
+		for (Way::NodesList::const_iterator i = way.Nodes.begin(); i != way.Nodes.end(); ++i) {
 			cur = nodes_.find(*i);
 			if (cur == nodes_.end()) {
-				std::cerr << "WARNING: node " << *i << " referenced by way " << last_way_->first << " was not found in this dump, dropping way" << std::endl;
-				ways_.erase_last();
-				last_way_ = ways_.end();
-				return;
+				missing = *i;
+				return false;
 			}
-			if (i != last_way_->second.Nodes.begin())
+			if (i != way.Nodes.begin())
 				area += (osmlong_t)prev->second.Pos.x * cur->second.Pos.y - (osmlong_t)cur->second.Pos.x * prev->second.Pos.y;
 			prev = cur;
-			last_way_->second.BBox.Include(cur->second.Pos);
+			way.BBox.Include(cur->second.Pos);
 		}
 
-		last_way_->second.Clockwise = area < 0;
+		way.Clockwise = area < 0;
 	} else {
-		for (Way::NodesList::const_iterator i = last_way_->second.Nodes.begin(); i != last_way_->second.Nodes.end(); ++i) {
+		for (Way::NodesList::const_iterator i = way.Nodes.begin(); i != way.Nodes.end(); ++i) {
 			NodesMap::const_iterator cur = nodes_.find(*i);
 			if (cur == nodes_.end()) {
-				std::cerr << "WARNING: node " << *i << " referenced by way " << last_way_->first << " was not found in this dump, dropping way" << std::endl;
-				ways_.erase_last();
-				last_way_ = ways_.end();
-				return;
+				missing = *i;
+				return false;
 			}
-			last_way_->second.BBox.Include(cur->second.Pos);
+			way.BBox.Include(cur->second.Pos);
 		}
 	}
+
+	return true;
 }
 
-void PreloadedXmlDatasource::FinalizeRelation() {
-	if (last_relation_ == relations_.end())
-		return;
+void PreloadedXmlDatasource::WarnDroppedWay(osmid_t id, osmid_t missing) const {
+	if (missing == 0)
+		std::cerr << "WARNING: way " << id << " has < 2 nodes, dropping" << std::endl;
+	else
+		std::cerr << "WARNING: node " << missing << " referenced by way " << id << " was not found in this dump, dropping way" << std::endl;
+}
 
-	TagsMap::const_iterator type = last_relation_->second.Tags.find("type");
-	if (type == last_relation_->second.Tags.end() || type->second != "multipolygon")
-		return;
+bool PreloadedXmlDatasource::IsMultipolygon(const Relation& relation) {
+	static const tagid_t type_tag = TagDictionary::Intern("type");
+	static const tagid_t multipolygon_value = TagDictionary::Intern("multipolygon");
 
-	WayMerger merger;
+	return relation.Tags.get(type_tag) == multipolygon_value;
+}
+
+void PreloadedXmlDatasource::AssembleMultipolygon(const Relation& relation, RingsList& rings, std::vector<osmid_t>& missing) const {
+	static const tagid_t outer_role = TagDictionary::Intern("outer");
+	static const tagid_t inner_role = TagDictionary::Intern("inner");
 
-	/* first, fill the merger with "outer" parts */
-	for (Relation::MemberList::const_iterator member = last_relation_->second.Members.begin(); member != last_relation_->second.Members.end(); ++member) {
-		if (member->Type != Relation::Member::WAY || member->Role != "outer")
+	/* outer and inner parts are merged separately */
+	WayMerger outer, inner;
+
+	for (Relation::MemberList::const_iterator member = relation.Members.begin(); member != relation.Members.end(); ++member) {
+		if (member->Type != Relation::Member::WAY || (member->Role != outer_role && member->Role != inner_role))
 			continue;
 
 		WaysMap::const_iterator way = ways_.find(member->Ref);
 		if (way == ways_.end()) {
-			std::cerr << "WARNING: way " << member->Ref << " referenced by relation " << last_relation_->first << " was not found in this dump, ignoring it" << std::endl;
+			missing.push_back(member->Ref);
 			continue;
 		}
 
-		merger.AddWay(way->second.Nodes);
+		(member->Role == outer_role ? outer : inner).AddWay(GetWayView(way->first, way->second).Nodes);
+	}
+
+	/* extract all complete merged ways */
+	Ring ring;
+	ring.Inner = false;
+	while (outer.GetNextWay(ring.Nodes))
+		rings.push_back(ring);
+
+	ring.Inner = true;
+	while (inner.GetNextWay(ring.Nodes))
+		rings.push_back(ring);
+}
+
+void PreloadedXmlDatasource::AddMultipolygon(osmid_t id, const Relation& relation, RingsList& rings) {
+	osmid_t next_id;
+	{
+		Guard guard(synthetic_id_mutex);
+		next_id = next_synthetic_id_;
+		next_synthetic_id_ -= rings.size();
 	}
 
-	/* next, extract all complete merged ways */
-	OsmDatasource::Way::NodesList tempnodes;
-	while (merger.GetNextWay(tempnodes)) {
-		std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(next_synthetic_id_, Way()));
+	std::vector<osmid_t> synthetic;
+	for (RingsList::iterator ring = rings.begin(); ring != rings.end(); ++ring, --next_id) {
+		std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(next_id, Way()));
 		assert(p.second);
 
-		p.first->second.Nodes.swap(tempnodes);
-		p.first->second.Tags = last_relation_->second.Tags;
+		Way& way = p.first->second;
+		way.Nodes.swap(ring->Nodes);
+		way.Tags = relation.Tags;
+		way.Inner = ring->Inner;
+
+		osmid_t missing;
+		if (!ProcessWay(way, missing)) {
+			WarnDroppedWay(p.first->first, missing);
+			ways_.erase_last();
+			continue;
+		}
+
+		synthetic.push_back(p.first->first);
+		if (change_)
+			change_->AddDirty(way.BBox);
+	}
+
+	if (!synthetic.empty())
+		synthetic_ways_.insert(std::make_pair(id, synthetic));
+}
+
+void PreloadedXmlDatasource::FinalizeRelation(osmid_t id) {
+	RelationsMap::const_iterator relation = relations_.find(id);
+	if (relation == relations_.end() || !IsMultipolygon(relation->second))
+		return;
+
+	RingsList rings;
+	std::vector<osmid_t> missing;
+	AssembleMultipolygon(relation->second, rings, missing);
+
+	for (std::vector<osmid_t>::const_iterator way = missing.begin(); way != missing.end(); ++way)
+		std::cerr << "WARNING: way " << *way << " referenced by relation " << id << " was not found in this dump, ignoring it" << std::endl;
+
+	AddMultipolygon(id, relation->second, rings);
+}
+
+void PreloadedXmlDatasource::DropSyntheticWays(osmid_t relation) {
+	SyntheticWaysMap::iterator synthetic = synthetic_ways_.find(relation);
+	if (synthetic == synthetic_ways_.end())
+		return;
+
+	for (std::vector<osmid_t>::const_iterator id = synthetic->second.begin(); id != synthetic->second.end(); ++id) {
+		WaysMap::const_iterator way = ways_.find(*id);
+		if (way == ways_.end())
+			continue;
+		if (change_)
+			change_->AddDirty(way->second.BBox);
+		ways_.erase(*id);
+	}
+
+	synthetic_ways_.erase(relation);
+}
+
+bool PreloadedXmlDatasource::BeginChange(CurrentTag type, osmid_t id) {
+	switch (type) {
+	case NODE:
+		/* ways which use the node are handled in FinalizeChange() */
+		nodes_.erase(id);
+		change_->nodes.push_back(id);
+		break;
+	case WAY:
+		{
+			WaysMap::const_iterator way = ways_.find(id);
+			if (way != ways_.end()) {
+				change_->AddDirty(way->second.BBox);
+				ways_.erase(id);
+			}
+			change_->ways.push_back(id);
+		}
+		break;
+	case RELATION:
+		DropSyntheticWays(id);
+		relations_.erase(id);
+		change_->relations.push_back(id);
+		break;
+	default:
+		break;
+	}
+
+	return change_->action != ChangeSet::DELETE;
+}
 
-		last_way_ = p.first;
+void PreloadedXmlDatasource::FinalizeChange() {
+	SortUnique(change_->nodes);
+	SortUnique(change_->ways);
+	SortUnique(change_->relations);
+
+	/* ways to process again: new versions of changed ways, and
+	 * ways which reference changed nodes */
+	std::vector<osmid_t> affected_ways;
+	for (WaysMap::const_iterator way = ways_.begin(); way != ways_.end(); ++way) {
+		if (Contains(change_->ways, way->first)) {
+			affected_ways.push_back(way->first);
+			continue;
+		}
+
+		WayView view = GetWayView(way->first, way->second);
+		for (ArrayView<osmid_t>::const_iterator node = view.Nodes.begin(); node != view.Nodes.end(); ++node) {
+			if (Contains(change_->nodes, *node)) {
+				change_->AddDirty(way->second.BBox);
+				affected_ways.push_back(way->first);
+				break;
+			}
+		}
+	}
+
+	/* synthetic ways are regenerated with their relations below */
+	for (std::vector<osmid_t>::const_iterator id = affected_ways.begin(); id != affected_ways.end(); ++id) {
+		WaysMap::iterator way = ways_.find(*id);
+		if (way == ways_.end() || *id > next_synthetic_id_)
+			continue;
+
+		/* changed ways are new objects, others were stored */
+		if (!Contains(change_->ways, *id))
+			RestoreWay(*id, way->second);
+
+		way->second.BBox = BBoxi::Empty();
+		way->second.Closed = false;
+		way->second.Clockwise = false;
+
+		osmid_t missing;
+		if (ProcessWay(way->second, missing)) {
+			change_->AddDirty(way->second.BBox);
+		} else {
+			WarnDroppedWay(*id, missing);
+			ways_.erase(*id);
+		}
+	}
+
+	affected_ways.insert(affected_ways.end(), change_->ways.begin(), change_->ways.end());
+	SortUnique(affected_ways);
+
+	/* multipolygons to process again: changed ones, and ones
+	 * which member ways have changed */
+	std::vector<osmid_t> affected_relations;
+	for (RelationsMap::const_iterator relation = relations_.begin(); relation != relations_.end(); ++relation) {
+		if (Contains(change_->relations, relation->first)) {
+			affected_relations.push_back(relation->first);
+			continue;
+		}
+
+		if (!IsMultipolygon(relation->second))
+			continue;
 
-		FinalizeWay();
+		for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end(); ++member) {
+			if (member->Type == Relation::Member::WAY && Contains(affected_ways, member->Ref)) {
+				affected_relations.push_back(relation->first);
+				break;
+			}
+		}
+	}
 
-		--next_synthetic_id_;
+	for (std::vector<osmid_t>::const_iterator id = affected_relations.begin(); id != affected_relations.end(); ++id) {
+		DropSyntheticWays(*id);
+		FinalizeRelation(*id);
 	}
+
+	for (std::vector<BBoxi>::const_iterator bbox = change_->dirty.begin(); bbox != change_->dirty.end(); ++bbox)
+		bbox_.Include(*bbox);
+
+	BuildIndex();
 }
 
 Vector2i PreloadedXmlDatasource::GetCenter() const {
@@ -312,20 +949,744 @@ void PreloadedXmlDatasource::Load(const char* filename) {
 
 	XMLParser::Load(filename);
 
+	FinalizeLoad(1);
+}
+
+void PreloadedXmlDatasource::ApplyChange(const char* filename, std::vector<BBoxi>& dirty) {
+	if (way_store_.HasCoords())
+		throw DataException() << "cannot apply changes after nodes were inlined";
+
+	ChangeSet change(dirty);
+
+	current_tag_ = NONE;
+	tag_level_ = 0;
+	object_level_ = 2;
+	change_ = &change;
+
+	try {
+		XMLParser::Load(filename);
+	} catch (...) {
+		/* keep data consistent with what was applied */
+		FinalizeChange();
+		object_level_ = 1;
+		change_ = NULL;
+		throw;
+	}
+
+	FinalizeChange();
+	object_level_ = 1;
+	change_ = NULL;
+}
+
+void* PreloadedXmlDatasource::ParseThread(void* arg) {
+	ParseTask* task = static_cast<ParseTask*>(arg);
+
+	/* each part is wrapped into root element to make a valid document */
+	static const char head[] = "<osm>";
+	static const char tail[] = "</osm>";
+
+	const char* fragments[] = { head, task->data, tail };
+	size_t sizes[] = { sizeof(head) - 1, task->size, sizeof(tail) - 1 };
+
+	try {
+		task->datasource->current_tag_ = NONE;
+		task->datasource->tag_level_ = 0;
+		task->datasource->LoadFragments(fragments, sizes, 3);
+	} catch (std::exception& e) {
+		task->error = e.what();
+	} catch (...) {
+		task->error = "unknown error";
+	}
+
+	return NULL;
+}
+
+void PreloadedXmlDatasource::LoadParallel(const char* filename, int nthreads) {
+	struct stat st;
+	if (nthreads <= 1 || strcmp(filename, "-") == 0 || stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+		Load(filename);
+		return;
+	}
+
+	Timer timer;
+
+	MappedFile file(filename);
+
+	const char* first;
+	const char* last;
+	if (file.GetSize() == 0 || !FindRootContents(file.GetData(), file.GetData() + file.GetSize(), first, last)) {
+		Load(filename);
+		return;
+	}
+
+	/* split root contents into parts of roughly equal size */
+	std::vector<ParseTask> tasks(nthreads);
+	const char* pos = first;
+	for (int i = 0; i < nthreads; ++i) {
+		const char* next = last;
+		if (i != nthreads - 1)
+			next = FindObjectStart(std::max(pos, first + (last - first) / nthreads * (i + 1)), last);
+
+		tasks[i].data = pos;
+		tasks[i].size = next - pos;
+		pos = next;
+	}
+
+	ResetLoadStats();
+	bbox_ = BBoxi::Empty();
+
+	int nstarted = 0;
+	try {
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+			task->datasource = new PreloadedXmlDatasource;
+			task->datasource->SetLoadFilter(filter_);
+			task->datasource->tokenizer_ = tokenizer_;
+		}
+
+		int errn;
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task, ++nstarted)
+			if ((errn = pthread_create(&task->thread, NULL, ParseThread, &*task)) != 0)
+				throw SystemError(errn) << "pthread_create failed";
+
+		for (; nstarted > 0; --nstarted)
+			pthread_join(tasks[nstarted - 1].thread, NULL);
+
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task)
+			if (!task->error.empty())
+				throw ParsingException() << task->error;
+
+		/* merge in order of file, so result is the same as with
+		 * sequential loading */
+		size_t nnodes = nodes_.size();
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task)
+			nnodes += task->datasource->nodes_.size();
+
+		if (HashSize(nnodes) > nodes_.bucket_count())
+			nodes_.rehash(HashSize(nnodes));
+
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+			bbox_.Include(task->datasource->bbox_);
+			task->datasource->nodes_.for_each_inserted(NodeMover(nodes_));
+			task->datasource->nodes_.clear();
+		}
+
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+			task->datasource->ways_.for_each_inserted(WayMover(*this));
+			task->datasource->ways_.clear();
+		}
+
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+			task->datasource->relations_.for_each_inserted(RelationMover(*this));
+			task->datasource->relations_.clear();
+		}
+	} catch (...) {
+		for (; nstarted > 0; --nstarted)
+			pthread_join(tasks[nstarted - 1].thread, NULL);
+		for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task)
+			delete task->datasource;
+		throw;
+	}
+
+	for (std::vector<ParseTask>::iterator task = tasks.begin(); task != tasks.end(); ++task)
+		delete task->datasource;
+
+	loaded_bytes_ = file.GetSize();
+	total_bytes_ = file.GetSize();
+	parse_time_ = timer.Count();
+	FinishPhase(LoadListener::PARSE, parse_time_);
+
+	FinalizeLoad(nthreads);
+
+	load_time_ = parse_time_ + timer.Count();
+}
+
+void PreloadedXmlDatasource::FilterObjects() {
+	if (filter_.keys.empty())
+		return;
+
+	/* only multipolygons may produce geometry */
+	std::vector<osmid_t> dropped;
+	std::vector<osmid_t> members;
+	for (RelationsMap::const_iterator relation = relations_.begin(); relation != relations_.end(); ++relation) {
+		if (!IsMultipolygon(relation->second) || !HasFilterKey(relation->second.Tags)) {
+			dropped.push_back(relation->first);
+			continue;
+		}
+
+		for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end(); ++member)
+			if (member->Type == Relation::Member::WAY)
+				members.push_back(member->Ref);
+	}
+
+	for (std::vector<osmid_t>::const_iterator id = dropped.begin(); id != dropped.end(); ++id)
+		relations_.erase(*id);
+
+	/* untagged ways may still be parts of multipolygons */
+	SortUnique(members);
+	dropped.clear();
+	for (WaysMap::const_iterator way = ways_.begin(); way != ways_.end(); ++way)
+		if (!HasFilterKey(way->second.Tags) && !Contains(members, way->first))
+			dropped.push_back(way->first);
+
+	for (std::vector<osmid_t>::const_iterator id = dropped.begin(); id != dropped.end(); ++id)
+		ways_.erase(*id);
+}
+
+void PreloadedXmlDatasource::FilterArea() {
+	if (IsFull(filter_bbox_))
+		return;
+
+	/* ways with any node inside the area are kept, along with
+	 * all their nodes, so ways crossing its border stay whole */
+	std::vector<osmid_t> kept;
+	for (WaysMap::const_iterator way = ways_.begin(); way != ways_.end(); ++way) {
+		for (Way::NodesList::const_iterator id = way->second.Nodes.begin(); id != way->second.Nodes.end(); ++id) {
+			NodesMap::const_iterator node = nodes_.find(*id);
+			if (node != nodes_.end() && filter_bbox_.Contains(node->second.Pos)) {
+				kept.push_back(way->first);
+				break;
+			}
+		}
+	}
+	std::sort(kept.begin(), kept.end());
+
+	/* so are relations with any member inside; multipolygons
+	 * need all their member ways to assemble rings */
+	std::vector<osmid_t> dropped;
+	std::vector<osmid_t> members;
+	for (RelationsMap::const_iterator relation = relations_.begin(); relation != relations_.end(); ++relation) {
+		bool inside = false;
+		for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end() && !inside; ++member) {
+			if (member->Type == Relation::Member::WAY) {
+				inside = Contains(kept, member->Ref);
+			} else if (member->Type == Relation::Member::NODE) {
+				NodesMap::const_iterator node = nodes_.find(member->Ref);
+				inside = node != nodes_.end() && filter_bbox_.Contains(node->second.Pos);
+			}
+		}
+
+		if (!inside) {
+			dropped.push_back(relation->first);
+		} else if (IsMultipolygon(relation->second)) {
+			for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end(); ++member)
+				if (member->Type == Relation::Member::WAY)
+					members.push_back(member->Ref);
+		}
+	}
+
+	for (std::vector<osmid_t>::const_iterator id = dropped.begin(); id != dropped.end(); ++id)
+		relations_.erase(*id);
+
+	kept.insert(kept.end(), members.begin(), members.end());
+	SortUnique(kept);
+
+	dropped.clear();
+	for (WaysMap::const_iterator way = ways_.begin(); way != ways_.end(); ++way)
+		if (!Contains(kept, way->first))
+			dropped.push_back(way->first);
+
+	for (std::vector<osmid_t>::const_iterator id = dropped.begin(); id != dropped.end(); ++id)
+		ways_.erase(*id);
+}
+
+void PreloadedXmlDatasource::PruneNodes() {
+	bool area = !IsFull(filter_bbox_);
+	if ((!filter_.prune_nodes && !area) || nodes_.empty())
+		return;
+
+	/* mark nodes used by ways and relations */
+	osmid_t minid = std::numeric_limits<osmid_t>::max();
+	osmid_t maxid = std::numeric_limits<osmid_t>::min();
+	std::vector<osmid_t> used;
+	for (WaysMap::const_iterator way = ways_.begin(); way != ways_.end(); ++way)
+		used.insert(used.end(), way->second.Nodes.begin(), way->second.Nodes.end());
+	for (RelationsMap::const_iterator relation = relations_.begin(); relation != relations_.end(); ++relation)
+		for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end(); ++member)
+			if (member->Type == Relation::Member::NODE)
+				used.push_back(member->Ref);
+
+	for (std::vector<osmid_t>::const_iterator id = used.begin(); id != used.end(); ++id) {
+		minid = std::min(minid, *id);
+		maxid = std::max(maxid, *id);
+	}
+
+	/* bitmap over used id range, unless ids are so sparse that
+	 * sorted list of them is smaller */
+	std::vector<bool> bitmap;
+	bool use_bitmap = !used.empty() && (uint64_t)(maxid - minid) / 8 < used.size() * sizeof(osmid_t);
+	if (use_bitmap) {
+		bitmap.resize(maxid - minid + 1);
+		for (std::vector<osmid_t>::const_iterator id = used.begin(); id != used.end(); ++id)
+			bitmap[*id - minid] = true;
+		std::vector<osmid_t>().swap(used);
+	} else {
+		SortUnique(used);
+	}
+
+	/* unused nodes inside filter area are only dropped if asked */
+	size_t nkept = 0;
+	for (NodesMap::const_iterator node = nodes_.begin(); node != nodes_.end(); ++node)
+		if ((!filter_.prune_nodes && filter_bbox_.Contains(node->second.Pos)) || (use_bitmap ? (node->first >= minid && node->first <= maxid && bitmap[node->first - minid]) : Contains(used, node->first)))
+			++nkept;
+
+	NodesMap kept;
+	kept.rehash(HashSize(nkept));
+	for (NodesMap::const_iterator node = nodes_.begin(); node != nodes_.end(); ++node)
+		if ((!filter_.prune_nodes && filter_bbox_.Contains(node->second.Pos)) || (use_bitmap ? (node->first >= minid && node->first <= maxid && bitmap[node->first - minid]) : Contains(used, node->first)))
+			kept.insert(*node);
+
+	nodes_.swap(kept);
+}
+
+void* PreloadedXmlDatasource::WayThread(void* arg) {
+	WayTask* task = static_cast<WayTask*>(arg);
+
+	osmid_t missing;
+	for (WaysMap::value_type** way = task->begin; way != task->end; ++way)
+		if (!task->datasource->ProcessWay((*way)->second, missing))
+			task->dropped.push_back(std::make_pair(*way, missing));
+
+	return NULL;
+}
+
+void* PreloadedXmlDatasource::RelationThread(void* arg) {
+	RelationTask* task = static_cast<RelationTask*>(arg);
+
+	task->rings.resize(task->end - task->begin);
+	task->missing.resize(task->end - task->begin);
+
+	for (RelationsMap::value_type** relation = task->begin; relation != task->end; ++relation)
+		task->datasource->AssembleMultipolygon((*relation)->second, task->rings[relation - task->begin], task->missing[relation - task->begin]);
+
+	return NULL;
+}
+
+void PreloadedXmlDatasource::FinalizeLoad(int nthreads) {
+	Timer timer;
+
+	/* ways loaded before are processed along with new ones */
+	RestoreWays();
+
+	FilterObjects();
+	FilterArea();
+
+	nthreads = std::max(nthreads, 1);
+
+	/* process all ways; ways are not added or removed meanwhile,
+	 * so threads may use pointers to them */
+	std::vector<WaysMap::value_type*> ways;
+	ways.reserve(ways_.size());
+	for (WaysMap::iterator way = ways_.begin(); way != ways_.end(); ++way)
+		ways.push_back(&*way);
+
+	std::vector<WayTask> waytasks(std::min((size_t)nthreads, std::max(ways.size(), (size_t)1)));
+	SplitTasks(waytasks, ways);
+	for (std::vector<WayTask>::iterator task = waytasks.begin(); task != waytasks.end(); ++task)
+		task->datasource = this;
+
+	RunTasks(waytasks, WayThread);
+
+	std::vector<osmid_t> dropped;
+	for (std::vector<WayTask>::const_iterator task = waytasks.begin(); task != waytasks.end(); ++task) {
+		for (std::vector<std::pair<WaysMap::value_type*, osmid_t> >::const_iterator way = task->dropped.begin(); way != task->dropped.end(); ++way) {
+			WarnDroppedWay(way->first->first, way->second);
+			dropped.push_back(way->first->first);
+		}
+	}
+
+	std::vector<WayTask>().swap(waytasks);
+	std::vector<WaysMap::value_type*>().swap(ways);
+
+	for (std::vector<osmid_t>::const_iterator id = dropped.begin(); id != dropped.end(); ++id)
+		ways_.erase(*id);
+
+	FinishPhase(LoadListener::FINALIZE, timer.Count());
+
+	/* assemble multipolygons; rings are merged in parallel, but
+	 * added in order of relations so synthetic ids don't depend
+	 * on number of threads */
+	std::vector<RelationsMap::value_type*> relations;
+	for (RelationsMap::iterator relation = relations_.begin(); relation != relations_.end(); ++relation)
+		if (IsMultipolygon(relation->second))
+			relations.push_back(&*relation);
+
+	std::vector<RelationTask> relationtasks(std::min((size_t)nthreads, std::max(relations.size(), (size_t)1)));
+	SplitTasks(relationtasks, relations);
+	for (std::vector<RelationTask>::iterator task = relationtasks.begin(); task != relationtasks.end(); ++task)
+		task->datasource = this;
+
+	RunTasks(relationtasks, RelationThread);
+
+	for (std::vector<RelationTask>::iterator task = relationtasks.begin(); task != relationtasks.end(); ++task) {
+		for (RelationsMap::value_type** relation = task->begin; relation != task->end; ++relation) {
+			size_t n = relation - task->begin;
+
+			for (std::vector<osmid_t>::const_iterator way = task->missing[n].begin(); way != task->missing[n].end(); ++way)
+				std::cerr << "WARNING: way " << *way << " referenced by relation " << (*relation)->first << " was not found in this dump, ignoring it" << std::endl;
+
+			AddMultipolygon((*relation)->first, (*relation)->second, task->rings[n]);
+		}
+	}
+
+	FinishPhase(LoadListener::MULTIPOLYGONS, timer.Count());
+
+	PruneNodes();
+
 	/* if file lacked bounding box, generate one ourselves */
 	if (bbox_.IsEmpty()) {
 		for (NodesMap::iterator node = nodes_.begin(); node != nodes_.end(); ++node)
 			bbox_.Include(node->second.Pos);
 	}
+
+	BuildIndex();
+
+	FinishPhase(LoadListener::INDEX, timer.Count());
+}
+
+void PreloadedXmlDatasource::GetLoadCounts(LoadListener::Progress& progress) const {
+	progress.nodes = nodes_.size();
+	progress.ways = ways_.size();
+	progress.relations = relations_.size();
+}
+
+void PreloadedXmlDatasource::BuildIndex() {
+	/* ways are placed into the store in the order of spatial
+	 * index, so ways returned by a query are close in memory;
+	 * first pass only establishes that order. Ids make order
+	 * of items with equal hilbert values deterministic */
+	std::vector<WayItem> order;
+	size_t nnodes = 0, ntags = 0;
+	{
+		PackedRTree<WayItem> sorter;
+		sorter.Reserve(ways_.size());
+		for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i) {
+			sorter.Insert(i->second.BBox, std::make_pair(i->first, &i->second));
+
+			WayView view = GetWayView(i->first, i->second);
+			nnodes += view.Nodes.size();
+			ntags += view.Tags.size();
+		}
+		sorter.Build();
+
+		order.reserve(ways_.size());
+		sorter.Query(BBoxi::Full(), order);
+	}
+
+	ways_index_.Clear();
+	ways_index_.Reserve(order.size());
+	std::vector<const Way*>().swap(way_pointers_);
+	way_pointers_.reserve(order.size());
+
+	/* ways not changed since previous build are only in the
+	 * old store, so new one is filled aside */
+	{
+		WayStore store;
+		store.Reserve(order.size(), nnodes, ntags);
+
+		/* as indexes go in the same order, the index sorts them
+		 * exactly like above */
+		for (std::vector<WayItem>::const_iterator i = order.begin(); i != order.end(); ++i) {
+			size_t index = store.Append(i->first, GetWayView(i->first, *i->second));
+			ways_index_.Insert(i->second->BBox, index);
+			way_pointers_.push_back(i->second);
+		}
+
+		way_store_.Swap(store);
+	}
+
+	ways_index_.Build();
+
+	std::vector<size_t>().swap(store_by_id_);
+	store_by_id_.reserve(way_store_.GetSize());
+	for (size_t i = 0; i < way_store_.GetSize(); ++i)
+		store_by_id_.push_back(i);
+	std::sort(store_by_id_.begin(), store_by_id_.end(), StoredIdLess(way_store_));
+
+	/* store is the only copy of way data from now on */
+	for (WaysMap::iterator way = ways_.begin(); way != ways_.end(); ++way) {
+		Way::NodesList().swap(way->second.Nodes);
+		Way::CoordsList().swap(way->second.Coords);
+		way->second.Tags.clear();
+	}
+}
+
+size_t PreloadedXmlDatasource::FindStoredWay(osmid_t id) const {
+	std::vector<size_t>::const_iterator i = std::lower_bound(store_by_id_.begin(), store_by_id_.end(), id, StoredIdSearch(way_store_));
+	if (i == store_by_id_.end() || way_store_.GetId(*i) != id)
+		return way_store_.GetSize();
+	return *i;
+}
+
+OsmDatasource::WayView PreloadedXmlDatasource::GetWayView(osmid_t id, const Way& way) const {
+	/* valid ways have at least two nodes, so ones without
+	 * nodes were moved into the store */
+	if (way.Nodes.empty()) {
+		size_t index = FindStoredWay(id);
+		if (index != way_store_.GetSize())
+			return way_store_.GetView(index);
+	}
+
+	return WayView(way);
+}
+
+void PreloadedXmlDatasource::RestoreWay(osmid_t id, Way& way) const {
+	if (!way.Nodes.empty())
+		return;
+
+	size_t index = FindStoredWay(id);
+	if (index != way_store_.GetSize())
+		RestoreStoredWay(index, way);
+}
+
+void PreloadedXmlDatasource::RestoreStoredWay(size_t index, Way& way) const {
+	if (!way.Nodes.empty())
+		return;
+
+	WayView view = way_store_.GetView(index);
+	way.Nodes.assign(view.Nodes.begin(), view.Nodes.end());
+	way.Coords.assign(view.Coords.begin(), view.Coords.end());
+	for (TagsView::const_iterator tag = view.Tags.begin(); tag != view.Tags.end(); ++tag)
+		way.Tags.insert(tag->first, tag->second);
+}
+
+void PreloadedXmlDatasource::RestoreWays() {
+	if (way_store_.IsEmpty())
+		return;
+
+	for (WaysMap::iterator way = ways_.begin(); way != ways_.end(); ++way)
+		RestoreWay(way->first, way->second);
+
+	way_store_.Clear();
+	ways_index_.Clear();
+	std::vector<const Way*>().swap(way_pointers_);
+	std::vector<size_t>().swap(store_by_id_);
+}
+
+void PreloadedXmlDatasource::SaveSnapshot(const char* filename) const {
+	SnapshotWriter writer(filename);
+
+	/* header */
+	writer.WriteData(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	writer.Write(SNAPSHOT_VERSION);
+	writer.Write(SNAPSHOT_BOM);
+	writer.WriteBBox(bbox_);
+	writer.Write(next_synthetic_id_);
+
+	/* whole dictionary is dumped, so tag ids may be written as is */
+	uint32_t nstrings = TagDictionary::GetSize();
+	writer.Write(nstrings);
+	for (uint32_t i = 1; i <= nstrings; ++i)
+		writer.WriteString(TagDictionary::GetString(i));
+
+	/* nodes */
+	writer.Write((uint64_t)nodes_.size());
+	for (NodesMap::const_iterator node = nodes_.begin(); node != nodes_.end(); ++node) {
+		writer.Write(node->first);
+		writer.Write(node->second.Pos.x);
+		writer.Write(node->second.Pos.y);
+	}
+
+	/* ways; their items may be restored meanwhile */
+	Guard guard(restore_mutex_);
+
+	writer.Write((uint64_t)ways_.size());
+	for (WaysMap::const_iterator way = ways_.begin(); way != ways_.end(); ++way) {
+		WayView view = GetWayView(way->first, way->second);
+
+		uint8_t flags = 0;
+		if (view.Closed)
+			flags |= SNAPSHOT_CLOSED;
+		if (view.Clockwise)
+			flags |= SNAPSHOT_CLOCKWISE;
+		if (!view.Coords.empty())
+			flags |= SNAPSHOT_COORDS;
+		if (view.Inner)
+			flags |= SNAPSHOT_INNER;
+
+		writer.Write(way->first);
+		writer.Write(flags);
+		writer.WriteBBox(view.BBox);
+		writer.Write((uint32_t)view.Nodes.size());
+		writer.WriteData(view.Nodes.data(), view.Nodes.size() * sizeof(osmid_t));
+		for (ArrayView<Vector2i>::const_iterator coord = view.Coords.begin(); coord != view.Coords.end(); ++coord) {
+			writer.Write(coord->x);
+			writer.Write(coord->y);
+		}
+		writer.WriteTags(view.Tags);
+	}
+
+	/* relations */
+	writer.Write((uint64_t)relations_.size());
+	for (RelationsMap::const_iterator relation = relations_.begin(); relation != relations_.end(); ++relation) {
+		writer.Write(relation->first);
+		writer.Write((uint32_t)relation->second.Members.size());
+		for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end(); ++member) {
+			writer.Write((uint8_t)member->Type);
+			writer.Write(member->Ref);
+			writer.Write((uint32_t)member->Role);
+		}
+		writer.WriteTags(relation->second.Tags);
+	}
+
+	/* synthetic ways of relations */
+	writer.Write((uint64_t)synthetic_ways_.size());
+	for (SyntheticWaysMap::const_iterator synthetic = synthetic_ways_.begin(); synthetic != synthetic_ways_.end(); ++synthetic) {
+		writer.Write(synthetic->first);
+		writer.Write((uint32_t)synthetic->second.size());
+		writer.WriteData(synthetic->second.data(), synthetic->second.size() * sizeof(osmid_t));
+	}
+
+	writer.Close();
+}
+
+void PreloadedXmlDatasource::LoadSnapshot(const char* filename) {
+	MappedFile file(filename);
+	SnapshotReader reader(file.GetData(), file.GetSize());
+
+	/* header */
+	if (memcmp(reader.ReadData(sizeof(SNAPSHOT_MAGIC)), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+		throw DataException() << filename << " is not a glosm snapshot";
+	uint32_t version = reader.Read<uint32_t>();
+	if (version != SNAPSHOT_VERSION)
+		throw DataException() << "unsupported snapshot version " << version << " (expected " << SNAPSHOT_VERSION << ")";
+	if (reader.Read<uint32_t>() != SNAPSHOT_BOM)
+		throw DataException() << "snapshot was created on a platform with different byte order";
+
+	Clear();
+
+	bbox_ = reader.ReadBBox();
+
+	/* keep synthetic ids unique among all datasources */
+	osmid_t next_synthetic_id = reader.Read<osmid_t>();
+	{
+		Guard guard(synthetic_id_mutex);
+		next_synthetic_id_ = std::min(next_synthetic_id_, next_synthetic_id);
+	}
+
+	reader.ReadStrings();
+
+	/* nodes */
+	uint64_t nnodes = reader.ReadCount<uint64_t>(sizeof(osmid_t) + 2 * sizeof(osmint_t));
+	if (HashSize(nnodes) > nodes_.bucket_count())
+		nodes_.rehash(HashSize(nnodes));
+	for (uint64_t count = nnodes; count > 0; --count) {
+		osmid_t id = reader.Read<osmid_t>();
+		osmint_t x = reader.Read<osmint_t>();
+		osmint_t y = reader.Read<osmint_t>();
+		nodes_.insert(std::make_pair(id, Node(x, y)));
+	}
+
+	/* ways */
+	uint64_t nways = reader.ReadCount<uint64_t>(sizeof(osmid_t) + sizeof(uint8_t) + 4 * sizeof(osmint_t) + 2 * sizeof(uint32_t));
+	if (HashSize(nways) > ways_.bucket_count())
+		ways_.rehash(HashSize(nways));
+	for (uint64_t count = nways; count > 0; --count) {
+		osmid_t id = reader.Read<osmid_t>();
+		Way& way = ways_.insert(std::make_pair(id, Way())).first->second;
+
+		uint8_t flags = reader.Read<uint8_t>();
+		way.Closed = flags & SNAPSHOT_CLOSED;
+		way.Clockwise = flags & SNAPSHOT_CLOCKWISE;
+		way.Inner = flags & SNAPSHOT_INNER;
+		way.BBox = reader.ReadBBox();
+
+		uint32_t nnodes = reader.Read<uint32_t>();
+		const char* nodes = reader.ReadData(nnodes * sizeof(osmid_t));
+		way.Nodes.resize(nnodes);
+		if (nnodes)
+			memcpy(way.Nodes.data(), nodes, nnodes * sizeof(osmid_t));
+
+		if (flags & SNAPSHOT_COORDS) {
+			way.Coords.reserve(nnodes);
+			for (uint32_t i = 0; i < nnodes; ++i) {
+				osmint_t x = reader.Read<osmint_t>();
+				osmint_t y = reader.Read<osmint_t>();
+				way.Coords.push_back(Vector2i(x, y));
+			}
+		}
+
+		reader.ReadTags(way.Tags);
+	}
+
+	/* relations */
+	for (uint64_t count = reader.ReadCount<uint64_t>(sizeof(osmid_t) + 2 * sizeof(uint32_t)); count > 0; --count) {
+		osmid_t id = reader.Read<osmid_t>();
+		Relation& relation = relations_.insert(std::make_pair(id, Relation())).first->second;
+
+		uint32_t nmembers = reader.ReadCount<uint32_t>(sizeof(uint8_t) + sizeof(osmid_t) + sizeof(uint32_t));
+		relation.Members.reserve(nmembers);
+		for (uint32_t i = 0; i < nmembers; ++i) {
+			uint8_t type = reader.Read<uint8_t>();
+			if (type >= Relation::Member::UNKNOWN)
+				throw DataException() << "bad relation member type in snapshot";
+			osmid_t ref = reader.Read<osmid_t>();
+			tagid_t role = reader.ReadStringId();
+			relation.Members.push_back(Relation::Member((Relation::Member::Type_t)type, ref, role));
+		}
+
+		reader.ReadTags(relation.Tags);
+	}
+
+	/* synthetic ways of relations */
+	for (uint64_t count = reader.Read<uint64_t>(); count > 0; --count) {
+		osmid_t id = reader.Read<osmid_t>();
+		uint32_t nways = reader.Read<uint32_t>();
+		const char* ways = reader.ReadData(nways * sizeof(osmid_t));
+
+		std::vector<osmid_t>& synthetic = synthetic_ways_.insert(std::make_pair(id, std::vector<osmid_t>())).first->second;
+		synthetic.resize(nways);
+		memcpy(synthetic.data(), ways, nways * sizeof(osmid_t));
+	}
+
+	BuildIndex();
+}
+
+void PreloadedXmlDatasource::InlineNodes() {
+	for (WaysMap::iterator way = ways_.begin(); way != ways_.end(); ++way) {
+		WayView view = GetWayView(way->first, way->second);
+		Way::CoordsList coords(view.Nodes.size());
+
+		/* ways with missing nodes are dropped by FinalizeLoad(), but
+		 * InlineNodes() may be called twice */
+		if (!TryGetNodes(view.Nodes.data(), view.Nodes.size(), coords.data()))
+			continue;
+
+		size_t index = FindStoredWay(way->first);
+		if (index != way_store_.GetSize())
+			way_store_.SetCoords(index, coords.data());
+
+		/* restored items get coordinates as well */
+		if (!way->second.Nodes.empty())
+			way->second.Coords.swap(coords);
+	}
+
+	NodesMap kept;
+	for (RelationsMap::const_iterator relation = relations_.begin(); relation != relations_.end(); ++relation) {
+		for (Relation::MemberList::const_iterator member = relation->second.Members.begin(); member != relation->second.Members.end(); ++member) {
+			if (member->Type != Relation::Member::NODE)
+				continue;
+
+			NodesMap::const_iterator node = nodes_.find(member->Ref);
+			if (node != nodes_.end())
+				kept.insert(*node);
+		}
+	}
+
+	nodes_.swap(kept);
 }
 
 void PreloadedXmlDatasource::Clear() {
 	nodes_.clear();
 	ways_.clear();
 	relations_.clear();
+	synthetic_ways_.clear();
+	way_store_.Clear();
+	ways_index_.Clear();
+	std::vector<const Way*>().swap(way_pointers_);
+	std::vector<size_t>().swap(store_by_id_);
 }
 
-const OsmDatasource::Node& PreloadedXmlDatasource::GetNode(osmid_t id) const {
+OsmDatasource::Node PreloadedXmlDatasource::GetNode(osmid_t id) const {
 	NodesMap::const_iterator i = nodes_.find(id);
 	if (i == nodes_.end())
 		throw DataException() << "node not found";
@@ -336,6 +1697,9 @@ const OsmDatasource::Way& PreloadedXmlDatasource::GetWay(osmid_t id) const {
 	WaysMap::const_iterator i = ways_.find(id);
 	if (i == ways_.end())
 		throw DataException() << "way not found";
+
+	Guard guard(restore_mutex_);
+	RestoreWay(id, const_cast<Way&>(i->second));
 	return i->second;
 }
 
@@ -346,11 +1710,56 @@ const OsmDatasource::Relation& PreloadedXmlDatasource::GetRelation(osmid_t id) c
 	return i->second;
 }
 
-void PreloadedXmlDatasource::GetWays(std::vector<OsmDatasource::Way>& out, const BBoxi& bbox) const {
+bool PreloadedXmlDatasource::TryGetNode(osmid_t id, Node& out) const {
+	NodesMap::const_iterator i = nodes_.find(id);
+	if (i == nodes_.end())
+		return false;
+	out = i->second;
+	return true;
+}
+
+bool PreloadedXmlDatasource::TryGetWay(osmid_t id, WayView& out) const {
+	WaysMap::const_iterator i = ways_.find(id);
+	if (i == ways_.end())
+		return false;
+
+	/* store is looked up first, as Way object may be being
+	 * restored by another thread; restored ways have the same
+	 * data as their stored copies anyway */
+	size_t index = FindStoredWay(id);
+	out = (index != way_store_.GetSize()) ? way_store_.GetView(index) : WayView(i->second);
+	return true;
+}
+
+bool PreloadedXmlDatasource::TryGetNodes(const osmid_t* ids, size_t count, Vector2i* out) const {
+	for (const osmid_t* id = ids; id < ids + count; ++id, ++out) {
+		NodesMap::const_iterator i = nodes_.find(*id);
+		if (i == nodes_.end())
+			return false;
+		*out = i->second.Pos;
+	}
+	return true;
+}
+
+void PreloadedXmlDatasource::GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const {
+	if (!bbox.Intersects(bbox_))
+		return;
+
+	std::vector<size_t> indexes;
+	ways_index_.Query(bbox, indexes);
+
+	Guard guard(restore_mutex_);
+	out.reserve(out.size() + indexes.size());
+	for (std::vector<size_t>::const_iterator index = indexes.begin(); index != indexes.end(); ++index) {
+		RestoreStoredWay(*index, const_cast<Way&>(*way_pointers_[*index]));
+		out.push_back(way_pointers_[*index]);
+	}
+}
+
+void PreloadedXmlDatasource::GetWays(std::vector<WayView>& out, const BBoxi& bbox) const {
 	if (!bbox.Intersects(bbox_))
 		return;
 
-	for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i)
-		if (i->second.BBox.Intersects(bbox))
-			out.push_back(i->second);
+	WayViewAppender appender(way_store_, out);
+	ways_index_.Query(bbox, appender);
 }
@@ -21,21 +21,18 @@
 #include <glosm/SRTMDatasource.hh>
 #include <glosm/Exception.hh>
 #include <glosm/Guard.hh>
-#include <glosm/Misc.hh>
+#include <glosm/MappedFile.hh>
 
 #include <glosm/geomath.h>
 
-#include <sys/param.h>
-#include <unistd.h>
-#include <fcntl.h>
-
+#include <algorithm>
 #include <cassert>
+#include <memory>
 #include <sstream>
 #include <iomanip>
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
-#include <cerrno>
 
 enum {
 	FILE_HEIGHT = 1201,
@@ -43,122 +40,240 @@ enum {
 
 	DATA_HEIGHT = 1200,
 	DATA_WIDTH = 1200,
+
+	/* chunks of the whole earth */
+	CHUNKS_WIDTH = 360,
+	CHUNKS_HEIGHT = 180,
+
+	/* denominator of fixed-point positions inside a cell */
+	SUBCELL = GEOM_UNITSINDEGREE,
 };
 
-SRTMDatasource::SRTMDatasource(const char* storage_path) : storage_path_(storage_path) {
-	generation_ = 0;
+inline int SRTMDatasource::Chunk::GetSample(int pos, int line) const {
+	if (data == NULL)
+		return 0;
+
+	/* rows go from north to south, and last row and column
+	 * duplicate first ones of neighbor files */
+	const unsigned char* sample = data + 2 * ((FILE_HEIGHT - 1 - line) * FILE_WIDTH + pos);
+	return (int16_t)((sample[0] << 8) | sample[1]);
+}
+
+inline osmint_t SRTMDatasource::Chunk::Interpolate(int pos, int line, int fx, int fy) const {
+	/*
+	 * here we take into account that our heightmap is split
+	 * into triangles like this:
+	 * +--+
+	 * | /|
+	 * |/ |
+	 * +--+
+	 * but "true" height would be 4-point interpolation
+	 *
+	 * right and top samples of a cell are always in the same
+	 * file, as files overlap by a sample
+	 */
+	osmlong_t bottomleft = GetSample(pos, line);
+	osmlong_t topright = GetSample(pos + 1, line + 1);
+
+	osmlong_t height;
+	if (fx < fy)
+		height = bottomleft * (SUBCELL - fy) + topright * fx + (osmlong_t)GetSample(pos, line + 1) * (fy - fx);
+	else
+		height = bottomleft * (SUBCELL - fx) + topright * fy + (osmlong_t)GetSample(pos + 1, line) * (fx - fy);
+
+	height *= GEOM_UNITSINMETER;
+	return (osmint_t)((height + (height >= 0 ? SUBCELL / 2 : -SUBCELL / 2)) / SUBCELL);
+}
+
+SRTMDatasource::SRTMDatasource(const char* storage_path, size_t cache_size) : storage_path_(storage_path), chunks_(NULL), clock_hand_(0), cache_size_(cache_size), mapped_bytes_(0), misses_(0) {
+	void_chunk_.state = Chunk::READY;
+
+	chunks_ = new Chunk*[CHUNKS_WIDTH * CHUNKS_HEIGHT];
+	std::fill(chunks_, chunks_ + CHUNKS_WIDTH * CHUNKS_HEIGHT, (Chunk*)NULL);
+
 	int errn;
-	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0) {
+		delete[] chunks_;
 		throw SystemError(errn) << "pthread_mutex_init failed";
+	}
 }
 
 SRTMDatasource::~SRTMDatasource() {
+	for (int i = 0; i < CHUNKS_WIDTH * CHUNKS_HEIGHT; ++i) {
+		if (chunks_[i]) {
+			delete chunks_[i]->file;
+			delete chunks_[i];
+		}
+	}
+	delete[] chunks_;
 	pthread_mutex_destroy(&mutex_);
 }
 
-SRTMDatasource::Chunk& SRTMDatasource::RequireChunk(int lon, int lat) const {
-	lon -= 180;
-	lat -= 90;
-
-	ChunksMap::iterator chunk = chunks_.find(ChunkId(lon, lat));
-	if (chunk == chunks_.end()) {
-		std::pair<ChunksMap::iterator, bool> p = chunks_.insert(std::make_pair(ChunkId(lon, lat), Chunk()));
-		assert(p.second);
-		chunk = p.first;
+const SRTMDatasource::Chunk& SRTMDatasource::AcquireChunk(int lon, int lat) const {
+	if (lon < 0 || lon >= CHUNKS_WIDTH || lat < 0 || lat >= CHUNKS_HEIGHT)
+		return void_chunk_;
+
+	Chunk* chunk = chunks_[lat * CHUNKS_WIDTH + lon];
+	if (chunk != NULL) {
+		/* this is full barrier, so either evicting thread sees
+		 * us as a reader, or we see that chunk is not ready */
+		__sync_fetch_and_add(&chunk->readers, 1);
+		if (chunk->state == Chunk::READY) {
+			/* also a barrier, so data is read after state */
+			__sync_fetch_and_add(&chunk->hits, 1);
+			if (!chunk->referenced)
+				chunk->referenced = 1;
+			return *chunk;
+		}
+		__sync_fetch_and_sub(&chunk->readers, 1);
 	}
 
-	chunk->second.generation = ++generation_;
+	Guard guard(mutex_);
+	return LoadChunk(lon, lat);
+}
+
+void SRTMDatasource::ReleaseChunk(const Chunk& chunk) const {
+	if (&chunk != &void_chunk_)
+		__sync_fetch_and_sub(&const_cast<Chunk&>(chunk).readers, 1);
+}
+
+const SRTMDatasource::Chunk& SRTMDatasource::LoadChunk(int lon, int lat) const {
+	Chunk* volatile& slot = chunks_[lat * CHUNKS_WIDTH + lon];
+	if (slot == NULL) {
+		Chunk* created = new Chunk;
 
-	/* hardcoded cleanup routine; make this customizable like in TileManager */
-	if (chunks_.size() > 32) {
-		std::multimap<int, ChunksMap::iterator> gensorted;
-		for (ChunksMap::iterator i = chunks_.begin(); i != chunks_.end(); ++i)
-			gensorted.insert(std::make_pair(i->second.generation, i));
+		/* chunk must be complete before it's visible */
+		__sync_synchronize();
+		slot = created;
+	}
+
+	Chunk* chunk = slot;
 
-		for (unsigned int i = 24; i < chunks_.size(); ++i)
-			gensorted.erase(gensorted.begin());
+	/* may have been mapped by another thread meanwhile */
+	if (chunk->state == Chunk::READY) {
+		__sync_fetch_and_add(&chunk->readers, 1);
+		__sync_fetch_and_add(&chunk->hits, 1);
+		chunk->referenced = 1;
+		return *chunk;
 	}
 
+	++misses_;
+
+	lon -= 180;
+	lat -= 90;
+
+	std::stringstream filename;
+	filename << storage_path_ << "/" << std::setfill('0')
+		<< (lat < 0 ? 'S' : 'N') << std::setw(2) << abs(lat)
+		<< (lon < 0 ? 'W' : 'E') << std::setw(3) << abs(lon) << ".hgt";
+
+	std::auto_ptr<MappedFile> file;
 	try {
-		if (chunk->second.data.empty()) {
-			chunk->second.data.resize(DATA_HEIGHT * DATA_WIDTH);
+		file.reset(new MappedFile(filename.str().c_str()));
+		if (file->GetSize() != 2 * FILE_WIDTH * FILE_HEIGHT)
+			throw Exception() << "unexpected size of SRTM file " << filename.str();
+	} catch (Exception& e) {
+		/* chunk with no data is still cached, so the warning
+		 * is not repeated, and it reads as zero height, which
+		 * is better than just dying */
+		fprintf(stderr, "warning: %s\n", e.what());
+		file.reset(NULL);
+	}
 
-			std::stringstream filename;
-			filename << storage_path_ << "/" << std::setfill('0')
-				<< (lat < 0 ? 'E' : 'N') << std::setw(2) << abs(lat)
-				<< (lon < 0 ? 'W' : 'E') << std::setw(3) << abs(lon) << ".hgt";
+	resident_.push_back(chunk);
 
-			int f;
-			if ((f = open(filename.str().c_str(), O_RDONLY)) == -1)
-				throw SystemError() << "cannot open SRTM file " << filename.str();
+	chunk->file = file.release();
+	chunk->data = chunk->file ? reinterpret_cast<const unsigned char*>(chunk->file->GetData()) : NULL;
+	chunk->referenced = 1;
 
-			try {
-				int16_t* current = chunk->second.data.data();
+	/* lock-free readers may have counted themselves in and out
+	 * meanwhile, so plain store could lose or fake a reader */
+	__sync_fetch_and_add(&chunk->readers, 1);
 
-				for (int line = 0; line < DATA_HEIGHT; line++) {
-					size_t toread = 2 * DATA_WIDTH;
-					char* readptr = reinterpret_cast<char*>(current);
+	if (chunk->file)
+		mapped_bytes_ += chunk->file->GetSize();
 
-					while (toread > 0) {
-						ssize_t nread = read(f, readptr, toread);
+	/* publish chunk only when data is in place */
+	__sync_synchronize();
+	chunk->state = Chunk::READY;
 
-						if (nread == -1 && errno == EINTR)
-							continue;
-						else if (nread == -1)
-							throw SystemError() << "read error on SRTM file " << filename.str();
-						else if (nread == 0)
-							throw Exception() << "unexpected EOF in SRTM file " << filename.str();
+	TrimCache(chunk);
 
-						toread -= nread;
-						readptr += nread;
-					}
+	return *chunk;
+}
 
-					/* SRTM data is in big-endian format, convert it if needed */
-					if (!IsBigEndian()) {
-						for (uint16_t* val = (uint16_t*)current; val < (uint16_t*)current + DATA_WIDTH; ++val)
-							*val = (*val >> 8) | (*val << 8);
-					}
+void SRTMDatasource::TrimCache(const Chunk* keep) const {
+	/* each chunk is passed at most twice: first time its
+	 * referenced flag is cleared, second time it's evicted */
+	for (size_t steps = 2 * resident_.size(); mapped_bytes_ > cache_size_ && resident_.size() > 1 && steps > 0; --steps) {
+		if (clock_hand_ >= resident_.size())
+			clock_hand_ = 0;
 
-					if (lseek(f, 2 * (FILE_WIDTH - DATA_WIDTH), SEEK_CUR) == -1)
-						throw SystemError() << "cannot seek SRTM file " << filename.str();
+		Chunk* chunk = resident_[clock_hand_];
 
-					current += DATA_WIDTH;
-				}
-			} catch (...) {
-				close(f);
-				throw;
-			}
+		if (chunk == keep) {
+			++clock_hand_;
+			continue;
+		}
 
-			close(f);
+		if (chunk->referenced) {
+			chunk->referenced = 0;
+			++clock_hand_;
+			continue;
 		}
-	} catch (Exception& e) {
-		/* if the problem is in our code, just display warning.
-		 * returned chunk will be legal, but it will have zeroed
-		 * or partial data, which is better than just dying */
-		fprintf(stderr, "warning: %s\n", e.what());
-	} catch (...) {
-		chunks_.erase(chunk);
-		throw;
+
+		/* pairs with barrier in AcquireChunk: either we see the
+		 * reader, or it sees the chunk is being evicted */
+		chunk->state = Chunk::EVICTING;
+		__sync_synchronize();
+		if (chunk->readers != 0) {
+			chunk->state = Chunk::READY;
+			++clock_hand_;
+			continue;
+		}
+
+		if (chunk->file) {
+			mapped_bytes_ -= chunk->file->GetSize();
+			delete chunk->file;
+			chunk->file = NULL;
+		}
+		chunk->data = NULL;
+		chunk->state = Chunk::EMPTY;
+
+		resident_[clock_hand_] = resident_.back();
+		resident_.pop_back();
 	}
+}
+
+void SRTMDatasource::SetCacheSize(size_t cache_size) {
+	Guard guard(mutex_);
 
-	return chunk->second;
+	cache_size_ = cache_size;
+	TrimCache(NULL);
 }
 
-osmint_t SRTMDatasource::GetPointHeight(int x, int y) const {
-	int xchunk = x / DATA_WIDTH;
-	int ychunk = y / DATA_HEIGHT;
+size_t SRTMDatasource::GetCacheHits() const {
+	Guard guard(mutex_);
 
-	int pos = x - xchunk * DATA_WIDTH;
-	int line = y - ychunk * DATA_HEIGHT;
+	size_t hits = 0;
+	for (int i = 0; i < CHUNKS_WIDTH * CHUNKS_HEIGHT; ++i)
+		if (chunks_[i])
+			hits += chunks_[i]->hits;
 
-	Chunk& chunk = RequireChunk(xchunk, ychunk);
+	return hits;
+}
 
-	return chunk.data[(DATA_HEIGHT - 1 - line) * DATA_WIDTH + pos] * GEOM_UNITSINMETER;
+size_t SRTMDatasource::GetCacheMisses() const {
+	Guard guard(mutex_);
+	return misses_;
 }
 
-void SRTMDatasource::GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const {
+size_t SRTMDatasource::GetMappedBytes() const {
 	Guard guard(mutex_);
+	return mapped_bytes_;
+}
 
+void SRTMDatasource::GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const {
 	BBox<int> srtm_bbox; /* bbox in srtm point numbers, zero-based at bottom left corner */
 	BBox<int> srtm_chunks; /* bbox in srtm chunk numbers, zero-based at bottom left corner */
 
@@ -192,57 +307,58 @@ void SRTMDatasource::GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap&
 
 			chunk_bbox -= Vector2<int>(xchunk * DATA_WIDTH, ychunk * DATA_HEIGHT);
 
-			Chunk& chunk = RequireChunk(xchunk, ychunk);
+			const Chunk& chunk = AcquireChunk(xchunk, ychunk);
 			for (int line = chunk_bbox.bottom; line <= chunk_bbox.top; ++line) {
-				for (int pos = chunk_bbox.left; pos <= chunk_bbox.right; ++pos) {
-					osmint_t current = chunk.data[(DATA_HEIGHT - 1 - line) * DATA_WIDTH + pos] * GEOM_UNITSINMETER;
-					out.points[(ychunk * DATA_HEIGHT - srtm_bbox.bottom + line) * width + (xchunk * DATA_WIDTH - srtm_bbox.left + pos)] = current;
-				}
+				osmint_t* row = &out.points[(ychunk * DATA_HEIGHT - srtm_bbox.bottom + line) * width + (xchunk * DATA_WIDTH - srtm_bbox.left)];
+				for (int pos = chunk_bbox.left; pos <= chunk_bbox.right; ++pos)
+					row[pos] = chunk.GetSample(pos, line) * GEOM_UNITSINMETER;
 			}
+			ReleaseChunk(chunk);
 		}
 	}
 }
 
 osmint_t SRTMDatasource::GetHeight(const Vector2i& where) const {
-	Guard guard(mutex_);
-
-	BBox<int> srtm_bbox; /* bbox in srtm point numbers, zero-based at bottom left corner */
-	BBox<int> srtm_chunks; /* bbox in srtm chunk numbers, zero-based at bottom left corner */
-	BBoxi real_bbox;
-
-	srtm_bbox.left = (int)floor(((double)where.x / (double)GEOM_UNITSINDEGREE + 180.0) * (double)DATA_WIDTH);
-	srtm_bbox.bottom = (int)floor(((double)where.y / (double)GEOM_UNITSINDEGREE + 90.0) * (double)DATA_HEIGHT);
-	srtm_bbox.right = srtm_bbox.left + 1;
-	srtm_bbox.top = srtm_bbox.bottom + 1;
+	osmint_t height;
+	GetHeights(&where, &height, 1);
+	return height;
+}
 
-	real_bbox.left = (osmint_t)round(((double)srtm_bbox.left / (double)DATA_WIDTH - 180.0) * (double)GEOM_UNITSINDEGREE);
-	real_bbox.bottom = (osmint_t)round(((double)srtm_bbox.bottom / (double)DATA_HEIGHT - 90.0) * (double)GEOM_UNITSINDEGREE);
-	real_bbox.right = (osmint_t)round(((double)srtm_bbox.right / (double)DATA_WIDTH - 180.0) * (double)GEOM_UNITSINDEGREE);
-	real_bbox.top = (osmint_t)round(((double)srtm_bbox.top / (double)DATA_HEIGHT - 90.0) * (double)GEOM_UNITSINDEGREE);
+void SRTMDatasource::GetHeights(const Vector2i* in, osmint_t* out, size_t n) const {
+	const Chunk* chunk = NULL;
+	int xchunk = 0;
+	int ychunk = 0;
 
-	double kx = (double)(where.x - real_bbox.left)/(double)(real_bbox.right - real_bbox.left);
-	double ky = (double)(where.y - real_bbox.bottom)/(double)(real_bbox.top - real_bbox.bottom);
+	try {
+		for (size_t i = 0; i < n; ++i) {
+			/* position in samples, in fixed point */
+			osmlong_t x = ((osmlong_t)in[i].x - GEOM_MINLON) * DATA_WIDTH;
+			osmlong_t y = ((osmlong_t)in[i].y - GEOM_MINLAT) * DATA_HEIGHT;
+
+			int xsample = (int)(x / SUBCELL);
+			int ysample = (int)(y / SUBCELL);
+
+			/* nearby points are mostly in the same chunk, which
+			 * is then acquired once for all of them */
+			if (chunk == NULL || xsample / DATA_WIDTH != xchunk || ysample / DATA_HEIGHT != ychunk) {
+				if (chunk != NULL) {
+					ReleaseChunk(*chunk);
+					chunk = NULL;
+				}
 
-	/*
-	 * here we take into account that our heightmap is split
-	 * into triangles like this:
-	 * +--+
-	 * | /|
-	 * |/ |
-	 * +--+
-	 * but "true" height would be 4-point interpolation
-	 */
+				xchunk = xsample / DATA_WIDTH;
+				ychunk = ysample / DATA_HEIGHT;
+				chunk = &AcquireChunk(xchunk, ychunk);
+			}
 
-	double height;
-	if (kx < ky) {
-		height = (double)GetPointHeight(srtm_bbox.left, srtm_bbox.bottom) * (1 - ky) +
-		         (double)GetPointHeight(srtm_bbox.right, srtm_bbox.top) * (kx) +
-		         (double)GetPointHeight(srtm_bbox.left, srtm_bbox.top) * (ky - kx);
-	} else {
-		height = (double)GetPointHeight(srtm_bbox.left, srtm_bbox.bottom) * (1 - kx) +
-		         (double)GetPointHeight(srtm_bbox.right, srtm_bbox.top) * (ky) +
-		         (double)GetPointHeight(srtm_bbox.right, srtm_bbox.bottom) * (kx - ky);
+			out[i] = chunk->Interpolate(xsample - xchunk * DATA_WIDTH, ysample - ychunk * DATA_HEIGHT, (int)(x - (osmlong_t)xsample * SUBCELL), (int)(y - (osmlong_t)ysample * SUBCELL));
+		}
+	} catch (...) {
+		if (chunk != NULL)
+			ReleaseChunk(*chunk);
+		throw;
 	}
 
-	return (osmint_t)round(height);
+	if (chunk != NULL)
+		ReleaseChunk(*chunk);
 }
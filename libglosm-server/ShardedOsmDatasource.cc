@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/ShardedOsmDatasource.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/Guard.hh>
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <map>
+
+namespace {
+	/* way accessors, so pointers and views may be handled alike */
+	inline const OsmDatasource::Way& AsWay(const OsmDatasource::Way* way) {
+		return *way;
+	}
+
+	inline const OsmDatasource::WayView& AsWay(const OsmDatasource::WayView& way) {
+		return way;
+	}
+
+	/* mapped shards don't keep node ids, so ways are told
+	 * apart by coordinates then */
+	template <class W>
+	uint64_t HashNodes(const W& way) {
+		uint64_t hash = way.Nodes.size();
+		for (size_t i = 0; i < way.Nodes.size(); ++i)
+			hash = (hash ^ (uint64_t)way.Nodes[i]) * 0x100000001B3ULL;
+		if (way.Nodes.empty()) {
+			hash = way.Coords.size();
+			for (size_t i = 0; i < way.Coords.size(); ++i) {
+				hash = (hash ^ (uint32_t)way.Coords[i].x) * 0x100000001B3ULL;
+				hash = (hash ^ (uint32_t)way.Coords[i].y) * 0x100000001B3ULL;
+			}
+		}
+		return hash;
+	}
+
+	/* ways from different shards are considered the same if they
+	 * refer to the same nodes (or have the same coordinates, if
+	 * there are no nodes) and have the same tags; there are no
+	 * way ids to compare, and synthetic ways have different ids in
+	 * different shards anyway */
+	template <class W>
+	bool SameWay(const W& a, const W& b) {
+		if (a.Inner != b.Inner || a.Nodes.size() != b.Nodes.size() || !std::equal(a.Nodes.begin(), a.Nodes.end(), b.Nodes.begin()))
+			return false;
+
+		if (a.Nodes.empty() && (a.BBox.left != b.BBox.left || a.BBox.bottom != b.BBox.bottom || a.BBox.right != b.BBox.right || a.BBox.top != b.BBox.top ||
+				a.Coords.size() != b.Coords.size() || !std::equal(a.Coords.begin(), a.Coords.end(), b.Coords.begin())))
+			return false;
+
+		return a.Tags.size() == b.Tags.size() && std::equal(a.Tags.begin(), a.Tags.end(), b.Tags.begin());
+	}
+}
+
+struct ShardedOsmDatasource::LoadTask {
+	std::vector<Shard*>* shards;
+	size_t* next;
+	pthread_mutex_t* mutex;
+
+	/* threads to parse each shard with */
+	int nthreads;
+	bool inline_nodes;
+
+	std::string error;
+};
+
+ShardedOsmDatasource::ShardedOsmDatasource() : bbox_(BBoxi::Empty()) {
+}
+
+ShardedOsmDatasource::~ShardedOsmDatasource() {
+	for (ShardsVector::iterator shard = shards_.begin(); shard != shards_.end(); ++shard)
+		delete shard->datasource;
+}
+
+void ShardedOsmDatasource::AddShard(OsmDatasource* datasource) {
+	try {
+		shards_.push_back(Shard(datasource));
+	} catch (...) {
+		delete datasource;
+		throw;
+	}
+
+	bbox_.Include(shards_.back().bbox);
+}
+
+void ShardedOsmDatasource::AddShard(PreloadedXmlDatasource* datasource, const char* filename) {
+	try {
+		shards_.push_back(Shard(datasource));
+	} catch (...) {
+		delete datasource;
+		throw;
+	}
+
+	/* shard is owned from now on, and its bbox is not known
+	 * until it's loaded */
+	shards_.back().loadable = datasource;
+	shards_.back().filename = filename;
+}
+
+void* ShardedOsmDatasource::LoadThread(void* arg) {
+	LoadTask* task = static_cast<LoadTask*>(arg);
+
+	for (;;) {
+		Shard* shard;
+		{
+			Guard guard(*task->mutex);
+			if (*task->next == task->shards->size())
+				return NULL;
+			shard = (*task->shards)[(*task->next)++];
+		}
+
+		try {
+			shard->loadable->LoadParallel(shard->filename.c_str(), task->nthreads);
+			if (task->inline_nodes)
+				shard->loadable->InlineNodes();
+		} catch (std::exception& e) {
+			task->error = shard->filename + ": " + e.what();
+			return NULL;
+		} catch (...) {
+			task->error = shard->filename + ": unknown error";
+			return NULL;
+		}
+	}
+}
+
+void ShardedOsmDatasource::Load(int nthreads, bool inline_nodes) {
+	std::vector<Shard*> pending;
+	for (ShardsVector::iterator shard = shards_.begin(); shard != shards_.end(); ++shard)
+		if (shard->loadable)
+			pending.push_back(&*shard);
+
+	if (pending.empty())
+		return;
+
+	/* shards are taken by threads one by one, so bigger
+	 * shards don't hold smaller ones */
+	size_t next = 0;
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, NULL);
+
+	std::vector<LoadTask> tasks(std::max(1, std::min(nthreads, (int)pending.size())));
+	for (std::vector<LoadTask>::iterator task = tasks.begin(); task != tasks.end(); ++task) {
+		task->shards = &pending;
+		task->next = &next;
+		task->mutex = &mutex;
+		task->nthreads = std::max(1, nthreads / (int)tasks.size());
+		task->inline_nodes = inline_nodes;
+	}
+
+	/* first task is run by calling thread, also tasks for
+	 * which thread could not be created */
+	std::vector<pthread_t> threads(tasks.size());
+	std::vector<bool> started(tasks.size());
+	for (size_t i = 1; i < tasks.size(); ++i)
+		started[i] = pthread_create(&threads[i], NULL, LoadThread, &tasks[i]) == 0;
+
+	for (size_t i = 0; i < tasks.size(); ++i)
+		if (!started[i])
+			LoadThread(&tasks[i]);
+
+	for (size_t i = 1; i < tasks.size(); ++i)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&mutex);
+
+	for (std::vector<LoadTask>::const_iterator task = tasks.begin(); task != tasks.end(); ++task)
+		if (!task->error.empty())
+			throw Exception() << task->error;
+
+	for (std::vector<Shard*>::iterator shard = pending.begin(); shard != pending.end(); ++shard) {
+		(*shard)->bbox = (*shard)->datasource->GetBBox();
+		(*shard)->loadable = NULL;
+		bbox_.Include((*shard)->bbox);
+	}
+}
+
+template <class W>
+void ShardedOsmDatasource::QueryShards(std::vector<W>& out, const BBoxi& bbox) const {
+	std::vector<const Shard*> queried;
+	for (ShardsVector::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard)
+		if (shard->bbox.Intersects(bbox))
+			queried.push_back(&*shard);
+
+	if (queried.size() == 1) {
+		queried.front()->datasource->GetWays(out, bbox);
+		return;
+	}
+
+	/* ways which may also be present in other queried shards,
+	 * keyed by hash of their nodes; values are indexes in out */
+	typedef std::multimap<uint64_t, size_t> BorderWaysMap;
+	BorderWaysMap border;
+
+	for (size_t s = 0; s < queried.size(); ++s) {
+		size_t begin = out.size();
+		queried[s]->datasource->GetWays(out, bbox);
+
+		/* compact ways in place, dropping duplicates */
+		size_t end = begin;
+		for (size_t i = begin; i < out.size(); ++i) {
+			const BBoxi& waybbox = AsWay(out[i]).BBox;
+
+			bool shared = false;
+			for (size_t other = 0; other < queried.size() && !shared; ++other)
+				shared = other != s && queried[other]->bbox.Intersects(waybbox);
+
+			if (shared) {
+				uint64_t hash = HashNodes(AsWay(out[i]));
+
+				/* only compare to ways of previous shards; same
+				 * shard may legitimately have ways looking the same */
+				bool duplicate = false;
+				std::pair<BorderWaysMap::const_iterator, BorderWaysMap::const_iterator> range = border.equal_range(hash);
+				for (BorderWaysMap::const_iterator other = range.first; other != range.second && !duplicate; ++other)
+					duplicate = other->second < begin && SameWay(AsWay(out[other->second]), AsWay(out[i]));
+
+				if (duplicate)
+					continue;
+
+				border.insert(std::make_pair(hash, end));
+			}
+
+			if (end != i)
+				out[end] = out[i];
+			++end;
+		}
+		out.resize(end);
+	}
+}
+
+OsmDatasource::Node ShardedOsmDatasource::GetNode(osmid_t id) const {
+	Node node;
+	if (!TryGetNode(id, node))
+		throw DataException() << "node not found";
+	return node;
+}
+
+const OsmDatasource::Way& ShardedOsmDatasource::GetWay(osmid_t id) const {
+	for (ShardsVector::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard) {
+		try {
+			return shard->datasource->GetWay(id);
+		} catch (DataException&) {
+			/* try next shard */
+		}
+	}
+	throw DataException() << "way not found";
+}
+
+const OsmDatasource::Relation& ShardedOsmDatasource::GetRelation(osmid_t id) const {
+	for (ShardsVector::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard) {
+		try {
+			return shard->datasource->GetRelation(id);
+		} catch (DataException&) {
+			/* try next shard */
+		}
+	}
+	throw DataException() << "relation not found";
+}
+
+bool ShardedOsmDatasource::TryGetNode(osmid_t id, Node& out) const {
+	for (ShardsVector::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard)
+		if (shard->datasource->TryGetNode(id, out))
+			return true;
+	return false;
+}
+
+bool ShardedOsmDatasource::TryGetWay(osmid_t id, WayView& out) const {
+	for (ShardsVector::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard)
+		if (shard->datasource->TryGetWay(id, out))
+			return true;
+	return false;
+}
+
+bool ShardedOsmDatasource::TryGetNodes(const osmid_t* ids, size_t count, Vector2i* out) const {
+	/* ways usually have all their nodes in the same shard */
+	for (ShardsVector::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard)
+		if (shard->datasource->TryGetNodes(ids, count, out))
+			return true;
+
+	return OsmDatasource::TryGetNodes(ids, count, out);
+}
+
+void ShardedOsmDatasource::GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const {
+	QueryShards(out, bbox);
+}
+
+void ShardedOsmDatasource::GetWays(std::vector<WayView>& out, const BBoxi& bbox) const {
+	QueryShards(out, bbox);
+}
+
+Vector2i ShardedOsmDatasource::GetCenter() const {
+	return bbox_.GetCenter();
+}
+
+BBoxi ShardedOsmDatasource::GetBBox() const {
+	return bbox_;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/TagDictionary.hh>
+#include <glosm/Exception.hh>
+
+#include <cstring>
+#include <cstdlib>
+
+namespace {
+	class ReadLock {
+	protected:
+		pthread_rwlock_t& lock_;
+	public:
+		ReadLock(pthread_rwlock_t& lock) : lock_(lock) { pthread_rwlock_rdlock(&lock_); }
+		~ReadLock() { pthread_rwlock_unlock(&lock_); }
+	};
+
+	class WriteLock {
+	protected:
+		pthread_rwlock_t& lock_;
+	public:
+		WriteLock(pthread_rwlock_t& lock) : lock_(lock) { pthread_rwlock_wrlock(&lock_); }
+		~WriteLock() { pthread_rwlock_unlock(&lock_); }
+	};
+}
+
+const tagid_t TagDictionary::NONE;
+
+TagDictionary::TagDictionary() : hash_(1024, NONE), hashes_(1024, 0), arena_used_(ARENA_PAGE_SIZE), next_id_(1) {
+	memset(chunks_, 0, sizeof(chunks_));
+
+	int errn;
+	if ((errn = pthread_rwlock_init(&lock_, 0)) != 0)
+		throw SystemError(errn) << "pthread_rwlock_init failed";
+
+	/* id 0 is reserved for NONE */
+	chunks_[0] = new const char*[CHUNK_SIZE];
+	chunks_[0][NONE] = "";
+}
+
+TagDictionary::~TagDictionary() {
+	for (int i = 0; i < MAX_CHUNKS && chunks_[i]; ++i)
+		delete[] chunks_[i];
+	for (std::vector<char*>::iterator i = arena_pages_.begin(); i != arena_pages_.end(); ++i)
+		delete[] *i;
+
+	pthread_rwlock_destroy(&lock_);
+}
+
+TagDictionary& TagDictionary::Instance() {
+	static TagDictionary instance;
+	return instance;
+}
+
+uint32_t TagDictionary::Hash(const char* str, size_t len) {
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	for (const char* c = str; c < str + len; ++c)
+		hash = (hash ^ (unsigned char)*c) * 16777619U;
+	return hash;
+}
+
+const char* TagDictionary::Store(const char* str, size_t len) {
+	char* target;
+	if (len + 1 > ARENA_PAGE_SIZE / 4) {
+		/* long strings get own page so arena is not wasted */
+		arena_pages_.push_back(target = new char[len + 1]);
+		if (arena_pages_.size() > 1)
+			std::swap(arena_pages_[arena_pages_.size() - 1], arena_pages_[arena_pages_.size() - 2]);
+	} else {
+		if (arena_used_ + len + 1 > ARENA_PAGE_SIZE) {
+			arena_pages_.push_back(new char[ARENA_PAGE_SIZE]);
+			arena_used_ = 0;
+		}
+		target = arena_pages_.back() + arena_used_;
+		arena_used_ += len + 1;
+	}
+
+	memcpy(target, str, len);
+	target[len] = '\0';
+	return target;
+}
+
+void TagDictionary::Rehash(size_t size) {
+	std::vector<tagid_t> newhash(size, NONE);
+	std::vector<uint32_t> newhashes(size, 0);
+
+	for (size_t i = 0; i < hash_.size(); ++i) {
+		if (hash_[i] == NONE)
+			continue;
+
+		size_t pos = hashes_[i] & (size - 1);
+		while (newhash[pos] != NONE)
+			pos = (pos + 1) & (size - 1);
+
+		newhash[pos] = hash_[i];
+		newhashes[pos] = hashes_[i];
+	}
+
+	hash_.swap(newhash);
+	hashes_.swap(newhashes);
+}
+
+tagid_t TagDictionary::Lookup(const char* str, uint32_t hash) const {
+	for (size_t pos = hash & (hash_.size() - 1); hash_[pos] != NONE; pos = (pos + 1) & (hash_.size() - 1))
+		if (hashes_[pos] == hash && strcmp(GetString(hash_[pos]), str) == 0)
+			return hash_[pos];
+
+	return NONE;
+}
+
+tagid_t TagDictionary::Insert(const char* str, size_t len, uint32_t hash) {
+	if ((next_id_ >> CHUNK_BITS) >= MAX_CHUNKS)
+		throw Exception() << "tag dictionary is full";
+
+	tagid_t id = next_id_++;
+
+	const char**& chunk = chunks_[id >> CHUNK_BITS];
+	if (chunk == NULL)
+		chunk = new const char*[CHUNK_SIZE];
+	chunk[id & (CHUNK_SIZE - 1)] = Store(str, len);
+
+	size_t pos = hash & (hash_.size() - 1);
+	while (hash_[pos] != NONE)
+		pos = (pos + 1) & (hash_.size() - 1);
+
+	hash_[pos] = id;
+	hashes_[pos] = hash;
+
+	/* keep load factor under 1/2 */
+	if (next_id_ * 2 > hash_.size())
+		Rehash(hash_.size() * 2);
+
+	return id;
+}
+
+tagid_t TagDictionary::DoIntern(const char* str, size_t len, uint32_t hash, bool create) {
+	/* most strings are already known, so try shared lock first */
+	{
+		ReadLock lock(lock_);
+		tagid_t id = Lookup(str, hash);
+		if (id != NONE || !create)
+			return id;
+	}
+
+	WriteLock lock(lock_);
+
+	/* string may have been added while we were not holding the lock */
+	tagid_t id = Lookup(str, hash);
+	if (id != NONE)
+		return id;
+
+	return Insert(str, len, hash);
+}
+
+tagid_t TagDictionary::Intern(const char* str) {
+	size_t len = strlen(str);
+	return Instance().DoIntern(str, len, Hash(str, len), true);
+}
+
+tagid_t TagDictionary::Find(const char* str) {
+	size_t len = strlen(str);
+	return Instance().DoIntern(str, len, Hash(str, len), false);
+}
+
+TagDictionary::Cache::Cache() : entries_(SIZE) {
+}
+
+tagid_t TagDictionary::Cache::Intern(const char* str) {
+	size_t len = strlen(str);
+	uint32_t hash = Hash(str, len);
+
+	/* ids in cache were obtained under the lock, and strings
+	 * they refer to never change, so these may be read freely */
+	Entry& entry = entries_[hash & (SIZE - 1)];
+	if (entry.id != NONE && entry.hash == hash && strcmp(GetString(entry.id), str) == 0)
+		return entry.id;
+
+	entry.hash = hash;
+	entry.id = Instance().DoIntern(str, len, hash, true);
+	return entry.id;
+}
+
+size_t TagDictionary::GetSize() {
+	TagDictionary& self = Instance();
+	ReadLock lock(self.lock_);
+	return self.next_id_ - 1;
+}
+
+size_t TagDictionary::GetFootprint() {
+	TagDictionary& self = Instance();
+	ReadLock lock(self.lock_);
+
+	size_t chunks = (self.next_id_ >> CHUNK_BITS) + 1;
+
+	return sizeof(self) + chunks * CHUNK_SIZE * sizeof(const char*) +
+		self.hash_.size() * (sizeof(tagid_t) + sizeof(uint32_t)) +
+		self.arena_pages_.size() * ARENA_PAGE_SIZE;
+}
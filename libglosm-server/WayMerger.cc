@@ -18,83 +18,113 @@
  * <http://www.gnu.org/licenses/>.
  */
 
-#include <cassert>
-#include <algorithm>
-
-#include <glosm/OsmDatasource.hh>
 #include <glosm/WayMerger.hh>
 
-WayMerger::WayMerger() {
+#include <stdint.h>
+
+namespace {
+	inline size_t HashNode(osmid_t node, size_t mask) {
+		/* node ids are often sequential, so spread them */
+		return (size_t)(((uint64_t)node * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	}
+}
+
+WayMerger::WayMerger() : first_unused_(0) {
 }
 
-void WayMerger::AddWay(const OsmDatasource::Way::NodesList& nodes) {
-	way_by_node.insert(std::make_pair(nodes.front(), &nodes));
-	way_by_node_rev.insert(std::make_pair(nodes.back(), &nodes));
+void WayMerger::AddWay(const NodesView& nodes) {
+	if (nodes.empty())
+		return;
+
+	chains_.push_back(nodes);
+	used_.push_back(false);
+
+	/* invalidate index */
+	buckets_.clear();
+}
+
+void WayMerger::BuildIndex() {
+	size_t size = 1;
+	while (size < chains_.size() * 4)
+		size *= 2;
+
+	buckets_.assign(size, -1);
+	tips_.resize(chains_.size() * 2);
+
+	/* add in reverse, so that lists are in order of addition */
+	for (size_t i = tips_.size(); i > 0; --i) {
+		int tip = (int)i - 1;
+		const NodesView& nodes = chains_[tip / 2];
+
+		tips_[tip].node = (tip % 2 == 0) ? nodes.front() : nodes.back();
+
+		size_t bucket = HashNode(tips_[tip].node, size - 1);
+		tips_[tip].next = buckets_[bucket];
+		buckets_[bucket] = tip;
+	}
+}
+
+int WayMerger::FindTip(osmid_t node) {
+	int* link = &buckets_[HashNode(node, buckets_.size() - 1)];
+	while (*link >= 0) {
+		Tip& tip = tips_[*link];
+
+		/* unlink tips of used chains as we go, so each is
+		 * skipped only once */
+		if (used_[*link / 2]) {
+			*link = tip.next;
+			continue;
+		}
+
+		if (tip.node == node)
+			return *link;
+
+		link = &tip.next;
+	}
+
+	return -1;
 }
 
-bool WayMerger::GetNextWay(OsmDatasource::Way::NodesList& outnodes) {
-	OsmDatasource::Way::NodesList tempnodes;
+bool WayMerger::GetNextWay(NodesList& outnodes) {
+	if (buckets_.empty() && !chains_.empty())
+		BuildIndex();
 
-	std::back_insert_iterator<OsmDatasource::Way::NodesList> inserter(tempnodes);
+	NodesList tempnodes;
 
-	const OsmDatasource::Way::NodesList* next_chain;
-	while (!way_by_node.empty()) {
+	for (;;) {
 		if (tempnodes.empty()) {
 			/* no current nodes, add just any chain */
-			next_chain = PickChain();
-			assert(next_chain);
-			std::copy(next_chain->begin(), next_chain->end(), inserter);
+			while (first_unused_ < chains_.size() && used_[first_unused_])
+				++first_unused_;
+
+			if (first_unused_ == chains_.size())
+				return false;
+
+			used_[first_unused_] = true;
+			tempnodes.assign(chains_[first_unused_].begin(), chains_[first_unused_].end());
 		} else {
-			/* find next chain, first try front map, then reverse */
-			if ((next_chain = PickChain(tempnodes.back())) != NULL) {
-				std::copy(++next_chain->begin(), next_chain->end(), inserter);
-			} else if ((next_chain = PickChain(tempnodes.back(), true)) != NULL) {
-				std::copy(++next_chain->rbegin(), next_chain->rend(), inserter);
-			} else {
+			/* find next chain which starts or ends where we are */
+			int tip = FindTip(tempnodes.back());
+			if (tip < 0) {
 				/* no suitable next chain, drop partial way */
 				/* XXX: (or, we can return it if we need unclosed ways too */
 				tempnodes.clear();
+				continue;
 			}
+
+			const NodesView& chain = chains_[tip / 2];
+			used_[tip / 2] = true;
+
+			if (tip % 2 == 0)
+				tempnodes.insert(tempnodes.end(), chain.begin() + 1, chain.end());
+			else
+				tempnodes.insert(tempnodes.end(), chain.rbegin() + 1, chain.rend());
 		}
 
 		/* check if we have complete cycle */
-		if (!tempnodes.empty() && tempnodes.front() == tempnodes.back()) {
+		if (tempnodes.size() > 1 && tempnodes.front() == tempnodes.back()) {
 			outnodes.swap(tempnodes);
 			return true;
 		}
 	}
-
-	return false;
-}
-
-const OsmDatasource::Way::NodesList* WayMerger::PickChain(osmid_t id, bool reverse) {
-	WayByTipMap& primary = reverse ? way_by_node_rev : way_by_node;
-	WayByTipMap& secondary = reverse ? way_by_node : way_by_node_rev;
-
-	/* find chain starting with given id in primary map */
-	WayByTipMap::iterator primary_iterator = ((id == 0) ? primary.begin() : primary.find(id));
-	if (primary_iterator == primary.end())
-		return NULL;
-
-	/* save chain poiter which we will return */
-	const OsmDatasource::Way::NodesList* ret = primary_iterator->second;
-
-	/* find the same chain in the other map */
-	std::pair<WayByTipMap::iterator, WayByTipMap::iterator> range =
-		secondary.equal_range(reverse ? ret->front() : ret->back());
-
-	WayByTipMap::iterator secondary_iterator;
-	for (secondary_iterator = range.first; secondary_iterator != range.second; ++secondary_iterator) {
-		if (secondary_iterator->second == ret) {
-			break;
-		}
-	}
-
-	assert(secondary_iterator != range.second);
-
-	/* delete chain references from both maps */
-	secondary.erase(secondary_iterator);
-	primary.erase(primary_iterator);
-
-	return ret;
 }
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/WayStore.hh>
+
+#include <algorithm>
+
+WayStore::WayStore() {
+	node_offsets_.push_back(0);
+	tag_offsets_.push_back(0);
+}
+
+size_t WayStore::Append(osmid_t id, const OsmDatasource::Way& way) {
+	return Append(id, OsmDatasource::WayView(way));
+}
+
+size_t WayStore::Append(osmid_t id, const OsmDatasource::WayView& way) {
+	uint8_t flags = 0;
+	if (way.Closed)
+		flags |= CLOSED;
+	if (way.Clockwise)
+		flags |= CLOCKWISE;
+	if (way.Inner)
+		flags |= INNER;
+
+	ids_.push_back(id);
+	bboxes_.push_back(way.BBox);
+
+	if (!way.Coords.empty() || !coords_.empty()) {
+		/* coordinates are kept parallel to nodes, so ways added
+		 * without them get zero placeholders */
+		coords_.resize(nodes_.size());
+		if (way.Coords.size() == way.Nodes.size()) {
+			coords_.insert(coords_.end(), way.Coords.begin(), way.Coords.end());
+			flags |= COORDS;
+		} else {
+			coords_.resize(nodes_.size() + way.Nodes.size());
+		}
+	}
+
+	flags_.push_back(flags);
+
+	nodes_.insert(nodes_.end(), way.Nodes.begin(), way.Nodes.end());
+	node_offsets_.push_back(nodes_.size());
+
+	tags_.insert(tags_.end(), way.Tags.begin(), way.Tags.end());
+	tag_offsets_.push_back(tags_.size());
+
+	return ids_.size() - 1;
+}
+
+void WayStore::SetCoords(size_t index, const Vector2i* coords) {
+	if (coords_.empty())
+		coords_.resize(nodes_.size());
+
+	std::copy(coords, coords + node_offsets_[index + 1] - node_offsets_[index], coords_.begin() + node_offsets_[index]);
+	flags_[index] |= COORDS;
+}
+
+void WayStore::Reserve(size_t ways, size_t nodes, size_t tags) {
+	ids_.reserve(ways);
+	bboxes_.reserve(ways);
+	flags_.reserve(ways);
+	node_offsets_.reserve(ways + 1);
+	tag_offsets_.reserve(ways + 1);
+	nodes_.reserve(nodes);
+	tags_.reserve(tags);
+}
+
+void WayStore::Clear() {
+	std::vector<osmid_t>().swap(ids_);
+	std::vector<BBoxi>().swap(bboxes_);
+	std::vector<uint8_t>().swap(flags_);
+	std::vector<size_t>(1, 0).swap(node_offsets_);
+	std::vector<osmid_t>().swap(nodes_);
+	std::vector<Vector2i>().swap(coords_);
+	std::vector<size_t>(1, 0).swap(tag_offsets_);
+	std::vector<Tag>().swap(tags_);
+}
+
+void WayStore::Swap(WayStore& other) {
+	ids_.swap(other.ids_);
+	bboxes_.swap(other.bboxes_);
+	flags_.swap(other.flags_);
+	node_offsets_.swap(other.node_offsets_);
+	nodes_.swap(other.nodes_);
+	coords_.swap(other.coords_);
+	tag_offsets_.swap(other.tag_offsets_);
+	tags_.swap(other.tags_);
+}
+
+OsmDatasource::WayView WayStore::GetView(size_t index) const {
+	OsmDatasource::WayView view;
+
+	uint8_t flags = flags_[index];
+	view.Closed = flags & CLOSED;
+	view.Clockwise = flags & CLOCKWISE;
+	view.Inner = flags & INNER;
+	view.BBox = bboxes_[index];
+
+	size_t first = node_offsets_[index];
+	size_t last = node_offsets_[index + 1];
+	if (first != last) {
+		view.Nodes = OsmDatasource::ArrayView<osmid_t>(&nodes_[first], &nodes_[0] + last);
+		if (flags & COORDS)
+			view.Coords = OsmDatasource::ArrayView<Vector2i>(&coords_[first], &coords_[0] + last);
+	}
+
+	first = tag_offsets_[index];
+	last = tag_offsets_[index + 1];
+	if (first != last)
+		view.Tags = OsmDatasource::TagsView(&tags_[first], &tags_[0] + last);
+
+	return view;
+}
+
+size_t WayStore::GetFootprint() const {
+	return ids_.capacity() * sizeof(osmid_t) + bboxes_.capacity() * sizeof(BBoxi) + flags_.capacity() +
+		node_offsets_.capacity() * sizeof(size_t) + nodes_.capacity() * sizeof(osmid_t) +
+		coords_.capacity() * sizeof(Vector2i) + tag_offsets_.capacity() * sizeof(size_t) + tags_.capacity() * sizeof(Tag);
+}
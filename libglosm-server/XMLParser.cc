@@ -19,14 +19,510 @@
  */
 
 #include <glosm/XMLParser.hh>
+#include <glosm/MappedFile.hh>
+#include <glosm/Timer.hh>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <expat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
+#include <vector>
 
-XMLParser::XMLParser(int flags) : flags_(flags) {
+/* amount of data passed to expat at once */
+static const size_t MAPPED_CHUNK_SIZE = 16 * 1048576;
+static const size_t STREAM_CHUNK_SIZE = 65536;
+
+/* amount of data appended at once to incomplete token */
+static const size_t PENDING_STEP = 4096;
+
+/* minimal interval between progress reports, in seconds */
+static const float PROGRESS_INTERVAL = 1.0f;
+
+/**
+ * Tokenizer for trusted XML
+ *
+ * Handles the subset of XML which is generated by OSM and GPX
+ * tools: elements, attributes, character data with predefined
+ * and numeric entities, comments, CDATA sections, processing
+ * instructions and simple doctype declarations. Markup is located
+ * with memchr(), which is vectorized in all sane libcs, and only
+ * names and attribute values are copied (to be null-terminated
+ * and have entities decoded).
+ *
+ * Data may be fed in arbitrary chunks; markup split between
+ * chunks is carried over in a small buffer.
+ */
+class XMLParser::TrustedTokenizer {
+protected:
+	XMLParser& parser_;
+
+	/* incomplete token from previous chunk */
+	std::vector<char> pending_;
+
+	/* decoded names and values of current element */
+	std::vector<char> scratch_;
+	std::vector<size_t> offsets_;
+	std::vector<const char*> atts_;
+
+	/* for error reporting */
+	size_t offset_;
+
+	int depth_;
+	bool seen_root_;
+
+protected:
+	static bool IsSpace(char c) {
+		return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+	}
+
+	static const char* SkipSpace(const char* cur, const char* end) {
+		while (cur < end && IsSpace(*cur))
+			++cur;
+		return cur;
+	}
+
+	/* checks whether incomplete token is a beginning of comment or
+	 * processing instruction */
+	static bool IsPartialComment(const char* cur, const char* end) {
+		if (end - cur < 2 || cur[0] != '<')
+			return end - cur == 1 && cur[0] == '<';
+		if (cur[1] == '?')
+			return true;
+		return memcmp(cur + 1, "!--", std::min(end - cur - 1, (ptrdiff_t)3)) == 0;
+	}
+
+	/* finds two-character terminator like "?>" or "]]>", returns
+	 * pointer to its beginning or NULL */
+	static const char* Find(const char* cur, const char* end, const char* what, size_t len) {
+		while (end - cur >= (ptrdiff_t)len) {
+			const char* first = static_cast<const char*>(memchr(cur, what[0], end - cur - len + 1));
+			if (first == NULL)
+				return NULL;
+			if (memcmp(first, what, len) == 0)
+				return first;
+			cur = first + 1;
+		}
+		return NULL;
+	}
+
+	static void AppendUtf8(std::vector<char>& out, unsigned long c) {
+		if (c < 0x80) {
+			out.push_back(c);
+		} else if (c < 0x800) {
+			out.push_back(0xc0 | (c >> 6));
+			out.push_back(0x80 | (c & 0x3f));
+		} else if (c < 0x10000) {
+			out.push_back(0xe0 | (c >> 12));
+			out.push_back(0x80 | ((c >> 6) & 0x3f));
+			out.push_back(0x80 | (c & 0x3f));
+		} else if (c < 0x110000) {
+			out.push_back(0xf0 | (c >> 18));
+			out.push_back(0x80 | ((c >> 12) & 0x3f));
+			out.push_back(0x80 | ((c >> 6) & 0x3f));
+			out.push_back(0x80 | (c & 0x3f));
+		} else {
+			throw ParsingException() << "reference to invalid character number";
+		}
+	}
+
+	/* decodes entity starting at cur (which points to '&') */
+	static const char* DecodeEntity(const char* cur, const char* end, std::vector<char>& out) {
+		const char* semicolon = static_cast<const char*>(memchr(cur, ';', std::min<ptrdiff_t>(end - cur, 12)));
+		if (semicolon == NULL)
+			throw ParsingException() << "not well-formed (invalid token)";
+
+		const char* name = cur + 1;
+		size_t len = semicolon - name;
+
+		if (len >= 2 && name[0] == '#') {
+			unsigned long c = 0;
+			if (name[1] == 'x') {
+				if (len < 3)
+					throw ParsingException() << "not well-formed (invalid token)";
+				for (const char* i = name + 2; i < semicolon; ++i) {
+					if (*i >= '0' && *i <= '9')
+						c = c * 16 + *i - '0';
+					else if (*i >= 'a' && *i <= 'f')
+						c = c * 16 + *i - 'a' + 10;
+					else if (*i >= 'A' && *i <= 'F')
+						c = c * 16 + *i - 'A' + 10;
+					else
+						throw ParsingException() << "not well-formed (invalid token)";
+				}
+			} else {
+				for (const char* i = name + 1; i < semicolon; ++i) {
+					if (*i >= '0' && *i <= '9')
+						c = c * 10 + *i - '0';
+					else
+						throw ParsingException() << "not well-formed (invalid token)";
+				}
+			}
+			if (c == 0)
+				throw ParsingException() << "reference to invalid character number";
+			AppendUtf8(out, c);
+		} else if (len == 2 && name[0] == 'l' && name[1] == 't') {
+			out.push_back('<');
+		} else if (len == 2 && name[0] == 'g' && name[1] == 't') {
+			out.push_back('>');
+		} else if (len == 3 && memcmp(name, "amp", 3) == 0) {
+			out.push_back('&');
+		} else if (len == 4 && memcmp(name, "quot", 4) == 0) {
+			out.push_back('"');
+		} else if (len == 4 && memcmp(name, "apos", 4) == 0) {
+			out.push_back('\'');
+		} else {
+			throw ParsingException() << "undefined entity";
+		}
+
+		return semicolon + 1;
+	}
+
+	/* appends attribute value with entities decoded and whitespace
+	 * normalized the way XML requires */
+	static void DecodeValue(const char* cur, const char* end, std::vector<char>& out) {
+		while (cur < end) {
+			const char* amp = static_cast<const char*>(memchr(cur, '&', end - cur));
+			const char* stop = amp ? amp : end;
+
+			for (; cur < stop; ++cur) {
+				if (*cur == '\r') {
+					out.push_back(' ');
+					if (cur + 1 < stop && cur[1] == '\n')
+						++cur;
+				} else if (*cur == '\n' || *cur == '\t') {
+					out.push_back(' ');
+				} else if (*cur == '<') {
+					throw ParsingException() << "not well-formed (invalid token)";
+				} else {
+					out.push_back(*cur);
+				}
+			}
+
+			if (amp)
+				cur = DecodeEntity(amp, end, out);
+		}
+	}
+
+	void Text(const char* begin, const char* end) {
+		if (!(parser_.flags_ & HANDLE_CHARDATA) || begin == end)
+			return;
+
+		if (depth_ == 0) {
+			/* only whitespace is allowed outside of root element */
+			for (const char* cur = begin; cur < end; ++cur)
+				if (!IsSpace(*cur))
+					throw ParsingException() << (seen_root_ ? "junk after document element" : "syntax error");
+			return;
+		}
+
+		/* fast path: nothing to decode */
+		if (memchr(begin, '&', end - begin) == NULL && memchr(begin, '\r', end - begin) == NULL) {
+			parser_.CharacterData(begin, end - begin);
+			return;
+		}
+
+		scratch_.clear();
+		while (begin < end) {
+			if (*begin == '&') {
+				begin = DecodeEntity(begin, end, scratch_);
+			} else if (*begin == '\r') {
+				scratch_.push_back('\n');
+				if (++begin < end && *begin == '\n')
+					++begin;
+			} else {
+				scratch_.push_back(*begin++);
+			}
+		}
+
+		if (!scratch_.empty())
+			parser_.CharacterData(&scratch_.front(), scratch_.size());
+	}
+
+	/* processes markup at cur, which points to '<', returns
+	 * pointer past it or NULL if markup is incomplete */
+	const char* Markup(const char* cur, const char* end) {
+		if (end - cur < 2)
+			return NULL;
+
+		if (cur[1] == '/')
+			return EndTag(cur, end);
+
+		if (cur[1] == '?') {
+			const char* close = Find(cur + 2, end, "?>", 2);
+			return close ? close + 2 : NULL;
+		}
+
+		if (cur[1] == '!') {
+			if (end - cur < 9)
+				return NULL;
+
+			if (cur[2] == '-' && cur[3] == '-') {
+				const char* close = Find(cur + 4, end, "-->", 3);
+				return close ? close + 3 : NULL;
+			}
+
+			if (memcmp(cur + 2, "[CDATA[", 7) == 0) {
+				const char* close = Find(cur + 9, end, "]]>", 3);
+				if (close == NULL)
+					return NULL;
+				if (depth_ == 0)
+					throw ParsingException() << "not well-formed (invalid token)";
+				if ((parser_.flags_ & HANDLE_CHARDATA) && close != cur + 9)
+					parser_.CharacterData(cur + 9, close - cur - 9);
+				return close + 3;
+			}
+
+			if (memcmp(cur + 2, "DOCTYPE", 7) == 0) {
+				/* internal subset is skipped as a whole */
+				const char* close = static_cast<const char*>(memchr(cur, '>', end - cur));
+				const char* bracket = static_cast<const char*>(memchr(cur, '[', end - cur));
+				if (bracket && (!close || bracket < close))
+					close = Find(bracket, end, "]>", 2);
+				if (close == NULL)
+					return NULL;
+				return static_cast<const char*>(memchr(close, '>', end - close)) + 1;
+			}
+
+			throw ParsingException() << "not well-formed (invalid token)";
+		}
+
+		return StartTag(cur, end);
+	}
+
+	const char* EndTag(const char* cur, const char* end) {
+		const char* close = static_cast<const char*>(memchr(cur, '>', end - cur));
+		if (close == NULL)
+			return NULL;
+
+		const char* name = cur + 2;
+		const char* nameend = close;
+		while (nameend > name && IsSpace(nameend[-1]))
+			--nameend;
+
+		if (nameend == name)
+			throw ParsingException() << "not well-formed (invalid token)";
+		if (depth_ == 0)
+			throw ParsingException() << "mismatched tag";
+
+		scratch_.assign(name, nameend);
+		scratch_.push_back('\0');
+
+		--depth_;
+		if (parser_.flags_ & HANDLE_ELEMENTS)
+			parser_.EndElement(&scratch_.front());
+
+		return close + 1;
+	}
+
+	const char* StartTag(const char* cur, const char* end) {
+		if (depth_ == 0 && seen_root_)
+			throw ParsingException() << "junk after document element";
+
+		scratch_.clear();
+		offsets_.clear();
+
+		/* element name */
+		const char* name = ++cur;
+		while (cur < end && !IsSpace(*cur) && *cur != '>' && *cur != '/')
+			++cur;
+		if (cur == end)
+			return NULL;
+		if (cur == name)
+			throw ParsingException() << "not well-formed (invalid token)";
+
+		scratch_.insert(scratch_.end(), name, cur);
+		scratch_.push_back('\0');
+
+		/* attributes */
+		bool empty = false;
+		for (;;) {
+			const char* attr = SkipSpace(cur, end);
+			if (attr == end)
+				return NULL;
+
+			if (*attr == '>') {
+				cur = attr + 1;
+				break;
+			}
+
+			if (*attr == '/') {
+				if (attr + 1 == end)
+					return NULL;
+				if (attr[1] != '>')
+					throw ParsingException() << "not well-formed (invalid token)";
+				empty = true;
+				cur = attr + 2;
+				break;
+			}
+
+			if (attr == cur)
+				throw ParsingException() << "not well-formed (invalid token)";
+
+			/* name */
+			const char* eq = attr;
+			while (eq < end && *eq != '=' && !IsSpace(*eq) && *eq != '>' && *eq != '/')
+				++eq;
+			const char* attrend = eq;
+			eq = SkipSpace(eq, end);
+			if (eq == end)
+				return NULL;
+			if (*eq != '=' || attrend == attr)
+				throw ParsingException() << "not well-formed (invalid token)";
+
+			/* value */
+			const char* quote = SkipSpace(eq + 1, end);
+			if (quote == end)
+				return NULL;
+			if (*quote != '"' && *quote != '\'')
+				throw ParsingException() << "not well-formed (invalid token)";
+
+			const char* value = quote + 1;
+			const char* valueend = static_cast<const char*>(memchr(value, *quote, end - value));
+			if (valueend == NULL)
+				return NULL;
+
+			offsets_.push_back(scratch_.size());
+			scratch_.insert(scratch_.end(), attr, attrend);
+			scratch_.push_back('\0');
+
+			offsets_.push_back(scratch_.size());
+			DecodeValue(value, valueend, scratch_);
+			scratch_.push_back('\0');
+
+			cur = valueend + 1;
+		}
+
+		/* pointers are only taken when scratch won't be reallocated */
+		atts_.clear();
+		for (std::vector<size_t>::const_iterator i = offsets_.begin(); i != offsets_.end(); ++i)
+			atts_.push_back(&scratch_[*i]);
+		atts_.push_back(NULL);
+
+		seen_root_ = true;
+		if (parser_.flags_ & HANDLE_ELEMENTS)
+			parser_.StartElement(&scratch_.front(), &atts_.front());
+
+		if (empty) {
+			if (parser_.flags_ & HANDLE_ELEMENTS)
+				parser_.EndElement(&scratch_.front());
+		} else {
+			++depth_;
+		}
+
+		return cur;
+	}
+
+	/* processes all complete tokens, returns pointer to the
+	 * first incomplete one */
+	const char* Tokenize(const char* cur, const char* end, bool final) {
+		while (cur < end) {
+			if (*cur != '<') {
+				const char* lt = static_cast<const char*>(memchr(cur, '<', end - cur));
+				if (lt == NULL) {
+					/* text may end with partial entity */
+					if (!final)
+						return cur;
+					lt = end;
+				}
+				Text(cur, lt);
+				offset_ += lt - cur;
+				cur = lt;
+				continue;
+			}
+
+			const char* next = Markup(cur, end);
+			if (next == NULL)
+				return cur;
+			offset_ += next - cur;
+			cur = next;
+		}
+		return cur;
+	}
+
+public:
+	TrustedTokenizer(XMLParser& parser) : parser_(parser), offset_(0), depth_(0), seen_root_(false) {
+	}
+
+	void Parse(const char* data, size_t size, bool final) {
+		/* complete pending token by appending new data piece by
+		 * piece, so large chunks are not copied as a whole */
+		while (!pending_.empty() && size > 0) {
+			size_t oldsize = pending_.size();
+			size_t add = std::min(size, PENDING_STEP);
+			pending_.insert(pending_.end(), data, data + add);
+
+			size_t consumed = Tokenize(&pending_.front(), &pending_.front() + pending_.size(), final && add == size) - &pending_.front();
+			if (consumed >= oldsize) {
+				data += consumed - oldsize;
+				size -= consumed - oldsize;
+				pending_.clear();
+				break;
+			}
+
+			pending_.erase(pending_.begin(), pending_.begin() + consumed);
+			data += add;
+			size -= add;
+		}
+
+		if (pending_.empty()) {
+			const char* stop = Tokenize(data, data + size, final);
+			pending_.assign(stop, data + size);
+		} else if (final) {
+			/* e.g. trailing whitespace */
+			size_t consumed = Tokenize(&pending_.front(), &pending_.front() + pending_.size(), true) - &pending_.front();
+			pending_.erase(pending_.begin(), pending_.begin() + consumed);
+		}
+
+		if (final) {
+			/* truncated trailing comment does not affect the document
+			 * once root element is closed */
+			if (!pending_.empty() && seen_root_ && depth_ == 0 && IsPartialComment(&pending_.front(), &pending_.front() + pending_.size()))
+				pending_.clear();
+			if (!pending_.empty())
+				throw ParsingException() << "unclosed token";
+			if (!seen_root_)
+				throw ParsingException() << "no element found";
+			if (depth_ != 0)
+				throw ParsingException() << "unclosed token";
+		}
+	}
+
+	size_t GetOffset() const {
+		return offset_;
+	}
+};
+
+namespace {
+	/* sets pointer for the lifetime of the object */
+	template <class T>
+	class ScopedPointer {
+	protected:
+		T*& ptr_;
+
+	public:
+		ScopedPointer(T*& ptr, T* value) : ptr_(ptr) {
+			ptr_ = value;
+		}
+
+		~ScopedPointer() {
+			ptr_ = NULL;
+		}
+	};
+}
+
+XMLParser::XMLParser(int flags) : flags_(flags),
+#if defined(TRUSTED_XML)
+	tokenizer_(TRUSTED_TOKENIZER),
+#else
+	tokenizer_(EXPAT_TOKENIZER),
+#endif
+	trusted_tokenizer_(NULL), loaded_bytes_(0), load_time_(0.0f), compressed_bytes_(0), parse_time_(0.0f), decompress_time_(0.0f),
+	load_listener_(NULL), total_bytes_(0), progress_time_(0.0f), reported_time_(0.0f) {
+	std::fill(phase_times_, phase_times_ + LoadListener::NPHASES, 0.0f);
 }
 
 XMLParser::~XMLParser() {
@@ -53,49 +549,300 @@ void XMLParser::EndElement(const char* /*unused*/) {
 void XMLParser::CharacterData(const char* /*unused*/, int /*unused*/) {
 }
 
+XML_Parser XMLParser::CreateParser() {
+	XML_Parser parser;
+	if ((parser = XML_ParserCreate(NULL)) == NULL)
+		throw Exception() << "cannot create XML parser";
+
+	if (flags_ & HANDLE_ELEMENTS)
+		XML_SetElementHandler(parser, StartElementWrapper, EndElementWrapper);
+	if (flags_ & HANDLE_CHARDATA)
+		XML_SetCharacterDataHandler(parser, CharacterDataWrapper);
+
+	XML_SetUserData(parser, this);
+
+	return parser;
+}
+
+void XMLParser::ParseMemory(XML_Parser parser, const char* data, size_t size, bool final) {
+	/* large buffers are parsed by chunks, so progress may be
+	 * reported. Expat built with XML_CONTEXT_BYTES (which is the
+	 * default) always copies input into its own buffer, even in
+	 * XML_Parse(), so chunks are copied there explicitly; only
+	 * trusted tokenizer parses directly from our buffer */
+	size_t offset = 0;
+	do {
+		size_t len = std::min(MAPPED_CHUNK_SIZE, size - offset);
+		bool last = final && offset + len == size;
+		if (trusted_tokenizer_) {
+			trusted_tokenizer_->Parse(data + offset, len, last);
+		} else {
+			void* buf = NULL;
+			if (len != 0) {
+				if ((buf = XML_GetBuffer(parser, len)) == NULL)
+					throw Exception() << "cannot allocate XML parser buffer";
+				memcpy(buf, data + offset, len);
+			}
+			if ((buf ? XML_ParseBuffer(parser, len, last) : XML_Parse(parser, NULL, 0, last)) == XML_STATUS_ERROR)
+				throw ParsingException() << XML_ErrorString(XML_GetErrorCode(parser));
+		}
+		loaded_bytes_ += len;
+		offset += len;
+
+		ReportParseProgress();
+	} while (offset < size);
+}
+
+void XMLParser::ParseMapped(XML_Parser parser, const char* filename) {
+	MappedFile file(filename);
+	file.Advise(MADV_SEQUENTIAL);
+
+	Decompressor::Format format = Decompressor::DetectFormat(file.GetData(), file.GetSize());
+	if (format != Decompressor::NONE) {
+		ParseCompressed(parser, format, file.GetData(), file.GetSize(), -1);
+	} else {
+		total_bytes_ = file.GetSize();
+		ParseMemory(parser, file.GetData(), file.GetSize(), true);
+	}
+}
+
+void XMLParser::ParseStream(XML_Parser parser, int f) {
+	/* read enough to detect compression */
+	char magic[3];
+	size_t magicsize = 0;
+	ssize_t len;
+	while (magicsize < sizeof(magic) && (len = read(f, magic + magicsize, sizeof(magic) - magicsize)) != 0) {
+		if (len < 0)
+			throw SystemError() << "input read error";
+		magicsize += len;
+	}
+
+	Decompressor::Format format = Decompressor::DetectFormat(magic, magicsize);
+	if (format != Decompressor::NONE) {
+		ParseCompressed(parser, format, magic, magicsize, f);
+		return;
+	}
+
+	ParseMemory(parser, magic, magicsize, false);
+
+	if (trusted_tokenizer_) {
+		std::vector<char> buf(STREAM_CHUNK_SIZE);
+		do {
+			if ((len = read(f, &buf.front(), buf.size())) < 0)
+				throw SystemError() << "input read error";
+			ParseMemory(parser, &buf.front(), len, len == 0);
+		} while (len != 0);
+		return;
+	}
+
+	/* read directly into expat buffer to avoid extra copy */
+	do {
+		void* buf = XML_GetBuffer(parser, STREAM_CHUNK_SIZE);
+		if (buf == NULL)
+			throw Exception() << "cannot allocate XML parser buffer";
+		if ((len = read(f, buf, STREAM_CHUNK_SIZE)) < 0)
+			throw SystemError() << "input read error";
+		if (XML_ParseBuffer(parser, len, len == 0) == XML_STATUS_ERROR)
+			throw ParsingException() << XML_ErrorString(XML_GetErrorCode(parser));
+		loaded_bytes_ += len;
+
+		ReportParseProgress();
+	} while (len != 0);
+}
+
+void XMLParser::ParseCompressed(XML_Parser parser, Decompressor::Format format, const char* prefix, size_t prefixsize, int fd) {
+	Decompressor decompressor(format, prefix, prefixsize, fd);
+
+	/* only time spent in expat is counted, not waiting for data */
+	Timer timer;
+	const char* data;
+	size_t size;
+	while (decompressor.GetData(data, size)) {
+		timer.Count();
+		ParseMemory(parser, data, size, false);
+		parse_time_ += timer.Count();
+	}
+	ParseMemory(parser, NULL, 0, true);
+
+	compressed_bytes_ = decompressor.GetInputBytes();
+	decompress_time_ = decompressor.GetBusyTime();
+}
+
+void XMLParser::ResetLoadStats() {
+	loaded_bytes_ = 0;
+	load_time_ = 0.0f;
+	compressed_bytes_ = 0;
+	parse_time_ = 0.0f;
+	decompress_time_ = 0.0f;
+
+	std::fill(phase_times_, phase_times_ + LoadListener::NPHASES, 0.0f);
+	total_bytes_ = 0;
+	progress_timer_.Count();
+	progress_time_ = 0.0f;
+	reported_time_ = 0.0f;
+}
+
+void XMLParser::GetLoadCounts(LoadListener::Progress& /*unused*/) const {
+}
+
+void XMLParser::ReportParseProgress() {
+	if (load_listener_ == NULL)
+		return;
+
+	progress_time_ += progress_timer_.Count();
+	if (progress_time_ - reported_time_ < PROGRESS_INTERVAL)
+		return;
+	reported_time_ = progress_time_;
+
+	LoadListener::Progress progress;
+	progress.bytes = loaded_bytes_;
+	progress.total_bytes = total_bytes_;
+	progress.time = progress_time_;
+	GetLoadCounts(progress);
+
+	load_listener_->LoadProgress(LoadListener::PARSE, progress);
+}
+
+void XMLParser::FinishPhase(LoadListener::Phase phase, float time) {
+	phase_times_[phase] = time;
+
+	if (load_listener_ == NULL)
+		return;
+
+	LoadListener::Progress progress;
+	progress.bytes = loaded_bytes_;
+	progress.total_bytes = total_bytes_;
+	progress.time = time;
+	GetLoadCounts(progress);
+
+	load_listener_->LoadPhaseFinished(phase, progress);
+}
+
+void XMLParser::SetTokenizer(Tokenizer tokenizer) {
+	tokenizer_ = tokenizer;
+}
+
+void XMLParser::SetLoadListener(LoadListener* listener) {
+	load_listener_ = listener;
+}
+
+void XMLParser::ThrowVerbose(XML_Parser parser, const ParsingException& e) {
+	ParsingException verbose;
+	verbose << "input parsing error: " << e.what();
+	if (trusted_tokenizer_)
+		verbose << " at byte " << trusted_tokenizer_->GetOffset();
+	else
+		verbose << " at line " << XML_GetCurrentLineNumber(parser) << " pos " << XML_GetCurrentColumnNumber(parser);
+	XML_ParserFree(parser);
+	throw verbose;
+}
+
 void XMLParser::Load(const char* filename) {
 	int f = 0;
-	XML_Parser parser = NULL;
+
+	/* regular files are mmapped, everything else is read */
+	struct stat st;
+	bool mapped = strcmp(filename, "-") != 0 && stat(filename, &st) == 0 && S_ISREG(st.st_mode);
 
 	/* if filename = "-", work with stdin */
-	if (strcmp(filename, "-") != 0 && (f = open(filename, O_RDONLY)) == -1)
+	if (!mapped && strcmp(filename, "-") != 0 && (f = open(filename, O_RDONLY)) == -1)
 		throw SystemError() << "cannot open input file";
 
 	/* Create and setup parser */
-	if ((parser = XML_ParserCreate(NULL)) == NULL) {
-		close(f);
-		throw Exception() << "cannot create XML parser";
+	XML_Parser parser;
+	try {
+		parser = CreateParser();
+	} catch (...) {
+		if (!mapped)
+			close(f);
+		throw;
 	}
 
-	if (flags_ & HANDLE_ELEMENTS)
-		XML_SetElementHandler(parser, StartElementWrapper, EndElementWrapper);
-	if (flags_ & HANDLE_CHARDATA)
-		XML_SetCharacterDataHandler(parser, CharacterDataWrapper);
+	TrustedTokenizer trusted(*this);
+	ScopedPointer<TrustedTokenizer> current(trusted_tokenizer_, tokenizer_ == TRUSTED_TOKENIZER ? &trusted : NULL);
 
-	XML_SetUserData(parser, this);
+	ResetLoadStats();
+	Timer timer;
 
 	/* Parse file */
 	try {
-		char buf[65536];
-		ssize_t len;
-		do {
-			if ((len = read(f, buf, sizeof(buf))) < 0)
-				throw SystemError() << "input read error";
-			if (XML_Parse(parser, buf, len, len == 0) == XML_STATUS_ERROR)
-				throw ParsingException() << XML_ErrorString(XML_GetErrorCode(parser));
-		} while (len != 0);
+		if (mapped)
+			ParseMapped(parser, filename);
+		else
+			ParseStream(parser, f);
 	} catch (ParsingException &e) {
-		ParsingException verbose;
-		verbose << "input parsing error: " << e.what() << " at line " << XML_GetCurrentLineNumber(parser) << " pos " << XML_GetCurrentColumnNumber(parser);
-		close(f);
-		XML_ParserFree(parser);
-		throw verbose;
+		if (!mapped)
+			close(f);
+		ThrowVerbose(parser, e);
 	} catch (...) {
+		if (!mapped)
+			close(f);
+		XML_ParserFree(parser);
+		throw;
+	}
+
+	load_time_ = timer.Count();
+	if (compressed_bytes_ == 0)
+		parse_time_ = load_time_;
+
+	FinishPhase(LoadListener::PARSE, load_time_);
+
+	XML_ParserFree(parser);
+	if (!mapped)
 		close(f);
+}
+
+void XMLParser::LoadFragments(const char* const* fragments, const size_t* sizes, int count) {
+	XML_Parser parser = CreateParser();
+
+	TrustedTokenizer trusted(*this);
+	ScopedPointer<TrustedTokenizer> current(trusted_tokenizer_, tokenizer_ == TRUSTED_TOKENIZER ? &trusted : NULL);
+
+	ResetLoadStats();
+	Timer timer;
+
+	try {
+		for (int i = 0; i < count; ++i)
+			ParseMemory(parser, fragments[i], sizes[i], i == count - 1);
+	} catch (ParsingException &e) {
+		ThrowVerbose(parser, e);
+	} catch (...) {
 		XML_ParserFree(parser);
 		throw;
 	}
 
+	load_time_ = timer.Count();
+	parse_time_ = load_time_;
+
+	FinishPhase(LoadListener::PARSE, load_time_);
+
 	XML_ParserFree(parser);
-	close(f);
+}
+
+size_t XMLParser::GetLoadedBytes() const {
+	return loaded_bytes_;
+}
+
+float XMLParser::GetLoadTime() const {
+	return load_time_;
+}
+
+float XMLParser::GetLoadRate() const {
+	return load_time_ > 0.0f ? loaded_bytes_ / load_time_ : 0.0f;
+}
+
+size_t XMLParser::GetCompressedBytes() const {
+	return compressed_bytes_;
+}
+
+float XMLParser::GetParseRate() const {
+	return parse_time_ > 0.0f ? loaded_bytes_ / parse_time_ : 0.0f;
+}
+
+float XMLParser::GetDecompressRate() const {
+	return decompress_time_ > 0.0f ? loaded_bytes_ / decompress_time_ : 0.0f;
+}
+
+float XMLParser::GetPhaseTime(LoadListener::Phase phase) const {
+	return phase_times_[phase];
 }
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECOMPRESSOR_HH
+#define DECOMPRESSOR_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Streaming decompressor for gzip and bzip2 input
+ *
+ * Decompression runs on a separate thread which fills a bounded
+ * queue of buffers, so consumer (e.g. XML parser) works on one
+ * buffer while the next ones are being decompressed. Concatenated
+ * streams (as produced by pigz or pbzip2) are supported.
+ */
+class Decompressor : private NonCopyable {
+public:
+	enum Format {
+		NONE,
+		GZIP,
+		BZIP2,
+	};
+
+protected:
+	struct Buffer {
+		std::vector<char> data;
+		size_t size;
+	};
+
+protected:
+	Format format_;
+
+	/* input */
+	const char* prefix_;
+	size_t prefix_size_;
+	int fd_;
+	std::vector<char> input_;
+
+	/* queue of decompressed buffers */
+	std::vector<Buffer> buffers_;
+	size_t produced_;
+	size_t consumed_;
+	bool holding_;
+	bool finished_;
+	bool stop_;
+	std::string error_;
+
+	/* statistics */
+	size_t input_bytes_;
+	size_t output_bytes_;
+	float busy_time_;
+
+	pthread_t thread_;
+	mutable pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+
+protected:
+	static void* ThreadFuncWrapper(void* arg);
+	void ThreadFunc();
+
+	/**
+	 * Returns next piece of compressed input
+	 *
+	 * @return false at the end of input
+	 */
+	bool ReadInput(const char*& data, size_t& size);
+
+	/**
+	 * Waits for a free buffer in the queue
+	 *
+	 * @return buffer to fill or NULL if decompressor is stopped
+	 */
+	Buffer* AcquireBuffer();
+
+	/**
+	 * Passes filled buffer to consumer
+	 *
+	 * @param size amount of data in buffer
+	 * @param busytime time spent to produce the buffer
+	 */
+	void PushBuffer(size_t size, float busytime);
+
+	/**
+	 * Decompression loop, codec wraps specific library
+	 */
+	template <class C>
+	void Run(C& codec);
+
+public:
+	/**
+	 * Detects compression format by magic bytes
+	 *
+	 * @param data beginning of the input
+	 * @param size size of data, at least 3 bytes are needed
+	 *             for detection
+	 */
+	static Format DetectFormat(const char* data, size_t size);
+
+	/**
+	 * Starts decompression thread
+	 *
+	 * Input consists of prefix data followed by the contents
+	 * of file descriptor, which allows to pass data already read
+	 * for format detection, or to decompress memory-mapped file.
+	 * Neither prefix nor descriptor are owned by decompressor.
+	 *
+	 * @param format compression format
+	 * @param prefix data which goes first in the input
+	 * @param prefixsize size of prefix
+	 * @param fd descriptor to read rest of the input from, or -1
+	 */
+	Decompressor(Format format, const char* prefix, size_t prefixsize, int fd);
+
+	/**
+	 * Stops decompression thread
+	 */
+	~Decompressor();
+
+	/**
+	 * Returns next piece of decompressed data
+	 *
+	 * Data is valid until next call. Throws if decompression
+	 * has failed.
+	 *
+	 * @return false at the end of data
+	 */
+	bool GetData(const char*& data, size_t& size);
+
+	/** Returns number of compressed bytes consumed so far */
+	size_t GetInputBytes() const;
+
+	/** Returns number of decompressed bytes produced so far */
+	size_t GetOutputBytes() const;
+
+	/**
+	 * Returns time decompression thread spent reading and
+	 * decompressing, not counting time it waited for consumer
+	 */
+	float GetBusyTime() const;
+};
+
+#endif
@@ -33,6 +33,7 @@ public:
 
 	virtual void GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const;
 	virtual osmint_t GetHeight(const Vector2i& where) const;
+	virtual void GetHeights(const Vector2i* in, osmint_t* out, size_t n) const;
 };
 
 #endif
@@ -31,7 +31,35 @@
  */
 class GPXDatasource {
 public:
+	/**
+	 * Returns all track points within bbox
+	 */
 	virtual void GetPoints(std::vector<Vector3i>& out, const BBoxi& bbox) const = 0;
+
+	/**
+	 * Returns parts of tracks which pass through bbox
+	 *
+	 * Tracks are returned as polylines, which may extend beyond
+	 * bbox by a few points, so lines crossing its border are not
+	 * lost. Datasource may simplify tracks as long as simplified
+	 * polyline doesn't deviate from original track by more than
+	 * given tolerance.
+	 *
+	 * @param points receives points of all polylines
+	 * @param lengths receives numbers of points in each polyline
+	 * @param bbox area of interest
+	 * @param tolerance allowed deviation, in fixed point units
+	 */
+	virtual void GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int tolerance) const;
+
+	virtual ~GPXDatasource() {}
 };
 
+inline void GPXDatasource::GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int /*unused*/) const {
+	/* without track structure, each point is a polyline by itself */
+	size_t first = points.size();
+	GetPoints(points, bbox);
+	lengths.insert(lengths.end(), points.size() - first, (size_t)1);
+}
+
 #endif
@@ -46,6 +46,22 @@ public:
 
 	virtual void GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const = 0;
 	virtual osmint_t GetHeight(const Vector2i& where) const = 0;
+
+	/**
+	 * Returns heights of a number of points
+	 *
+	 * Implementations may do this much faster than separate
+	 * GetHeight() calls, especially for nearby points, like
+	 * vertices of a building.
+	 *
+	 * @param in points to get heights of
+	 * @param out array of at least n heights to fill
+	 * @param n number of points
+	 */
+	virtual void GetHeights(const Vector2i* in, osmint_t* out, size_t n) const {
+		for (size_t i = 0; i < n; ++i)
+			out[i] = GetHeight(in[i]);
+	}
 };
 
 #endif
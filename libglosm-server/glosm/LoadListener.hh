@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOADLISTENER_HH
+#define LOADLISTENER_HH
+
+#include <cstddef>
+#include <cstdio>
+
+/**
+ * Interface for receiving progress of data loading.
+ *
+ * Listener is set on a datasource with SetLoadListener() and is
+ * notified periodically while input is parsed and once after
+ * each loading phase, which makes it possible to see both how
+ * far the load went and which phase takes most time. All calls
+ * are made from the thread which called Load().
+ */
+class LoadListener {
+public:
+	/** Phases of data loading */
+	enum Phase {
+		/* reading and parsing input */
+		PARSE,
+
+		/* filtering objects and processing ways */
+		FINALIZE,
+
+		/* assembling multipolygons */
+		MULTIPOLYGONS,
+
+		/* pruning nodes and building spatial index */
+		INDEX,
+
+		NPHASES,
+	};
+
+	/** State of loading */
+	struct Progress {
+		/* bytes of (uncompressed) input parsed so far */
+		size_t bytes;
+
+		/* size of input, or 0 if it's not known in advance,
+		 * as is the case for compressed input and streams */
+		size_t total_bytes;
+
+		/* numbers of objects loaded so far */
+		size_t nodes;
+		size_t ways;
+		size_t relations;
+
+		/* seconds passed since start of the phase */
+		float time;
+
+		Progress() : bytes(0), total_bytes(0), nodes(0), ways(0), relations(0), time(0.0f) {}
+	};
+
+public:
+	/**
+	 * Called periodically while a phase runs
+	 *
+	 * Currently only parsing reports progress.
+	 */
+	virtual void LoadProgress(Phase phase, const Progress& progress) = 0;
+
+	/**
+	 * Called when a phase is finished
+	 *
+	 * Phases which have nothing to do (such as assembling
+	 * multipolygons when there are none) are still reported.
+	 */
+	virtual void LoadPhaseFinished(Phase phase, const Progress& progress) = 0;
+
+	virtual ~LoadListener() {}
+
+	/**
+	 * Returns human readable name of a phase
+	 */
+	static const char* GetPhaseName(Phase phase);
+};
+
+/**
+ * Load listener which prints progress to a stream
+ */
+class PrintingLoadListener : public LoadListener {
+protected:
+	FILE* stream_;
+
+public:
+	/**
+	 * Constructs listener
+	 *
+	 * @param stream stream to print to
+	 */
+	PrintingLoadListener(FILE* stream = stderr);
+
+	virtual void LoadProgress(Phase phase, const Progress& progress);
+	virtual void LoadPhaseFinished(Phase phase, const Progress& progress);
+};
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPEDFILE_HH
+#define MAPPEDFILE_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <cstddef>
+
+/**
+ * Read-only memory mapping of a whole file
+ *
+ * Mapping is held for the lifetime of the object.
+ */
+class MappedFile : private NonCopyable {
+protected:
+	int fd_;
+	const char* data_;
+	size_t size_;
+
+public:
+	/**
+	 * Opens and maps the file
+	 *
+	 * @param filename path to file
+	 */
+	MappedFile(const char* filename);
+
+	/**
+	 * Unmaps and closes the file
+	 */
+	~MappedFile();
+
+	/** Returns pointer to file contents, NULL for empty file */
+	inline const char* GetData() const {
+		return data_;
+	}
+
+	/** Returns size of file in bytes */
+	inline size_t GetSize() const {
+		return size_;
+	}
+
+	/**
+	 * Gives kernel a hint on how mapping will be accessed
+	 *
+	 * @param advice one of MADV_* constants for madvise(2)
+	 */
+	void Advise(int advice) const;
+};
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPEDOSMDATASOURCE_HH
+#define MAPPEDOSMDATASOURCE_HH
+
+#include <glosm/OsmDatasource.hh>
+#include <glosm/MappedFile.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <vector>
+
+#include <stdint.h>
+
+class WayStore;
+
+/**
+ * Source of OpenStreetMap data which reads ways from memory
+ * mapped file.
+ *
+ * File is produced once from loaded data with Write(). It holds
+ * ways with inlined node coordinates, stored in columns like in
+ * WayStore, in order of Hilbert curve, and a packed R-tree over
+ * them. Nothing is loaded on open except for tag strings, and
+ * queries only touch pages of the index and of the ways found,
+ * which are mostly adjacent. Since mapping is read-only, all
+ * these pages are clean and kernel may drop them at any time,
+ * so resident memory is bounded by what's actually viewed
+ * rather than by size of the data.
+ *
+ * Ids of node references, standalone nodes and relations are
+ * not stored (multipolygons are stored as ways they produce),
+ * so GetNode() and GetRelation() always throw, and ways have
+ * only Coords with empty Nodes.
+ *
+ * Way objects are not kept either, so ways are only available
+ * as views, with TryGetWay() and GetWays(); GetWay() and
+ * pointer GetWays() throw Exception, as there's no storage
+ * which returned references could safely point to.
+ */
+class MappedOsmDatasource : public OsmDatasource, private NonCopyable {
+protected:
+	typedef TagsView::value_type Tag;
+
+	/* helper for index query */
+	struct WayViewAppender;
+
+protected:
+	MappedFile file_;
+
+	BBoxi bbox_;
+
+	size_t nways_;
+
+	/* columns; these point into mapped file */
+	const osmid_t* ids_;
+	const uint64_t* byid_;
+	const BBoxi* bboxes_;
+	const uint8_t* flags_;
+	const uint64_t* coord_offsets_;
+	const Vector2i* coords_;
+	const uint64_t* tag_offsets_;
+	const Tag* tags_;
+
+	/* spatial index: bboxes of nodes of all levels, bottom
+	 * level first, and offsets of levels */
+	const BBoxi* index_;
+	const uint64_t* levels_;
+	size_t nlevels_;
+
+	/* copy of tags with ids translated to TagDictionary ones;
+	 * only used when these differ from ids in file */
+	std::vector<Tag> remapped_tags_;
+
+protected:
+	/**
+	 * Calls visitor for indexes of all ways which intersect bbox
+	 */
+	template <class V>
+	void Query(const BBoxi& bbox, V& visitor) const;
+
+	/**
+	 * Returns view of way with given index
+	 */
+	WayView GetView(size_t index) const;
+
+public:
+	/**
+	 * Maps file written by Write()
+	 *
+	 * @param filename path to file
+	 */
+	MappedOsmDatasource(const char* filename);
+
+	/**
+	 * Destructor
+	 */
+	virtual ~MappedOsmDatasource();
+
+	/**
+	 * Writes ways into file suitable for MappedOsmDatasource
+	 *
+	 * Ways must have coordinates of their nodes inlined. They
+	 * are stored in order of the store, which should be spatial
+	 * for queries to be efficient; PreloadedXmlDatasource keeps
+	 * its store this way.
+	 *
+	 * @param filename path to file
+	 * @param ways ways to write
+	 * @param bbox bounding box of data
+	 */
+	static void Write(const char* filename, const WayStore& ways, const BBoxi& bbox);
+
+	/**
+	 * Returns number of ways in file
+	 */
+	inline size_t GetWaysCount() const {
+		return nways_;
+	}
+
+public:
+	virtual Node GetNode(osmid_t id) const;
+	virtual const Way& GetWay(osmid_t id) const;
+	virtual const Relation& GetRelation(osmid_t id) const;
+
+	virtual bool TryGetNode(osmid_t id, Node& out) const;
+	virtual bool TryGetWay(osmid_t id, WayView& out) const;
+
+	using OsmDatasource::GetWays;
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const;
+	virtual void GetWays(std::vector<WayView>& out, const BBoxi& bbox) const;
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+};
+
+#endif
@@ -23,10 +23,11 @@
 
 #include <glosm/Math.hh>
 #include <glosm/BBox.hh>
+#include <glosm/TagDictionary.hh>
 
-#include <string>
 #include <vector>
-#include <map>
+#include <algorithm>
+#include <iterator>
 
 /**
  * Abstract base class for sources of OpenStreetMap data.
@@ -36,7 +37,134 @@
  */
 class OsmDatasource {
 public:
-	typedef std::map<std::string, std::string> TagsMap;
+	/**
+	 * Read-only view of contiguous array elements.
+	 *
+	 * Doesn't own the data, so it's only valid as long as the
+	 * array it refers to is.
+	 */
+	template <typename T>
+	class ArrayView {
+	public:
+		typedef T                                value_type;
+		typedef const T*                         const_iterator;
+		typedef std::reverse_iterator<const T*>  const_reverse_iterator;
+
+	protected:
+		const T* begin_;
+		const T* end_;
+
+	public:
+		ArrayView() : begin_(NULL), end_(NULL) {}
+		ArrayView(const T* begin, const T* end) : begin_(begin), end_(end) {}
+		ArrayView(const std::vector<T>& v) : begin_(v.empty() ? NULL : &v.front()), end_(v.empty() ? NULL : &v.back() + 1) {}
+
+		const_iterator begin() const { return begin_; }
+		const_iterator end() const { return end_; }
+		const_reverse_iterator rbegin() const { return const_reverse_iterator(end_); }
+		const_reverse_iterator rend() const { return const_reverse_iterator(begin_); }
+
+		const T* data() const { return begin_; }
+		const T& operator[](size_t n) const { return begin_[n]; }
+		const T& front() const { return *begin_; }
+		const T& back() const { return *(end_ - 1); }
+
+		size_t size() const { return end_ - begin_; }
+		bool empty() const { return begin_ == end_; }
+	};
+
+	/**
+	 * Read-only view of object tags sorted by key.
+	 *
+	 * Provides the same lookups as TagsMap.
+	 */
+	class TagsView : public ArrayView<std::pair<tagid_t, tagid_t> > {
+	protected:
+		struct KeyLess {
+			bool operator()(const value_type& tag, tagid_t key) const { return tag.first < key; }
+		};
+
+	public:
+		TagsView() {}
+		TagsView(const value_type* begin, const value_type* end) : ArrayView<value_type>(begin, end) {}
+
+		const_iterator find(tagid_t key) const {
+			const_iterator i = std::lower_bound(begin(), end(), key, KeyLess());
+			return (i != end() && i->first == key) ? i : end();
+		}
+
+		/**
+		 * Returns value id for given key, TagDictionary::NONE if
+		 * there's no such key
+		 */
+		tagid_t get(tagid_t key) const {
+			const_iterator i = find(key);
+			return i == end() ? TagDictionary::NONE : i->second;
+		}
+	};
+
+	/**
+	 * Compact map of object tags.
+	 *
+	 * Keys and values are ids from TagDictionary, stored as
+	 * array of pairs sorted by key. Interface resembles that of
+	 * std::map, but lookups are done by tag ids, so callers should
+	 * resolve ids of keys and values they need once beforehand.
+	 */
+	class TagsMap {
+	public:
+		typedef std::pair<tagid_t, tagid_t>      value_type;
+		typedef const value_type*                const_iterator;
+
+	protected:
+		struct KeyLess {
+			bool operator()(const value_type& tag, tagid_t key) const { return tag.first < key; }
+		};
+
+		typedef std::vector<value_type> TagsVector;
+
+	protected:
+		TagsVector tags_;
+
+	public:
+		const_iterator begin() const { return tags_.empty() ? NULL : &tags_.front(); }
+		const_iterator end() const { return tags_.empty() ? NULL : &tags_.back() + 1; }
+
+		size_t size() const { return tags_.size(); }
+		bool empty() const { return tags_.empty(); }
+
+		const_iterator find(tagid_t key) const {
+			return TagsView(begin(), end()).find(key);
+		}
+
+		/**
+		 * Returns value id for given key, TagDictionary::NONE if
+		 * there's no such key
+		 */
+		tagid_t get(tagid_t key) const {
+			return TagsView(begin(), end()).get(key);
+		}
+
+		/**
+		 * Adds a tag; like std::map, doesn't replace existing
+		 * value if key is already present
+		 */
+		bool insert(tagid_t key, tagid_t value) {
+			TagsVector::iterator i = std::lower_bound(tags_.begin(), tags_.end(), key, KeyLess());
+			if (i != tags_.end() && i->first == key)
+				return false;
+			tags_.insert(i, std::make_pair(key, value));
+			return true;
+		}
+
+		void clear() {
+			TagsVector().swap(tags_);
+		}
+
+		void swap(TagsMap& other) {
+			tags_.swap(other.tags_);
+		}
+	};
 
 public:
 	struct Node {
@@ -48,16 +176,51 @@ public:
 
 	struct Way {
 		typedef std::vector<osmid_t> NodesList;
+		typedef std::vector<Vector2i> CoordsList;
 
 		NodesList Nodes;
 
+		/* coordinates of nodes, in the same order; may be empty
+		 * if datasource doesn't store them inline, in which case
+		 * nodes should be resolved via TryGetNodes() */
+		CoordsList Coords;
+
 		TagsMap Tags;
 		bool Closed;
 		bool Clockwise;
 
+		/* way is an inner ring of multipolygon, that is, it
+		 * bounds a hole in an area */
+		bool Inner;
+
 		BBoxi BBox;
 
-		Way() : Closed(false), Clockwise(false), BBox(BBoxi::Empty()) {
+		Way() : Closed(false), Clockwise(false), Inner(false), BBox(BBoxi::Empty()) {
+		}
+	};
+
+	/**
+	 * Read-only view of a way.
+	 *
+	 * Has the same members as Way, but refers to nodes, tags and
+	 * coordinates stored elsewhere, so datasources which don't
+	 * keep Way objects may still hand out ways without copying.
+	 * View is only valid while the data it refers to is.
+	 */
+	struct WayView {
+		ArrayView<osmid_t> Nodes;
+		ArrayView<Vector2i> Coords;
+		TagsView Tags;
+		bool Closed;
+		bool Clockwise;
+		bool Inner;
+		BBoxi BBox;
+
+		WayView() : Closed(false), Clockwise(false), Inner(false), BBox(BBoxi::Empty()) {
+		}
+
+		WayView(const Way& way) : Nodes(way.Nodes), Coords(way.Coords), Tags(way.Tags.begin(), way.Tags.end()),
+				Closed(way.Closed), Clockwise(way.Clockwise), Inner(way.Inner), BBox(way.BBox) {
 		}
 	};
 
@@ -72,9 +235,10 @@ public:
 			} Type;
 
 			osmid_t Ref;
-			std::string Role;
+			tagid_t Role;
 
-			Member(Type_t type, osmid_t ref, const char* role): Type(type), Ref(ref), Role(role) {}
+			Member(Type_t type, osmid_t ref, const char* role): Type(type), Ref(ref), Role(TagDictionary::Intern(role)) {}
+			Member(Type_t type, osmid_t ref, tagid_t role): Type(type), Ref(ref), Role(role) {}
 		};
 
 		typedef std::vector<Member> MemberList;
@@ -84,17 +248,89 @@ public:
 	};
 
 public:
-	/** Returns node by its id */
-	virtual const Node& GetNode(osmid_t id) const = 0;
+	/**
+	 * Returns node by its id
+	 *
+	 * Node is returned by value, as datasource is not required
+	 * to store nodes as Node objects.
+	 */
+	virtual Node GetNode(osmid_t id) const = 0;
 
-	/** Returns way by its id */
+	/**
+	 * Returns way by its id
+	 *
+	 * Datasources which don't keep Way objects may throw
+	 * Exception; TryGetWay() works with all of them.
+	 */
 	virtual const Way& GetWay(osmid_t id) const = 0;
 
 	/** Returns relation by its id */
 	virtual const Relation& GetRelation(osmid_t id) const = 0;
 
+	/**
+	 * Looks up node by its id without throwing
+	 *
+	 * @param id node id
+	 * @param out node to fill
+	 * @return true if node was found, false otherwise
+	 */
+	virtual bool TryGetNode(osmid_t id, Node& out) const = 0;
+
+	/**
+	 * Looks up way by its id without throwing
+	 *
+	 * View refers to datasource storage and stays valid until
+	 * datasource is modified or destroyed.
+	 *
+	 * @param id way id
+	 * @param out view to fill
+	 * @return true if way was found, false otherwise
+	 */
+	virtual bool TryGetWay(osmid_t id, WayView& out) const = 0;
+
+	/**
+	 * Looks up positions of multiple nodes without throwing
+	 *
+	 * This is intended for resolving way nodes in bulk.
+	 *
+	 * @param ids array of node ids
+	 * @param count number of nodes
+	 * @param out array of at least count elements to fill
+	 * @return true if all nodes were found, false otherwise
+	 *         (contents of out is undefined in this case)
+	 */
+	virtual bool TryGetNodes(const osmid_t* ids, size_t count, Vector2i* out) const;
+
 	/* multiple - object accessors subject to change */
-	virtual void GetWays(std::vector<Way>& out, const BBoxi& bbox) const = 0;
+
+	/**
+	 * Returns pointers to all ways which intersect given bbox
+	 *
+	 * Pointers refer to datasource storage and stay valid
+	 * until datasource is modified or destroyed. Datasources
+	 * which don't keep Way objects may throw Exception, so
+	 * views should be used by code which isn't tied to
+	 * specific datasource.
+	 */
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const = 0;
+
+	/**
+	 * Returns copies of all ways which intersect given bbox
+	 *
+	 * @note this is considerably slower than view variant
+	 *       as nodes and tags of each way are copied
+	 */
+	virtual void GetWays(std::vector<Way>& out, const BBoxi& bbox) const;
+
+	/**
+	 * Returns views of all ways which intersect given bbox
+	 *
+	 * Views refer to datasource storage and stay valid until
+	 * datasource is modified or destroyed. This is the preferred
+	 * way of reading many ways, as datasource may keep them in
+	 * a form more compact than Way.
+	 */
+	virtual void GetWays(std::vector<WayView>& out, const BBoxi& bbox) const;
 
 	/** Returns center of available area */
 	virtual Vector2i GetCenter() const {
@@ -105,6 +341,47 @@ public:
 	virtual BBoxi GetBBox() const {
 		return BBoxi::ForEarth();
 	}
+
+	virtual ~OsmDatasource() {}
 };
 
+inline bool OsmDatasource::TryGetNodes(const osmid_t* ids, size_t count, Vector2i* out) const {
+	Node node;
+	for (size_t i = 0; i < count; ++i) {
+		if (!TryGetNode(ids[i], node))
+			return false;
+		out[i] = node.Pos;
+	}
+	return true;
+}
+
+inline void OsmDatasource::GetWays(std::vector<Way>& out, const BBoxi& bbox) const {
+	std::vector<WayView> views;
+	GetWays(views, bbox);
+
+	out.reserve(out.size() + views.size());
+	for (std::vector<WayView>::const_iterator i = views.begin(); i != views.end(); ++i) {
+		out.push_back(Way());
+
+		Way& way = out.back();
+		way.Nodes.assign(i->Nodes.begin(), i->Nodes.end());
+		way.Coords.assign(i->Coords.begin(), i->Coords.end());
+		for (TagsView::const_iterator tag = i->Tags.begin(); tag != i->Tags.end(); ++tag)
+			way.Tags.insert(tag->first, tag->second);
+		way.Closed = i->Closed;
+		way.Clockwise = i->Clockwise;
+		way.Inner = i->Inner;
+		way.BBox = i->BBox;
+	}
+}
+
+inline void OsmDatasource::GetWays(std::vector<WayView>& out, const BBoxi& bbox) const {
+	std::vector<const Way*> ways;
+	GetWays(ways, bbox);
+
+	out.reserve(out.size() + ways.size());
+	for (std::vector<const Way*>::const_iterator i = ways.begin(); i != ways.end(); ++i)
+		out.push_back(WayView(**i));
+}
+
 #endif
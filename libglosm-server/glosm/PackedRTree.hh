@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKEDRTREE_HH
+#define PACKEDRTREE_HH
+
+#include <glosm/BBox.hh>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+#include <stdint.h>
+
+/**
+ * Returns position of a point on Hilbert curve of order 16
+ *
+ * @param x x coordinate in range [0; 65535]
+ * @param y y coordinate in range [0; 65535]
+ */
+inline uint32_t HilbertIndex(uint32_t x, uint32_t y) {
+	uint32_t d = 0;
+	for (uint32_t s = 1 << 15; s > 0; s >>= 1) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		/* rotate quadrant */
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+/**
+ * Returns position of a point on Hilbert curve of order 16
+ * laid over given extent
+ */
+inline uint32_t HilbertIndex(const Vector2i& point, const BBoxi& extent) {
+	osmlong_t w = (osmlong_t)extent.right - (osmlong_t)extent.left;
+	osmlong_t h = (osmlong_t)extent.top - (osmlong_t)extent.bottom;
+
+	uint32_t x = w > 0 ? (uint32_t)(((osmlong_t)point.x - (osmlong_t)extent.left) * 65535 / w) : 0;
+	uint32_t y = h > 0 ? (uint32_t)(((osmlong_t)point.y - (osmlong_t)extent.bottom) * 65535 / h) : 0;
+
+	return HilbertIndex(x, y);
+}
+
+/**
+ * Static spatial index over bounding boxes.
+ *
+ * This is a bulk-loaded R-tree: items are sorted by Hilbert
+ * value of their centers and packed into nodes of NODE_SIZE
+ * entries, level by level, into flat arrays. There are no
+ * pointers in the tree - children of node i on a level are
+ * nodes [i * NODE_SIZE; (i + 1) * NODE_SIZE) on the level below.
+ *
+ * The tree cannot be modified after Build(); to add items,
+ * Insert() them and call Build() again, which rebuilds the
+ * tree from scratch in O(n log n).
+ *
+ * Query costs O(log n + k) for k results. Results come in
+ * the order of the curve, ties are broken with operator< on
+ * values, so output order is fully defined by index contents.
+ */
+template <typename T, int NODE_SIZE = 16>
+class PackedRTree {
+public:
+	typedef T value_type;
+
+protected:
+	struct Item {
+		BBoxi bbox;
+		T value;
+		uint32_t hilbert;
+
+		Item(const BBoxi& b, const T& v) : bbox(b), value(v), hilbert(0) {}
+
+		bool operator<(const Item& other) const {
+			return hilbert < other.hilbert || (hilbert == other.hilbert && value < other.value);
+		}
+	};
+
+	typedef std::vector<Item> ItemsVector;
+	typedef std::vector<BBoxi> BBoxesVector;
+
+	struct Appender {
+		std::vector<T>& out;
+
+		Appender(std::vector<T>& o) : out(o) {}
+		void operator()(const T& value) { out.push_back(value); }
+	};
+
+protected:
+	/* leaf level, sorted after Build() */
+	ItemsVector items_;
+
+	/* bboxes of inner nodes, all levels from bottom to top */
+	BBoxesVector nodes_;
+
+	/* offset of each level in nodes_, plus end marker */
+	std::vector<size_t> levels_;
+
+	BBoxi extent_;
+
+	bool built_;
+
+public:
+	PackedRTree() : extent_(BBoxi::Empty()), built_(true) {
+	}
+
+	/**
+	 * Adds an item to the index
+	 *
+	 * Item only becomes visible to queries after Build()
+	 */
+	void Insert(const BBoxi& bbox, const T& value) {
+		items_.push_back(Item(bbox, value));
+		extent_.Include(bbox);
+		built_ = false;
+	}
+
+	/**
+	 * Preallocates memory for given number of items
+	 */
+	void Reserve(size_t count) {
+		items_.reserve(count);
+	}
+
+	/**
+	 * Sorts items and builds the tree
+	 */
+	void Build() {
+		for (typename ItemsVector::iterator i = items_.begin(); i != items_.end(); ++i)
+			i->hilbert = HilbertIndex(i->bbox.GetCenter(), extent_);
+
+		std::sort(items_.begin(), items_.end());
+
+		nodes_.clear();
+		levels_.clear();
+
+		/* level 0 bboxes are nodes over leaf items */
+		size_t count = items_.size();
+		levels_.push_back(0);
+		for (size_t i = 0; i < count; i += NODE_SIZE) {
+			BBoxi bbox(BBoxi::Empty());
+			for (size_t j = i; j < count && j < i + NODE_SIZE; ++j)
+				bbox.Include(items_[j].bbox);
+			nodes_.push_back(bbox);
+		}
+
+		/* upper levels until we have single root */
+		while (nodes_.size() - levels_.back() > 1) {
+			size_t begin = levels_.back();
+			size_t end = nodes_.size();
+			levels_.push_back(end);
+			for (size_t i = begin; i < end; i += NODE_SIZE) {
+				BBoxi bbox(BBoxi::Empty());
+				for (size_t j = i; j < end && j < i + NODE_SIZE; ++j)
+					bbox.Include(nodes_[j]);
+				nodes_.push_back(bbox);
+			}
+		}
+		levels_.push_back(nodes_.size());
+
+		built_ = true;
+	}
+
+	/**
+	 * Calls visitor for values of all items which bboxes intersect
+	 * given bbox
+	 *
+	 * Visitor is any object with operator()(const T&) defined.
+	 */
+	template <class V>
+	void Query(const BBoxi& bbox, V& visitor) const {
+		assert(built_);
+
+		if (items_.empty() || !bbox.Intersects(extent_))
+			return;
+
+		/* stack of (level, index) of nodes to visit; it never holds
+		 * more than NODE_SIZE entries per level, and there can't be
+		 * more than 16 levels for any sane node size */
+		struct { int level; size_t index; } stack[NODE_SIZE * 16];
+		int top = 0;
+
+		stack[top].level = (int)levels_.size() - 2;
+		stack[top].index = 0;
+		++top;
+
+		while (top > 0) {
+			--top;
+			int level = stack[top].level;
+			size_t index = stack[top].index;
+
+			if (level == 0) {
+				/* children are leaf items */
+				size_t end = std::min(items_.size(), (index + 1) * NODE_SIZE);
+				for (size_t i = index * NODE_SIZE; i < end; ++i)
+					if (items_[i].bbox.Intersects(bbox))
+						visitor(items_[i].value);
+			} else {
+				size_t below = levels_[level - 1];
+				size_t belowcount = levels_[level] - below;
+				size_t end = std::min(belowcount, (index + 1) * NODE_SIZE);
+
+				/* push in reverse so that children are visited in order */
+				for (size_t i = end; i > index * NODE_SIZE; --i) {
+					if (nodes_[below + i - 1].Intersects(bbox)) {
+						assert(top < NODE_SIZE * 16);
+						stack[top].level = level - 1;
+						stack[top].index = i - 1;
+						++top;
+					}
+				}
+			}
+		}
+	}
+
+	/**
+	 * Appends values of all items which bboxes intersect given
+	 * bbox to the output vector
+	 */
+	void Query(const BBoxi& bbox, std::vector<T>& out) const {
+		Appender appender(out);
+		Query(bbox, appender);
+	}
+
+	/**
+	 * Removes all items from the index
+	 */
+	void Clear() {
+		ItemsVector().swap(items_);
+		BBoxesVector().swap(nodes_);
+		levels_.clear();
+		extent_ = BBoxi::Empty();
+		built_ = true;
+	}
+
+	inline size_t GetSize() const {
+		return items_.size();
+	}
+
+	inline bool IsEmpty() const {
+		return items_.empty();
+	}
+
+	/**
+	 * Returns memory used by the index, in bytes
+	 */
+	inline size_t GetFootprint() const {
+		return items_.capacity() * sizeof(Item) + nodes_.capacity() * sizeof(BBoxi) + levels_.capacity() * sizeof(size_t);
+	}
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAGEALLOCATOR_HH
+#define PAGEALLOCATOR_HH
+
+#include <string>
+#include <new>
+#include <cstddef>
+
+/*
+ * Allocation policies for id_map storage pages and hash tables.
+ *
+ * Policy is a class with two static methods:
+ *
+ *   void* Allocate(size_t size);
+ *   void Free(void* ptr, size_t size);
+ *
+ * Free() is always called with the size given to Allocate().
+ * Allocation failure is reported with std::bad_alloc, same as
+ * for operator new.
+ */
+
+/**
+ * Plain heap allocation
+ */
+struct HeapPageAllocator {
+	static void* Allocate(size_t size) {
+		return ::operator new(size);
+	}
+
+	static void Free(void* ptr, size_t /*unused*/) {
+		::operator delete(ptr);
+	}
+};
+
+/**
+ * Anonymous memory mappings eligible for transparent huge pages
+ *
+ * Large blocks are aligned to huge page boundary and marked with
+ * MADV_HUGEPAGE, so kernel backs them with 2MB pages even when
+ * THP is only enabled in madvise mode. This reduces TLB misses
+ * on random lookups in large maps. To be fully covered, storage
+ * pages should be multiple of 2MB in size.
+ *
+ * Blocks are carved from ARENA_SIZE mappings shared by all maps,
+ * so number of mappings stays small. Memory of freed blocks is
+ * returned to the system, and their address space is reused for
+ * blocks of the same size.
+ *
+ * Blocks smaller than MIN_MAPPED_SIZE come from heap.
+ */
+struct HugePageAllocator {
+	static const size_t HUGE_PAGE_SIZE = 2 * 1048576;
+	static const size_t MIN_MAPPED_SIZE = 65536;
+	static const size_t ARENA_SIZE = 256 * 1048576;
+
+	static void* Allocate(size_t size);
+	static void Free(void* ptr, size_t size);
+};
+
+/**
+ * Memory mappings of temporary files
+ *
+ * Allows maps larger than available RAM: kernel writes pages
+ * back to files under memory pressure instead of failing.
+ * Blocks come from a single file created in directory set with
+ * SetDirectory(), which grows by ARENA_SIZE extents. The file is
+ * unlinked right away, so it disappears when the process exits;
+ * disk space of freed blocks is released where supported.
+ *
+ * Until directory is set, this works as HugePageAllocator, so
+ * maps using this policy may be spilled to disk on demand.
+ * Blocks smaller than MIN_MAPPED_SIZE always come from heap.
+ */
+struct FilePageAllocator {
+	static const size_t MIN_MAPPED_SIZE = HugePageAllocator::MIN_MAPPED_SIZE;
+
+	static void* Allocate(size_t size);
+	static void Free(void* ptr, size_t size);
+
+	/**
+	 * Sets directory for backing files
+	 *
+	 * Affects subsequent allocations only. Empty string
+	 * disables file backing.
+	 */
+	static void SetDirectory(const std::string& directory);
+
+private:
+	static std::string directory_;
+};
+
+#endif
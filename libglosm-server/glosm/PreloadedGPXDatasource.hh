@@ -24,21 +24,72 @@
 #include <glosm/GPXDatasource.hh>
 #include <glosm/XMLParser.hh>
 #include <glosm/NonCopyable.hh>
+#include <glosm/PackedRTree.hh>
 
+#include <string>
 #include <vector>
 
 /**
  * Source of GPX data which preloads tracks into memory.
  *
- * @todo this needs quadtree or some other clever interface
- * to scale for large amounts of data.
+ * Track segments are kept as polylines, split into chunks of a
+ * few dozen points, and chunks are put into spatial index, so
+ * cost of a query depends on amount of data returned rather than
+ * on amount of data loaded.
+ *
+ * For coarse queries, simplified variants of tracks are built
+ * with Douglas-Peucker algorithm, each level with tolerance four
+ * times larger than the previous one. Each level is simplified
+ * from the previous one, so deviation from original tracks may
+ * exceed level tolerance by up to a third.
+ *
+ * Many files may be loaded at once with LoadFiles(), which parses
+ * them concurrently and builds the index once for all of them.
  */
 class PreloadedGPXDatasource : public XMLParser, public GPXDatasource, private NonCopyable {
 protected:
 	typedef std::vector<Vector3i> PointsVector;
 
+	/**
+	 * Part of track segment; chunks of the same segment share
+	 * their boundary point, so there are no gaps between them
+	 */
+	struct Chunk {
+		size_t begin;
+		size_t end;
+
+		Chunk(size_t b, size_t e) : begin(b), end(e) {}
+	};
+
+	typedef std::vector<Chunk> ChunksVector;
+
+	/**
+	 * Tracks simplified with given tolerance, with index
+	 */
+	struct Level {
+		int tolerance;
+
+		PointsVector points;
+
+		/* offsets of segments in points, plus end marker */
+		std::vector<size_t> segments;
+
+		ChunksVector chunks;
+
+		/* holds indexes of chunks */
+		PackedRTree<size_t> index;
+
+		Level() : tolerance(0), segments(1, 0) {}
+	};
+
+	typedef std::vector<Level> LevelsVector;
+
+	/* parallel loading helper */
+	struct LoadTask;
+
 protected:
-	PointsVector points_;
+	/* original tracks first, then simplified ones */
+	LevelsVector levels_;
 
 	/* parser state */
 	enum {
@@ -52,6 +103,9 @@ protected:
 
 	int tag_level_;
 
+	/* text of current ele element */
+	std::string ele_;
+
 protected:
 	/**
 	 * Processes start XML element
@@ -64,10 +118,43 @@ protected:
 	virtual void EndElement(const char* name);
 
 	/**
-	 * Processes end XML element
+	 * Processes character data
 	 */
 	virtual void CharacterData(const char* data, int len);
 
+	/**
+	 * Fills numbers of loaded objects in progress report
+	 */
+	virtual void GetLoadCounts(LoadListener::Progress& progress) const;
+
+	/**
+	 * Splits segments of a level into chunks and indexes them
+	 */
+	static void IndexLevel(Level& level);
+
+	/**
+	 * Rebuilds simplified levels and indexes of all levels
+	 */
+	void BuildIndex();
+
+	/**
+	 * Returns indexes of chunks of a level which intersect
+	 * bbox, in order of points
+	 */
+	static void QueryChunks(const Level& level, const BBoxi& bbox, std::vector<size_t>& out);
+
+	/**
+	 * Parses GPX file and appends its tracks to original ones
+	 * without updating index; if parsing fails, nothing from
+	 * the file is kept
+	 */
+	void ParseFile(const char* filename);
+
+	/**
+	 * Thread function which parses files
+	 */
+	static void* LoadThread(void* arg);
+
 public:
 	/**
 	 * Constructs empty datasource
@@ -80,13 +167,54 @@ public:
 	virtual ~PreloadedGPXDatasource();
 
 	/**
-	 * Parses OSM dump file and loads map data into memory
+	 * Parses GPX file and adds its tracks to loaded ones
 	 *
-	 * @param filename path to dump file
+	 * @param filename path to GPX file
 	 */
 	virtual void Load(const char* filename);
 
+	/**
+	 * Parses a number of GPX files concurrently and adds their
+	 * tracks to loaded ones
+	 *
+	 * Files which fail to load are skipped, and the rest are
+	 * loaded anyway. Tracks are added in order of files
+	 * regardless of number of threads.
+	 *
+	 * @param filenames paths to GPX files
+	 * @param nthreads number of threads to use
+	 * @param errors error messages for failed files are
+	 *        appended here, prefixed with file names
+	 * @return number of successfully loaded files
+	 */
+	size_t LoadFiles(const std::vector<std::string>& filenames, int nthreads, std::vector<std::string>& errors);
+
+	/**
+	 * Appends paths of all .gpx files in a directory, sorted
+	 *
+	 * @param path path to directory
+	 * @param filenames vector to append paths to
+	 */
+	static void FindFiles(const char* path, std::vector<std::string>& filenames);
+
+	/**
+	 * Returns number of loaded track points
+	 */
+	size_t GetPointsCount() const;
+
+	/**
+	 * Returns number of loaded track segments
+	 */
+	size_t GetSegmentsCount() const;
+
+	/**
+	 * Returns number of simplified levels built, not counting
+	 * original tracks
+	 */
+	size_t GetSimplifiedLevelsCount() const;
+
 	virtual void GetPoints(std::vector<Vector3i>& out, const BBoxi& bbox) const;
+	virtual void GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int tolerance) const;
 };
 
 #endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRELOADEDPBFDATASOURCE_HH
+#define PRELOADEDPBFDATASOURCE_HH
+
+#include <glosm/PreloadedXmlDatasource.hh>
+
+/**
+ * Source of OpenStreetMap data which preloads .osm.pbf dump into
+ * memory.
+ *
+ * Data is stored and processed the same way PreloadedXmlDatasource
+ * does (and all of its facilities like snapshots are available),
+ * only input format differs. Blobs of the file are inflated and
+ * decoded on a pool of threads, while decoded blocks are merged
+ * into storage in the order of the file.
+ *
+ * As with XML, nodes are expected to come before ways, and ways
+ * before relations, which is the case for all common dumps.
+ */
+class PreloadedPbfDatasource : public PreloadedXmlDatasource {
+public:
+	/**
+	 * Constructs empty datasource
+	 */
+	PreloadedPbfDatasource();
+
+	/**
+	 * Destructor
+	 */
+	virtual ~PreloadedPbfDatasource();
+
+	/**
+	 * Parses PBF dump file with a single decoding thread
+	 *
+	 * @param filename path to dump file
+	 */
+	virtual void Load(const char* filename);
+
+	/**
+	 * Parses PBF dump file decoding blobs with multiple threads
+	 *
+	 * @param filename path to dump file
+	 * @param nthreads number of decoding threads
+	 */
+	virtual void LoadParallel(const char* filename, int nthreads);
+};
+
+#endif
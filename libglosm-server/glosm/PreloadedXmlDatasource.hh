@@ -26,6 +26,13 @@
 #include <glosm/XMLParser.hh>
 #include <glosm/NonCopyable.hh>
 #include <glosm/id_map.hh>
+#include <glosm/packed_node_map.hh>
+#include <glosm/PackedRTree.hh>
+#include <glosm/WayStore.hh>
+
+#include <vector>
+
+#include <pthread.h>
 
 /**
  * Excepion that denotes inconsistent OSM data
@@ -41,21 +48,75 @@ class DataException : public Exception {
  * memory.
  */
 class PreloadedXmlDatasource : public XMLParser, public OsmDatasource, private NonCopyable {
+public:
+	/**
+	 * Restrictions on data which is kept on load
+	 *
+	 * Objects which can never produce geometry are dropped as
+	 * early as possible, which saves memory and processing time.
+	 */
+	struct LoadFilter {
+		/** area of interest; ways and relations touching it are
+		 * kept whole, other objects outside it are dropped */
+		BBoxi bbox;
+
+		/** extension of bbox to each side, in bbox units */
+		osmint_t margin;
+
+		/** ways and multipolygons without any of these keys are
+		 * dropped, unless ways are parts of kept multipolygons;
+		 * empty to keep everything */
+		std::vector<tagid_t> keys;
+
+		/** drop nodes not used by kept ways and relations */
+		bool prune_nodes;
+
+		LoadFilter() : bbox(BBoxi::Full()), margin(0), prune_nodes(false) {
+		}
+	};
+
 protected:
 	enum CurrentTag {
 		NONE,
-		OSM, /* root */
+		OSM, /* root, or action in osmChange */
+		OSMCHANGE, /* root of change file */
 		NODE,
 		WAY,
 		RELATION,
 	};
 
 protected:
-	typedef id_map<osmid_t, Node> NodesMap;
+#if defined(WITH_PACKED_NODES)
+	/* compact storage for sorted dumps */
+	typedef packed_node_map<osmid_t, Node> NodesMap;
+#else
+	/* node table is the largest structure for big dumps and is
+	 * accessed randomly, so it's placed in huge pages, or in
+	 * files if FilePageAllocator::SetDirectory() was called */
+	typedef id_map<osmid_t, Node, 2097152, FilePageAllocator> NodesMap;
+#endif
 	//typedef id_map<osmid_t, TagsMap> NodeTagsMap;
 	typedef id_map<osmid_t, Way> WaysMap;
 	typedef id_map<osmid_t, Relation> RelationsMap;
 
+	/* values are indexes in way_store_, which is filled in
+	 * the order of the index */
+	typedef PackedRTree<size_t> WaysIndex;
+
+	/* relation id -> ids of ways synthesized from it */
+	typedef id_map<osmid_t, std::vector<osmid_t> > SyntheticWaysMap;
+
+	/* state of ApplyChange() */
+	struct ChangeSet;
+
+	/* closed ring assembled from multipolygon members */
+	struct Ring {
+		Way::NodesList Nodes;
+		bool Inner;
+	};
+
+	typedef std::vector<Ring> RingsList;
+
 protected:
 	/* data */
 	NodesMap nodes_;
@@ -63,6 +124,26 @@ protected:
 	WaysMap ways_;
 	RelationsMap relations_;
 
+	/* ways are moved into way_store_ when it's built along with
+	 * spatial index over it, and ways_ items only keep bboxes and
+	 * flags; nodes, coordinates and tags are copied back into
+	 * items which are asked for by GetWay() or pointer GetWays(),
+	 * or reprocessed by ApplyChange() */
+	WayStore way_store_;
+	WaysIndex ways_index_;
+
+	/* ways_ items in the order of way_store_ */
+	std::vector<const Way*> way_pointers_;
+
+	/* indexes of way_store_ sorted by way id */
+	std::vector<size_t> store_by_id_;
+
+	/* guards restoring of ways_ items by const accessors */
+	mutable pthread_mutex_t restore_mutex_;
+
+	/* multipolygon ways, to be replaced when relation changes */
+	SyntheticWaysMap synthetic_ways_;
+
 	/* parser state */
 	CurrentTag current_tag_;
 	int tag_level_;
@@ -72,8 +153,24 @@ protected:
 	WaysMap::iterator last_way_;
 	RelationsMap::iterator last_relation_;
 
+	/* ids of recently met tag strings; each parsing thread has
+	 * own datasource, so dictionary lock is rarely touched */
+	TagDictionary::Cache tag_cache_;
+
 	BBoxi bbox_;
 
+	/* level of node/way/relation elements: 1 in .osm, 2 in .osc */
+	int object_level_;
+
+	/* non-NULL while change file is parsed */
+	ChangeSet* change_;
+
+	/* load filter; keys are sorted */
+	LoadFilter filter_;
+
+	/* filter bbox extended by margin */
+	BBoxi filter_bbox_;
+
 	/* id counter for syntheric objects; goes down from max possible ID */
 	static osmid_t next_synthetic_id_;
 
@@ -90,14 +187,165 @@ protected:
 
 protected:
 	/**
-	 * Extra processing for ways
+	 * Calculates bbox and flags of a way
+	 *
+	 * This only reads nodes_, so it may be called for different
+	 * ways from multiple threads.
+	 *
+	 * @param missing set to id of first missing node, or 0 if
+	 *        way has too few nodes
+	 * @return false if the way is invalid and should be dropped
+	 */
+	bool ProcessWay(Way& way, osmid_t& missing) const;
+
+	/**
+	 * Reports way dropped by ProcessWay()
+	 */
+	void WarnDroppedWay(osmid_t id, osmid_t missing) const;
+
+	/**
+	 * Checks whether relation is a multipolygon
+	 */
+	static bool IsMultipolygon(const Relation& relation);
+
+	/**
+	 * Merges member ways of multipolygon into closed rings
+	 *
+	 * This only reads ways_, so it may be called for different
+	 * relations from multiple threads.
+	 *
+	 * @param missing receives ids of member ways not found
+	 */
+	void AssembleMultipolygon(const Relation& relation, RingsList& rings, std::vector<osmid_t>& missing) const;
+
+	/**
+	 * Stores rings of multipolygon as synthetic ways
+	 */
+	void AddMultipolygon(osmid_t id, const Relation& relation, RingsList& rings);
+
+	/**
+	 * Assembles single multipolygon
+	 */
+	void FinalizeRelation(osmid_t id);
+
+	/**
+	 * Checks whether tags contain any of filter keys
+	 */
+	bool HasFilterKey(const TagsMap& tags) const;
+
+	/**
+	 * Drops ways and relations rejected by filter
+	 */
+	void FilterObjects();
+
+	/**
+	 * Drops ways and relations which lie completely outside
+	 * of filter area
+	 */
+	void FilterArea();
+
+	/**
+	 * Drops nodes not used by ways and relations, if filter
+	 * says so, and unused nodes outside of filter area
+	 */
+	void PruneNodes();
+
+	/**
+	 * Builds way store and spatial index for all loaded ways
+	 *
+	 * After that, ways_ items only keep bboxes and flags.
+	 */
+	void BuildIndex();
+
+	/**
+	 * Finds way in way store
+	 *
+	 * @return index of way, or size of store if it's not there
+	 */
+	size_t FindStoredWay(osmid_t id) const;
+
+	/**
+	 * Returns view of ways_ item, whether it was moved into way
+	 * store or not
+	 */
+	WayView GetWayView(osmid_t id, const Way& way) const;
+
+	/**
+	 * Copies nodes, coordinates and tags of ways_ item back
+	 * from way store, if they were moved there
+	 */
+	void RestoreWay(osmid_t id, Way& way) const;
+
+	/**
+	 * Same as above, for way with known index in way store
+	 */
+	void RestoreStoredWay(size_t index, Way& way) const;
+
+	/**
+	 * Moves all ways back from way store, and drops the store
+	 * and spatial index
+	 */
+	void RestoreWays();
+
+	/**
+	 * Extra processing after all data is loaded
+	 *
+	 * Ways and relations are not processed while parsing, so
+	 * it doesn't matter in which order objects come in a file.
+	 * Instead, after loading, bboxes and flags of all ways are
+	 * calculated and then multipolygons are assembled, both
+	 * in parallel.
+	 *
+	 * @param nthreads number of threads to use
+	 */
+	void FinalizeLoad(int nthreads);
+
+	/**
+	 * Fills numbers of loaded objects in progress report
+	 */
+	virtual void GetLoadCounts(LoadListener::Progress& progress) const;
+
+	/**
+	 * Removes ways synthesized from a relation
+	 */
+	void DropSyntheticWays(osmid_t relation);
+
+	/**
+	 * Removes previous version of an object met in change file
+	 *
+	 * @return true if new version should be stored
+	 */
+	bool BeginChange(CurrentTag type, osmid_t id);
+
+	/**
+	 * Reprocesses ways and relations affected by change file
+	 */
+	void FinalizeChange();
+
+	/* parallel loading helpers */
+	struct ParseTask;
+	struct NodeMover;
+	struct WayMover;
+	struct RelationMover;
+
+	/* parallel finalization helpers */
+	struct WayTask;
+	struct RelationTask;
+
+	/**
+	 * Thread function which processes a range of ways
 	 */
-	void FinalizeWay();
+	static void* WayThread(void* arg);
 
 	/**
-	 * Extra processing for relations
+	 * Thread function which assembles a range of multipolygons
 	 */
-	void FinalizeRelation();
+	static void* RelationThread(void* arg);
+
+	/**
+	 * Thread function which parses part of a dump
+	 */
+	static void* ParseThread(void* arg);
 
 public:
 	/**
@@ -110,6 +358,19 @@ public:
 	 */
 	virtual ~PreloadedXmlDatasource();
 
+	/**
+	 * Sets filter for subsequent loads
+	 *
+	 * Filter applies to Load() and LoadParallel(), but not to
+	 * snapshots and changes. Objects rejected by filter are
+	 * dropped after relations are loaded, as those may need
+	 * them; nodes outside the area are kept until then, so
+	 * ways crossing its border keep all their nodes.
+	 *
+	 * @param filter filter to use
+	 */
+	void SetLoadFilter(const LoadFilter& filter);
+
 	/**
 	 * Parses OSM dump file and loads map data into memory
 	 *
@@ -117,6 +378,90 @@ public:
 	 */
 	virtual void Load(const char* filename);
 
+	/**
+	 * Parses OSM dump file using multiple threads
+	 *
+	 * File is split into parts at object boundaries, and these
+	 * are parsed in parallel. After that, results are merged in
+	 * the order of the file and ways and relations are processed,
+	 * so loaded data is exactly the same as with Load().
+	 *
+	 * Falls back to Load() for stdin, non-regular files and files
+	 * which structure was not recognized.
+	 *
+	 * @param filename path to dump file
+	 * @param nthreads number of threads to use
+	 */
+	virtual void LoadParallel(const char* filename, int nthreads);
+
+	/**
+	 * Saves loaded data into binary snapshot file
+	 *
+	 * Snapshot contains complete state of the datasource after
+	 * loading (including synthetic multipolygon ways, computed
+	 * way bboxes and flags), so it may be loaded back with
+	 * LoadSnapshot() without any further processing.
+	 *
+	 * @param filename path to snapshot file
+	 */
+	void SaveSnapshot(const char* filename) const;
+
+	/**
+	 * Loads binary snapshot file saved with SaveSnapshot()
+	 *
+	 * Unlike Load(), this replaces any previously loaded data.
+	 *
+	 * @param filename path to snapshot file
+	 */
+	void LoadSnapshot(const char* filename);
+
+	/**
+	 * Applies osmChange (.osc) file to loaded data
+	 *
+	 * Objects are created, replaced and deleted as the file says.
+	 * After that, ways which nodes have moved and multipolygons
+	 * which member ways have changed are processed again.
+	 * Ways which reference missing nodes are dropped, like on
+	 * load.
+	 *
+	 * Bounding boxes of all changed ways, both before and after
+	 * the change, are appended to dirty, so only tiles which
+	 * intersect those need to be rebuilt.
+	 *
+	 * Data must not be accessed from other threads during the
+	 * update. Nodes must not be inlined, as ways may need them.
+	 * If the file is broken, changes parsed before the error are
+	 * still applied.
+	 *
+	 * @param filename path to change file
+	 * @param dirty vector to append dirty areas to
+	 */
+	void ApplyChange(const char* filename, std::vector<BBoxi>& dirty);
+
+	/**
+	 * Stores node coordinates directly in ways
+	 *
+	 * Fills coordinates of each loaded way and frees all nodes which
+	 * are not referenced by relations, as ways no longer need
+	 * them. This saves memory and removes a node lookup for each
+	 * vertex of a way, but GetNode() and TryGetNode() won't find
+	 * most nodes afterwards.
+	 *
+	 * Should be called after Load().
+	 */
+	void InlineNodes();
+
+	/**
+	 * Returns loaded ways
+	 *
+	 * This is where nodes, coordinates and tags of all ways
+	 * are kept after loading. Ways are stored in spatial order.
+	 * The store is rebuilt by any modification of the datasource.
+	 */
+	const WayStore& GetWayStore() const {
+		return way_store_;
+	}
+
 	/**
 	 * Drops all loaded data
 	 *
@@ -144,11 +489,26 @@ public:
 	virtual BBoxi GetBBox() const;
 
 public:
-	virtual const Node& GetNode(osmid_t id) const;
+	virtual Node GetNode(osmid_t id) const;
+
+	/**
+	 * Returns way by its id
+	 *
+	 * Way object is filled from way store on first request and
+	 * takes memory from then on, so views should be preferred
+	 * for reading many ways; same applies to pointer GetWays().
+	 */
 	virtual const Way& GetWay(osmid_t id) const;
+
 	virtual const Relation& GetRelation(osmid_t id) const;
 
-	virtual void GetWays(std::vector<Way>& out, const BBoxi& bbox) const;
+	virtual bool TryGetNode(osmid_t id, Node& out) const;
+	virtual bool TryGetWay(osmid_t id, WayView& out) const;
+	virtual bool TryGetNodes(const osmid_t* ids, size_t count, Vector2i* out) const;
+
+	using OsmDatasource::GetWays;
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const;
+	virtual void GetWays(std::vector<WayView>& out, const BBoxi& bbox) const;
 };
 
 #endif
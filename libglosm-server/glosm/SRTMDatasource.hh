@@ -22,53 +22,169 @@
 #define SRTMDATASOURCE_HH
 
 #include <glosm/HeightmapDatasource.hh>
+#include <glosm/NonCopyable.hh>
 
 #include <stdint.h>
 #include <pthread.h>
 
 #include <vector>
-#include <map>
 
-class SRTMDatasource : public HeightmapDatasource {
-protected:
-	struct ChunkId {
-		short lon;
-		short lat;
-
-		ChunkId(short lo, short la): lon(lo), lat(la) {
-		}
+class MappedFile;
 
-		bool operator< (const ChunkId& other) const {
-			return lon < other.lon || (lon == other.lon && lat < other.lat);
-		}
+/**
+ * Source of heightmap data from SRTM3 .hgt files
+ *
+ * Files are memory mapped on first access, and samples, which
+ * are big-endian in .hgt files, are converted as they are read.
+ * Mapped files are kept in cache limited by total size of
+ * mappings; when the limit is exceeded, files not used recently
+ * are unmapped (CLOCK approximation of LRU).
+ *
+ * Height queries of mapped files take no locks: chunks are found
+ * in a fixed table indexed by coordinates, and each chunk has
+ * a counter of readers, which prevents it from being unmapped
+ * while in use. Mutex is only taken to map a file.
+ *
+ * Missing or broken files are reported once and read as zero
+ * height.
+ */
+class SRTMDatasource : public HeightmapDatasource, private NonCopyable {
+public:
+	enum {
+		/* enough for 32 files */
+		DEFAULT_CACHE_SIZE = 96 * 1024 * 1024,
 	};
 
+protected:
+	/**
+	 * One-degree square of SRTM data
+	 *
+	 * Chunk objects live as long as datasource does, only their
+	 * files are unmapped, so readers may always touch counters.
+	 */
 	struct Chunk {
-		int generation;
-		std::vector<int16_t> data;
+		enum State {
+			EMPTY,
+			READY,
+			EVICTING,
+		};
+
+		/* set and cleared under mutex */
+		MappedFile* file;
+		const unsigned char* data;
+		volatile int state;
+
+		/* updated by readers without lock */
+		volatile int readers;
+		volatile int referenced;
+		volatile size_t hits;
+
+		Chunk() : file(NULL), data(NULL), state(EMPTY), readers(0), referenced(0), hits(0) {}
+
+		/**
+		 * Returns height of a sample in meters
+		 *
+		 * @param pos sample number from west edge
+		 * @param line sample number from south edge
+		 */
+		inline int GetSample(int pos, int line) const;
+
+		/**
+		 * Returns height of a point inside a cell, in fixed-point
+		 * units
+		 *
+		 * @param pos, line bottom left sample of the cell
+		 * @param fx, fy position inside the cell, in 1/SUBCELL
+		 *        fractions
+		 */
+		inline osmint_t Interpolate(int pos, int line, int fx, int fy) const;
 	};
 
-protected:
-	typedef std::map<ChunkId, Chunk> ChunksMap;
+	typedef std::vector<Chunk*> ChunksVector;
 
 protected:
 	const char* storage_path_;
-	mutable int generation_;
 
 	mutable pthread_mutex_t mutex_;
 
-	mutable ChunksMap chunks_;
+	/* table of 360x180 chunks, created on first access; pointers
+	 * are read without lock */
+	Chunk* volatile* chunks_;
+
+	/* stands for chunks beyond the table, reads as zero */
+	mutable Chunk void_chunk_;
+
+	/* chunks with files mapped and hand of the clock */
+	mutable ChunksVector resident_;
+	mutable size_t clock_hand_;
+
+	size_t cache_size_;
+	mutable size_t mapped_bytes_;
+
+	mutable size_t misses_;
 
 protected:
-	Chunk& RequireChunk(int lon, int lat) const;
-	osmint_t GetPointHeight(int x, int y) const;
+	/**
+	 * Returns chunk with reader reference held, mapping its
+	 * file if needed
+	 *
+	 * Reference must be released with ReleaseChunk() before
+	 * acquiring another one.
+	 */
+	const Chunk& AcquireChunk(int lon, int lat) const;
+
+	/**
+	 * Releases chunk reference
+	 */
+	void ReleaseChunk(const Chunk& chunk) const;
+
+	/**
+	 * Maps file of a chunk and returns it with reference held;
+	 * called with mutex locked
+	 */
+	const Chunk& LoadChunk(int lon, int lat) const;
+
+	/**
+	 * Unmaps chunks which were not used recently until cache fits
+	 * into the limit; called with mutex locked
+	 *
+	 * Chunks in use are skipped, as well as the given one.
+	 */
+	void TrimCache(const Chunk* keep) const;
 
 public:
-	SRTMDatasource(const char* storage_path);
+	/**
+	 * Constructs datasource
+	 *
+	 * @param storage_path path to directory with .hgt files
+	 * @param cache_size limit of size of mapped files, in bytes
+	 */
+	SRTMDatasource(const char* storage_path, size_t cache_size = DEFAULT_CACHE_SIZE);
 	virtual ~SRTMDatasource();
 
+	/**
+	 * Changes limit of size of mapped files
+	 */
+	void SetCacheSize(size_t cache_size);
+
+	/**
+	 * Returns number of chunk lookups which found chunk mapped
+	 */
+	size_t GetCacheHits() const;
+
+	/**
+	 * Returns number of chunk lookups which had to map a file
+	 */
+	size_t GetCacheMisses() const;
+
+	/**
+	 * Returns total size of currently mapped files, in bytes
+	 */
+	size_t GetMappedBytes() const;
+
 	virtual void GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const;
 	virtual osmint_t GetHeight(const Vector2i& where) const;
+	virtual void GetHeights(const Vector2i* in, osmint_t* out, size_t n) const;
 };
 
 #endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHARDEDOSMDATASOURCE_HH
+#define SHARDEDOSMDATASOURCE_HH
+
+#include <glosm/OsmDatasource.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <string>
+#include <vector>
+
+class PreloadedXmlDatasource;
+
+/**
+ * Source of OpenStreetMap data combined from multiple datasources.
+ *
+ * This is used when an area is split into regional files: each
+ * file is loaded into its own datasource (shard), and shards may
+ * be loaded concurrently. Each shard is keyed by its bounding
+ * box, and object requests are only routed to shards which may
+ * contain requested area.
+ *
+ * Ways which cross shard borders are usually present in all
+ * shards they touch. Such ways are returned once: when a way
+ * found in one shard lies within bbox of another shard also
+ * queried, it's compared to ways of that shard by node ids and
+ * tags, and duplicates from later shards are dropped.
+ *
+ * Lookups by id go to all shards in order they were added, and
+ * first found object is returned.
+ *
+ * After loading, datasource is read-only, and it's safe to
+ * query it from multiple threads if all shards are.
+ */
+class ShardedOsmDatasource : public OsmDatasource, private NonCopyable {
+protected:
+	struct Shard {
+		OsmDatasource* datasource;
+		BBoxi bbox;
+
+		/* non-NULL if shard is to be loaded by Load() */
+		PreloadedXmlDatasource* loadable;
+		std::string filename;
+
+		Shard(OsmDatasource* d) : datasource(d), bbox(d->GetBBox()), loadable(NULL) {}
+	};
+
+	typedef std::vector<Shard> ShardsVector;
+
+	/* parallel loading helper */
+	struct LoadTask;
+
+protected:
+	ShardsVector shards_;
+	BBoxi bbox_;
+
+protected:
+	/**
+	 * Queries all shards which intersect bbox and drops
+	 * duplicate ways
+	 */
+	template <class W>
+	void QueryShards(std::vector<W>& out, const BBoxi& bbox) const;
+
+	/**
+	 * Thread function which loads shards
+	 */
+	static void* LoadThread(void* arg);
+
+public:
+	/**
+	 * Constructs datasource with no shards
+	 */
+	ShardedOsmDatasource();
+
+	/**
+	 * Destructor
+	 *
+	 * Destroys all shards.
+	 */
+	virtual ~ShardedOsmDatasource();
+
+	/**
+	 * Adds shard which already holds its data
+	 *
+	 * @param datasource shard; datasource takes ownership of it
+	 */
+	void AddShard(OsmDatasource* datasource);
+
+	/**
+	 * Adds shard to be loaded from file by Load()
+	 *
+	 * Load filter, if needed, should be set on the shard
+	 * beforehand.
+	 *
+	 * @param datasource empty shard; datasource takes ownership of it
+	 * @param filename path to dump file
+	 */
+	void AddShard(PreloadedXmlDatasource* datasource, const char* filename);
+
+	/**
+	 * Loads all shards added with file names
+	 *
+	 * Shards are loaded concurrently; if there are more threads
+	 * than shards, remaining threads are used to parse each
+	 * shard in parallel.
+	 *
+	 * @param nthreads number of threads to use
+	 * @param inline_nodes whether to call InlineNodes() on
+	 *        loaded shards, which saves memory when nodes
+	 *        won't be needed by themselves
+	 */
+	void Load(int nthreads, bool inline_nodes = false);
+
+	/**
+	 * Returns number of shards
+	 */
+	inline size_t GetShardsCount() const {
+		return shards_.size();
+	}
+
+	/**
+	 * Returns shard by its index
+	 */
+	inline const OsmDatasource& GetShard(size_t index) const {
+		return *shards_[index].datasource;
+	}
+
+public:
+	virtual Node GetNode(osmid_t id) const;
+	virtual const Way& GetWay(osmid_t id) const;
+	virtual const Relation& GetRelation(osmid_t id) const;
+
+	virtual bool TryGetNode(osmid_t id, Node& out) const;
+	virtual bool TryGetWay(osmid_t id, WayView& out) const;
+	virtual bool TryGetNodes(const osmid_t* ids, size_t count, Vector2i* out) const;
+
+	using OsmDatasource::GetWays;
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const;
+	virtual void GetWays(std::vector<WayView>& out, const BBoxi& bbox) const;
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TAGDICTIONARY_HH
+#define TAGDICTIONARY_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <vector>
+
+/* Id of interned string */
+typedef uint32_t tagid_t;
+
+/**
+ * Process-wide dictionary of tag keys and values.
+ *
+ * Maps each distinct string to a small integer id, so objects
+ * may store and compare tags as integers, while each string is
+ * stored once. Ids are never reused or invalidated, which also
+ * makes them safe to share between datasources.
+ *
+ * Lookups in Intern() and Find() are done under shared lock, so
+ * they may run concurrently; only adding new strings is exclusive.
+ * GetString() is lock-free: strings are never moved once stored.
+ * Parsers which intern many strings from several threads should
+ * go through a Cache each, which avoids the lock for strings
+ * seen recently.
+ */
+class TagDictionary : private NonCopyable {
+public:
+	/** Id which is never assigned to any string */
+	static const tagid_t NONE = 0;
+
+protected:
+	enum {
+		CHUNK_BITS = 16,
+		CHUNK_SIZE = 1 << CHUNK_BITS,
+		MAX_CHUNKS = 1 << 16,
+
+		ARENA_PAGE_SIZE = 65536,
+	};
+
+protected:
+	/* id -> string; two-level so pointers never move */
+	const char** chunks_[MAX_CHUNKS];
+
+	/* string -> id; open addressing, 0 denotes empty slot */
+	std::vector<tagid_t> hash_;
+	std::vector<uint32_t> hashes_;
+
+	/* storage for string data */
+	std::vector<char*> arena_pages_;
+	size_t arena_used_;
+
+	tagid_t next_id_;
+
+	mutable pthread_rwlock_t lock_;
+
+protected:
+	TagDictionary();
+	~TagDictionary();
+
+	static TagDictionary& Instance();
+
+	static uint32_t Hash(const char* str, size_t len);
+
+	const char* Store(const char* str, size_t len);
+	void Rehash(size_t size);
+
+	tagid_t Lookup(const char* str, uint32_t hash) const;
+	tagid_t Insert(const char* str, size_t len, uint32_t hash);
+
+	tagid_t DoIntern(const char* str, size_t len, uint32_t hash, bool create);
+
+public:
+	/**
+	 * Per-thread front of the dictionary.
+	 *
+	 * Remembers ids of recently interned strings in a small
+	 * direct-mapped table, so repeated strings, which most of
+	 * tag keys and values in OSM data are, are resolved without
+	 * touching the dictionary lock. Cache itself is not
+	 * thread-safe: each thread should use its own.
+	 */
+	class Cache : private NonCopyable {
+	protected:
+		enum {
+			SIZE_BITS = 12,
+			SIZE = 1 << SIZE_BITS,
+		};
+
+		struct Entry {
+			uint32_t hash;
+			tagid_t id;
+
+			Entry() : hash(0), id(NONE) {}
+		};
+
+	protected:
+		std::vector<Entry> entries_;
+
+	public:
+		Cache();
+
+		/**
+		 * Returns id of a string, adding it to dictionary if
+		 * needed; same as TagDictionary::Intern()
+		 */
+		tagid_t Intern(const char* str);
+	};
+
+public:
+	/**
+	 * Returns id of a string, adding it to dictionary if needed
+	 */
+	static tagid_t Intern(const char* str);
+
+	/**
+	 * Returns id of a string if it's in dictionary, NONE otherwise
+	 */
+	static tagid_t Find(const char* str);
+
+	/**
+	 * Returns string by its id
+	 *
+	 * @note id must've been returned by Intern()
+	 */
+	static const char* GetString(tagid_t id) {
+		TagDictionary& self = Instance();
+		return self.chunks_[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+	}
+
+	/**
+	 * Returns number of strings in dictionary
+	 */
+	static size_t GetSize();
+
+	/**
+	 * Returns memory used by dictionary, in bytes
+	 */
+	static size_t GetFootprint();
+};
+
+#endif
@@ -21,37 +21,76 @@
 #ifndef WAYMERGER_HH
 #define WAYMERGER_HH
 
-#include <map>
 #include <vector>
 
-#include <glosm/osmtypes.h>
+#include <glosm/OsmDatasource.hh>
 
 /**
  * Class that merges complete ways from parts
  *
+ * Parts are linked by their tip nodes, which are looked up
+ * in a hash table, so merging takes linear time in number of
+ * parts. Parts may be reversed to fit.
+ *
  * @note this currently only works with closed ways, but a
  *       flag(s) may be added to support e.g routes
  */
 class WayMerger {
 protected:
-	typedef std::multimap<osmid_t, const OsmDatasource::Way::NodesList*> WayByTipMap;
+	typedef OsmDatasource::Way::NodesList NodesList;
+	typedef OsmDatasource::ArrayView<osmid_t> NodesView;
 
-	typedef std::vector<osmid_t> NodeChain;
-	typedef std::vector<NodeChain> NodeChainVector;
+	/* tip of a chain; chain i has its front tip at 2i
+	 * and back tip at 2i + 1 */
+	struct Tip {
+		osmid_t node;
+		int next;
+	};
 
 protected:
-	WayByTipMap way_by_node;
-	WayByTipMap way_by_node_rev;
+	std::vector<NodesView> chains_;
+	std::vector<bool> used_;
+
+	std::vector<Tip> tips_;
+
+	/* heads of tip lists, by hash of node id */
+	std::vector<int> buckets_;
+
+	/* first chain which may be unused */
+	size_t first_unused_;
 
 public:
 	WayMerger();
 
-	void AddWay(const OsmDatasource::Way::NodesList& nodes);
+	/**
+	 * Adds a part
+	 *
+	 * Nodes are not copied and must be valid until merging is
+	 * finished.
+	 */
+	void AddWay(const NodesView& nodes);
 
-	bool GetNextWay(OsmDatasource::Way::NodesList& outnodes);
+	/**
+	 * Extracts next complete way
+	 *
+	 * Parts which can't be completed into closed way are dropped.
+	 *
+	 * @return false if there are no more complete ways
+	 */
+	bool GetNextWay(NodesList& outnodes);
 
 protected:
-	const OsmDatasource::Way::NodesList* PickChain(osmid_t id = 0, bool reverse = false);
+	/**
+	 * Builds hash table of tips
+	 */
+	void BuildIndex();
+
+	/**
+	 * Finds tip of unused chain at given node
+	 *
+	 * @return tip index or -1 if not found
+	 */
+	int FindTip(osmid_t node);
 };
 
 #endif
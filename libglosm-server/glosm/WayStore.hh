@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WAYSTORE_HH
+#define WAYSTORE_HH
+
+#include <glosm/OsmDatasource.hh>
+
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Columnar storage of ways.
+ *
+ * Instead of an object per way, which holds its nodes and tags
+ * in separate heap blocks, each field of all ways is kept in its
+ * own flat array: bboxes, flags, ids. Nodes, coordinates and
+ * tags of all ways are concatenated and indexed by offset arrays
+ * (that is, stored in CSR form).
+ *
+ * So scans over many ways touch contiguous memory, and there's
+ * no per-way allocation overhead. Ways are accessed by index in
+ * order of addition, as WayView.
+ *
+ * Ways can only be appended, save for coordinates which may be
+ * set later; to modify ways otherwise, fill another store and
+ * swap it with this one.
+ */
+class WayStore {
+protected:
+	enum Flags {
+		CLOSED = 0x01,
+		CLOCKWISE = 0x02,
+		INNER = 0x04,
+		COORDS = 0x08,
+	};
+
+	typedef OsmDatasource::TagsMap::value_type Tag;
+
+protected:
+	std::vector<osmid_t> ids_;
+	std::vector<BBoxi> bboxes_;
+	std::vector<uint8_t> flags_;
+
+	/* way i has nodes [node_offsets_[i]; node_offsets_[i + 1]) */
+	std::vector<size_t> node_offsets_;
+	std::vector<osmid_t> nodes_;
+
+	/* coordinates of nodes, same offsets as nodes_; only
+	 * allocated when first way with coordinates is added */
+	std::vector<Vector2i> coords_;
+
+	/* way i has tags [tag_offsets_[i]; tag_offsets_[i + 1]) */
+	std::vector<size_t> tag_offsets_;
+	std::vector<Tag> tags_;
+
+public:
+	WayStore();
+
+	/**
+	 * Adds a way
+	 *
+	 * @return index of added way
+	 */
+	size_t Append(osmid_t id, const OsmDatasource::Way& way);
+
+	/**
+	 * Adds a way from a view, which may not refer to this store
+	 *
+	 * @return index of added way
+	 */
+	size_t Append(osmid_t id, const OsmDatasource::WayView& way);
+
+	/**
+	 * Sets coordinates of nodes of way with given index
+	 *
+	 * @param coords array of as many coordinates as way has nodes
+	 */
+	void SetCoords(size_t index, const Vector2i* coords);
+
+	/**
+	 * Preallocates memory for given number of ways, nodes and
+	 * tags
+	 */
+	void Reserve(size_t ways, size_t nodes, size_t tags);
+
+	/**
+	 * Removes all ways and frees memory
+	 */
+	void Clear();
+
+	/**
+	 * Exchanges contents with other store
+	 */
+	void Swap(WayStore& other);
+
+	/**
+	 * Returns view of way with given index
+	 */
+	OsmDatasource::WayView GetView(size_t index) const;
+
+	inline osmid_t GetId(size_t index) const {
+		return ids_[index];
+	}
+
+	inline const BBoxi& GetBBox(size_t index) const {
+		return bboxes_[index];
+	}
+
+	inline size_t GetSize() const {
+		return ids_.size();
+	}
+
+	inline bool IsEmpty() const {
+		return ids_.empty();
+	}
+
+	/**
+	 * Checks whether any way has coordinates
+	 */
+	inline bool HasCoords() const {
+		return !coords_.empty();
+	}
+
+	/**
+	 * Returns memory used by the store, in bytes
+	 */
+	size_t GetFootprint() const;
+};
+
+#endif
@@ -22,6 +22,13 @@
 #define XMLPARSER_HH
 
 #include <glosm/Exception.hh>
+#include <glosm/Decompressor.hh>
+#include <glosm/LoadListener.hh>
+#include <glosm/Timer.hh>
+
+#include <cstddef>
+
+struct XML_ParserStruct;
 
 /**
  * Excepion that denotes XML parsing error
@@ -43,6 +50,39 @@ protected:
 
 	int flags_;
 
+	/* tokenizer used for next Load() */
+	int tokenizer_;
+
+	class TrustedTokenizer;
+
+	/* tokenizer of current Load(), NULL if expat is used */
+	TrustedTokenizer* trusted_tokenizer_;
+
+	/* statistics of last Load() */
+	size_t loaded_bytes_;
+	float load_time_;
+
+	/* per-stage statistics, for compressed input parsing and
+	 * decompression run in parallel */
+	size_t compressed_bytes_;
+	float parse_time_;
+	float decompress_time_;
+
+	/* listener notified of load progress, may be NULL */
+	LoadListener* load_listener_;
+
+	/* time spent in each phase of last load */
+	float phase_times_[LoadListener::NPHASES];
+
+	/* size of input if known, for progress reports */
+	size_t total_bytes_;
+
+	/* time since start of parsing and time of last progress
+	 * report */
+	Timer progress_timer_;
+	float progress_time_;
+	float reported_time_;
+
 protected:
 	/**
 	 * Static wrapper for StartElement
@@ -74,6 +114,65 @@ protected:
 	 */
 	virtual void CharacterData(const char* data, int len);
 
+	/**
+	 * Creates expat parser with handlers set up
+	 */
+	XML_ParserStruct* CreateParser();
+
+	/**
+	 * Parses a piece of document from memory
+	 *
+	 * With expat, data is copied into parser buffer in chunks;
+	 * trusted tokenizer reads it in place.
+	 */
+	void ParseMemory(XML_ParserStruct* parser, const char* data, size_t size, bool final);
+
+	/**
+	 * Parses memory-mapped file
+	 */
+	void ParseMapped(XML_ParserStruct* parser, const char* filename);
+
+	/**
+	 * Parses file descriptor contents with read(2)
+	 */
+	void ParseStream(XML_ParserStruct* parser, int fd);
+
+	/**
+	 * Parses compressed input, decompressing it on a separate thread
+	 *
+	 * @see Decompressor
+	 */
+	void ParseCompressed(XML_ParserStruct* parser, Decompressor::Format format, const char* prefix, size_t prefixsize, int fd);
+
+	/**
+	 * Resets statistics before load
+	 */
+	void ResetLoadStats();
+
+	/**
+	 * Fills numbers of loaded objects in progress report
+	 *
+	 * Default implementation leaves them zero.
+	 */
+	virtual void GetLoadCounts(LoadListener::Progress& progress) const;
+
+	/**
+	 * Notifies listener of parsing progress, if enough time
+	 * passed since last notification
+	 */
+	void ReportParseProgress();
+
+	/**
+	 * Records time spent in a phase and notifies listener
+	 */
+	void FinishPhase(LoadListener::Phase phase, float time);
+
+	/**
+	 * Adds position to parsing error message, frees parser
+	 * and rethrows
+	 */
+	void ThrowVerbose(XML_ParserStruct* parser, const ParsingException& e);
+
 protected:
 	/**
 	 * Constructs empty datasource
@@ -86,12 +185,92 @@ protected:
 	virtual ~XMLParser();
 
 public:
+	enum Tokenizer {
+		/* generic conforming XML parser */
+		EXPAT_TOKENIZER,
+
+		/* fast tokenizer for well-formed machine-generated
+		 * XML like OSM dumps and GPX tracks. It does minimal
+		 * checking: document is expected to be well-formed,
+		 * UTF-8 encoded, and have no DTD */
+		TRUSTED_TOKENIZER,
+	};
+
+public:
+	/**
+	 * Selects tokenizer used for subsequent loads
+	 *
+	 * Default is EXPAT_TOKENIZER, or TRUSTED_TOKENIZER if glosm
+	 * is built with TRUSTED_XML option. Both produce the same
+	 * sequence of handler calls for well-formed input.
+	 */
+	void SetTokenizer(Tokenizer tokenizer);
+
+	/**
+	 * Sets listener notified of progress of subsequent loads
+	 *
+	 * @param listener listener, or NULL to disable notifications;
+	 *        caller retains ownership of it
+	 */
+	void SetLoadListener(LoadListener* listener);
+
 	/**
 	 * Parses OSM dump file and loads map data into memory
 	 *
 	 * @param filename path to dump file
 	 */
 	virtual void Load(const char* filename);
+
+	/**
+	 * Parses XML document which consists of a number of fragments
+	 * in memory, e.g. parts of a mapped file with additional data
+	 * in between
+	 *
+	 * @param fragments pointers to fragments data
+	 * @param sizes sizes of fragments
+	 * @param count number of fragments
+	 */
+	void LoadFragments(const char* const* fragments, const size_t* sizes, int count);
+
+	/**
+	 * Returns number of bytes parsed by last Load()
+	 */
+	size_t GetLoadedBytes() const;
+
+	/**
+	 * Returns time spent in last Load(), in seconds
+	 */
+	float GetLoadTime() const;
+
+	/**
+	 * Returns parsing speed of last Load(), in bytes per second
+	 */
+	float GetLoadRate() const;
+
+	/**
+	 * Returns number of compressed bytes read by last Load(),
+	 * 0 if input was not compressed
+	 */
+	size_t GetCompressedBytes() const;
+
+	/**
+	 * Returns speed of XML parsing in last Load(), not counting
+	 * time spent waiting for decompressor, in bytes per second
+	 */
+	float GetParseRate() const;
+
+	/**
+	 * Returns speed of decompression in last Load(), not counting
+	 * time spent waiting for parser, in decompressed bytes per
+	 * second; 0 if input was not compressed
+	 */
+	float GetDecompressRate() const;
+
+	/**
+	 * Returns time spent in given phase of last Load(), in
+	 * seconds; 0 for phases the loader doesn't have
+	 */
+	float GetPhaseTime(LoadListener::Phase phase) const;
 };
 
 #endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLAT_ID_MAP_HH
+#define FLAT_ID_MAP_HH
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+#include <stdint.h>
+
+/**
+ * Open addressing variant of id_map for small values.
+ *
+ * Elements are stored right in the hash table, which is a flat
+ * array probed linearly with Robin Hood displacement. Lookup
+ * thus costs single cache miss in most cases (chained id_map
+ * needs two: bucket and element), and iteration is a sequential
+ * scan of the array. Ids are mixed with multiplicative hash, so
+ * strided ids, which are common after filtering, don't form
+ * clusters.
+ *
+ * Elements are copied when table grows and on erase, so this is
+ * only suitable for small, cheaply copyable values such as node
+ * coordinates; use id_map for anything holding containers.
+ *
+ * Interface and usage semantics are the same as for std::map,
+ * except that iteration order is unspecified and any insert or
+ * erase invalidates iterators and pointers. Key EMPTY_KEY is
+ * reserved for marking empty slots and cannot be stored.
+ */
+template <typename I, typename T, I EMPTY_KEY = (I)((uint64_t)1 << (sizeof(I) * 8 - 1))>
+class flat_id_map {
+public:
+	typedef I                                key_type;
+	typedef T                                mapped_type;
+	typedef std::pair<const I, T>            value_type;
+
+	typedef value_type*                      pointer;
+	typedef const value_type*                const_pointer;
+	typedef value_type&                      reference;
+	typedef const value_type&                const_reference;
+
+private:
+	enum {
+		/* hash table never gets smaller than this */
+		MIN_SLOTS = 8,
+	};
+
+	typedef std::vector<value_type>          slot_list;
+
+private:
+	size_t count_;
+	slot_list slots_;
+	int shift_;
+
+public:
+	class iterator;
+
+	class const_iterator {
+	public:
+		typedef const_iterator self;
+
+	private:
+		typedef flat_id_map<I, T, EMPTY_KEY>      map;
+
+		typedef typename map::const_pointer       pointer;
+		typedef typename map::const_reference     reference;
+
+		const value_type* current_;
+		const value_type* end_;
+
+	public:
+		const_iterator() : current_(), end_() {}
+		const_iterator(const value_type* c, const value_type* e) : current_(c), end_(e) {}
+		const_iterator(const iterator& it): current_(it.current_), end_(it.end_) {}
+
+		self& operator++() {
+			current_ = map::skip_empty(current_ + 1, end_);
+			return *this;
+		}
+
+		self operator++(int) {
+			self tmp = *this;
+			current_ = map::skip_empty(current_ + 1, end_);
+			return tmp;
+		}
+
+		reference operator*() const { return *current_; }
+		pointer operator->() const { return current_; }
+
+		bool operator==(const self& x) const { return x.current_ == current_; }
+		bool operator!=(const self& x) const { return x.current_ != current_; }
+	};
+
+	class iterator {
+		friend class const_iterator;
+
+	public:
+		typedef iterator self;
+
+	private:
+		typedef flat_id_map<I, T, EMPTY_KEY>      map;
+
+		typedef typename map::pointer             pointer;
+		typedef typename map::reference           reference;
+
+		value_type* current_;
+		value_type* end_;
+
+	public:
+		iterator() : current_(), end_() {}
+		iterator(value_type* c, value_type* e) : current_(c), end_(e) {}
+
+		self& operator++() {
+			current_ = map::skip_empty(current_ + 1, end_);
+			return *this;
+		}
+
+		self operator++(int) {
+			self tmp = *this;
+			current_ = map::skip_empty(current_ + 1, end_);
+			return tmp;
+		}
+
+		reference operator*() const { return *current_; }
+		pointer operator->() const { return current_; }
+
+		bool operator==(const self& x) const { return x.current_ == current_; }
+		bool operator!=(const self& x) const { return x.current_ != current_; }
+	};
+
+public:
+	flat_id_map(size_t nbuckets = 1024) : count_(0) {
+		assert(nbuckets > 0);
+		assert((nbuckets & (nbuckets - 1)) == 0); // power of two
+
+		resize_table(std::max(nbuckets, (size_t)MIN_SLOTS));
+	}
+
+	virtual ~flat_id_map() {
+	}
+
+	std::pair<iterator, bool> insert(const value_type& v) {
+		assert(v.first != EMPTY_KEY);
+
+		/* keep load factor below 7/8 */
+		if ((count_ + 1) * 8 > slots_.size() * 7)
+			rehash(slots_.size() * 2);
+
+		size_t mask = slots_.size() - 1;
+		size_t pos = home(v.first);
+		size_t dist = 0;
+
+		/* look for existing key until we reach either an empty
+		 * slot or a slot which is closer to its home than we are;
+		 * in latter case the key cannot be found further */
+		for (;; pos = (pos + 1) & mask, ++dist) {
+			const key_type& key = slots_[pos].first;
+			if (key == EMPTY_KEY)
+				break;
+			if (key == v.first)
+				return std::make_pair(make_iterator(pos), false);
+			if (((pos - home(key)) & mask) < dist)
+				break;
+		}
+
+		++count_;
+
+		if (slots_[pos].first == EMPTY_KEY) {
+			assign(slots_[pos], v);
+		} else {
+			/* take the slot and push displaced ones forward */
+			value_type displaced(slots_[pos]);
+			assign(slots_[pos], v);
+			place(displaced, (pos + 1) & mask);
+		}
+
+		return std::make_pair(make_iterator(pos), true);
+	}
+
+	/* erases element with given key, returns number of erased
+	 * elements (0 or 1) */
+	size_t erase(key_type k) {
+		size_t pos = find_slot(k);
+		if (pos == slots_.size())
+			return 0;
+
+		/* backward shift deletion: following elements which are
+		 * not at their home are moved one step back */
+		size_t mask = slots_.size() - 1;
+		for (size_t next = (pos + 1) & mask; slots_[next].first != EMPTY_KEY && home(slots_[next].first) != next; next = (next + 1) & mask) {
+			assign(slots_[pos], slots_[next]);
+			pos = next;
+		}
+
+		assign(slots_[pos], value_type(EMPTY_KEY, T()));
+		--count_;
+
+		return 1;
+	}
+
+	inline size_t size() const {
+		return count_;
+	}
+
+	inline bool empty() const {
+		return count_ == 0;
+	}
+
+	inline size_t bucket_count() const {
+		return slots_.size();
+	}
+
+	void clear() {
+		resize_table(MIN_SLOTS);
+		count_ = 0;
+	}
+
+	iterator find(key_type k) {
+		size_t pos = find_slot(k);
+		if (pos == slots_.size())
+			return end();
+
+		return make_iterator(pos);
+	}
+
+	const_iterator find(key_type k) const {
+		size_t pos = find_slot(k);
+		if (pos == slots_.size())
+			return end();
+
+		return const_iterator(&slots_[pos], end_pointer());
+	}
+
+	/* hints CPU to fetch hash table slot for given key; issuing
+	 * this some lookups ahead of find() hides memory latency
+	 * when looking up many unrelated keys */
+	inline void prefetch(key_type k) const {
+#if defined(__GNUC__)
+		__builtin_prefetch(&slots_[home(k)]);
+#endif
+	}
+
+	iterator begin() {
+		value_type* end = &slots_.front() + slots_.size();
+		return iterator(skip_empty(&slots_.front(), end), end);
+	}
+
+	const_iterator begin() const {
+		return const_iterator(skip_empty(&slots_.front(), end_pointer()), end_pointer());
+	}
+
+	iterator end() {
+		value_type* end = &slots_.front() + slots_.size();
+		return iterator(end, end);
+	}
+
+	const_iterator end() const {
+		return const_iterator(end_pointer(), end_pointer());
+	}
+
+	void swap(flat_id_map<I, T, EMPTY_KEY>& other) {
+		slots_.swap(other.slots_);
+		std::swap(count_, other.count_);
+		std::swap(shift_, other.shift_);
+	}
+
+	/* sets number of hash table slots; it's rounded up if
+	 * current elements would not fit */
+	void rehash(size_t size) {
+		assert(size > 0);
+		assert((size & (size - 1)) == 0); // power of two
+
+		while (size < MIN_SLOTS || count_ * 8 > size * 7)
+			size *= 2;
+
+		slot_list old;
+		old.swap(slots_);
+		resize_table(size);
+
+		for (typename slot_list::const_iterator i = old.begin(); i != old.end(); ++i)
+			if (i->first != EMPTY_KEY)
+				place(*i, home(i->first));
+	}
+
+	/* prepares map to hold given number of elements without
+	 * growing hash table */
+	void reserve(size_t count) {
+		size_t size = MIN_SLOTS;
+		while (count * 8 > size * 7)
+			size *= 2;
+
+		if (size > slots_.size())
+			rehash(size);
+	}
+
+protected:
+	inline size_t home(key_type k) const {
+		return (size_t)(((uint64_t)k * 0x9E3779B97F4A7C15ULL) >> shift_);
+	}
+
+	inline iterator make_iterator(size_t pos) {
+		return iterator(&slots_[pos], &slots_.front() + slots_.size());
+	}
+
+	inline const value_type* end_pointer() const {
+		return &slots_.front() + slots_.size();
+	}
+
+	template <class P>
+	static inline P* skip_empty(P* current, P* end) {
+		while (current != end && current->first == EMPTY_KEY)
+			++current;
+		return current;
+	}
+
+	/* key is const in value_type, so elements are moved around
+	 * by reconstruction */
+	static inline void assign(value_type& to, const value_type& from) {
+		to.~value_type();
+		new(reinterpret_cast<void*>(&to)) value_type(from);
+	}
+
+	/* returns position of slot holding given key or slots_.size() */
+	size_t find_slot(key_type k) const {
+		size_t mask = slots_.size() - 1;
+		size_t pos = home(k);
+
+		for (size_t dist = 0;; pos = (pos + 1) & mask, ++dist) {
+			const key_type& key = slots_[pos].first;
+			if (key == EMPTY_KEY || ((pos - home(key)) & mask) < dist)
+				return slots_.size();
+			if (key == k)
+				return pos;
+		}
+	}
+
+	/* places element which key is known to be absent, starting
+	 * probing from given position */
+	void place(const value_type& v, size_t pos) {
+		size_t mask = slots_.size() - 1;
+		size_t dist = (pos - home(v.first)) & mask;
+
+		value_type carry(v);
+		for (;; pos = (pos + 1) & mask, ++dist) {
+			value_type& s = slots_[pos];
+			if (s.first == EMPTY_KEY) {
+				assign(s, carry);
+				return;
+			}
+
+			size_t sdist = (pos - home(s.first)) & mask;
+			if (sdist < dist) {
+				value_type displaced(s);
+				assign(s, carry);
+				assign(carry, displaced);
+				dist = sdist;
+			}
+		}
+	}
+
+	void resize_table(size_t size) {
+		slot_list(size, value_type(EMPTY_KEY, T())).swap(slots_);
+
+		shift_ = 64;
+		for (size_t i = size; i > 1; i /= 2)
+			--shift_;
+	}
+};
+
+#endif
@@ -21,7 +21,10 @@
 #ifndef ID_MAP_HH
 #define ID_MAP_HH
 
+#include <glosm/PageAllocator.hh>
+
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 
@@ -31,9 +34,15 @@
  * Uses lower bits of object id as a hash for no calculation overhead
  * and pooled data storage to pack elements effeciently.
  *
- * Interface and usage semantics are the same as for std::map
+ * Interface and usage semantics are the same as for std::map,
+ * except that iteration is done in order of insertion: iterators
+ * walk storage pages sequentially and never look into the hash
+ * table.
+ *
+ * Memory for storage pages and hash table is requested from
+ * allocator policy A, see PageAllocator.hh.
  */
-template <typename I, typename T, int PAGE_SIZE = 1048576>
+template <typename I, typename T, int PAGE_SIZE = 1048576, class A = HeapPageAllocator>
 class id_map {
 public:
 	typedef I                                key_type;
@@ -60,7 +69,7 @@ private:
 		typedef const hash_node* const_iterator;
 
 	public:
-		page() : count_(0), data_(reinterpret_cast<hash_node*>(::operator new(PAGE_SIZE))) {
+		page() : count_(0), data_(reinterpret_cast<hash_node*>(A::Allocate(PAGE_SIZE))) {
 			assert(sizeof(hash_node) <= PAGE_SIZE);
 		}
 
@@ -87,7 +96,7 @@ private:
 			if (data_) {
 				for (hash_node* i = data_; i < data_ + count_; ++i)
 					i->data.~value_type();
-				::operator delete(data_);
+				A::Free(data_, PAGE_SIZE);
 			}
 		}
 
@@ -131,7 +140,37 @@ private:
 
 	typedef std::vector<page>                page_list;
 
-	typedef std::vector<hash_node*>          hashtable;
+	/* array of bucket heads; for large maps it's comparable to
+	 * storage in size, so it comes from allocator policy too */
+	class hashtable {
+	public:
+		hashtable(size_t size) : size_(size), data_(static_cast<hash_node**>(A::Allocate(size * sizeof(hash_node*)))) {
+			std::fill(data_, data_ + size_, (hash_node*)NULL);
+		}
+
+		~hashtable() {
+			A::Free(data_, size_ * sizeof(hash_node*));
+		}
+
+		inline size_t size() const { return size_; }
+
+		inline hash_node*& operator[](size_t n) { return data_[n]; }
+		inline hash_node* const& operator[](size_t n) const { return data_[n]; }
+
+		void swap(hashtable& other) {
+			std::swap(size_, other.size_);
+			std::swap(data_, other.data_);
+		}
+
+	private:
+		/* not copyable */
+		hashtable(const hashtable&);
+		hashtable& operator=(const hashtable&);
+
+	private:
+		size_t size_;
+		hash_node** data_;
+	};
 
 private:
 	size_t count_;
@@ -146,7 +185,7 @@ public:
 		typedef const_iterator self;
 
 	private:
-		typedef id_map<I, T, PAGE_SIZE>           map;
+		typedef id_map<I, T, PAGE_SIZE, A>        map;
 
 		typedef const map*                        const_map_ptr;
 
@@ -157,28 +196,24 @@ public:
 		typedef typename map::const_hash_node_ptr const_hash_node_ptr;
 
 		const_map_ptr map_;
+		size_t page_;
 		const_hash_node_ptr current_;
 
 	public:
-		const_iterator() : map_(), current_() {}
-		const_iterator(const_map_ptr m) : map_(m), current_() {}
-		const_iterator(const_map_ptr m, const_hash_node_ptr c) : map_(m), current_(c) {}
-		const_iterator(const iterator& it): map_(it.map_), current_(it.current_) {}
+		const_iterator() : map_(), page_(), current_() {}
+		const_iterator(const_map_ptr m) : map_(m), page_(), current_() {}
+		const_iterator(const_map_ptr m, const_hash_node_ptr c) : map_(m), page_(map::UNKNOWN_PAGE), current_(c) {}
+		const_iterator(const_map_ptr m, size_t p, const_hash_node_ptr c) : map_(m), page_(p), current_(c) {}
+		const_iterator(const iterator& it): map_(it.map_), page_(it.page_), current_(it.current_) {}
 
 		self& operator++() {
-			if (current_->next)
-				current_ = current_->next;
-			else
-				current_ = map_->findfirstafter(current_->data.first);
+			current_ = map_->next(page_, current_);
 			return *this;
 		}
 
 		self operator++(int) {
 			self tmp = *this;
-			if (current_->next)
-				current_ = current_->next;
-			else
-				current_ = map_->findfirstafter(current_->data.first);
+			current_ = map_->next(page_, current_);
 			return tmp;
 		}
 
@@ -196,7 +231,7 @@ public:
 		typedef iterator self;
 
 	private:
-		typedef id_map<I, T, PAGE_SIZE>          map;
+		typedef id_map<I, T, PAGE_SIZE, A>       map;
 
 		typedef const map*                       const_map_ptr;
 
@@ -206,27 +241,23 @@ public:
 
 	private:
 		const_map_ptr map_;
+		size_t page_;
 		hash_node_ptr current_;
 
 	public:
-		iterator() : map_(), current_() {}
-		iterator(const_map_ptr m) : map_(m), current_() {}
-		iterator(const_map_ptr m, hash_node_ptr c) : map_(m), current_(c) {}
+		iterator() : map_(), page_(), current_() {}
+		iterator(const_map_ptr m) : map_(m), page_(), current_() {}
+		iterator(const_map_ptr m, hash_node_ptr c) : map_(m), page_(map::UNKNOWN_PAGE), current_(c) {}
+		iterator(const_map_ptr m, size_t p, hash_node_ptr c) : map_(m), page_(p), current_(c) {}
 
 		self& operator++() {
-			if (current_->next)
-				current_ = current_->next;
-			else
-				current_ = map_->findfirstafter(current_->data.first);
+			current_ = map_->next(page_, current_);
 			return *this;
 		}
 
 		self operator++(int) {
 			self tmp = *this;
-			if (current_->next)
-				current_ = current_->next;
-			else
-				current_ = map_->findfirstafter(current_->data.first);
+			current_ = map_->next(page_, current_);
 			return tmp;
 		}
 
@@ -238,7 +269,7 @@ public:
 	};
 
 public:
-	id_map(size_t nbuckets = 1024) : count_(0), buckets_(nbuckets, (hash_node*)NULL) {
+	id_map(size_t nbuckets = 1024) : count_(0), buckets_(nbuckets) {
 		assert(nbuckets > 0);
 		assert((nbuckets & (nbuckets - 1)) == 0); // power of two
 	}
@@ -258,12 +289,52 @@ public:
 
 		++count_;
 
-		return std::make_pair(iterator(this, buckets_[bucket]), true);
+		return std::make_pair(iterator(this, pages_.size() - 1, buckets_[bucket]), true);
+	}
+
+	/* erases element with given key, returns number of erased
+	 * elements (0 or 1)
+	 *
+	 * storage is kept dense by moving last stored element into
+	 * the freed slot, so this invalidates iterators and pointers
+	 * to that element as well as the erased one, and changes
+	 * order of for_each_inserted()
+	 */
+	size_t erase(key_type k) {
+		hash_node** victim = &buckets_[k & (buckets_.size() - 1)];
+		while (*victim && (*victim)->data.first != k)
+			victim = &(*victim)->next;
+
+		if (*victim == NULL)
+			return 0;
+
+		hash_node* node = *victim;
+		*victim = node->next;
+
+		hash_node* last = &pages_.back().back();
+		if (node != last) {
+			/* relink last element into the freed slot */
+			hash_node** ref = &buckets_[last->data.first & (buckets_.size() - 1)];
+			while (*ref != last)
+				ref = &(*ref)->next;
+			*ref = node;
+
+			node->data.~value_type();
+			new(reinterpret_cast<void*>(&node->data)) value_type(last->data);
+			node->next = last->next;
+		}
+
+		pages_.back().pop();
+		if (pages_.back().empty())
+			pages_.pop_back();
+
+		--count_;
+
+		return 1;
 	}
 
 	/* erases last added element from the map
-	 * !! assumes that there's no other way for elements to be erased !!
-	 * if some other erase() is added, this should be rewritten
+	 * it must not have been moved by erase() since insertion
 	 */
 	void erase_last() {
 		assert(!pages_.empty()); /* external invaiant */
@@ -292,8 +363,34 @@ public:
 		return count_ == 0;
 	}
 
+	inline size_t bucket_count() const {
+		return buckets_.size();
+	}
+
+	/* number of allocated storage pages */
+	inline size_t page_count() const {
+		return pages_.size();
+	}
+
+	/* memory taken by storage pages, in bytes */
+	inline size_t page_memory() const {
+		return pages_.size() * PAGE_SIZE;
+	}
+
+	/* memory taken by hash table, in bytes */
+	inline size_t bucket_memory() const {
+		return buckets_.size() * sizeof(hash_node*);
+	}
+
+	/* memory taken by the map, in bytes */
+	inline size_t memory() const {
+		return page_memory() + bucket_memory();
+	}
+
 	void clear() {
-		buckets_.clear();
+		/* hash table must never be empty, as it's size is used as a
+		 * mask; shrink it to single bucket to free memory */
+		hashtable(1).swap(buckets_);
 		pages_.clear();
 		count_ = 0;
 	}
@@ -318,18 +415,27 @@ public:
 		return end();
 	}
 
+	/* hints CPU to fetch hash bucket for given key; issuing
+	 * this some lookups ahead of find() hides part of memory
+	 * latency when looking up many unrelated keys */
+	inline void prefetch(key_type k) const {
+#if defined(__GNUC__)
+		__builtin_prefetch(&buckets_[k & (buckets_.size() - 1)]);
+#endif
+	}
+
 	iterator begin() {
 		if (count_ == 0)
 			return end();
 
-		return iterator(this, findfirst());
+		return iterator(this, 0, &pages_.front().front());
 	}
 
 	const_iterator begin() const {
 		if (count_ == 0)
 			return end();
 
-		return const_iterator(this, findfirst());
+		return const_iterator(this, 0, &pages_.front().front());
 	}
 
 	iterator end() {
@@ -340,17 +446,28 @@ public:
 		return const_iterator(this, NULL);
 	}
 
-	void swap(id_map<I, T, PAGE_SIZE>& other) {
+	void swap(id_map<I, T, PAGE_SIZE, A>& other) {
 		buckets_.swap(other.buckets_);
 		pages_.swap(other.pages_);
 		std::swap(count_, other.count_);
 	}
 
+	/* calls function for each element in order of insertion,
+	 * same as iterating over the map does */
+	template <class F>
+	F for_each_inserted(F f) {
+		for (typename page_list::iterator p = pages_.begin(); p != pages_.end(); ++p)
+			for (typename page::iterator i = p->begin(); i != p->end(); ++i)
+				f(i->data);
+
+		return f;
+	}
+
 	void rehash(size_t size) {
 		assert(size > 0);
 		assert((size & (size - 1)) == 0); // power of two
 
-		hashtable newbuckets(size, NULL);
+		hashtable newbuckets(size);
 
 		for (typename page_list::iterator p = pages_.begin(); p != pages_.end(); ++p) {
 			for (typename page::iterator i = p->begin(); i != p->end(); ++i) {
@@ -363,33 +480,43 @@ public:
 		buckets_.swap(newbuckets);
 	}
 
-protected:
-	hash_node* findfirst() const {
-		for (typename hashtable::const_iterator i = buckets_.begin(); i != buckets_.end(); ++i)
-			if (*i != NULL)
-				return *i;
+	/* prepares map to hold given number of elements without
+	 * growing hash table */
+	void reserve(size_t count) {
+		size_t size = 1;
+		while (size < count)
+			size *= 2;
 
-		return NULL;
+		if (size > buckets_.size())
+			rehash(size);
 	}
 
-	hash_node* findfirstfor(key_type v) const {
-		int bucket = v & (buckets_.size() - 1);
+protected:
+	enum { UNKNOWN_PAGE = (size_t)-1 };
+
+	/* returns element stored after given one, which is in given
+	 * page, and updates page if needed; iterators from find()
+	 * don't know their page, so it's looked up on first use */
+	hash_node* next(size_t& page, const hash_node* current) const {
+		if (page == (size_t)UNKNOWN_PAGE)
+			page = findpage(current);
+
+		if (current != &pages_[page].back())
+			return const_cast<hash_node*>(current + 1);
 
-		for (typename hashtable::const_iterator i = buckets_.begin() + bucket; i != buckets_.end(); ++i)
-			if (*i != NULL)
-				return *i;
+		if (++page < pages_.size())
+			return &pages_[page].front();
 
 		return NULL;
 	}
 
-	hash_node* findfirstafter(key_type v) const {
-		int bucket = v & (buckets_.size() - 1);
-
-		for (typename hashtable::const_iterator i = buckets_.begin() + bucket + 1; i != buckets_.end(); ++i)
-			if (*i != NULL)
-				return *i;
+	size_t findpage(const hash_node* node) const {
+		for (size_t page = 0; page < pages_.size(); ++page)
+			if (node >= &pages_[page].front() && node <= &pages_[page].back())
+				return page;
 
-		return NULL;
+		assert(false);
+		return pages_.size();
 	}
 };
 
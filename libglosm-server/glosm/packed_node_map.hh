@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKED_NODE_MAP_HH
+#define PACKED_NODE_MAP_HH
+
+#include <glosm/id_map.hh>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+#include <stdint.h>
+
+/**
+ * Compact std::map-like container for node coordinates.
+ *
+ * Designed for sorted input, as found in OSM dumps. Nodes added
+ * in increasing id order are packed into blocks of BLOCK_SIZE
+ * nodes, indexed by id range:
+ *
+ * - if ids in a block are consecutive, ids are not stored at all
+ *   and coordinates are kept in a flat array, so lookup is
+ *   constant time
+ * - otherwise, id and coordinate deltas from the previous node
+ *   are stored as variable length integers, and lookup decodes
+ *   block from its start
+ *
+ * That takes 8 bytes per node for dense ids and usually 4-7 for
+ * sparse ones, compared to 24 + 8-16 bytes in id_map.
+ *
+ * Nodes coming out of order go to id_map, and erased packed
+ * nodes are only marked as such, so any sequence of operations
+ * is supported; it's just less compact.
+ *
+ * T must be constructible from (x, y) and have Vector2i-like
+ * Pos member; it's never stored as is, so values are read-only
+ * and iterators hold decoded copies. Iteration goes over packed
+ * nodes in id order, then over out of order ones. Insertion may
+ * invalidate iterators.
+ */
+template <typename I, typename T, int BLOCK_SIZE = 64>
+class packed_node_map {
+public:
+	typedef I                                key_type;
+	typedef T                                mapped_type;
+	typedef std::pair<const I, T>            value_type;
+
+	typedef const value_type*                const_pointer;
+	typedef const value_type&                const_reference;
+
+private:
+	typedef id_map<I, T>                     overflow_map;
+
+	struct block {
+		I first;
+		I last;
+
+		/* coordinates of the first node */
+		int x;
+		int y;
+
+		/* offset of encoded data in bytes_ for sparse blocks,
+		 * or of first node in dense_ for dense ones */
+		size_t offset;
+
+		/* position of the first node among packed ones */
+		size_t index;
+
+		unsigned short count;
+		bool dense;
+	};
+
+	typedef std::vector<block>               block_list;
+
+	enum part_t {
+		PART_BLOCKS,
+		PART_PENDING,
+		PART_OVERFLOW,
+		PART_END,
+	};
+
+private:
+	size_t count_;
+
+	/* complete blocks */
+	block_list blocks_;
+	std::vector<unsigned char> bytes_;
+	std::vector<int> dense_;
+
+	/* nodes of the block being filled */
+	std::vector<I> pending_ids_;
+	std::vector<int> pending_coords_;
+
+	/* erase marks for all packed nodes */
+	std::vector<bool> erased_;
+
+	overflow_map overflow_;
+
+public:
+	class const_iterator {
+		friend class packed_node_map<I, T, BLOCK_SIZE>;
+
+	public:
+		typedef const_iterator self;
+
+	private:
+		typedef packed_node_map<I, T, BLOCK_SIZE> map;
+
+		typedef typename map::const_pointer       pointer;
+		typedef typename map::const_reference     reference;
+
+		const map* map_;
+		part_t part_;
+
+		/* position in packed part: block, node in block and, for
+		 * sparse blocks, offset of the next encoded node */
+		size_t block_;
+		size_t pos_;
+		size_t next_;
+
+		typename overflow_map::const_iterator overflow_;
+
+		/* decoded node */
+		union {
+			char bytes[sizeof(value_type)];
+			I align;
+		} value_;
+
+	public:
+		const_iterator() : map_(), part_(PART_END), block_(), pos_(), next_() {}
+
+		self& operator++() {
+			map_->advance(*this);
+			return *this;
+		}
+
+		self operator++(int) {
+			self tmp = *this;
+			map_->advance(*this);
+			return tmp;
+		}
+
+		reference operator*() const { return part_ == PART_OVERFLOW ? *overflow_ : *reinterpret_cast<const value_type*>(value_.bytes); }
+		pointer operator->() const { return &**this; }
+
+		bool operator==(const self& x) const {
+			if (x.part_ != part_)
+				return false;
+			if (part_ == PART_OVERFLOW)
+				return x.overflow_ == overflow_;
+			return x.block_ == block_ && x.pos_ == pos_;
+		}
+		bool operator!=(const self& x) const { return !(*this == x); }
+
+	private:
+		const_iterator(const map* m, part_t part) : map_(m), part_(part), block_(), pos_(), next_() {}
+
+		void set(I id, int x, int y) {
+			new(reinterpret_cast<void*>(value_.bytes)) value_type(id, T(x, y));
+		}
+
+		const value_type& get() const {
+			return *reinterpret_cast<const value_type*>(value_.bytes);
+		}
+	};
+
+	/* values are read-only */
+	typedef const_iterator iterator;
+
+public:
+	packed_node_map(size_t nbuckets = 1024) : count_(0), overflow_(nbuckets) {
+	}
+
+	virtual ~packed_node_map() {
+	}
+
+	std::pair<iterator, bool> insert(const value_type& v) {
+		if (packed_empty() || v.first > last_id()) {
+			if (pending_ids_.size() == BLOCK_SIZE)
+				flush();
+
+			pending_ids_.push_back(v.first);
+			pending_coords_.push_back(v.second.Pos.x);
+			pending_coords_.push_back(v.second.Pos.y);
+			erased_.push_back(false);
+			++count_;
+
+			const_iterator it(this, PART_PENDING);
+			it.block_ = blocks_.size();
+			it.pos_ = pending_ids_.size() - 1;
+			it.set(v.first, v.second.Pos.x, v.second.Pos.y);
+			return std::make_pair(it, true);
+		}
+
+		const_iterator it = find_packed(v.first);
+		if (it.part_ != PART_END)
+			return std::make_pair(it, false);
+
+		/* id_map doesn't check for duplicates itself */
+		it.part_ = PART_OVERFLOW;
+		it.overflow_ = overflow_.find(v.first);
+		if (it.overflow_ != overflow_.end())
+			return std::make_pair(it, false);
+
+		it.overflow_ = overflow_.insert(v).first;
+		++count_;
+		return std::make_pair(it, true);
+	}
+
+	size_t erase(key_type k) {
+		const_iterator it = find_packed(k);
+		if (it.part_ != PART_END) {
+			erased_[packed_index(it)] = true;
+			--count_;
+			return 1;
+		}
+
+		if (overflow_.erase(k)) {
+			--count_;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	inline size_t size() const {
+		return count_;
+	}
+
+	inline bool empty() const {
+		return count_ == 0;
+	}
+
+	/* packed storage needs no presizing, and only out of order
+	 * nodes go to the hash table, so it's left to grow as needed */
+	inline size_t bucket_count() const {
+		return overflow_.bucket_count();
+	}
+
+	void rehash(size_t /*unused*/) {
+	}
+
+	void clear() {
+		block_list().swap(blocks_);
+		std::vector<unsigned char>().swap(bytes_);
+		std::vector<int>().swap(dense_);
+		std::vector<I>().swap(pending_ids_);
+		std::vector<int>().swap(pending_coords_);
+		std::vector<bool>().swap(erased_);
+		overflow_.clear();
+		count_ = 0;
+	}
+
+	const_iterator find(key_type k) const {
+		const_iterator it = find_packed(k);
+		if (it.part_ != PART_END)
+			return it;
+
+		typename overflow_map::const_iterator o = overflow_.find(k);
+		if (o == overflow_.end())
+			return end();
+
+		it.part_ = PART_OVERFLOW;
+		it.overflow_ = o;
+		return it;
+	}
+
+	const_iterator begin() const {
+		const_iterator it(this, PART_BLOCKS);
+		it.block_ = 0;
+		it.pos_ = 0;
+		enter(it);
+		return it;
+	}
+
+	const_iterator end() const {
+		return const_iterator(this, PART_END);
+	}
+
+	void swap(packed_node_map<I, T, BLOCK_SIZE>& other) {
+		std::swap(count_, other.count_);
+		blocks_.swap(other.blocks_);
+		bytes_.swap(other.bytes_);
+		dense_.swap(other.dense_);
+		pending_ids_.swap(other.pending_ids_);
+		pending_coords_.swap(other.pending_coords_);
+		erased_.swap(other.erased_);
+		overflow_.swap(other.overflow_);
+	}
+
+	/* calls function for each element in order of iteration */
+	template <class F>
+	F for_each_inserted(F f) const {
+		for (const_iterator i = begin(); i != end(); ++i)
+			f(*i);
+
+		return f;
+	}
+
+	/* memory taken by the map, in bytes */
+	size_t memory() const {
+		return blocks_.capacity() * sizeof(block) + bytes_.capacity() + dense_.capacity() * sizeof(int) +
+			pending_ids_.capacity() * sizeof(I) + pending_coords_.capacity() * sizeof(int) + erased_.capacity() / 8 +
+			overflow_.memory();
+	}
+
+	/* number of nodes which didn't come in order */
+	inline size_t overflow_size() const {
+		return overflow_.size();
+	}
+
+protected:
+	inline bool packed_empty() const {
+		return blocks_.empty() && pending_ids_.empty();
+	}
+
+	inline I last_id() const {
+		return pending_ids_.empty() ? blocks_.back().last : pending_ids_.back();
+	}
+
+	inline size_t packed_index(const const_iterator& it) const {
+		if (it.part_ == PART_PENDING)
+			return erased_.size() - pending_ids_.size() + it.pos_;
+		return blocks_[it.block_].index + it.pos_;
+	}
+
+	static inline void write_varint(std::vector<unsigned char>& out, uint64_t value) {
+		while (value >= 0x80) {
+			out.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((unsigned char)value);
+	}
+
+	static inline uint64_t read_varint(const unsigned char*& in) {
+		uint64_t value = 0;
+		for (int shift = 0;; shift += 7) {
+			unsigned char byte = *in++;
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return value;
+		}
+	}
+
+	static inline uint64_t zigzag(int64_t value) {
+		return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	}
+
+	static inline int64_t unzigzag(uint64_t value) {
+		return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+	}
+
+	/* packs pending nodes into a block */
+	void flush() {
+		assert(!pending_ids_.empty());
+
+		block b;
+		b.first = pending_ids_.front();
+		b.last = pending_ids_.back();
+		b.x = pending_coords_[0];
+		b.y = pending_coords_[1];
+		b.index = erased_.size() - pending_ids_.size();
+		b.count = pending_ids_.size();
+		b.dense = (uint64_t)(b.last - b.first) == pending_ids_.size() - 1;
+
+		if (b.dense) {
+			b.offset = dense_.size();
+			dense_.insert(dense_.end(), pending_coords_.begin(), pending_coords_.end());
+		} else {
+			b.offset = bytes_.size();
+			for (size_t i = 1; i < pending_ids_.size(); ++i) {
+				write_varint(bytes_, (uint64_t)(pending_ids_[i] - pending_ids_[i - 1]) - 1);
+				write_varint(bytes_, zigzag((int64_t)pending_coords_[i * 2] - pending_coords_[i * 2 - 2]));
+				write_varint(bytes_, zigzag((int64_t)pending_coords_[i * 2 + 1] - pending_coords_[i * 2 - 1]));
+			}
+		}
+
+		blocks_.push_back(b);
+		pending_ids_.clear();
+		pending_coords_.clear();
+	}
+
+	/* decodes node at iterator position, which is either first
+	 * in a block or follows currently decoded one */
+	void decode(const_iterator& it) const {
+		if (it.part_ == PART_PENDING) {
+			it.set(pending_ids_[it.pos_], pending_coords_[it.pos_ * 2], pending_coords_[it.pos_ * 2 + 1]);
+			return;
+		}
+
+		const block& b = blocks_[it.block_];
+		if (it.pos_ == 0) {
+			it.next_ = b.offset;
+			it.set(b.first, b.x, b.y);
+		} else if (b.dense) {
+			it.set(b.first + it.pos_, dense_[b.offset + it.pos_ * 2], dense_[b.offset + it.pos_ * 2 + 1]);
+		} else {
+			const value_type& prev = it.get();
+			const unsigned char* data = &bytes_[it.next_];
+			I id = prev.first + (I)read_varint(data) + 1;
+			int x = (int)(prev.second.Pos.x + unzigzag(read_varint(data)));
+			int y = (int)(prev.second.Pos.y + unzigzag(read_varint(data)));
+			it.next_ = data - &bytes_.front();
+			it.set(id, x, y);
+		}
+	}
+
+	/* settles iterator on the first non-erased node starting
+	 * from its current position, moving on to the next parts
+	 * as they are exhausted */
+	void enter(const_iterator& it) const {
+		while (it.part_ == PART_BLOCKS) {
+			if (it.block_ >= blocks_.size()) {
+				it.part_ = PART_PENDING;
+				it.block_ = blocks_.size();
+				it.pos_ = 0;
+				break;
+			}
+			decode(it);
+			if (!erased_[packed_index(it)])
+				return;
+			if (++it.pos_ == blocks_[it.block_].count) {
+				++it.block_;
+				it.pos_ = 0;
+			}
+		}
+
+		while (it.part_ == PART_PENDING) {
+			if (it.pos_ >= pending_ids_.size()) {
+				it.part_ = PART_OVERFLOW;
+				it.overflow_ = overflow_.begin();
+				break;
+			}
+			decode(it);
+			if (!erased_[packed_index(it)])
+				return;
+			++it.pos_;
+		}
+
+		if (it.part_ == PART_OVERFLOW && it.overflow_ == overflow_.end())
+			it = end();
+	}
+
+	void advance(const_iterator& it) const {
+		switch (it.part_) {
+		case PART_BLOCKS:
+			if (++it.pos_ == blocks_[it.block_].count) {
+				++it.block_;
+				it.pos_ = 0;
+			}
+			enter(it);
+			break;
+		case PART_PENDING:
+			++it.pos_;
+			enter(it);
+			break;
+		case PART_OVERFLOW:
+			if (++it.overflow_ == overflow_.end())
+				it = end();
+			break;
+		default:
+			assert(false);
+		}
+	}
+
+	/* returns iterator to non-erased packed node or end() */
+	const_iterator find_packed(key_type k) const {
+		if (packed_empty() || k > last_id())
+			return end();
+
+		const_iterator it(this, PART_PENDING);
+
+		if (!pending_ids_.empty() && k >= pending_ids_.front()) {
+			typename std::vector<I>::const_iterator i = std::lower_bound(pending_ids_.begin(), pending_ids_.end(), k);
+			if (*i != k)
+				return end();
+			it.block_ = blocks_.size();
+			it.pos_ = i - pending_ids_.begin();
+			decode(it);
+		} else {
+			/* first block which may contain the id */
+			size_t lo = 0, hi = blocks_.size();
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (blocks_[mid].last < k)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if (lo == blocks_.size() || blocks_[lo].first > k)
+				return end();
+
+			const block& b = blocks_[lo];
+			it.part_ = PART_BLOCKS;
+			it.block_ = lo;
+
+			if (b.dense) {
+				it.pos_ = k - b.first;
+				decode(it);
+			} else {
+				/* walk encoded nodes up to the wanted one */
+				for (it.pos_ = 0;; ++it.pos_) {
+					decode(it);
+					if (it.get().first == k)
+						break;
+					if (it.get().first > k || it.pos_ + 1 == b.count)
+						return end();
+				}
+			}
+		}
+
+		if (erased_[packed_index(it)])
+			return end();
+
+		return it;
+	}
+};
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a benchmark for OSM datasource.
+ *
+ * Usage: DatasourceBench [file.osm ...]
+ *
+ * Without arguments, synthetic grid of buildings is generated
+ * and used.
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/MappedOsmDatasource.hh>
+#include <glosm/Timer.hh>
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* count heap allocations to see how much work requests incur */
+static unsigned long nallocs = 0;
+
+void* operator new(size_t size) {
+	++nallocs;
+	void* p = malloc(size == 0 ? 1 : size);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) throw() {
+	free(p);
+}
+
+void operator delete(void* p, size_t) throw() {
+	free(p);
+}
+
+/* exposes internals for comparison with older approaches */
+class BenchDatasource : public PreloadedXmlDatasource {
+public:
+	/* full scan which GetWays() used before spatial index was introduced */
+	void GetWaysScan(std::vector<Way>& out, const BBoxi& bbox) const {
+		if (!bbox.Intersects(bbox_))
+			return;
+
+		for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i)
+			if (i->second.BBox.Intersects(bbox))
+				out.push_back(GetWay(i->first));
+	}
+
+	void PrintNodesMemory() const {
+		fprintf(stderr, "  node table: %lu nodes, %.1f MB\n", (unsigned long)nodes_.size(), nodes_.memory() / 1048576.0f);
+	}
+
+	/* way objects with heap blocks they own, and way store */
+	void PrintWaysMemory() const {
+		size_t objects = ways_.memory();
+		for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i)
+			objects += i->second.Nodes.capacity() * sizeof(osmid_t) + i->second.Coords.capacity() * sizeof(Vector2i) + i->second.Tags.size() * sizeof(TagsMap::value_type);
+
+		size_t store = way_store_.GetFootprint() + store_by_id_.capacity() * sizeof(size_t);
+
+		fprintf(stderr, "  way objects: %lu ways, %.1f MB; way store: %.1f MB\n", (unsigned long)ways_.size(), objects / 1048576.0f, store / 1048576.0f);
+	}
+};
+
+static std::string MakeGrid(int size) {
+	char path[] = "/tmp/glosm-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(1);
+	}
+
+	FILE* f = fdopen(fd, "w");
+	fprintf(f, "<?xml version='1.0' encoding='UTF-8'?>\n<osm version='0.6'>\n");
+
+	/* cells are ~100m apart, buildings are ~50m wide */
+	for (int y = 0; y <= size * 2; ++y)
+		for (int x = 0; x <= size * 2; ++x)
+			fprintf(f, "  <node id='%d' lat='%.7f' lon='%.7f' />\n", y * (size * 2 + 1) + x + 1, 55.0 + y * 0.00045, 37.0 + x * 0.00045);
+
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			int bl = (y * 2) * (size * 2 + 1) + x * 2 + 1;
+			int tl = bl + size * 2 + 1;
+			fprintf(f, "  <way id='%d'>\n", y * size + x + 1);
+			fprintf(f, "    <nd ref='%d' />\n    <nd ref='%d' />\n    <nd ref='%d' />\n    <nd ref='%d' />\n    <nd ref='%d' />\n", bl, bl + 1, tl + 1, tl, bl);
+			fprintf(f, "    <tag k='building' v='yes' />\n    <tag k='building:levels' v='%d' />\n", x % 9 + 1);
+			fprintf(f, "  </way>\n");
+		}
+	}
+
+	fprintf(f, "</osm>\n");
+	fclose(f);
+
+	return path;
+}
+
+/* evicts file from page cache, so next read comes from disk */
+static void DropCache(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static void BenchSnapshot(const PreloadedXmlDatasource& ds) {
+	char path[] = "/tmp/glosm-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+
+	Timer t;
+	ds.SaveSnapshot(path);
+	float savetime = t.Count();
+
+	DropCache(path);
+
+	t.Count();
+	{
+		PreloadedXmlDatasource loaded;
+		loaded.LoadSnapshot(path);
+	}
+	float coldtime = t.Count();
+
+	{
+		PreloadedXmlDatasource loaded;
+		loaded.LoadSnapshot(path);
+	}
+	float warmtime = t.Count();
+
+	unlink(path);
+
+	fprintf(stderr, "  snapshot save: %.3f sec\n", savetime);
+	fprintf(stderr, "  snapshot load: %.3f sec cold, %.3f sec warm\n", coldtime, warmtime);
+}
+
+/* compares expat with trusted tokenizer; small files are parsed
+ * repeatedly to get measurable times */
+static void BenchTokenizers(const char* path) {
+	const XMLParser::Tokenizer tokenizers[] = { XMLParser::EXPAT_TOKENIZER, XMLParser::TRUSTED_TOKENIZER };
+	const char* names[] = { "expat", "trusted" };
+
+	for (int i = 0; i < 2; ++i) {
+		size_t bytes = 0;
+		float time = 0.0f;
+		do {
+			PreloadedXmlDatasource ds;
+			ds.SetTokenizer(tokenizers[i]);
+			ds.Load(path);
+			bytes += ds.GetLoadedBytes();
+			time += ds.GetLoadTime();
+		} while (bytes < 64 * 1048576);
+
+		fprintf(stderr, "  %s tokenizer: parsed at %.1f MB/s\n", names[i], bytes / time / 1048576.0f);
+	}
+}
+
+/* runs requests against mapped file made of the dump, with
+ * file not in page cache and then cached */
+static void BenchMapped(const char* path, const std::vector<BBoxi>& tiles) {
+	char mappedpath[] = "/tmp/glosm-bench-XXXXXX";
+	int fd = mkstemp(mappedpath);
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+
+	{
+		PreloadedXmlDatasource ds;
+		ds.Load(path);
+		ds.InlineNodes();
+		MappedOsmDatasource::Write(mappedpath, ds.GetWayStore(), ds.GetBBox());
+	}
+
+	DropCache(mappedpath);
+
+	Timer t;
+	MappedOsmDatasource mapped(mappedpath);
+	float opentime = t.Count();
+
+	float times[2];
+	size_t nways = 0;
+	for (int pass = 0; pass < 2; ++pass) {
+		for (std::vector<BBoxi>::const_iterator i = tiles.begin(); i != tiles.end(); ++i) {
+			std::vector<OsmDatasource::WayView> ways;
+			mapped.GetWays(ways, *i);
+			for (std::vector<OsmDatasource::WayView>::const_iterator w = ways.begin(); w != ways.end(); ++w)
+				nways += !w->Coords.empty();
+		}
+		times[pass] = t.Count();
+	}
+
+	unlink(mappedpath);
+
+	fprintf(stderr, "  mapped open:          %.3f sec\n", opentime);
+	fprintf(stderr, "  mapped, views:        %.3f sec cold, %.3f sec warm, %lu ways\n", times[0], times[1], (unsigned long)nways / 2);
+}
+
+static void Bench(const char* path) {
+	BenchDatasource ds;
+
+	DropCache(path);
+
+	Timer t;
+	ds.Load(path);
+	fprintf(stderr, "  load: %.3f sec, parsed at %.1f MB/s\n", t.Count(), ds.GetLoadRate() / 1048576.0f);
+	ds.PrintNodesMemory();
+	ds.PrintWaysMemory();
+
+	{
+		BenchDatasource inlined;
+		inlined.Load(path);
+		inlined.InlineNodes();
+		fprintf(stderr, "  after InlineNodes():\n");
+		inlined.PrintWaysMemory();
+	}
+
+	BenchTokenizers(path);
+
+	for (int nthreads = 2; nthreads <= 16; nthreads *= 2) {
+		PreloadedXmlDatasource parallel;
+		t.Count();
+		parallel.LoadParallel(path, nthreads);
+		fprintf(stderr, "  load with %d threads: %.3f sec\n", nthreads, t.Count());
+	}
+
+	BenchSnapshot(ds);
+
+	/* split dataset into 64x64 tiles, which is comparable with
+	 * what viewer or tiler request */
+	const int ntiles = 64;
+	BBoxi bbox = ds.GetBBox();
+	osmlong_t w = (osmlong_t)bbox.right - bbox.left;
+	osmlong_t h = (osmlong_t)bbox.top - bbox.bottom;
+
+	std::vector<BBoxi> tiles;
+	for (int y = 0; y < ntiles; ++y)
+		for (int x = 0; x < ntiles; ++x)
+			tiles.push_back(BBoxi(bbox.left + w * x / ntiles, bbox.bottom + h * y / ntiles, bbox.left + w * (x + 1) / ntiles, bbox.bottom + h * (y + 1) / ntiles));
+
+	size_t nscan = 0, ncopy = 0, nptr = 0, nview = 0;
+	unsigned long ascan, acopy, aptr, aview;
+
+	/* pointers and views are cheap to get, so count reading
+	 * ways through them as well */
+	size_t touched = 0;
+
+	t.Count();
+	nallocs = 0;
+	for (std::vector<BBoxi>::const_iterator i = tiles.begin(); i != tiles.end(); ++i) {
+		std::vector<OsmDatasource::Way> ways;
+		ds.GetWaysScan(ways, *i);
+		nscan += ways.size();
+	}
+	float scantime = t.Count();
+	ascan = nallocs;
+
+	nallocs = 0;
+	for (std::vector<BBoxi>::const_iterator i = tiles.begin(); i != tiles.end(); ++i) {
+		std::vector<OsmDatasource::Way> ways;
+		ds.GetWays(ways, *i);
+		ncopy += ways.size();
+	}
+	float copytime = t.Count();
+	acopy = nallocs;
+
+	nallocs = 0;
+	for (std::vector<BBoxi>::const_iterator i = tiles.begin(); i != tiles.end(); ++i) {
+		std::vector<const OsmDatasource::Way*> ways;
+		ds.GetWays(ways, *i);
+		nptr += ways.size();
+		for (std::vector<const OsmDatasource::Way*>::const_iterator w = ways.begin(); w != ways.end(); ++w)
+			touched += (*w)->Nodes.size() + (*w)->Tags.size() + (*w)->BBox.left;
+	}
+	float ptrtime = t.Count();
+	aptr = nallocs;
+
+	nallocs = 0;
+	for (std::vector<BBoxi>::const_iterator i = tiles.begin(); i != tiles.end(); ++i) {
+		std::vector<OsmDatasource::WayView> ways;
+		ds.GetWays(ways, *i);
+		nview += ways.size();
+		for (std::vector<OsmDatasource::WayView>::const_iterator w = ways.begin(); w != ways.end(); ++w)
+			touched += w->Nodes.size() + w->Tags.size() + w->BBox.left;
+	}
+	float viewtime = t.Count();
+	aview = nallocs;
+
+	fprintf(stderr, "  %d requests\n", ntiles * ntiles);
+	fprintf(stderr, "  full scan, copies:    %.3f sec, %lu ways, %lu allocations\n", scantime, (unsigned long)nscan, ascan);
+	fprintf(stderr, "  index, copies:        %.3f sec, %lu ways, %lu allocations\n", copytime, (unsigned long)ncopy, acopy);
+	fprintf(stderr, "  index, pointers:      %.3f sec, %lu ways, %lu allocations\n", ptrtime, (unsigned long)nptr, aptr);
+	fprintf(stderr, "  index, views:         %.3f sec, %lu ways, %lu allocations\n", viewtime, (unsigned long)nview, aview);
+
+	/* prevent optimizing reads away */
+	if (touched == 0)
+		fprintf(stderr, "  (checksum is zero)\n");
+
+	BenchMapped(path, tiles);
+}
+
+int main(int argc, char** argv) {
+	try {
+		if (argc < 2) {
+			std::string grid = MakeGrid(300);
+			fprintf(stderr, "Synthetic grid (90000 ways):\n");
+			Bench(grid.c_str());
+			unlink(grid.c_str());
+
+			fprintf(stderr, "%s:\n", TESTDATA_DIR "/glosm.osm");
+			BenchTokenizers(TESTDATA_DIR "/glosm.osm");
+		}
+
+		for (int i = 1; i < argc; ++i) {
+			fprintf(stderr, "%s:\n", argv[i]);
+			Bench(argv[i]);
+		}
+	} catch (std::exception& e) {
+		fprintf(stderr, "Exception: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
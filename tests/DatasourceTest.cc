@@ -0,0 +1,1162 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that different ways of loading data into
+ * datasource (parallel loading, PBF, compressed input, snapshots) produce the same
+ * result as plain sequential loading.
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/PreloadedGPXDatasource.hh>
+#include <glosm/ParsingHelpers.hh>
+#include <glosm/MappedOsmDatasource.hh>
+#include <glosm/ShardedOsmDatasource.hh>
+#include <glosm/WayStore.hh>
+
+#include "testing.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <unistd.h>
+
+/* exposes internals for comparison */
+class TestDatasource : public PreloadedXmlDatasource {
+public:
+	/* makes synthetic ids of subsequent loads comparable */
+	static void ResetSyntheticIds() {
+		next_synthetic_id_ = std::numeric_limits<osmid_t>::max();
+	}
+
+	static bool SameBBox(const BBoxi& a, const BBoxi& b) {
+		return a.left == b.left && a.bottom == b.bottom && a.right == b.right && a.top == b.top;
+	}
+
+	/* number of nodes held by Way objects rather than way store */
+	size_t CountObjectNodes() const {
+		size_t count = 0;
+		for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i)
+			count += i->second.Nodes.size();
+		return count;
+	}
+
+	static bool SameTags(const TagsMap& a, const TagsMap& b) {
+		return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+	}
+
+	bool SameAs(const TestDatasource& other) const {
+		if (nodes_.size() != other.nodes_.size() || ways_.size() != other.ways_.size() || relations_.size() != other.relations_.size())
+			return false;
+
+		if (!SameBBox(bbox_, other.bbox_))
+			return false;
+
+		for (NodesMap::const_iterator i = nodes_.begin(); i != nodes_.end(); ++i) {
+			NodesMap::const_iterator j = other.nodes_.find(i->first);
+			if (j == other.nodes_.end() || i->second.Pos != j->second.Pos)
+				return false;
+		}
+
+		for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i) {
+			WaysMap::const_iterator j = other.ways_.find(i->first);
+			if (j == other.ways_.end())
+				return false;
+			WayView a = GetWayView(i->first, i->second);
+			WayView b = other.GetWayView(j->first, j->second);
+			if (a.Nodes.size() != b.Nodes.size() || !std::equal(a.Nodes.begin(), a.Nodes.end(), b.Nodes.begin()))
+				return false;
+			if (a.Coords.size() != b.Coords.size() || !std::equal(a.Coords.begin(), a.Coords.end(), b.Coords.begin()))
+				return false;
+			if (a.Closed != b.Closed || a.Clockwise != b.Clockwise || !SameBBox(a.BBox, b.BBox))
+				return false;
+			if (a.Tags.size() != b.Tags.size() || !std::equal(a.Tags.begin(), a.Tags.end(), b.Tags.begin()))
+				return false;
+		}
+
+		for (RelationsMap::const_iterator i = relations_.begin(); i != relations_.end(); ++i) {
+			RelationsMap::const_iterator j = other.relations_.find(i->first);
+			if (j == other.relations_.end() || i->second.Members.size() != j->second.Members.size())
+				return false;
+			for (size_t m = 0; m < i->second.Members.size(); ++m) {
+				const Relation::Member& a = i->second.Members[m];
+				const Relation::Member& b = j->second.Members[m];
+				if (a.Type != b.Type || a.Ref != b.Ref || a.Role != b.Role)
+					return false;
+			}
+			if (!SameTags(i->second.Tags, j->second.Tags))
+				return false;
+		}
+
+		return true;
+	}
+};
+
+static std::string ReadFile(const char* path) {
+	std::ifstream file(path, std::ios::binary);
+	std::stringstream data;
+	data << file.rdbuf();
+	return data.str();
+}
+
+static void WriteFile(const char* path, const char* data) {
+	std::ofstream file(path, std::ios::binary);
+	file << data;
+}
+
+/* minimal protobuf encoder for hand-made PBF files */
+static void PbfVarint(std::string& out, uint64_t value) {
+	for (; value >= 0x80; value >>= 7)
+		out += (char)((value & 0x7f) | 0x80);
+	out += (char)value;
+}
+
+static void PbfInt(std::string& out, int field, uint64_t value) {
+	PbfVarint(out, field << 3);
+	PbfVarint(out, value);
+}
+
+static void PbfSInt(std::string& out, int field, int64_t value) {
+	PbfInt(out, field, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void PbfBytes(std::string& out, int field, const std::string& data) {
+	PbfVarint(out, (field << 3) | 2);
+	PbfVarint(out, data.size());
+	out += data;
+}
+
+/* appends uncompressed OSMData blob with given primitive block */
+static void PbfAppendBlob(std::string& out, const std::string& block) {
+	std::string blob, header;
+	PbfBytes(blob, 1, block);
+	PbfBytes(header, 1, "OSMData");
+	PbfInt(header, 3, blob.size());
+
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out += (char)((header.size() >> shift) & 0xff);
+	out += header + blob;
+}
+
+/* PBF counterpart of duplicate_osm; duplicates are in the second block */
+static std::string MakeDuplicatePbf() {
+	std::string strings;
+	const char* table[] = { "", "highway", "residential", "service", "outer", "inner" };
+	for (unsigned int i = 0; i < sizeof(table)/sizeof(table[0]); ++i)
+		PbfBytes(strings, 1, table[i]);
+
+	/* coordinates are in default granularity of 100 nanodegrees */
+	std::string nodes;
+	int coords[][2] = { { 0, 0 }, { 0, 1000000 }, { 1000000, 1000000 }, { 1000000, 0 } };
+	for (int i = 0; i < 4; ++i) {
+		std::string node;
+		PbfSInt(node, 1, i + 1);
+		PbfSInt(node, 8, coords[i][0]);
+		PbfSInt(node, 9, coords[i][1]);
+		PbfBytes(nodes, 1, node);
+	}
+
+	/* way id, first node, second node, value of highway tag */
+	int ways[][4] = { { 100, 1, 2, 2 }, { 101, 1, 3, 0 }, { 100, 3, 4, 3 } };
+	std::string waygroups[2];
+	for (int i = 0; i < 3; ++i) {
+		std::string way, keys, vals, refs;
+		PbfInt(way, 1, ways[i][0]);
+		if (ways[i][3]) {
+			PbfVarint(keys, 1);
+			PbfVarint(vals, ways[i][3]);
+			PbfBytes(way, 2, keys);
+			PbfBytes(way, 3, vals);
+		}
+		PbfVarint(refs, (ways[i][1] << 1));
+		PbfVarint(refs, ((ways[i][2] - ways[i][1]) << 1));
+		PbfBytes(way, 8, refs);
+		PbfBytes(waygroups[i / 2], 3, way);
+	}
+
+	/* relation id, member way, member role */
+	int relations[][3] = { { 200, 100, 4 }, { 200, 101, 5 } };
+	std::string relationgroups[2];
+	for (int i = 0; i < 2; ++i) {
+		std::string relation, roles, memids, types;
+		PbfInt(relation, 1, relations[i][0]);
+		PbfVarint(roles, relations[i][2]);
+		PbfVarint(memids, relations[i][1] << 1);
+		PbfVarint(types, 1);
+		PbfBytes(relation, 8, roles);
+		PbfBytes(relation, 9, memids);
+		PbfBytes(relation, 10, types);
+		PbfBytes(relationgroups[i], 4, relation);
+	}
+
+	std::string file;
+	for (int i = 0; i < 2; ++i) {
+		std::string block;
+		PbfBytes(block, 1, strings);
+		if (i == 0)
+			PbfBytes(block, 2, nodes);
+		PbfBytes(block, 2, waygroups[i]);
+		PbfBytes(block, 2, relationgroups[i]);
+		PbfAppendBlob(file, block);
+	}
+	return file;
+}
+
+static bool HasNode(const OsmDatasource& datasource, osmid_t id) {
+	OsmDatasource::Node node;
+	return datasource.TryGetNode(id, node);
+}
+
+static bool HasWay(const OsmDatasource& datasource, osmid_t id) {
+	OsmDatasource::WayView way;
+	return datasource.TryGetWay(id, way);
+}
+
+/* returns offset of table of way indexes sorted by id in mapped
+ * file, see MappedOsmDatasource.cc for format */
+static size_t MappedByIdOffset(const std::string& data) {
+	uint64_t nstrings, nways;
+	memcpy(&nstrings, data.data() + 32, sizeof(nstrings));
+	memcpy(&nways, data.data() + 40, sizeof(nways));
+
+	size_t pos = 88;
+	for (uint64_t i = 0; i < nstrings; ++i)
+		pos = data.find('\0', pos) + 1;
+	pos = (pos + 7) / 8 * 8;
+
+	return pos + nways * sizeof(osmid_t);
+}
+
+static bool AnyIntersects(const std::vector<BBoxi>& bboxes, const BBoxi& bbox) {
+	for (std::vector<BBoxi>::const_iterator i = bboxes.begin(); i != bboxes.end(); ++i)
+		if (i->Intersects(bbox))
+			return true;
+	return false;
+}
+
+/* checks that way views are the same as ways themselves */
+static bool SameViews(const OsmDatasource& datasource, const BBoxi& bbox) {
+	std::vector<const OsmDatasource::Way*> ways;
+	std::vector<OsmDatasource::WayView> views;
+	datasource.GetWays(ways, bbox);
+	datasource.GetWays(views, bbox);
+
+	if (ways.size() != views.size())
+		return false;
+
+	for (size_t i = 0; i < ways.size(); ++i) {
+		const OsmDatasource::Way& way = *ways[i];
+		const OsmDatasource::WayView& view = views[i];
+		if (way.Nodes.size() != view.Nodes.size() || !std::equal(view.Nodes.begin(), view.Nodes.end(), way.Nodes.begin()))
+			return false;
+		if (way.Coords.size() != view.Coords.size() || !std::equal(view.Coords.begin(), view.Coords.end(), way.Coords.begin()))
+			return false;
+		if (way.Tags.size() != view.Tags.size() || !std::equal(view.Tags.begin(), view.Tags.end(), way.Tags.begin()))
+			return false;
+		if (way.Closed != view.Closed || way.Clockwise != view.Clockwise || way.Inner != view.Inner || !TestDatasource::SameBBox(way.BBox, view.BBox))
+			return false;
+	}
+
+	return true;
+}
+
+/* records notifications of load phases */
+struct PhaseCounter : public LoadListener {
+	int finished[NPHASES];
+	Progress last;
+
+	PhaseCounter() {
+		std::fill(finished, finished + NPHASES, 0);
+	}
+
+	virtual void LoadProgress(Phase /*unused*/, const Progress& /*unused*/) {
+	}
+
+	virtual void LoadPhaseFinished(Phase phase, const Progress& progress) {
+		++finished[phase];
+		last = progress;
+	}
+
+	bool AllFinishedOnce() const {
+		for (int i = 0; i < NPHASES; ++i)
+			if (finished[i] != 1)
+				return false;
+		return true;
+	}
+};
+
+static const char sample_osm[] =
+	"<osm>"
+	"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='0.0' lon='0.1'/>"
+	"<node id='3' lat='0.1' lon='0.1'/><node id='4' lat='0.1' lon='0.0'/>"
+	"<node id='5' lat='1.0' lon='1.0'/><node id='6' lat='1.0' lon='1.1'/>"
+	"<node id='7' lat='1.1' lon='1.1'/><node id='8' lat='1.1' lon='1.0'/>"
+	"<node id='9' lat='2.0' lon='2.0'/><node id='10' lat='2.1' lon='2.1'/>"
+	"<way id='100'><nd ref='1'/><nd ref='2'/><nd ref='3'/><nd ref='4'/><nd ref='1'/><tag k='building' v='yes'/></way>"
+	"<way id='101'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='8'/><nd ref='5'/></way>"
+	"<way id='102'><nd ref='9'/><nd ref='10'/><tag k='highway' v='residential'/></way>"
+	"<relation id='200'><member type='way' ref='101' role='outer'/><tag k='type' v='multipolygon'/><tag k='building' v='yes'/></relation>"
+	"</osm>";
+
+static const char sample_osc[] =
+	"<osmChange version='0.6'>"
+	"<modify><node id='1' lat='-0.1' lon='-0.1'/><node id='5' lat='0.9' lon='0.9'/></modify>"
+	"<delete><way id='102'/><node id='10'/></delete>"
+	"<create><node id='11' lat='3.0' lon='3.0'/><node id='12' lat='3.1' lon='3.1'/>"
+	"<way id='103'><nd ref='11'/><nd ref='12'/></way></create>"
+	"</osmChange>";
+
+/* way and relation ids repeated with different contents */
+static const char duplicate_osm[] =
+	"<osm>"
+	"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='0.0' lon='0.1'/>"
+	"<node id='3' lat='0.1' lon='0.1'/><node id='4' lat='0.1' lon='0.0'/>"
+	"<way id='100'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>"
+	"<way id='101'><nd ref='1'/><nd ref='3'/></way>"
+	"<way id='100'><nd ref='3'/><nd ref='4'/><tag k='highway' v='service'/></way>"
+	"<relation id='200'><member type='way' ref='100' role='outer'/></relation>"
+	"<relation id='200'><member type='way' ref='101' role='inner'/></relation>"
+	"</osm>";
+
+/* way 100 crosses border of area filter used by test */
+static const char crossing_osm[] =
+	"<osm>"
+	"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='0.5' lon='0.5'/>"
+	"<node id='3' lat='0.6' lon='0.6'/>"
+	"<way id='100'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>"
+	"</osm>";
+
+/* sample_osm split in two; way 101 is present in both parts */
+static const char shard_a_osm[] =
+	"<osm>"
+	"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='0.0' lon='0.1'/>"
+	"<node id='3' lat='0.1' lon='0.1'/><node id='4' lat='0.1' lon='0.0'/>"
+	"<node id='5' lat='1.0' lon='1.0'/><node id='6' lat='1.0' lon='1.1'/>"
+	"<node id='7' lat='1.1' lon='1.1'/><node id='8' lat='1.1' lon='1.0'/>"
+	"<way id='100'><nd ref='1'/><nd ref='2'/><nd ref='3'/><nd ref='4'/><nd ref='1'/><tag k='building' v='yes'/></way>"
+	"<way id='101'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='8'/><nd ref='5'/></way>"
+	"<relation id='200'><member type='way' ref='101' role='outer'/><tag k='type' v='multipolygon'/><tag k='building' v='yes'/></relation>"
+	"</osm>";
+
+static const char shard_b_osm[] =
+	"<osm>"
+	"<node id='5' lat='1.0' lon='1.0'/><node id='6' lat='1.0' lon='1.1'/>"
+	"<node id='7' lat='1.1' lon='1.1'/><node id='8' lat='1.1' lon='1.0'/>"
+	"<node id='9' lat='2.0' lon='2.0'/><node id='10' lat='2.1' lon='2.1'/>"
+	"<way id='101'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='8'/><nd ref='5'/></way>"
+	"<way id='102'><nd ref='9'/><nd ref='10'/><tag k='highway' v='residential'/></way>"
+	"</osm>";
+
+/* relation comes before its members */
+static const char multipolygon_osm[] =
+	"<osm>"
+	"<relation id='300'><member type='way' ref='401' role='outer'/><member type='way' ref='402' role='outer'/>"
+	"<member type='way' ref='403' role='inner'/><tag k='type' v='multipolygon'/><tag k='building' v='yes'/></relation>"
+	"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='0.0' lon='1.0'/>"
+	"<node id='3' lat='1.0' lon='1.0'/><node id='4' lat='1.0' lon='0.0'/>"
+	"<node id='5' lat='0.2' lon='0.2'/><node id='6' lat='0.2' lon='0.8'/><node id='7' lat='0.8' lon='0.5'/>"
+	"<way id='401'><nd ref='1'/><nd ref='2'/><nd ref='3'/></way>"
+	"<way id='402'><nd ref='1'/><nd ref='4'/><nd ref='3'/></way>"
+	"<way id='403'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='5'/></way>"
+	"</osm>";
+
+BEGIN_TEST()
+	char path[] = "/tmp/glosm-test-XXXXXX";
+	int fd = mkstemp(path);
+	EXPECT_TRUE(fd != -1);
+	close(fd);
+
+	// parallel loading
+	const char* files[] = { TESTDATA_DIR "/glosm.osm", TESTDATA_DIR "/grid.osm" };
+	for (unsigned int f = 0; f < sizeof(files)/sizeof(files[0]); ++f) {
+		TestDatasource sequential;
+		TestDatasource::ResetSyntheticIds();
+		sequential.Load(files[f]);
+		sequential.SaveSnapshot(path);
+		std::string expected = ReadFile(path);
+
+		int nthreads[] = { 1, 2, 3, 4, 7, 16, 1000 };
+		for (unsigned int n = 0; n < sizeof(nthreads)/sizeof(nthreads[0]); ++n) {
+			TestDatasource parallel;
+			TestDatasource::ResetSyntheticIds();
+			parallel.LoadParallel(files[f], nthreads[n]);
+
+			EXPECT_TRUE(sequential.SameAs(parallel));
+
+			// byte-exact snapshot means that even internal order is the same
+			parallel.SaveSnapshot(path);
+			EXPECT_TRUE(ReadFile(path) == expected);
+		}
+	}
+
+	// first of duplicate objects is kept by both loaders
+	{
+		WriteFile(path, duplicate_osm);
+
+		TestDatasource sequential;
+		sequential.Load(path);
+
+		EXPECT_INT((int)sequential.GetWay(100).Nodes.size(), 2);
+		EXPECT_INT((int)sequential.GetWay(100).Nodes.back(), 2);
+		EXPECT_INT((int)sequential.GetRelation(200).Members.size(), 1);
+		EXPECT_INT((int)sequential.GetRelation(200).Members.front().Ref, 100);
+
+		int nthreads[] = { 2, 3, 4, 1000 };
+		for (unsigned int n = 0; n < sizeof(nthreads)/sizeof(nthreads[0]); ++n) {
+			TestDatasource parallel;
+			parallel.LoadParallel(path, nthreads[n]);
+
+			EXPECT_TRUE(sequential.SameAs(parallel));
+		}
+	}
+
+	// PBF load keeps first of duplicate objects too
+	{
+		WriteFile(path, duplicate_osm);
+
+		TestDatasource sequential;
+		TestDatasource::ResetSyntheticIds();
+		sequential.Load(path);
+		sequential.SaveSnapshot(path);
+		std::string expected = ReadFile(path);
+
+		std::string pbfdata = MakeDuplicatePbf();
+		int nthreads[] = { 1, 2, 4 };
+		for (unsigned int n = 0; n < sizeof(nthreads)/sizeof(nthreads[0]); ++n) {
+			std::ofstream(path, std::ios::binary).write(pbfdata.data(), pbfdata.size());
+
+			PreloadedPbfDatasource pbf;
+			TestDatasource::ResetSyntheticIds();
+			pbf.LoadParallel(path, nthreads[n]);
+
+			EXPECT_INT((int)pbf.GetWay(100).Nodes.back(), 2);
+			EXPECT_INT((int)pbf.GetRelation(200).Members.front().Ref, 100);
+
+			pbf.SaveSnapshot(path);
+			EXPECT_TRUE(ReadFile(path) == expected);
+		}
+	}
+
+	// PBF dump of the same data
+	{
+		TestDatasource sequential;
+		TestDatasource::ResetSyntheticIds();
+		sequential.Load(TESTDATA_DIR "/glosm.osm");
+		sequential.SaveSnapshot(path);
+		std::string expected = ReadFile(path);
+
+		int nthreads[] = { 1, 2, 4, 16 };
+		for (unsigned int n = 0; n < sizeof(nthreads)/sizeof(nthreads[0]); ++n) {
+			PreloadedPbfDatasource pbf;
+			TestDatasource::ResetSyntheticIds();
+			pbf.LoadParallel(TESTDATA_DIR "/glosm.osm.pbf", nthreads[n]);
+			pbf.SaveSnapshot(path);
+			EXPECT_TRUE(ReadFile(path) == expected);
+
+			TestDatasource loaded;
+			loaded.LoadSnapshot(path);
+			EXPECT_TRUE(sequential.SameAs(loaded));
+		}
+	}
+
+	// compressed XML
+	{
+		TestDatasource sequential;
+		TestDatasource::ResetSyntheticIds();
+		sequential.Load(TESTDATA_DIR "/glosm.osm");
+
+		const char* compressed[] = { TESTDATA_DIR "/glosm.osm.gz", TESTDATA_DIR "/glosm.osm.bz2" };
+		for (unsigned int f = 0; f < sizeof(compressed)/sizeof(compressed[0]); ++f) {
+			TestDatasource loaded;
+			TestDatasource::ResetSyntheticIds();
+			loaded.LoadParallel(compressed[f], 4);
+
+			EXPECT_TRUE(sequential.SameAs(loaded));
+			EXPECT_TRUE(loaded.GetLoadedBytes() == sequential.GetLoadedBytes());
+			EXPECT_TRUE(loaded.GetCompressedBytes() > 0);
+		}
+	}
+
+	// zero padding after gzip stream is ignored
+	{
+		std::string data = ReadFile(TESTDATA_DIR "/glosm.osm.gz");
+		data.append(1000, '\0');
+		FILE* f = fopen(path, "w");
+		fwrite(data.data(), 1, data.size(), f);
+		fclose(f);
+
+		TestDatasource original, loaded;
+		TestDatasource::ResetSyntheticIds();
+		original.Load(TESTDATA_DIR "/glosm.osm");
+		TestDatasource::ResetSyntheticIds();
+		loaded.Load(path);
+
+		EXPECT_TRUE(original.SameAs(loaded));
+	}
+
+	// truncated compressed XML is rejected
+	{
+		std::string data = ReadFile(TESTDATA_DIR "/glosm.osm.gz");
+		FILE* f = fopen(path, "w");
+		fwrite(data.data(), 1, data.size() / 2, f);
+		fclose(f);
+
+		TestDatasource loaded;
+		bool thrown = false;
+		try {
+			loaded.Load(path);
+		} catch (Exception&) {
+			thrown = true;
+		}
+		EXPECT_TRUE(thrown);
+	}
+
+	// truncated PBF is rejected
+	{
+		std::string data = ReadFile(TESTDATA_DIR "/glosm.osm.pbf");
+		FILE* f = fopen(path, "w");
+		fwrite(data.data(), 1, data.size() - 100, f);
+		fclose(f);
+
+		PreloadedPbfDatasource pbf;
+		bool thrown = false;
+		try {
+			pbf.Load(path);
+		} catch (ParsingException&) {
+			thrown = true;
+		}
+		EXPECT_TRUE(thrown);
+	}
+
+	// plain datasource
+	{
+		TestDatasource original, loaded;
+		original.Load(TESTDATA_DIR "/glosm.osm");
+		original.SaveSnapshot(path);
+		loaded.LoadSnapshot(path);
+
+		EXPECT_TRUE(original.SameAs(loaded));
+
+		std::vector<const OsmDatasource::Way*> ways;
+		loaded.GetWays(ways, loaded.GetBBox());
+		EXPECT_TRUE(!ways.empty());
+	}
+
+	// datasource with nodes inlined into ways
+	{
+		TestDatasource original, loaded;
+		original.Load(TESTDATA_DIR "/glosm.osm");
+		original.InlineNodes();
+		original.SaveSnapshot(path);
+		loaded.LoadSnapshot(path);
+
+		EXPECT_TRUE(original.SameAs(loaded));
+	}
+
+	// way views
+	{
+		TestDatasource datasource;
+		datasource.Load(TESTDATA_DIR "/glosm.osm");
+
+		std::vector<OsmDatasource::WayView> views;
+		datasource.GetWays(views, datasource.GetBBox());
+		EXPECT_TRUE(!views.empty());
+
+		/* way data is only in the store until way is asked for */
+		EXPECT_INT((int)datasource.CountObjectNodes(), 0);
+		const OsmDatasource::Way& way = datasource.GetWay(datasource.GetWayStore().GetId(0));
+		OsmDatasource::WayView stored = datasource.GetWayStore().GetView(0);
+		EXPECT_TRUE(!way.Nodes.empty() && way.Nodes.size() == stored.Nodes.size() && std::equal(stored.Nodes.begin(), stored.Nodes.end(), way.Nodes.begin()));
+		EXPECT_TRUE(way.Tags.size() == stored.Tags.size());
+		EXPECT_INT((int)datasource.CountObjectNodes(), (int)way.Nodes.size());
+
+		EXPECT_TRUE(SameViews(datasource, datasource.GetBBox()));
+		EXPECT_TRUE(SameViews(datasource, BBoxi(datasource.GetCenter(), datasource.GetBBox().GetTopRight())));
+
+		/* views pick up inlined coordinates */
+		datasource.InlineNodes();
+		views.clear();
+		datasource.GetWays(views, datasource.GetBBox());
+		EXPECT_TRUE(!views.empty() && !views.front().Coords.empty());
+		EXPECT_TRUE(SameViews(datasource, datasource.GetBBox()));
+
+		/* tag lookups */
+		bool found = true;
+		for (std::vector<OsmDatasource::WayView>::const_iterator view = views.begin(); view != views.end(); ++view) {
+			for (OsmDatasource::TagsView::const_iterator tag = view->Tags.begin(); tag != view->Tags.end(); ++tag)
+				found = found && view->Tags.get(tag->first) == tag->second;
+			found = found && view->Tags.find(TagDictionary::NONE) == view->Tags.end();
+		}
+		EXPECT_TRUE(found);
+	}
+
+	// mapped file
+	{
+		std::string mappedpath = std::string(path) + ".map";
+
+		TestDatasource original;
+		original.Load(TESTDATA_DIR "/glosm.osm");
+		original.InlineNodes();
+		MappedOsmDatasource::Write(mappedpath.c_str(), original.GetWayStore(), original.GetBBox());
+
+		MappedOsmDatasource mapped(mappedpath.c_str());
+		EXPECT_INT((int)mapped.GetWaysCount(), (int)original.GetWayStore().GetSize());
+		EXPECT_TRUE(TestDatasource::SameBBox(mapped.GetBBox(), original.GetBBox()));
+
+		/* same ways in the same order, save for node ids */
+		BBoxi bboxes[] = { original.GetBBox(), BBoxi(original.GetCenter(), original.GetBBox().GetTopRight()), BBoxi(-1000, -1000, 1000, 1000) };
+		for (size_t b = 0; b < sizeof(bboxes)/sizeof(bboxes[0]); ++b) {
+			std::vector<OsmDatasource::WayView> expected, views;
+			original.GetWays(expected, bboxes[b]);
+			mapped.GetWays(views, bboxes[b]);
+
+			bool same = expected.size() == views.size();
+			for (size_t i = 0; same && i < views.size(); ++i) {
+				same = expected[i].Coords.size() == views[i].Coords.size() && std::equal(views[i].Coords.begin(), views[i].Coords.end(), expected[i].Coords.begin()) &&
+					expected[i].Tags.size() == views[i].Tags.size() && std::equal(views[i].Tags.begin(), views[i].Tags.end(), expected[i].Tags.begin()) &&
+					expected[i].Closed == views[i].Closed && expected[i].Clockwise == views[i].Clockwise && expected[i].Inner == views[i].Inner &&
+					TestDatasource::SameBBox(expected[i].BBox, views[i].BBox);
+			}
+			EXPECT_TRUE(same);
+		}
+
+		/* ways may be looked up by id */
+		const WayStore& store = original.GetWayStore();
+		bool found = true;
+		for (size_t i = 0; i < store.GetSize(); i += 7) {
+			OsmDatasource::WayView view;
+			const OsmDatasource::Way& way = original.GetWay(store.GetId(i));
+			found = found && mapped.TryGetWay(store.GetId(i), view) && view.Coords.size() == way.Coords.size() &&
+				std::equal(view.Coords.begin(), view.Coords.end(), way.Coords.begin());
+		}
+		EXPECT_TRUE(found);
+		EXPECT_TRUE(!HasWay(mapped, 0));
+		EXPECT_TRUE(!HasNode(mapped, 1));
+
+		/* there are no Way objects to point to */
+		std::vector<const OsmDatasource::Way*> pointers;
+		EXPECT_EXCEPTION(mapped.GetWay(store.GetId(0)), Exception);
+		EXPECT_EXCEPTION(mapped.GetWays(pointers, mapped.GetBBox()), Exception);
+
+		/* truncated file is rejected */
+		std::string data = ReadFile(mappedpath.c_str());
+		std::ofstream(mappedpath.c_str(), std::ios::binary).write(data.data(), data.size() / 2);
+		bool thrown = false;
+		try {
+			MappedOsmDatasource truncated(mappedpath.c_str());
+		} catch (DataException&) {
+			thrown = true;
+		}
+		EXPECT_TRUE(thrown);
+
+		/* so are out of range way index and non-monotonic offsets */
+		uint64_t nways = store.GetSize();
+		size_t corrupted[] = {
+			MappedByIdOffset(data) + sizeof(uint64_t) * 3,
+			MappedByIdOffset(data) + sizeof(uint64_t) * nways + sizeof(BBoxi) * nways + sizeof(uint64_t) * 2,
+		};
+		for (size_t c = 0; c < sizeof(corrupted)/sizeof(corrupted[0]); ++c) {
+			std::string bad = data;
+			uint64_t value = nways * 1000;
+			memcpy(&bad[corrupted[c]], &value, sizeof(value));
+			std::ofstream(mappedpath.c_str(), std::ios::binary).write(bad.data(), bad.size());
+
+			thrown = false;
+			try {
+				MappedOsmDatasource corrupt(mappedpath.c_str());
+			} catch (DataException&) {
+				thrown = true;
+			}
+			EXPECT_TRUE(thrown);
+		}
+
+		unlink(mappedpath.c_str());
+	}
+
+	// sharded datasource
+	for (int inline_nodes = 0; inline_nodes < 2; ++inline_nodes) {
+		std::string shardpaths[] = { std::string(path) + ".a", std::string(path) + ".b" };
+		WriteFile(shardpaths[0].c_str(), shard_a_osm);
+		WriteFile(shardpaths[1].c_str(), shard_b_osm);
+		WriteFile(path, sample_osm);
+
+		TestDatasource whole;
+		whole.Load(path);
+
+		ShardedOsmDatasource sharded;
+		sharded.AddShard(new PreloadedXmlDatasource, shardpaths[0].c_str());
+		sharded.AddShard(new PreloadedXmlDatasource, shardpaths[1].c_str());
+		sharded.Load(2, inline_nodes);
+
+		EXPECT_INT((int)sharded.GetShardsCount(), 2);
+		EXPECT_TRUE(TestDatasource::SameBBox(sharded.GetBBox(), whole.GetBBox()));
+
+		/* way crossing the border is returned once */
+		BBoxi bboxes[] = { whole.GetBBox(), BBoxi(5000000, 5000000, 15000000, 15000000), BBoxi(19000000, 19000000, 22000000, 22000000) };
+		for (size_t b = 0; b < sizeof(bboxes)/sizeof(bboxes[0]); ++b) {
+			std::vector<const OsmDatasource::Way*> expected, ways;
+			std::vector<OsmDatasource::WayView> views;
+			whole.GetWays(expected, bboxes[b]);
+			sharded.GetWays(ways, bboxes[b]);
+			sharded.GetWays(views, bboxes[b]);
+
+			EXPECT_INT((int)ways.size(), (int)expected.size());
+			EXPECT_INT((int)views.size(), (int)expected.size());
+			EXPECT_TRUE(views.empty() || views.front().Coords.empty() != (bool)inline_nodes);
+		}
+
+		/* lookups by id go to all shards */
+		EXPECT_TRUE(HasWay(sharded, 100) && HasWay(sharded, 101) && HasWay(sharded, 102));
+		EXPECT_TRUE(!HasWay(sharded, 103));
+		EXPECT_TRUE(HasNode(sharded, 10) == !inline_nodes);
+		EXPECT_TRUE(sharded.GetRelation(200).Members.size() == 1);
+
+		/* nodes of a way may be split between shards */
+		osmid_t ids[] = { 1, 10 };
+		Vector2i coords[2];
+		EXPECT_TRUE(sharded.TryGetNodes(ids, 2, coords) == !inline_nodes);
+
+		unlink(shardpaths[0].c_str());
+		unlink(shardpaths[1].c_str());
+	}
+
+	// sharded mapped files
+	{
+		/* mapped shards keep no node ids; way 100 is in both
+		 * shards, and way 101 looks like it save for coordinates */
+		const char* shardosm[] = {
+			"<osm>"
+			"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='1.0' lon='1.0'/>"
+			"<way id='100'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>"
+			"</osm>",
+			"<osm>"
+			"<node id='1' lat='0.0' lon='0.0'/><node id='2' lat='1.0' lon='1.0'/>"
+			"<node id='3' lat='0.5' lon='0.5'/><node id='4' lat='1.5' lon='1.5'/>"
+			"<way id='100'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>"
+			"<way id='101'><nd ref='3'/><nd ref='4'/><tag k='highway' v='residential'/></way>"
+			"</osm>",
+		};
+
+		std::string shardpaths[] = { std::string(path) + ".a.map", std::string(path) + ".b.map" };
+		ShardedOsmDatasource sharded;
+		for (int i = 0; i < 2; ++i) {
+			WriteFile(path, shardosm[i]);
+			TestDatasource shard;
+			shard.Load(path);
+			shard.InlineNodes();
+			MappedOsmDatasource::Write(shardpaths[i].c_str(), shard.GetWayStore(), shard.GetBBox());
+			sharded.AddShard(new MappedOsmDatasource(shardpaths[i].c_str()));
+		}
+
+		std::vector<OsmDatasource::Way> ways;
+		std::vector<OsmDatasource::WayView> views;
+		sharded.GetWays(ways, sharded.GetBBox());
+		sharded.GetWays(views, sharded.GetBBox());
+		EXPECT_INT((int)ways.size(), 2);
+		EXPECT_INT((int)views.size(), 2);
+		EXPECT_TRUE(HasWay(sharded, 101));
+
+		unlink(shardpaths[0].c_str());
+		unlink(shardpaths[1].c_str());
+	}
+
+	// failed shard load is reported
+	{
+		ShardedOsmDatasource sharded;
+		sharded.AddShard(new PreloadedXmlDatasource, TESTDATA_DIR "/glosm.osm");
+		sharded.AddShard(new PreloadedXmlDatasource, TESTDATA_DIR "/nonexistent.osm");
+
+		bool thrown = false;
+		try {
+			sharded.Load(2);
+		} catch (Exception&) {
+			thrown = true;
+		}
+		EXPECT_TRUE(thrown);
+	}
+
+	// load listener
+	const char* listenedfiles[] = { TESTDATA_DIR "/glosm.osm", TESTDATA_DIR "/glosm.osm.pbf" };
+	for (unsigned int f = 0; f < sizeof(listenedfiles)/sizeof(listenedfiles[0]); ++f) {
+		for (int nthreads = 1; nthreads <= 2; ++nthreads) {
+			PhaseCounter counter;
+			std::auto_ptr<PreloadedXmlDatasource> datasource(f == 0 ? new PreloadedXmlDatasource : new PreloadedPbfDatasource);
+			datasource->SetLoadListener(&counter);
+			datasource->LoadParallel(listenedfiles[f], nthreads);
+
+			EXPECT_TRUE(counter.AllFinishedOnce());
+			EXPECT_INT((int)counter.last.ways, (int)datasource->GetWayStore().GetSize());
+			EXPECT_INT((int)counter.last.bytes, (int)datasource->GetLoadedBytes());
+			EXPECT_TRUE(datasource->GetPhaseTime(LoadListener::PARSE) <= datasource->GetLoadTime());
+		}
+	}
+
+	// loading snapshot replaces previous data
+	{
+		TestDatasource original, loaded;
+		original.Load(TESTDATA_DIR "/glosm.osm");
+		original.SaveSnapshot(path);
+		loaded.Load(TESTDATA_DIR "/grid.osm");
+		loaded.LoadSnapshot(path);
+
+		EXPECT_TRUE(original.SameAs(loaded));
+	}
+
+	// garbage is rejected
+	{
+		FILE* f = fopen(path, "w");
+		fprintf(f, "<osm></osm>\n");
+		fclose(f);
+
+		TestDatasource loaded;
+		bool thrown = false;
+		try {
+			loaded.LoadSnapshot(path);
+		} catch (DataException&) {
+			thrown = true;
+		}
+		EXPECT_TRUE(thrown);
+	}
+
+	// bogus object counts are rejected before reserving memory
+	{
+		TestDatasource original;
+		original.Load(TESTDATA_DIR "/glosm.osm");
+		original.SaveSnapshot(path);
+		std::string data = ReadFile(path);
+
+		/* node count follows header and string table */
+		size_t offset = 40;
+		uint32_t nstrings;
+		memcpy(&nstrings, &data[offset], sizeof(nstrings));
+		offset += sizeof(nstrings);
+		for (uint32_t i = 0; i < nstrings; ++i)
+			offset = data.find('\0', offset) + 1;
+
+		uint64_t counts[] = { (uint64_t)1 << 40, ((uint64_t)1 << 63) + 1, std::numeric_limits<uint64_t>::max() };
+		for (size_t c = 0; c < sizeof(counts)/sizeof(counts[0]); ++c) {
+			std::string bad = data;
+			memcpy(&bad[offset], &counts[c], sizeof(counts[c]));
+			std::ofstream(path, std::ios::binary).write(bad.data(), bad.size());
+
+			TestDatasource loaded;
+			bool thrown = false;
+			try {
+				loaded.LoadSnapshot(path);
+			} catch (DataException&) {
+				thrown = true;
+			}
+			EXPECT_TRUE(thrown);
+		}
+	}
+
+	// load filter
+	{
+		WriteFile(path, sample_osm);
+
+		/* area filter drops ways and nodes outside of it */
+		PreloadedXmlDatasource::LoadFilter areafilter;
+		areafilter.bbox = BBoxi(0, 0, 1000000, 1000000);
+		areafilter.margin = 100000;
+
+		TestDatasource area;
+		area.SetLoadFilter(areafilter);
+		area.Load(path);
+
+		EXPECT_TRUE(HasNode(area, 1));
+		EXPECT_TRUE(!HasNode(area, 5));
+		EXPECT_TRUE(HasWay(area, 100));
+		EXPECT_TRUE(!HasWay(area, 101));
+		EXPECT_TRUE(!HasWay(area, 102));
+
+		std::vector<const OsmDatasource::Way*> ways;
+		area.GetWays(ways, BBoxi::Full());
+		EXPECT_INT((int)ways.size(), 1);
+
+		/* ways crossing area border are kept whole, unused
+		 * nodes outside are dropped */
+		WriteFile(path, crossing_osm);
+
+		TestDatasource crossing;
+		crossing.SetLoadFilter(areafilter);
+		crossing.Load(path);
+
+		EXPECT_TRUE(HasWay(crossing, 100));
+		EXPECT_INT((int)crossing.GetWay(100).Nodes.size(), 2);
+		EXPECT_TRUE(HasNode(crossing, 2));
+		EXPECT_TRUE(!HasNode(crossing, 3));
+
+		WriteFile(path, sample_osm);
+
+		/* key filter keeps untagged multipolygon members */
+		PreloadedXmlDatasource::LoadFilter keyfilter;
+		keyfilter.keys.push_back(TagDictionary::Intern("building"));
+		keyfilter.prune_nodes = true;
+
+		TestDatasource keys;
+		keys.SetLoadFilter(keyfilter);
+		keys.Load(path);
+
+		EXPECT_TRUE(HasWay(keys, 100));
+		EXPECT_TRUE(HasWay(keys, 101));
+		EXPECT_TRUE(!HasWay(keys, 102));
+		EXPECT_TRUE(HasNode(keys, 5));
+		EXPECT_TRUE(!HasNode(keys, 9));
+
+		ways.clear();
+		keys.GetWays(ways, BBoxi::Full());
+		EXPECT_INT((int)ways.size(), 3);
+
+		/* parallel loading gives the same result */
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.bbox = BBoxi(-1800000000, -900000000, 1800000000, 900000000);
+		filter.keys.push_back(TagDictionary::Intern("building"));
+		filter.keys.push_back(TagDictionary::Intern("highway"));
+		filter.prune_nodes = true;
+
+		TestDatasource::ResetSyntheticIds();
+		TestDatasource sequential;
+		sequential.SetLoadFilter(filter);
+		sequential.Load(TESTDATA_DIR "/glosm.osm");
+
+		TestDatasource unfiltered;
+		unfiltered.Load(TESTDATA_DIR "/glosm.osm");
+		EXPECT_TRUE(!sequential.SameAs(unfiltered));
+
+		TestDatasource::ResetSyntheticIds();
+		TestDatasource parallel;
+		parallel.SetLoadFilter(filter);
+		parallel.LoadParallel(TESTDATA_DIR "/glosm.osm", 4);
+
+		EXPECT_TRUE(sequential.SameAs(parallel));
+	}
+
+	// multipolygons
+	{
+		WriteFile(path, multipolygon_osm);
+
+		TestDatasource datasource;
+		datasource.Load(path);
+
+		std::vector<const OsmDatasource::Way*> ways;
+		datasource.GetWays(ways, BBoxi::Full());
+		EXPECT_INT((int)ways.size(), 5);
+
+		int nouter = 0, ninner = 0;
+		for (std::vector<const OsmDatasource::Way*>::const_iterator way = ways.begin(); way != ways.end(); ++way) {
+			if ((*way)->Tags.empty())
+				continue;
+			EXPECT_TRUE((*way)->Closed);
+			if ((*way)->Inner)
+				++ninner;
+			else
+				++nouter;
+		}
+		EXPECT_INT(nouter, 1);
+		EXPECT_INT(ninner, 1);
+	}
+
+	// applying changes
+	{
+		std::string changepath = std::string(path) + ".osc";
+		WriteFile(path, sample_osm);
+		WriteFile(changepath.c_str(), sample_osc);
+
+		TestDatasource datasource;
+		datasource.Load(path);
+
+		std::vector<const OsmDatasource::Way*> ways;
+		datasource.GetWays(ways, datasource.GetBBox());
+		EXPECT_INT((int)ways.size(), 4);
+
+		std::vector<BBoxi> dirty;
+		datasource.ApplyChange(changepath.c_str(), dirty);
+
+		/* moved node changes way bbox */
+		EXPECT_INT(datasource.GetWay(100).BBox.left, -1000000);
+		EXPECT_TRUE(!HasWay(datasource, 102));
+		EXPECT_TRUE(HasWay(datasource, 103));
+
+		/* both old and new locations are dirty, untouched areas are not */
+		EXPECT_TRUE(AnyIntersects(dirty, BBoxi(-1000000, -1000000, -900000, -900000)));
+		EXPECT_TRUE(AnyIntersects(dirty, BBoxi(20500000, 20500000, 20600000, 20600000)));
+		EXPECT_TRUE(AnyIntersects(dirty, BBoxi(30500000, 30500000, 30600000, 30600000)));
+		EXPECT_TRUE(AnyIntersects(dirty, BBoxi(9000000, 9000000, 9100000, 9100000)));
+		EXPECT_TRUE(!AnyIntersects(dirty, BBoxi(15000000, 15000000, 16000000, 16000000)));
+
+		/* multipolygon is regenerated, not duplicated */
+		ways.clear();
+		datasource.GetWays(ways, datasource.GetBBox());
+		EXPECT_INT((int)ways.size(), 4);
+
+		ways.clear();
+		datasource.GetWays(ways, BBoxi(9000000, 9000000, 9100000, 9100000));
+		EXPECT_INT((int)ways.size(), 2);
+
+		ways.clear();
+		datasource.GetWays(ways, BBoxi(20500000, 20500000, 20600000, 20600000));
+		EXPECT_INT((int)ways.size(), 0);
+
+		/* same through snapshot, which keeps synthetic ways */
+		TestDatasource original, loaded;
+		original.Load(path);
+		original.SaveSnapshot(path);
+		loaded.LoadSnapshot(path);
+		dirty.clear();
+		loaded.ApplyChange(changepath.c_str(), dirty);
+
+		ways.clear();
+		loaded.GetWays(ways, loaded.GetBBox());
+		EXPECT_INT((int)ways.size(), 4);
+
+		/* ways need nodes to be updated */
+		TestDatasource inlined;
+		WriteFile(path, sample_osm);
+		inlined.Load(path);
+		inlined.InlineNodes();
+		bool thrown = false;
+		try {
+			inlined.ApplyChange(changepath.c_str(), dirty);
+		} catch (DataException&) {
+			thrown = true;
+		}
+		EXPECT_TRUE(thrown);
+
+		unlink(changepath.c_str());
+	}
+
+	// GPX tracks
+	{
+		/* two segments zigzagging by few units along a straight line */
+		std::vector<Vector3i> expected;
+		FILE* f = fopen(path, "w");
+		fprintf(f, "<gpx><trk>\n");
+		for (int seg = 0; seg < 2; ++seg) {
+			fprintf(f, "<trkseg>\n");
+			for (int i = 0; i < 1000; ++i) {
+				int lon = i * 1000;
+				int lat = seg * 10000000 + (i % 2) * 10;
+				fprintf(f, "<trkpt lat=\"%d.%07d\" lon=\"%d.%07d\"><ele>%d</ele></trkpt>\n", lat / 10000000, lat % 10000000, lon / 10000000, lon % 10000000, i);
+				expected.push_back(Vector3i(lon, lat, ParseEle("1") * i));
+			}
+			fprintf(f, "</trkseg>\n");
+		}
+		fprintf(f, "<trkseg></trkseg></trk></gpx>\n");
+		fclose(f);
+
+		PreloadedGPXDatasource gpx;
+		gpx.Load(path);
+		EXPECT_INT((int)gpx.GetPointsCount(), 2000);
+		EXPECT_INT((int)gpx.GetSegmentsCount(), 2);
+		EXPECT_TRUE(gpx.GetSimplifiedLevelsCount() > 0);
+
+		/* indexed query matches full scan */
+		BBoxi bboxes[] = { BBoxi(0, 0, 1000000, 10000010), BBoxi(123456, -5, 345678, 10000005), BBoxi(500000, 5, 500000, 5) };
+		for (size_t b = 0; b < sizeof(bboxes)/sizeof(bboxes[0]); ++b) {
+			std::vector<Vector3i> scanned, points;
+			for (std::vector<Vector3i>::const_iterator i = expected.begin(); i != expected.end(); ++i)
+				if (bboxes[b].Contains(*i))
+					scanned.push_back(*i);
+			gpx.GetPoints(points, bboxes[b]);
+			EXPECT_TRUE(points == scanned);
+		}
+
+		/* exact tracks are whole */
+		std::vector<Vector3i> points;
+		std::vector<size_t> lengths;
+		gpx.GetTracks(points, lengths, BBoxi(0, 0, 1000000, 10000010), 0);
+		EXPECT_TRUE(points == expected);
+		EXPECT_INT((int)lengths.size(), 2);
+		EXPECT_INT((int)lengths[0], 1000);
+
+		/* coarse tracks are reduced to straight lines */
+		points.clear();
+		lengths.clear();
+		gpx.GetTracks(points, lengths, BBoxi(0, 0, 1000000, 10000010), 1000);
+		EXPECT_INT((int)lengths.size(), 2);
+		EXPECT_INT((int)points.size(), 4);
+		EXPECT_TRUE(points.front() == expected.front() && points.back() == expected.back());
+	}
+
+	// bulk GPX loading
+	{
+		char dir[] = "/tmp/glosm-test-XXXXXX";
+		EXPECT_TRUE(mkdtemp(dir) != NULL);
+
+		std::string dirpath = dir;
+		const char* names[] = { "/a.gpx", "/b.gpx", "/broken.gpx", "/c.gpx", "/readme.txt" };
+		for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i) {
+			FILE* f = fopen((dirpath + names[i]).c_str(), "w");
+			if (i == 2) {
+				fprintf(f, "<gpx><trk><trkseg><trkpt lat=\"1.0\" lon=\"1.0\"/></trkseg>\n");
+			} else {
+				fprintf(f, "<gpx><trk>\n");
+				for (int seg = 0; seg <= (int)i; ++seg) {
+					fprintf(f, "<trkseg>\n");
+					for (int pt = 0; pt < 50; ++pt)
+						fprintf(f, "<trkpt lat=\"0.%03d%d\" lon=\"0.%03d\"/>\n", pt, (int)i, seg * 100 + pt);
+					fprintf(f, "</trkseg>\n");
+				}
+				fprintf(f, "</trk></gpx>\n");
+			}
+			fclose(f);
+		}
+
+		std::vector<std::string> files;
+		PreloadedGPXDatasource::FindFiles(dir, files);
+		EXPECT_INT((int)files.size(), 4);
+
+		PreloadedGPXDatasource sequential;
+		sequential.Load((dirpath + names[0]).c_str());
+		sequential.Load((dirpath + names[1]).c_str());
+		sequential.Load((dirpath + names[3]).c_str());
+
+		std::vector<Vector3i> expected;
+		std::vector<size_t> expectedlengths;
+		sequential.GetTracks(expected, expectedlengths, BBoxi::ForEarth(), 0);
+		EXPECT_INT((int)sequential.GetSegmentsCount(), 7);
+
+		int nthreads[] = { 1, 2, 8 };
+		for (size_t n = 0; n < sizeof(nthreads)/sizeof(nthreads[0]); ++n) {
+			PreloadedGPXDatasource bulk;
+			std::vector<std::string> errors;
+			EXPECT_INT((int)bulk.LoadFiles(files, nthreads[n], errors), 3);
+			EXPECT_INT((int)errors.size(), 1);
+			EXPECT_TRUE(errors.size() == 1 && errors[0].find("broken.gpx") != std::string::npos);
+
+			std::vector<Vector3i> points;
+			std::vector<size_t> lengths;
+			bulk.GetTracks(points, lengths, BBoxi::ForEarth(), 0);
+			EXPECT_TRUE(points == expected);
+			EXPECT_TRUE(lengths == expectedlengths);
+		}
+
+		for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i)
+			unlink((dirpath + names[i]).c_str());
+		rmdir(dir);
+	}
+
+	unlink(path);
+END_TEST()
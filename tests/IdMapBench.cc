@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a benchmark comparing chained and open addressing id maps.
+ *
+ * Usage: IdMapBench [count]
+ *
+ * Count of synthetic ids defaults to 100M, which needs ~4GB of
+ * memory. id_map is also tested with huge page allocator, which
+ * requires transparent huge pages to be enabled in the kernel. Ids are increasing with random gaps, like node ids in
+ * an OSM dump. Random lookups go in shuffled order, sequential
+ * ones imitate walking nodes of ways, which refer to nodes with
+ * close ids.
+ */
+
+#include <glosm/id_map.hh>
+#include <glosm/flat_id_map.hh>
+#include <glosm/osmtypes.h>
+#include <glosm/Timer.hh>
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+/* how many lookups ahead to prefetch */
+static const size_t PREFETCH_DISTANCE = 8;
+
+struct Value {
+	int x, y;
+
+	Value(int xx = 0, int yy = 0) : x(xx), y(yy) {}
+};
+
+/* simple LCG, so runs are repeatable and fast */
+struct Random {
+	uint64_t state;
+
+	Random() : state(1) {}
+	size_t operator()(size_t n) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (size_t)(state >> 33) % n;
+	}
+};
+
+template <class M>
+void Bench(const char* name, const std::vector<osmid_t>& ids, const std::vector<osmid_t>& shuffled) {
+	fprintf(stderr, "%s:\n", name);
+
+	long long sum = 0;
+	Timer timer;
+
+	{
+		M map;
+
+		for (std::vector<osmid_t>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+			map.insert(std::make_pair(*i, Value((int)*i, 1)));
+		fprintf(stderr, "  insert:          %8.3f sec\n", timer.Count());
+
+		for (std::vector<osmid_t>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+			sum += map.find(*i)->second.x;
+		fprintf(stderr, "  sequential find: %8.3f sec\n", timer.Count());
+
+		for (std::vector<osmid_t>::const_iterator i = shuffled.begin(); i != shuffled.end(); ++i)
+			sum += map.find(*i)->second.x;
+		fprintf(stderr, "  random find:     %8.3f sec\n", timer.Count());
+
+		for (size_t i = 0; i < shuffled.size(); ++i) {
+			if (i + PREFETCH_DISTANCE < shuffled.size())
+				map.prefetch(shuffled[i + PREFETCH_DISTANCE]);
+			sum += map.find(shuffled[i])->second.x;
+		}
+		fprintf(stderr, "  prefetched find: %8.3f sec\n", timer.Count());
+
+		/* id + 1 is missing in 3/4 of cases */
+		for (std::vector<osmid_t>::const_iterator i = shuffled.begin(); i != shuffled.end(); ++i)
+			sum += map.find(*i + 1) == map.end();
+		fprintf(stderr, "  random miss:     %8.3f sec\n", timer.Count());
+
+		for (typename M::const_iterator i = map.begin(); i != map.end(); ++i)
+			sum += i->second.y;
+		fprintf(stderr, "  iterate:         %8.3f sec\n", timer.Count());
+	}
+
+	fprintf(stderr, "  destroy:         %8.3f sec\n", timer.Count());
+
+	{
+		M map;
+		map.reserve(ids.size());
+
+		timer.Count();
+		for (std::vector<osmid_t>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+			map.insert(std::make_pair(*i, Value((int)*i, 1)));
+		fprintf(stderr, "  presized insert: %8.3f sec\n", timer.Count());
+	}
+
+	/* prevent optimizing lookups away */
+	if (sum == 0)
+		fprintf(stderr, "  (checksum is zero)\n");
+}
+
+int main(int argc, char** argv) {
+	size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000000;
+
+	Random random;
+
+	std::vector<osmid_t> ids;
+	ids.reserve(count);
+	osmid_t id = 0;
+	for (size_t i = 0; i < count; ++i)
+		ids.push_back(id += 1 + random(4));
+
+	std::vector<osmid_t> shuffled(ids);
+	std::random_shuffle(shuffled.begin(), shuffled.end(), random);
+
+	fprintf(stderr, "%lu ids\n", (unsigned long)count);
+
+	Bench<id_map<osmid_t, Value> >("id_map", ids, shuffled);
+	Bench<id_map<osmid_t, Value, 2097152, HugePageAllocator> >("id_map, huge pages", ids, shuffled);
+	Bench<flat_id_map<osmid_t, Value> >("flat_id_map", ids, shuffled);
+
+	return 0;
+}
@@ -29,11 +29,84 @@
  */
 
 #include <glosm/id_map.hh>
+#include <glosm/flat_id_map.hh>
+
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
 
 #include "testing.h"
 
 typedef id_map<unsigned int, unsigned int, sizeof(unsigned int)*8> TestMap;
 
+typedef flat_id_map<long long, unsigned int> FlatMap;
+
+/* maps with pages of 2MB, which is huge page size on amd64 */
+typedef id_map<long long, unsigned int, 2097152, HugePageAllocator> HugePageMap;
+typedef id_map<long long, unsigned int, 2097152, FilePageAllocator> FilePageMap;
+
+/* many small mapped pages */
+typedef id_map<long long, unsigned int, 65536, FilePageAllocator> SmallFilePageMap;
+
+/* fills map with enough elements to take several pages and
+ * checks all of them */
+template <class M>
+static bool FillAndCheck(M& map) {
+	const long long count = 500000;
+	for (long long i = 0; i < count; ++i)
+		map.insert(std::make_pair(i * 3, (unsigned int)i));
+
+	if ((long long)map.size() != count)
+		return false;
+
+	for (long long i = 0; i < count; ++i) {
+		typename M::const_iterator el = map.find(i * 3);
+		if (el == map.end() || el->second != (unsigned int)i)
+			return false;
+	}
+
+	long long iterations = 0;
+	for (typename M::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations)
+		if (i->first != iterations * 3)
+			return false;
+
+	return iterations == count;
+}
+
+/* returns number of memory mappings of the process, or -1 if
+ * it's not known */
+static int CountMappings() {
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps == NULL)
+		return -1;
+
+	int count = 0;
+	for (int c; (c = fgetc(maps)) != EOF; )
+		if (c == '\n')
+			++count;
+
+	fclose(maps);
+	return count;
+}
+
+/* checks flat map contents against reference map */
+static bool SameContents(const FlatMap& map, const std::map<long long, unsigned int>& reference) {
+	if (map.size() != reference.size())
+		return false;
+
+	size_t iterations = 0;
+	for (FlatMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
+		std::map<long long, unsigned int>::const_iterator ref = reference.find(i->first);
+		if (ref == reference.end() || ref->second != i->second)
+			return false;
+		if (map.find(i->first) != i)
+			return false;
+	}
+
+	return iterations == reference.size();
+}
+
 BEGIN_TEST()
 	// create
 	TestMap map(8);
@@ -115,6 +188,22 @@ BEGIN_TEST()
 		EXPECT_INT(testksum, ksum);
 	}
 
+	// iteration goes in order of insertion, also when starting
+	// from an iterator returned by find()
+	{
+		bool ordered = true;
+		unsigned int expected = 0;
+		for (TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++expected)
+			ordered = ordered && i->first == expected;
+		EXPECT_TRUE(ordered);
+
+		expected = 13;
+		for (TestMap::iterator i = map.find(13); i != map.end(); ++i, ++expected)
+			ordered = ordered && i->first == expected;
+		EXPECT_TRUE(ordered);
+		EXPECT_INT(expected, 32);
+	}
+
 	// find
 	{
 		int testksum = 0, testvsum = 0;
@@ -170,4 +259,179 @@ BEGIN_TEST()
 		}
 	}
 
+	// erase arbitrary elements; keys colliding in a bucket and
+	// elements spread over several pages are involved
+	{
+		TestMap emap(4);
+		for (unsigned int i = 0; i < 64; ++i)
+			emap.insert(std::make_pair(i, 1024 - i));
+
+		EXPECT_INT(emap.erase(100), 0);
+
+		for (unsigned int i = 0; i < 64; i += 3)
+			EXPECT_INT(emap.erase(i), 1);
+		EXPECT_INT(emap.erase(0), 0);
+
+		EXPECT_INT(emap.size(), 64 - 22);
+
+		int iterations = 0;
+		for (TestMap::const_iterator i = emap.begin(); i != emap.end(); ++i, ++iterations)
+			EXPECT_TRUE(i->first % 3 != 0 && i->second == 1024 - i->first);
+		EXPECT_INT(iterations, 64 - 22);
+
+		for (unsigned int i = 0; i < 64; ++i) {
+			TestMap::iterator el = emap.find(i);
+			if (i % 3 == 0) {
+				EXPECT_TRUE(el == emap.end());
+			} else {
+				EXPECT_TRUE(el != emap.end() && el->second == 1024 - i);
+			}
+		}
+
+		// erased keys may be inserted again
+		for (unsigned int i = 0; i < 64; i += 3)
+			emap.insert(std::make_pair(i, i));
+		EXPECT_INT(emap.size(), 64);
+		EXPECT_TRUE(emap.find(63) != emap.end() && emap.find(63)->second == 63);
+
+		// erase everything
+		for (unsigned int i = 0; i < 64; ++i)
+			EXPECT_INT(emap.erase(i), 1);
+		EXPECT_TRUE(emap.empty());
+		EXPECT_TRUE(emap.begin() == emap.end());
+	}
+
+	// open addressing map
+	{
+		FlatMap fmap(8);
+
+		EXPECT_TRUE(fmap.empty());
+		EXPECT_TRUE(fmap.begin() == fmap.end());
+		EXPECT_TRUE(fmap.find(1) == fmap.end());
+
+		for (unsigned int i = 0; i < 10; ++i)
+			EXPECT_TRUE(fmap.insert(std::make_pair((long long)i * 1024, i)).second);
+
+		{
+			unsigned int sum = 0, iterations = 0;
+			for (FlatMap::iterator i = fmap.begin(); i != fmap.end(); ++i, ++iterations)
+				sum += i->second;
+			EXPECT_INT(iterations, 10);
+			EXPECT_INT(sum, 45);
+		}
+
+		// existing key is not replaced
+		std::pair<FlatMap::iterator, bool> res = fmap.insert(std::make_pair(3072LL, 100U));
+		EXPECT_TRUE(!res.second);
+		EXPECT_TRUE(res.first->first == 3072 && res.first->second == 3);
+		EXPECT_INT(fmap.size(), 10);
+
+		EXPECT_INT(fmap.erase(3072), 1);
+		EXPECT_INT(fmap.erase(3072), 0);
+		EXPECT_INT(fmap.size(), 9);
+		EXPECT_TRUE(fmap.find(3072) == fmap.end());
+		EXPECT_TRUE(fmap.find(4096) != fmap.end());
+
+		fmap.clear();
+		EXPECT_TRUE(fmap.empty());
+		EXPECT_TRUE(fmap.begin() == fmap.end());
+	}
+
+	// open addressing map under random inserts and erases; keys
+	// are clustered and negative ones are involved, to produce
+	// long probe sequences and exercise backward shift deletion
+	{
+		FlatMap fmap(8);
+		std::map<long long, unsigned int> reference;
+		bool same = true;
+
+		srand(1);
+		for (int i = 0; i < 20000; ++i) {
+			long long key = rand() % 2000 - 1000;
+			if (rand() % 3 == 0) {
+				same = same && fmap.erase(key) == reference.erase(key);
+			} else {
+				bool inserted = reference.insert(std::make_pair(key, (unsigned int)i)).second;
+				std::pair<FlatMap::iterator, bool> res = fmap.insert(std::make_pair(key, (unsigned int)i));
+				same = same && res.second == inserted && res.first->first == key;
+			}
+
+			if (i % 1000 == 0)
+				same = same && SameContents(fmap, reference);
+		}
+
+		EXPECT_TRUE(same);
+		EXPECT_TRUE(SameContents(fmap, reference));
+
+		// misses
+		for (long long key = 1000; key < 1100; ++key)
+			same = same && fmap.find(key) == fmap.end();
+		EXPECT_TRUE(same);
+
+		// presizing keeps everything in place
+		fmap.reserve(100000);
+		EXPECT_TRUE(fmap.bucket_count() >= 100000);
+		EXPECT_TRUE(SameContents(fmap, reference));
+
+		// swap
+		FlatMap other;
+		other.swap(fmap);
+		EXPECT_TRUE(fmap.empty());
+		EXPECT_TRUE(SameContents(other, reference));
+	}
+
+	// allocator policies and memory statistics
+	{
+		HugePageMap hmap;
+		EXPECT_TRUE(FillAndCheck(hmap));
+		EXPECT_TRUE(hmap.page_count() > 1);
+		EXPECT_TRUE(hmap.page_memory() == hmap.page_count() * 2097152);
+		EXPECT_TRUE(hmap.bucket_memory() == hmap.bucket_count() * sizeof(void*));
+
+		hmap.clear();
+		EXPECT_INT(hmap.page_count(), 0);
+		EXPECT_INT(hmap.page_memory(), 0);
+
+		// without directory, this is the same as huge pages
+		FilePageMap fmap;
+		EXPECT_TRUE(FillAndCheck(fmap));
+	}
+
+	{
+		char dir[] = "/tmp/glosm-test-XXXXXX";
+		EXPECT_TRUE(mkdtemp(dir) != NULL);
+		FilePageAllocator::SetDirectory(dir);
+
+		{
+			FilePageMap fmap;
+			EXPECT_TRUE(FillAndCheck(fmap));
+
+			// swapped maps keep their memory
+			FilePageMap other;
+			other.swap(fmap);
+			EXPECT_TRUE(fmap.empty());
+			EXPECT_TRUE(other.find(300) != other.end() && other.find(300)->second == 100);
+		}
+
+		// pages share a few mappings of a single file, and freed
+		// pages are reused
+		{
+			int before = CountMappings();
+
+			SmallFilePageMap small;
+			EXPECT_TRUE(FillAndCheck(small));
+			EXPECT_TRUE(small.page_count() > 100);
+			small.clear();
+			EXPECT_TRUE(FillAndCheck(small));
+
+			if (before != -1)
+				EXPECT_TRUE(CountMappings() - before < 10);
+		}
+
+		FilePageAllocator::SetDirectory("");
+
+		// backing files are unlinked, so directory is left empty
+		EXPECT_TRUE(rmdir(dir) == 0);
+	}
+
 END_TEST()
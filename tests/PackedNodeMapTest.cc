@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that packed node map behaves like std::map
+ * for both sorted and unsorted input.
+ */
+
+#include <glosm/packed_node_map.hh>
+#include <glosm/Math.hh>
+
+#include "testing.h"
+
+#include <map>
+
+struct TestNode {
+	Vector2i Pos;
+
+	TestNode() {}
+	TestNode(int x, int y) : Pos(x, y) {}
+};
+
+/* small blocks, so many of them are produced */
+typedef packed_node_map<long long, TestNode, 8> TestMap;
+typedef std::map<long long, Vector2i> ReferenceMap;
+
+static unsigned int seed = 1;
+
+static int Random(int max) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % max;
+}
+
+static bool SameContents(const TestMap& map, const ReferenceMap& reference) {
+	if (map.size() != reference.size())
+		return false;
+
+	size_t iterations = 0;
+	for (TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
+		ReferenceMap::const_iterator ref = reference.find(i->first);
+		if (ref == reference.end() || ref->second != i->second.Pos)
+			return false;
+	}
+
+	if (iterations != reference.size())
+		return false;
+
+	for (ReferenceMap::const_iterator ref = reference.begin(); ref != reference.end(); ++ref) {
+		TestMap::const_iterator i = map.find(ref->first);
+		if (i == map.end() || i->first != ref->first || i->second.Pos != ref->second)
+			return false;
+	}
+
+	return true;
+}
+
+BEGIN_TEST()
+	// empty
+	{
+		TestMap map;
+		EXPECT_TRUE(map.empty());
+		EXPECT_TRUE(map.begin() == map.end());
+		EXPECT_TRUE(map.find(1) == map.end());
+	}
+
+	// sorted input with dense and sparse runs of ids and
+	// coordinates of all magnitudes
+	{
+		TestMap map;
+		ReferenceMap reference;
+
+		long long id = 0;
+		bool inserted = true;
+		for (int i = 0; i < 1000; ++i) {
+			id += (i / 100) % 2 ? 1 + Random(1000) : 1;
+
+			Vector2i pos(Random(2) ? Random(100) : Random(2000000000) - 1000000000, Random(2000000000) - 1000000000);
+			if (i == 500)
+				pos = Vector2i(-2147483647 - 1, 2147483647);
+
+			inserted = inserted && map.insert(std::make_pair(id, TestNode(pos.x, pos.y))).second;
+			reference.insert(std::make_pair(id, pos));
+		}
+
+		EXPECT_TRUE(inserted);
+		EXPECT_TRUE(SameContents(map, reference));
+		EXPECT_TRUE(map.overflow_size() == 0);
+
+		// lookups between ids and out of range miss
+		bool misses = true;
+		for (long long k = -10; k < id + 10; ++k)
+			if (reference.find(k) == reference.end())
+				misses = misses && map.find(k) == map.end();
+		EXPECT_TRUE(misses);
+
+		// iteration goes in id order
+		bool ordered = true;
+		long long prev = -1;
+		for (TestMap::const_iterator i = map.begin(); i != map.end(); ++i) {
+			ordered = ordered && i->first > prev;
+			prev = i->first;
+		}
+		EXPECT_TRUE(ordered);
+
+		// existing key is not replaced
+		std::pair<TestMap::iterator, bool> res = map.insert(std::make_pair(reference.begin()->first, TestNode(1, 2)));
+		EXPECT_TRUE(!res.second);
+		EXPECT_TRUE(res.first->second.Pos == reference.begin()->second);
+	}
+
+	// memory use with dense ids and close coordinates, as
+	// produced by mappers drawing ways
+	{
+		packed_node_map<long long, TestNode> map;
+		for (int i = 1; i <= 100000; ++i)
+			map.insert(std::make_pair((long long)i, TestNode(370000000 + i * 10, 550000000 + (i % 100))));
+
+		EXPECT_TRUE(map.memory() < map.size() * 12);
+	}
+
+	// random operations
+	{
+		TestMap map;
+		ReferenceMap reference;
+		bool same = true;
+
+		/* mostly increasing ids with occasional going back */
+		long long next = 0;
+		for (int i = 0; i < 20000; ++i) {
+			long long id = Random(10) ? (next += 1 + Random(3)) : Random(next + 1);
+			Vector2i pos(Random(1000), Random(1000));
+
+			if (Random(4) == 0) {
+				same = same && map.erase(id) == reference.erase(id);
+			} else {
+				bool inserted = reference.insert(std::make_pair(id, pos)).second;
+				std::pair<TestMap::iterator, bool> res = map.insert(std::make_pair(id, TestNode(pos.x, pos.y)));
+				same = same && res.second == inserted && res.first->first == id && res.first->second.Pos == reference[id];
+			}
+
+			if (i % 1000 == 0)
+				same = same && SameContents(map, reference);
+		}
+
+		EXPECT_TRUE(same);
+		EXPECT_TRUE(SameContents(map, reference));
+		EXPECT_TRUE(map.overflow_size() > 0);
+
+		// swap and clear
+		TestMap other;
+		other.swap(map);
+		EXPECT_TRUE(map.empty());
+		EXPECT_TRUE(SameContents(other, reference));
+
+		other.clear();
+		EXPECT_TRUE(other.empty());
+		EXPECT_TRUE(other.begin() == other.end());
+	}
+
+END_TEST()
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that spatial index returns exactly the same
+ * set of items as full scan does.
+ */
+
+#include <glosm/PackedRTree.hh>
+
+#include "testing.h"
+
+#include <algorithm>
+
+typedef PackedRTree<int> TestTree;
+
+static unsigned int seed = 1;
+
+static int Random(int max) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % max;
+}
+
+static BBoxi RandomBBox(int extent, int maxsize) {
+	int x = Random(extent) - extent / 2;
+	int y = Random(extent) - extent / 2;
+	return BBoxi(x, y, x + Random(maxsize), y + Random(maxsize));
+}
+
+BEGIN_TEST()
+	std::vector<BBoxi> bboxes;
+
+	// empty tree
+	{
+		TestTree tree;
+		tree.Build();
+
+		std::vector<int> out;
+		tree.Query(BBoxi::Full(), out);
+
+		EXPECT_TRUE(tree.IsEmpty());
+		EXPECT_TRUE(out.empty());
+	}
+
+	// tree sizes around node size boundaries
+	int sizes[] = { 1, 15, 16, 17, 256, 257, 10000 };
+	for (unsigned int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+		TestTree tree;
+		bboxes.clear();
+
+		for (int i = 0; i < sizes[s]; ++i) {
+			bboxes.push_back(RandomBBox(1000000, 10000));
+			tree.Insert(bboxes.back(), i);
+		}
+
+		tree.Build();
+
+		EXPECT_INT(tree.GetSize(), sizes[s]);
+
+		// everything
+		{
+			std::vector<int> out;
+			tree.Query(BBoxi::Full(), out);
+			EXPECT_INT(out.size(), sizes[s]);
+		}
+
+		// random queries against full scan
+		int mismatches = 0;
+		for (int q = 0; q < 100; ++q) {
+			BBoxi query = RandomBBox(1000000, 100000);
+
+			std::vector<int> indexed, scanned;
+			tree.Query(query, indexed);
+			for (int i = 0; i < sizes[s]; ++i)
+				if (bboxes[i].Intersects(query))
+					scanned.push_back(i);
+
+			std::sort(indexed.begin(), indexed.end());
+			if (indexed != scanned)
+				mismatches++;
+		}
+
+		EXPECT_INT(mismatches, 0);
+	}
+
+	// rebuild after clear
+	{
+		TestTree tree;
+		tree.Insert(BBoxi(0, 0, 10, 10), 1);
+		tree.Build();
+		tree.Clear();
+		tree.Insert(BBoxi(20, 20, 30, 30), 2);
+		tree.Build();
+
+		std::vector<int> out;
+		tree.Query(BBoxi(0, 0, 10, 10), out);
+		EXPECT_TRUE(out.empty());
+		tree.Query(BBoxi(25, 25, 26, 26), out);
+		EXPECT_INT(out.size(), 1);
+	}
+END_TEST()
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a benchmark of concurrent height queries.
+ *
+ * Usage: SRTMBench [maxthreads] [queries]
+ *
+ * Synthetic SRTM files are generated for a 2x2 degree area, and
+ * each thread queries heights at random points in it. Queries
+ * are also run through a global mutex, as SRTMDatasource did
+ * before its read path became lock-free, and with cache limited
+ * to a single file, so mapping files is included.
+ *
+ * Finally, single and batched queries are compared on clusters
+ * of nearby points, like building outlines.
+ */
+
+#include <glosm/SRTMDatasource.hh>
+#include <glosm/Guard.hh>
+#include <glosm/Timer.hh>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+static const int SAMPLES = 1201;
+static const size_t FILE_SIZE = 2 * SAMPLES * SAMPLES;
+
+static void WriteHgt(const std::string& dir, int lon, int lat) {
+	char name[32];
+	snprintf(name, sizeof(name), "/N%02dE%03d.hgt", lat, lon);
+
+	std::vector<unsigned char> data(FILE_SIZE);
+	for (size_t i = 0; i < data.size(); i += 2)
+		data[i + 1] = (unsigned char)(i / 2);
+
+	FILE* f = fopen((dir + name).c_str(), "wb");
+	fwrite(&data[0], 1, data.size(), f);
+	fclose(f);
+}
+
+struct Task {
+	const SRTMDatasource* srtm;
+	pthread_mutex_t* mutex;
+	size_t queries;
+	unsigned int seed;
+	long long sum;
+};
+
+static void* QueryThread(void* arg) {
+	Task* task = static_cast<Task*>(arg);
+
+	for (size_t i = 0; i < task->queries; ++i) {
+		task->seed = task->seed * 1103515245 + 12345;
+		/* stay off the north and east edges, which need neighbor files */
+		Vector2i where((task->seed >> 4) % 19990000, (task->seed * 2654435761U >> 4) % 19990000);
+
+		if (task->mutex) {
+			Guard guard(*task->mutex);
+			task->sum += task->srtm->GetHeight(where);
+		} else {
+			task->sum += task->srtm->GetHeight(where);
+		}
+	}
+
+	return NULL;
+}
+
+static void Bench(const char* name, const SRTMDatasource& srtm, bool locked, int nthreads, size_t queries) {
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, NULL);
+
+	std::vector<Task> tasks(nthreads);
+	for (int i = 0; i < nthreads; ++i) {
+		tasks[i].srtm = &srtm;
+		tasks[i].mutex = locked ? &mutex : NULL;
+		tasks[i].queries = queries / nthreads;
+		tasks[i].seed = i + 1;
+		tasks[i].sum = 0;
+	}
+
+	Timer timer;
+
+	std::vector<pthread_t> threads(nthreads);
+	for (int i = 0; i < nthreads; ++i)
+		pthread_create(&threads[i], NULL, QueryThread, &tasks[i]);
+	for (int i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+
+	float time = timer.Count();
+
+	pthread_mutex_destroy(&mutex);
+
+	fprintf(stderr, "  %-12s %2d threads: %8.3f sec, %8.2f Mqueries/sec\n", name, nthreads, time, (float)queries / time / 1000000.0f);
+}
+
+int main(int argc, char** argv) {
+	int maxthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	size_t queries = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+
+	char dir[] = "/tmp/glosm-bench-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	for (int lat = 0; lat < 2; ++lat)
+		for (int lon = 0; lon < 2; ++lon)
+			WriteHgt(dir, lon, lat);
+
+	fprintf(stderr, "%lu queries\n", (unsigned long)queries);
+
+	{
+		SRTMDatasource srtm(dir);
+		for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+			Bench("locked", srtm, true, nthreads, queries);
+			Bench("lock-free", srtm, false, nthreads, queries);
+		}
+	}
+
+	{
+		SRTMDatasource srtm(dir, FILE_SIZE);
+		for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+			Bench("single file", srtm, false, nthreads, queries / 10);
+		fprintf(stderr, "  %lu hits, %lu misses\n", (unsigned long)srtm.GetCacheHits(), (unsigned long)srtm.GetCacheMisses());
+	}
+
+	{
+		SRTMDatasource srtm(dir);
+
+		/* clusters of 8 points within ~50 meters */
+		std::vector<Vector2i> points(queries);
+		unsigned int seed = 1;
+		for (size_t i = 0; i < points.size(); i += 8) {
+			seed = seed * 1103515245 + 12345;
+			Vector2i center((seed >> 4) % 19990000, (seed * 2654435761U >> 4) % 19990000);
+			for (size_t j = i; j < i + 8 && j < points.size(); ++j)
+				points[j] = center + Vector2i((int)(j - i) * 500, (int)(j - i) % 3 * 500);
+		}
+
+		std::vector<osmint_t> heights(points.size());
+		long long sum = 0;
+
+		Timer timer;
+		for (size_t i = 0; i < points.size(); ++i)
+			sum += srtm.GetHeight(points[i]);
+		float single = timer.Count();
+
+		for (size_t i = 0; i < points.size(); i += 8)
+			srtm.GetHeights(&points[i], &heights[i], std::min((size_t)8, points.size() - i));
+		float batched = timer.Count();
+
+		for (size_t i = 0; i < heights.size(); ++i)
+			sum -= heights[i];
+
+		fprintf(stderr, "  single:      %8.3f sec, %8.2f Mqueries/sec\n", single, (float)queries / single / 1000000.0f);
+		fprintf(stderr, "  batched:     %8.3f sec, %8.2f Mqueries/sec\n", batched, (float)queries / batched / 1000000.0f);
+		if (sum != 0)
+			fprintf(stderr, "  (results differ)\n");
+	}
+
+	for (int lat = 0; lat < 2; ++lat) {
+		for (int lon = 0; lon < 2; ++lon) {
+			char name[32];
+			snprintf(name, sizeof(name), "/N%02dE%03d.hgt", lat, lon);
+			unlink((std::string(dir) + name).c_str());
+		}
+	}
+	rmdir(dir);
+
+	return 0;
+}
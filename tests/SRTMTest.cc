@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks reading of SRTM files and behavior of
+ * their cache on synthetic files, in which height grows by
+ * a meter per sample both northwards and eastwards.
+ */
+
+#include <glosm/SRTMDatasource.hh>
+#include <glosm/geomath.h>
+
+#include "testing.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+static const int SAMPLES = 1201;
+static const size_t FILE_SIZE = 2 * SAMPLES * SAMPLES;
+
+/* writes file for a square with bottom left corner at 0N lon E */
+static void WriteHgt(const std::string& dir, int lon) {
+	char name[32];
+	snprintf(name, sizeof(name), "/N00E%03d.hgt", lon);
+
+	std::vector<unsigned char> data(FILE_SIZE);
+	for (int row = 0; row < SAMPLES; ++row) {
+		for (int col = 0; col < SAMPLES; ++col) {
+			int height = (SAMPLES - 1 - row) + lon * (SAMPLES - 1) + col;
+			data[2 * (row * SAMPLES + col)] = height >> 8;
+			data[2 * (row * SAMPLES + col) + 1] = height & 0xff;
+		}
+	}
+
+	FILE* f = fopen((dir + name).c_str(), "wb");
+	fwrite(&data[0], 1, data.size(), f);
+	fclose(f);
+}
+
+static osmint_t ExpectedHeight(const Vector2i& where) {
+	return (osmint_t)round(((double)where.x + (double)where.y) / GEOM_UNITSINDEGREE * (SAMPLES - 1) * GEOM_UNITSINMETER);
+}
+
+static bool HeightMatches(const SRTMDatasource& srtm, const Vector2i& where) {
+	return abs(srtm.GetHeight(where) - ExpectedHeight(where)) <= 1;
+}
+
+struct QueryTask {
+	const SRTMDatasource* srtm;
+	unsigned int seed;
+	int mismatches;
+};
+
+/* queries both files in turn, so they are evicted while read */
+static void* QueryThread(void* arg) {
+	QueryTask* task = static_cast<QueryTask*>(arg);
+
+	for (unsigned int i = 0; i < 2000; ++i) {
+		Vector2i where((i % 2) * 10000000 + (task->seed * 7919 + i * 104729) % 9990000, (task->seed * 15485863 + i * 32452843) % 9990000);
+		if (!HeightMatches(*task->srtm, where))
+			++task->mismatches;
+	}
+
+	return NULL;
+}
+
+struct FirstAccessTask {
+	const SRTMDatasource* srtm;
+	pthread_barrier_t* barrier;
+	int mismatches;
+};
+
+/* all threads hit the same chunk at once, before it's loaded */
+static void* FirstAccessThread(void* arg) {
+	FirstAccessTask* task = static_cast<FirstAccessTask*>(arg);
+
+	pthread_barrier_wait(task->barrier);
+	for (int i = 0; i < 10; ++i)
+		if (!HeightMatches(*task->srtm, Vector2i(1000000 + i * 100000, 2000000)))
+			++task->mismatches;
+
+	return NULL;
+}
+
+BEGIN_TEST()
+	char dir[] = "/tmp/glosm-test-XXXXXX";
+	EXPECT_TRUE(mkdtemp(dir) != NULL);
+
+	WriteHgt(dir, 0);
+	WriteHgt(dir, 1);
+
+	// heights are read in correct orientation
+	{
+		SRTMDatasource srtm(dir);
+
+		EXPECT_TRUE(HeightMatches(srtm, Vector2i(0, 0)));
+		EXPECT_TRUE(HeightMatches(srtm, Vector2i(1234567, 2345678)));
+		EXPECT_TRUE(HeightMatches(srtm, Vector2i(9999999, 9999)));
+		EXPECT_TRUE(HeightMatches(srtm, Vector2i(15000000, 7654321)));
+
+		EXPECT_INT((int)srtm.GetCacheMisses(), 2);
+		EXPECT_TRUE(srtm.GetCacheHits() > 0);
+		EXPECT_TRUE(srtm.GetMappedBytes() == 2 * FILE_SIZE);
+
+		HeightmapDatasource::Heightmap heightmap;
+		srtm.GetHeightmap(BBoxi(9900000, 100000, 10100000, 200000), 1, heightmap);
+
+		bool matches = true;
+		for (int y = 0; y < heightmap.height; ++y) {
+			for (int x = 0; x < heightmap.width; ++x) {
+				Vector2i where(
+						heightmap.bbox.left + (osmlong_t)(heightmap.bbox.right - heightmap.bbox.left) * x / (heightmap.width - 1),
+						heightmap.bbox.bottom + (osmlong_t)(heightmap.bbox.top - heightmap.bbox.bottom) * y / (heightmap.height - 1)
+					);
+				if (abs(heightmap.points[y * heightmap.width + x] - ExpectedHeight(where)) > GEOM_UNITSINMETER)
+					matches = false;
+			}
+		}
+		EXPECT_TRUE(matches);
+	}
+
+	// missing file reads as zero height
+	{
+		SRTMDatasource srtm(dir);
+
+		EXPECT_INT(srtm.GetHeight(Vector2i(5000000, 15000000)), 0);
+		EXPECT_INT(srtm.GetHeight(Vector2i(5000000, 15000000)), 0);
+		EXPECT_INT((int)srtm.GetCacheMisses(), 1);
+		EXPECT_INT((int)srtm.GetMappedBytes(), 0);
+	}
+
+	// cache is bounded
+	{
+		SRTMDatasource srtm(dir, FILE_SIZE);
+
+		for (int i = 0; i < 4; ++i) {
+			EXPECT_TRUE(HeightMatches(srtm, Vector2i(5000000, 5000000)));
+			EXPECT_TRUE(HeightMatches(srtm, Vector2i(15000000, 5000000)));
+			EXPECT_TRUE(srtm.GetMappedBytes() == FILE_SIZE);
+		}
+		EXPECT_INT((int)srtm.GetCacheMisses(), 8);
+
+		srtm.SetCacheSize(2 * FILE_SIZE);
+		for (int i = 0; i < 4; ++i) {
+			EXPECT_TRUE(HeightMatches(srtm, Vector2i(5000000, 5000000)));
+			EXPECT_TRUE(HeightMatches(srtm, Vector2i(15000000, 5000000)));
+		}
+		EXPECT_INT((int)srtm.GetCacheMisses(), 9);
+		EXPECT_TRUE(srtm.GetMappedBytes() == 2 * FILE_SIZE);
+
+		srtm.SetCacheSize(0);
+		EXPECT_TRUE(srtm.GetMappedBytes() == FILE_SIZE);
+	}
+
+	// batched queries match single ones
+	{
+		SRTMDatasource srtm(dir);
+
+		/* points around both files and missing ones north of them */
+		std::vector<Vector2i> points;
+		for (unsigned int i = 0; i < 1000; ++i)
+			points.push_back(Vector2i((i * 104729U) % 25000000, (i * 32452843U) % 12000000));
+
+		std::vector<osmint_t> heights(points.size());
+		srtm.GetHeights(&points.front(), &heights.front(), points.size());
+
+		bool matches = true;
+		for (size_t i = 0; i < points.size(); ++i)
+			if (heights[i] != srtm.GetHeight(points[i]))
+				matches = false;
+		EXPECT_TRUE(matches);
+
+		EXPECT_TRUE(abs(heights[1] - ExpectedHeight(points[1])) <= 1);
+	}
+
+	// concurrent queries with evictions
+	{
+		SRTMDatasource srtm(dir, FILE_SIZE);
+
+		QueryTask tasks[4];
+		pthread_t threads[4];
+		for (int i = 0; i < 4; ++i) {
+			tasks[i].srtm = &srtm;
+			tasks[i].seed = i;
+			tasks[i].mismatches = 0;
+			pthread_create(&threads[i], NULL, QueryThread, &tasks[i]);
+		}
+
+		int mismatches = 0;
+		for (int i = 0; i < 4; ++i) {
+			pthread_join(threads[i], NULL);
+			mismatches += tasks[i].mismatches;
+		}
+
+		EXPECT_INT(mismatches, 0);
+		EXPECT_TRUE(srtm.GetMappedBytes() <= 2 * FILE_SIZE);
+	}
+
+	// concurrent first access to a chunk
+	{
+		bool evicted = true;
+		int mismatches = 0;
+		for (int round = 0; round < 50; ++round) {
+			SRTMDatasource srtm(dir, FILE_SIZE);
+
+			pthread_barrier_t barrier;
+			pthread_barrier_init(&barrier, NULL, 8);
+
+			FirstAccessTask tasks[8];
+			pthread_t threads[8];
+			for (int i = 0; i < 8; ++i) {
+				tasks[i].srtm = &srtm;
+				tasks[i].barrier = &barrier;
+				tasks[i].mismatches = 0;
+				pthread_create(&threads[i], NULL, FirstAccessThread, &tasks[i]);
+			}
+
+			for (int i = 0; i < 8; ++i) {
+				pthread_join(threads[i], NULL);
+				mismatches += tasks[i].mismatches;
+			}
+
+			pthread_barrier_destroy(&barrier);
+
+			/* all readers are gone, so chunk may be evicted */
+			HeightMatches(srtm, Vector2i(15000000, 5000000));
+			evicted = evicted && srtm.GetMappedBytes() == FILE_SIZE;
+		}
+
+		EXPECT_INT(mismatches, 0);
+		EXPECT_TRUE(evicted);
+	}
+
+	unlink((std::string(dir) + "/N00E000.hgt").c_str());
+	unlink((std::string(dir) + "/N00E001.hgt").c_str());
+	rmdir(dir);
+END_TEST()
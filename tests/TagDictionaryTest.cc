@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that tag dictionary assigns stable unique ids
+ * and that TagsMap behaves like the map it replaced.
+ */
+
+#include <glosm/OsmDatasource.hh>
+
+#include "testing.h"
+
+#include <pthread.h>
+
+#include <cstdio>
+#include <string>
+
+/* interns the same set of strings through own cache */
+static void* CacheThread(void* arg) {
+	std::vector<tagid_t>& ids = *static_cast<std::vector<tagid_t>*>(arg);
+	TagDictionary::Cache cache;
+	char buf[32];
+	for (int round = 0; round < 3; ++round) {
+		for (int i = 0; i < 20000; ++i) {
+			snprintf(buf, sizeof(buf), "cached%d", i);
+			ids[i] = cache.Intern(buf);
+		}
+	}
+	return NULL;
+}
+
+BEGIN_TEST()
+	// interning
+	{
+		tagid_t building = TagDictionary::Intern("building");
+		tagid_t highway = TagDictionary::Intern("highway");
+
+		EXPECT_TRUE(building != TagDictionary::NONE);
+		EXPECT_TRUE(highway != TagDictionary::NONE);
+		EXPECT_TRUE(building != highway);
+		EXPECT_TRUE(TagDictionary::Intern("building") == building);
+		EXPECT_TRUE(TagDictionary::Find("building") == building);
+		EXPECT_TRUE(TagDictionary::Find("no such tag") == TagDictionary::NONE);
+		EXPECT_STRING(TagDictionary::GetString(building), "building");
+		EXPECT_STRING(TagDictionary::GetString(highway), "highway");
+	}
+
+	// empty string is a valid value
+	{
+		tagid_t empty = TagDictionary::Intern("");
+		EXPECT_TRUE(empty != TagDictionary::NONE);
+		EXPECT_STRING(TagDictionary::GetString(empty), "");
+	}
+
+	// many strings, forcing rehashes and multiple arena pages
+	{
+		std::vector<tagid_t> ids;
+		char buf[32];
+		for (int i = 0; i < 100000; ++i) {
+			snprintf(buf, sizeof(buf), "value%d", i);
+			ids.push_back(TagDictionary::Intern(buf));
+		}
+
+		bool ok = true;
+		for (int i = 0; i < 100000; ++i) {
+			snprintf(buf, sizeof(buf), "value%d", i);
+			if (TagDictionary::Find(buf) != ids[i] || std::string(TagDictionary::GetString(ids[i])) != buf)
+				ok = false;
+		}
+		EXPECT_TRUE(ok);
+	}
+
+	// cache gives the same ids as dictionary, also after its slots are reused
+	{
+		TagDictionary::Cache cache;
+		char buf[32];
+		bool ok = true;
+		for (int round = 0; round < 2; ++round) {
+			for (int i = 0; i < 10000; ++i) {
+				snprintf(buf, sizeof(buf), "value%d", i * 7);
+				if (cache.Intern(buf) != TagDictionary::Intern(buf))
+					ok = false;
+			}
+		}
+		EXPECT_TRUE(ok);
+
+		tagid_t added = cache.Intern("added through cache");
+		EXPECT_TRUE(TagDictionary::Find("added through cache") == added);
+		EXPECT_STRING(TagDictionary::GetString(added), "added through cache");
+	}
+
+	// threads with own caches agree on ids of new strings
+	{
+		std::vector<tagid_t> ids[4];
+		pthread_t threads[4];
+		for (int i = 0; i < 4; ++i) {
+			ids[i].resize(20000);
+			pthread_create(&threads[i], NULL, CacheThread, &ids[i]);
+		}
+		for (int i = 0; i < 4; ++i)
+			pthread_join(threads[i], NULL);
+
+		bool ok = true;
+		char buf[32];
+		for (int i = 0; i < 20000; ++i) {
+			snprintf(buf, sizeof(buf), "cached%d", i);
+			for (int t = 0; t < 4; ++t)
+				if (ids[t][i] != TagDictionary::Find(buf))
+					ok = false;
+		}
+		EXPECT_TRUE(ok);
+	}
+
+	// tags map
+	{
+		tagid_t a = TagDictionary::Intern("a");
+		tagid_t b = TagDictionary::Intern("b");
+		tagid_t c = TagDictionary::Intern("c");
+
+		OsmDatasource::TagsMap tags;
+		EXPECT_TRUE(tags.empty());
+		EXPECT_TRUE(tags.find(a) == tags.end());
+		EXPECT_TRUE(tags.get(a) == TagDictionary::NONE);
+
+		EXPECT_TRUE(tags.insert(c, a));
+		EXPECT_TRUE(tags.insert(a, b));
+		EXPECT_TRUE(!tags.insert(a, c));
+
+		EXPECT_TRUE(tags.size() == 2);
+		EXPECT_TRUE(tags.get(a) == b);
+		EXPECT_TRUE(tags.get(c) == a);
+		EXPECT_TRUE(tags.find(b) == tags.end());
+
+		// sorted by key
+		EXPECT_TRUE(tags.begin()->first < (tags.begin() + 1)->first);
+	}
+END_TEST()
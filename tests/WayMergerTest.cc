@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/WayMerger.hh>
+
+#include "testing.h"
+
+typedef OsmDatasource::Way::NodesList NodesList;
+
+static NodesList Chain(osmid_t a, osmid_t b, osmid_t c = 0) {
+	NodesList nodes;
+	nodes.push_back(a);
+	nodes.push_back(b);
+	if (c)
+		nodes.push_back(c);
+	return nodes;
+}
+
+BEGIN_TEST()
+	// single closed way
+	{
+		NodesList ring;
+		for (osmid_t i = 1; i <= 4; ++i)
+			ring.push_back(i);
+		ring.push_back(1);
+
+		WayMerger merger;
+		merger.AddWay(ring);
+
+		NodesList out;
+		EXPECT_TRUE(merger.GetNextWay(out));
+		EXPECT_TRUE(out == ring);
+		EXPECT_TRUE(!merger.GetNextWay(out));
+	}
+
+	// parts out of order and reversed
+	{
+		NodesList a = Chain(1, 2, 3);
+		NodesList b = Chain(5, 4, 3); /* reversed */
+		NodesList c = Chain(5, 6, 1);
+
+		WayMerger merger;
+		merger.AddWay(a);
+		merger.AddWay(c);
+		merger.AddWay(b);
+
+		NodesList out;
+		EXPECT_TRUE(merger.GetNextWay(out));
+		EXPECT_INT((int)out.size(), 7);
+		EXPECT_TRUE(out.front() == 1 && out.back() == 1);
+		EXPECT_TRUE(out[1] == 2 && out[2] == 3 && out[3] == 4 && out[4] == 5 && out[5] == 6);
+		EXPECT_TRUE(!merger.GetNextWay(out));
+	}
+
+	// two rings and a dangling part
+	{
+		NodesList a1 = Chain(1, 2), a2 = Chain(2, 3), a3 = Chain(3, 1);
+		NodesList b1 = Chain(10, 11, 12), b2 = Chain(10, 12);
+		NodesList dangling = Chain(20, 21);
+
+		WayMerger merger;
+		merger.AddWay(dangling);
+		merger.AddWay(a1);
+		merger.AddWay(b1);
+		merger.AddWay(a2);
+		merger.AddWay(b2);
+		merger.AddWay(a3);
+
+		NodesList out;
+		int nrings = 0;
+		while (merger.GetNextWay(out)) {
+			EXPECT_TRUE(out.front() == out.back());
+			EXPECT_TRUE(out.front() != 20 && out.front() != 21);
+			++nrings;
+		}
+		EXPECT_INT(nrings, 2);
+	}
+
+	// many parts sharing a node
+	{
+		std::vector<NodesList> parts;
+		for (osmid_t i = 0; i < 100; ++i) {
+			parts.push_back(Chain(1, 1000 + i));
+			parts.push_back(Chain(1000 + i, 1));
+		}
+
+		WayMerger merger;
+		for (std::vector<NodesList>::const_iterator part = parts.begin(); part != parts.end(); ++part)
+			merger.AddWay(*part);
+
+		NodesList out;
+		size_t nnodes = 0;
+		int nrings = 0;
+		while (merger.GetNextWay(out)) {
+			EXPECT_TRUE(out.front() == out.back());
+			nnodes += out.size() - 1;
+			++nrings;
+		}
+		EXPECT_TRUE(nrings > 0);
+		EXPECT_INT((int)nnodes, 200);
+	}
+END_TEST()
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that trusted tokenizer produces exactly the
+ * same sequence of handler calls as expat does, regardless of
+ * how input is split into chunks.
+ */
+
+#include <glosm/XMLParser.hh>
+
+#include "testing.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* records handler calls */
+class RecordingParser : public XMLParser {
+protected:
+	std::string log_;
+	std::string chardata_;
+
+	void Flush() {
+		/* expat may split character data arbitrarily */
+		if (!chardata_.empty())
+			log_ += "text(" + chardata_ + ")\n";
+		chardata_.clear();
+	}
+
+	virtual void StartElement(const char* name, const char** atts) {
+		Flush();
+		log_ += std::string("start(") + name;
+		for (const char** att = atts; *att; att += 2)
+			log_ += std::string(" ") + att[0] + "=[" + att[1] + "]";
+		log_ += ")\n";
+	}
+
+	virtual void EndElement(const char* name) {
+		Flush();
+		log_ += std::string("end(") + name + ")\n";
+	}
+
+	virtual void CharacterData(const char* data, int len) {
+		chardata_.append(data, len);
+	}
+
+public:
+	RecordingParser(Tokenizer tokenizer) {
+		SetTokenizer(tokenizer);
+	}
+
+	std::string Parse(const std::string& data, size_t chunk) {
+		std::vector<const char*> fragments;
+		std::vector<size_t> sizes;
+		for (size_t pos = 0; pos == 0 || pos < data.size(); pos += chunk) {
+			fragments.push_back(data.data() + pos);
+			sizes.push_back(std::min(chunk, data.size() - pos));
+		}
+
+		log_.clear();
+		chardata_.clear();
+		LoadFragments(&fragments.front(), &sizes.front(), fragments.size());
+		Flush();
+		return log_;
+	}
+
+	std::string LoadFile(const char* filename) {
+		log_.clear();
+		chardata_.clear();
+		XMLParser::Load(filename);
+		Flush();
+		return log_;
+	}
+};
+
+static bool Rejects(const std::string& data) {
+	RecordingParser parser(XMLParser::TRUSTED_TOKENIZER);
+	try {
+		parser.Parse(data, data.size() + 1);
+	} catch (ParsingException&) {
+		return true;
+	}
+	return false;
+}
+
+BEGIN_TEST()
+	const char* documents[] = {
+		"<osm/>",
+		"<?xml version='1.0' encoding='UTF-8'?>\n<osm version=\"0.6\" generator='test'>\n  <node id='1' lat='55.0' lon=\"37.0\" />\n</osm>\n",
+		"<!DOCTYPE osm>\n<!-- comment -->\n<osm><!-- <node> --><way id = '1' ><nd ref='1'/></way ></osm>",
+		"<osm><tag k='name' v='&lt;&amp;&gt;&quot;&apos;'/><tag k='a&#65;&#x42;' v='&#1078;&#x20AC;&#x1F600;'/></osm>",
+		"<osm><tag k='a' v='x>y'/><tag k='b' v=\"it's\"/><tag k='c' v='line\nbreak\ttab\r\nend'/></osm>",
+		"<gpx><trk><trkseg><trkpt lat='1' lon='2'><ele>123.4</ele></trkpt></trkseg></trk></gpx>",
+		"<gpx><desc>a &amp; b<![CDATA[ <raw> & ]]>c\r\nd&#13;e</desc></gpx>",
+		"\n\n<osm>\n</osm>\n\n",
+	};
+
+	for (unsigned int d = 0; d < sizeof(documents)/sizeof(documents[0]); ++d) {
+		std::string data = documents[d];
+		std::string expected = RecordingParser(XMLParser::EXPAT_TOKENIZER).Parse(data, data.size());
+
+		EXPECT_STRING(RecordingParser(XMLParser::TRUSTED_TOKENIZER).Parse(data, data.size()), expected);
+
+		/* every possible split point is tried */
+		for (size_t chunk = 1; chunk < data.size(); ++chunk)
+			EXPECT_TRUE(RecordingParser(XMLParser::TRUSTED_TOKENIZER).Parse(data, chunk) == expected);
+	}
+
+	const char* files[] = { TESTDATA_DIR "/glosm.osm", TESTDATA_DIR "/grid.osm", TESTDATA_DIR "/glosm.gpx", TESTDATA_DIR "/glosm.osm.bz2" };
+	for (unsigned int f = 0; f < sizeof(files)/sizeof(files[0]); ++f) {
+		std::string expected = RecordingParser(XMLParser::EXPAT_TOKENIZER).LoadFile(files[f]);
+		EXPECT_TRUE(!expected.empty());
+		EXPECT_TRUE(RecordingParser(XMLParser::TRUSTED_TOKENIZER).LoadFile(files[f]) == expected);
+	}
+
+	/* gross errors are still detected */
+	EXPECT_TRUE(Rejects(""));
+	EXPECT_TRUE(Rejects("<osm>"));
+	EXPECT_TRUE(Rejects("<osm></osm><osm/>"));
+	EXPECT_TRUE(Rejects("<osm></osm></osm>"));
+	EXPECT_TRUE(Rejects("<osm><node id='1/></osm>"));
+	EXPECT_TRUE(Rejects("<osm><tag v='&unknown;'/></osm>"));
+	EXPECT_TRUE(Rejects("<osm>junk</osm>junk"));
+	EXPECT_TRUE(Rejects("<osm><!-- unclosed"));
+	EXPECT_TRUE(Rejects("<osm></osm><node"));
+
+	/* truncated comment after root element is ignored */
+	const char* trailing[] = { "<osm></osm>\n<", "<osm></osm>\n<!-", "<osm></osm>\n<!-- unclosed", "<osm></osm><?xml" };
+	for (unsigned int t = 0; t < sizeof(trailing)/sizeof(trailing[0]); ++t)
+		for (size_t chunk = 1; chunk <= strlen(trailing[t]); ++chunk)
+			EXPECT_STRING(RecordingParser(XMLParser::TRUSTED_TOKENIZER).Parse(trailing[t], chunk), "start(osm)\nend(osm)\n");
+END_TEST()
@@ -20,6 +20,11 @@
 
 #include <glosm/MercatorProjection.hh>
 #include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/MappedOsmDatasource.hh>
+#include <glosm/ShardedOsmDatasource.hh>
+#include <glosm/PageAllocator.hh>
+#include <glosm/LoadListener.hh>
 #include <glosm/GeometryGenerator.hh>
 #include <glosm/GeometryLayer.hh>
 #include <glosm/OrthoViewer.hh>
@@ -37,8 +42,14 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
 
 struct LevelInfo {
 	int tiling;
@@ -72,11 +83,16 @@ static LevelInfo LevelInfos[] = {
 };
 
 void usage(const char* progname) {
-	fprintf(stderr, "Usage: %s [-0123456789] [-s skew] [-z minzoom] [-Z maxzoom] [-m multisamples] -x minlon -X maxlon -y minlat -Y maxlat infile.osm outdir\n", progname);
+	fprintf(stderr, "Usage: %s [-0123456789] [-s skew] [-z minzoom] [-Z maxzoom] [-m multisamples] [-j threads] [-d snapshot] [-c change.osc]... [-f] [-t tmpdir] -x minlon -X maxlon -y minlat -Y maxlat <infile.osm[.gz|.bz2]|infile.osm.pbf|infile.glosm|infile.glosmmap>... outdir\n", progname);
 	exit(1);
 }
 
-int RenderTiles(PBuffer& pbuffer, OrthoViewer& viewer, GeometryLayer& layer, const char* target, float minlon, float minlat, float maxlon, float maxlat, int minzoom, int maxzoom, int pnglevel) {
+bool HasSuffix(const std::string& str, const char* suffix) {
+	size_t len = strlen(suffix);
+	return str.length() > len && str.compare(str.length() - len, len, suffix) == 0;
+}
+
+int RenderTiles(PBuffer& pbuffer, OrthoViewer& viewer, GeometryLayer& layer, const char* target, float minlon, float minlat, float maxlon, float maxlat, int minzoom, int maxzoom, int pnglevel, const std::vector<BBoxi>* dirty) {
 	int x, y, zoom, ntiles = 0;
 	PixelBuffer pixels(256, 256, 3);
 
@@ -112,6 +128,15 @@ int RenderTiles(PBuffer& pbuffer, OrthoViewer& viewer, GeometryLayer& layer, con
 				/* @todo take skew into account */
 				request_bbox.bottom -= 1000.0 / WGS84_EARTH_EQ_LENGTH * 360.0 * GEOM_UNITSINDEGREE;
 
+				/* when updating, only rerender tiles affected by changes */
+				if (dirty) {
+					std::vector<BBoxi>::const_iterator area = dirty->begin();
+					while (area != dirty->end() && !area->Intersects(request_bbox))
+						++area;
+					if (area == dirty->end())
+						continue;
+				}
+
 				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 				layer.GarbageCollect();
 				layer.LoadArea(request_bbox, TileManager::SYNC);
@@ -143,8 +168,16 @@ int real_main(int argc, char** argv) {
 
 	int multisamples = 4;
 
+	const char* snapshotpath = NULL;
+
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	std::vector<const char*> changepaths;
+
+	bool filter = false;
+
 	int c;
-	while ((c = getopt(argc, argv, "0123456789s:z:Z:x:X:y:Y:m:")) != -1) {
+	while ((c = getopt(argc, argv, "0123456789s:z:Z:x:X:y:Y:m:d:j:c:ft:")) != -1) {
 		switch (c) {
 		case '0': case '1': case '2': case '3': case '4':
 		case '5': case '6': case '7': case '8': case '9':
@@ -158,6 +191,11 @@ int real_main(int argc, char** argv) {
 		case 'y': minlat = strtof(optarg, NULL); break;
 		case 'Y': maxlat = strtof(optarg, NULL); break;
 		case 'm': multisamples = (int)strtol(optarg, NULL, 10); break;
+		case 'd': snapshotpath = optarg; break;
+		case 'j': nthreads = (int)strtol(optarg, NULL, 10); break;
+		case 'c': changepaths.push_back(optarg); break;
+		case 'f': filter = true; break;
+		case 't': FilePageAllocator::SetDirectory(optarg); break;
 		default:
 			usage(progname);
 		}
@@ -174,9 +212,11 @@ int real_main(int argc, char** argv) {
 		usage(progname);
 	if (skew <= 0.0)
 		usage(progname);
-	if (argc != 2)
+	if (argc < 2)
 		usage(progname);
 
+	const char* outdir = argv[argc - 1];
+
 	/* OpenGL init */
 	PBuffer pbuffer(256, 256, multisamples);
 	glClearColor(0.5, 0.5, 0.5, 0.0);
@@ -184,14 +224,99 @@ int real_main(int argc, char** argv) {
 	/* glosm init */
 	OrthoViewer viewer;
 	viewer.SetSkew(skew);
-	PreloadedXmlDatasource osm_datasource;
+	std::auto_ptr<PreloadedXmlDatasource> osm_datasource;
+	std::auto_ptr<MappedOsmDatasource> mapped_datasource;
+	std::auto_ptr<ShardedOsmDatasource> sharded_datasource;
+	PrintingLoadListener load_listener;
+
+	/* keep only data which may be visible in rendered area;
+	 * margin covers skewed objects and objects crossing
+	 * the border, and is taken on widest latitude */
+	PreloadedXmlDatasource::LoadFilter loadfilter;
+	if (filter) {
+		float maxabslat = std::max(fabsf(minlat), fabsf(maxlat));
+
+		loadfilter.bbox = BBoxi(minlon * GEOM_UNITSINDEGREE, minlat * GEOM_UNITSINDEGREE, maxlon * GEOM_UNITSINDEGREE, maxlat * GEOM_UNITSINDEGREE);
+		loadfilter.margin = 2000.0 / (WGS84_EARTH_EQ_LENGTH * cos(maxabslat / 180.0 * M_PI)) * 360.0 * GEOM_UNITSINDEGREE;
+		GeometryGenerator::GetKnownKeys(loadfilter.keys);
+		loadfilter.prune_nodes = true;
+	}
 
-	fprintf(stderr, "Loading OSM data...\n");
-	osm_datasource.Load(argv[0]);
+	std::string infile = argv[0];
+	if (argc > 2) {
+		/* regional files are loaded into shards of single
+		 * datasource, which is read-only */
+		if (!changepaths.empty() || snapshotpath)
+			usage(progname);
+		fprintf(stderr, "Loading %d OSM data shards...\n", argc - 1);
+		sharded_datasource.reset(new ShardedOsmDatasource);
+		for (int i = 0; i < argc - 1; ++i) {
+			std::string shardfile = argv[i];
+			if (HasSuffix(shardfile, ".glosmmap")) {
+				sharded_datasource->AddShard(new MappedOsmDatasource(argv[i]));
+			} else if (HasSuffix(shardfile, ".glosm")) {
+				std::auto_ptr<PreloadedXmlDatasource> shard(new PreloadedXmlDatasource);
+				shard->LoadSnapshot(argv[i]);
+				sharded_datasource->AddShard(shard.release());
+			} else {
+				PreloadedXmlDatasource* shard = HasSuffix(shardfile, ".pbf") ? new PreloadedPbfDatasource : new PreloadedXmlDatasource;
+				sharded_datasource->AddShard(shard, argv[i]);
+				if (filter)
+					shard->SetLoadFilter(loadfilter);
+			}
+		}
+		sharded_datasource->Load(nthreads, true);
+	} else if (HasSuffix(infile, ".glosmmap")) {
+		/* mapped data is read-only */
+		if (!changepaths.empty() || snapshotpath)
+			usage(progname);
+		fprintf(stderr, "Mapping OSM data...\n");
+		mapped_datasource.reset(new MappedOsmDatasource(argv[0]));
+	} else if (HasSuffix(infile, ".glosm")) {
+		fprintf(stderr, "Loading OSM data snapshot...\n");
+		osm_datasource.reset(new PreloadedXmlDatasource);
+		osm_datasource->LoadSnapshot(argv[0]);
+	} else {
+		if (HasSuffix(infile, ".pbf")) {
+			fprintf(stderr, "Loading OSM PBF data...\n");
+			osm_datasource.reset(new PreloadedPbfDatasource);
+		} else {
+			fprintf(stderr, "Loading OSM data...\n");
+			osm_datasource.reset(new PreloadedXmlDatasource);
+		}
+		if (filter)
+			osm_datasource->SetLoadFilter(loadfilter);
+		osm_datasource->SetLoadListener(&load_listener);
+		osm_datasource->LoadParallel(argv[0], nthreads);
+		/* changes need nodes to update ways */
+		if (changepaths.empty())
+			osm_datasource->InlineNodes();
+		fprintf(stderr, "Parsed %lu bytes at %.1f MB/s\n", (unsigned long)osm_datasource->GetLoadedBytes(), osm_datasource->GetLoadRate() / 1048576.0f);
+		if (osm_datasource->GetCompressedBytes() > 0)
+			fprintf(stderr, "Decompressed %lu bytes at %.1f MB/s, parsed at %.1f MB/s\n", (unsigned long)osm_datasource->GetCompressedBytes(), osm_datasource->GetDecompressRate() / 1048576.0f, osm_datasource->GetParseRate() / 1048576.0f);
+	}
+
+	std::vector<BBoxi> dirty;
+	for (std::vector<const char*>::const_iterator path = changepaths.begin(); path != changepaths.end(); ++path) {
+		fprintf(stderr, "Applying %s...\n", *path);
+		osm_datasource->ApplyChange(*path, dirty);
+	}
+	if (!changepaths.empty())
+		fprintf(stderr, "%lu areas changed\n", (unsigned long)dirty.size());
+
+	if (snapshotpath) {
+		fprintf(stderr, "Saving OSM data snapshot...\n");
+		osm_datasource->SaveSnapshot(snapshotpath);
+	}
 
 	fprintf(stderr, "Creating geometry...\n");
 	DummyHeightmap heightmap;
-	GeometryGenerator geometry_generator(osm_datasource, heightmap);
+	const OsmDatasource* datasource = osm_datasource.get();
+	if (mapped_datasource.get())
+		datasource = mapped_datasource.get();
+	else if (sharded_datasource.get())
+		datasource = sharded_datasource.get();
+	GeometryGenerator geometry_generator(*datasource, heightmap);
 
 	GeometryLayer layer(MercatorProjection(), geometry_generator);
 	layer.SetSizeLimit(128*1024*1024);
@@ -202,7 +327,7 @@ int real_main(int argc, char** argv) {
 	struct timeval begin, end;
 
 	gettimeofday(&begin, NULL);
-	int ntiles = RenderTiles(pbuffer, viewer, layer, argv[1], minlon, minlat, maxlon, maxlat, minzoom, maxzoom, pnglevel);
+	int ntiles = RenderTiles(pbuffer, viewer, layer, outdir, minlon, minlat, maxlon, maxlat, minzoom, maxzoom, pnglevel, changepaths.empty() ? NULL : &dirty);
 	gettimeofday(&end, NULL);
 
 	float dt = (float)(end.tv_sec - begin.tv_sec) + (float)(end.tv_usec - begin.tv_usec)/1000000.0f;
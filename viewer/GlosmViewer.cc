@@ -30,6 +30,7 @@
 #include <glosm/util/gl.h>
 
 #include <getopt.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -65,7 +66,7 @@ GlosmViewer::GlosmViewer() : projection_(MercatorProjection()), viewer_(new Firs
 }
 
 void GlosmViewer::Usage(int status, bool detailed, const char* progname) {
-	fprintf(stderr, "Usage: %s [-sfh] [-t <path>] [-l lon,lat,ele,yaw,pitch] <file.osm|-> [file.gpx ...]\n", progname);
+	fprintf(stderr, "Usage: %s [-sfh] [-t <path>] [-d <path>] [-j <threads>] [-c <change.osc>]... [-l lon,lat,ele,yaw,pitch] <file.osm[.gz|.bz2]|file.osm.pbf|file.glosm|file.glosmmap|-> [file.gpx|dir ...]\n", progname);
 	if (detailed) {
 		fprintf(stderr, "Options:\n");
 		//               [==================================72==================================]
@@ -73,6 +74,14 @@ void GlosmViewer::Usage(int status, bool detailed, const char* progname) {
 		fprintf(stderr, "  -s       - use spherical projection instead of mercator\n");
 		fprintf(stderr, "  -t path  - add terrain layer, argument specifies path to directory\n");
 		fprintf(stderr, "             with SRTM data (*.hgt files)\n");
+		fprintf(stderr, "  -j num   - number of threads used to load OSM and GPX data (default:\n");
+		fprintf(stderr, "             number of CPUs)\n");
+		fprintf(stderr, "  -d path  - save loaded OSM data into binary snapshot (*.glosm),\n");
+		fprintf(stderr, "             which may be used later in place of .osm file for\n");
+		fprintf(stderr, "             faster startup\n");
+		fprintf(stderr, "  -c path  - osmChange file to apply when U is pressed, may be given\n");
+		fprintf(stderr, "             multiple times. Files are read again on each press, so\n");
+		fprintf(stderr, "             new diffs may be placed there while viewer is running\n");
 		fprintf(stderr, "  -l ...   - set initial viewer's location and direction\n");
 		fprintf(stderr, "             argument is comma-separated list of longitude, latitude,\n");
 		fprintf(stderr, "             elevation, pitch and yaw, each of those may be empty for\n");
@@ -90,10 +99,15 @@ void GlosmViewer::Init(int argc, char** argv) {
 	int c;
 	const char* progname = argv[0];
 	const char* srtmpath = NULL;
-	while ((c = getopt(argc, argv, "sfht:l:")) != -1) {
+	const char* snapshotpath = NULL;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "sfht:d:j:c:l:")) != -1) {
 		switch (c) {
 		case 's': projection_ = SphericalProjection(); break;
 		case 't': srtmpath = optarg; break;
+		case 'd': snapshotpath = optarg; break;
+		case 'j': nthreads = (int)strtol(optarg, NULL, 10); break;
+		case 'c': changepaths_.push_back(optarg); break;
 		case 'l': {
 					  int n = 0;
 					  char* start = optarg;
@@ -131,33 +145,82 @@ void GlosmViewer::Init(int argc, char** argv) {
 	argc -= optind;
 	argv += optind;
 
-	/* load data */
+	/* load data; GPX files are collected and loaded together */
+	std::vector<std::string> gpxfiles;
 	for (int narg = 0; narg < argc; ++narg) {
 		std::string file = argv[narg];
+		struct stat st;
 
-		if (file == "-" || file.rfind(".osm") == file.length() - 4) {
+		if (file == "-" || file.rfind(".osm") == file.length() - 4 || (file.length() > 7 && file.rfind(".osm.gz") == file.length() - 7) || (file.length() > 8 && file.rfind(".osm.bz2") == file.length() - 8)) {
 			fprintf(stderr, "Loading %s as OSM...\n", file == "-" ? "stdin" : argv[narg]);
-			if (osm_datasource_.get() == NULL) {
+			if (osm_datasource_.get() == NULL && mapped_datasource_.get() == NULL) {
 				Timer t;
 				osm_datasource_.reset(new PreloadedXmlDatasource);
-				osm_datasource_->Load(argv[narg]);
+				osm_datasource_->SetLoadListener(&load_listener_);
+				osm_datasource_->LoadParallel(argv[narg], nthreads);
+				/* changes need nodes to update ways */
+				if (changepaths_.empty())
+					osm_datasource_->InlineNodes();
+				fprintf(stderr, "Loaded in %.3f seconds (parsed at %.1f MB/s)\n", t.Count(), osm_datasource_->GetLoadRate() / 1048576.0f);
+				if (osm_datasource_->GetCompressedBytes() > 0)
+					fprintf(stderr, "Decompressed %lu bytes at %.1f MB/s, parsed at %.1f MB/s\n", (unsigned long)osm_datasource_->GetCompressedBytes(), osm_datasource_->GetDecompressRate() / 1048576.0f, osm_datasource_->GetParseRate() / 1048576.0f);
+			} else {
+				fprintf(stderr, "Only single OSM file may be loaded at once, skipped\n");
+			}
+		} else if (file.length() > 4 && file.rfind(".pbf") == file.length() - 4) {
+			fprintf(stderr, "Loading %s as OSM PBF...\n", argv[narg]);
+			if (osm_datasource_.get() == NULL && mapped_datasource_.get() == NULL) {
+				Timer t;
+				osm_datasource_.reset(new PreloadedPbfDatasource);
+				osm_datasource_->SetLoadListener(&load_listener_);
+				osm_datasource_->LoadParallel(argv[narg], nthreads);
+				/* changes need nodes to update ways */
+				if (changepaths_.empty())
+					osm_datasource_->InlineNodes();
+				fprintf(stderr, "Loaded in %.3f seconds (parsed at %.1f MB/s)\n", t.Count(), osm_datasource_->GetLoadRate() / 1048576.0f);
+			} else {
+				fprintf(stderr, "Only single OSM file may be loaded at once, skipped\n");
+			}
+		} else if (file.rfind(".glosm") == file.length() - 6) {
+			fprintf(stderr, "Loading %s as snapshot...\n", argv[narg]);
+			if (osm_datasource_.get() == NULL && mapped_datasource_.get() == NULL) {
+				Timer t;
+				osm_datasource_.reset(new PreloadedXmlDatasource);
+				osm_datasource_->LoadSnapshot(argv[narg]);
 				fprintf(stderr, "Loaded in %.3f seconds\n", t.Count());
 			} else {
 				fprintf(stderr, "Only single OSM file may be loaded at once, skipped\n");
 			}
+		} else if (file.length() > 9 && file.rfind(".glosmmap") == file.length() - 9) {
+			fprintf(stderr, "Mapping %s...\n", argv[narg]);
+			if (osm_datasource_.get() == NULL && mapped_datasource_.get() == NULL) {
+				mapped_datasource_.reset(new MappedOsmDatasource(argv[narg]));
+				fprintf(stderr, "Mapped %lu ways\n", (unsigned long)mapped_datasource_->GetWaysCount());
+			} else {
+				fprintf(stderr, "Only single OSM file may be loaded at once, skipped\n");
+			}
 		} else if (file.rfind(".gpx") == file.length() - 4) {
-			fprintf(stderr, "Loading %s as GPX...\n", argv[narg]);
-			if (gpx_datasource_.get() == NULL)
-				gpx_datasource_.reset(new PreloadedGPXDatasource);
-
-			Timer t;
-			gpx_datasource_->Load(argv[narg]);
-			fprintf(stderr, "Loaded in %.3f seconds\n", t.Count());
+			gpxfiles.push_back(file);
+		} else if (stat(argv[narg], &st) == 0 && S_ISDIR(st.st_mode)) {
+			PreloadedGPXDatasource::FindFiles(argv[narg], gpxfiles);
 		} else {
 			fprintf(stderr, "Not loading %s - unknown file type\n", argv[narg]);
 		}
 	}
 
+	if (!gpxfiles.empty()) {
+		fprintf(stderr, "Loading %lu GPX files...\n", (unsigned long)gpxfiles.size());
+		gpx_datasource_.reset(new PreloadedGPXDatasource);
+		gpx_datasource_->SetLoadListener(&load_listener_);
+
+		Timer t;
+		std::vector<std::string> errors;
+		size_t loaded = gpx_datasource_->LoadFiles(gpxfiles, nthreads, errors);
+		for (std::vector<std::string>::const_iterator error = errors.begin(); error != errors.end(); ++error)
+			fprintf(stderr, "Failed to load %s\n", error->c_str());
+		fprintf(stderr, "Loaded %lu files in %.3f seconds (parsed at %.1f MB/s)\n", (unsigned long)loaded, t.Count(), gpx_datasource_->GetLoadRate() / 1048576.0f);
+	}
+
 	if (srtmpath) {
 		heightmap_datasource_.reset(new SRTMDatasource(srtmpath));
 		viewer_->SetHeightmapDatasource(heightmap_datasource_.get());
@@ -165,9 +228,18 @@ void GlosmViewer::Init(int argc, char** argv) {
 		heightmap_datasource_.reset(new DummyHeightmap());
 	}
 
-	if (osm_datasource_.get() == NULL)
+	if (osm_datasource_.get() == NULL && mapped_datasource_.get() == NULL)
 		throw Exception() << "no osm dump specified";
 
+	if (snapshotpath && osm_datasource_.get() == NULL) {
+		fprintf(stderr, "Mapped file can't be saved as snapshot, skipped\n");
+	} else if (snapshotpath) {
+		fprintf(stderr, "Saving snapshot to %s...\n", snapshotpath);
+		Timer t;
+		osm_datasource_->SaveSnapshot(snapshotpath);
+		fprintf(stderr, "Saved in %.3f seconds\n", t.Count());
+	}
+
 	gettimeofday(&curtime_, NULL);
 	prevtime_ = curtime_;
 	fpstime_ = curtime_;
@@ -192,7 +264,8 @@ void GlosmViewer::InitGL() {
 #endif
 	CheckGL();
 
-	geometry_generator_.reset(new GeometryGenerator(*osm_datasource_, *heightmap_datasource_));
+	const OsmDatasource& osm_datasource = mapped_datasource_.get() ? static_cast<const OsmDatasource&>(*mapped_datasource_) : *osm_datasource_;
+	geometry_generator_.reset(new GeometryGenerator(osm_datasource, *heightmap_datasource_));
 	ground_layer_.reset(new GeometryLayer(projection_, *geometry_generator_));
 	detail_layer_.reset(new GeometryLayer(projection_, *geometry_generator_));
 
@@ -320,6 +393,34 @@ void GlosmViewer::Render() {
 #endif
 }
 
+void GlosmViewer::ApplyChanges() {
+	if (osm_datasource_.get() == NULL) {
+		fprintf(stderr, "Changes can't be applied to mapped file, skipped\n");
+		return;
+	}
+
+	/* tiles must not be loaded from data being changed */
+	ground_layer_->StopLoading();
+	detail_layer_->StopLoading();
+
+	std::vector<BBoxi> dirty;
+	for (std::vector<std::string>::const_iterator path = changepaths_.begin(); path != changepaths_.end(); ++path) {
+		fprintf(stderr, "Applying %s...\n", path->c_str());
+		try {
+			osm_datasource_->ApplyChange(path->c_str(), dirty);
+		} catch (std::exception& e) {
+			fprintf(stderr, "Failed to apply %s: %s\n", path->c_str(), e.what());
+		}
+	}
+
+	for (std::vector<BBoxi>::const_iterator area = dirty.begin(); area != dirty.end(); ++area) {
+		ground_layer_->InvalidateArea(*area);
+		detail_layer_->InvalidateArea(*area);
+	}
+
+	fprintf(stderr, "%lu areas changed\n", (unsigned long)dirty.size());
+}
+
 void GlosmViewer::Resize(int w, int h) {
 	if (w <= 0)
 		w = 1;
@@ -398,6 +499,10 @@ void GlosmViewer::KeyDown(int key) {
 	case '4':
 		terrain_shown_ = !terrain_shown_;
 		break;
+	case 'u':
+		if (!changepaths_.empty())
+			ApplyChanges();
+		break;
 	case KEY_SHIFT:
 		fast_ = true;
 		break;
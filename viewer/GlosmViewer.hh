@@ -26,13 +26,18 @@
 #include <glosm/GPXLayer.hh>
 #include <glosm/GeometryGenerator.hh>
 #include <glosm/GeometryLayer.hh>
+#include <glosm/LoadListener.hh>
+#include <glosm/MappedOsmDatasource.hh>
 #include <glosm/PreloadedGPXDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
 #include <glosm/PreloadedXmlDatasource.hh>
 #include <glosm/Projection.hh>
 #include <glosm/SRTMDatasource.hh>
 #include <glosm/TerrainLayer.hh>
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <sys/time.h>
 
@@ -64,9 +69,13 @@ protected:
 	double start_yaw_;
 	double start_pitch_;
 
+	std::vector<std::string> changepaths_;
+
 	/* glosm objects */
+	PrintingLoadListener load_listener_;
 	std::auto_ptr<FirstPersonViewer> viewer_;
 	std::auto_ptr<PreloadedXmlDatasource> osm_datasource_;
+	std::auto_ptr<MappedOsmDatasource> mapped_datasource_;
 	std::auto_ptr<PreloadedGPXDatasource> gpx_datasource_;
 	std::auto_ptr<HeightmapDatasource> heightmap_datasource_;
 	std::auto_ptr<GeometryGenerator> geometry_generator_;
@@ -104,6 +113,8 @@ protected:
 	virtual void Flip() = 0;
 	virtual void ShowCursor(bool show) = 0;
 
+	void ApplyChanges();
+
 public:
 	GlosmViewer();
 